@@ -155,6 +155,12 @@ function upsertDocsTable(doc, sName, socket, wopiHost) {
 	if (add === true) { row.appendChild(isModifiedCell); } else { row.cells[0] = isModifiedCell; }
 	isModifiedCell.className = 'has-text-centered';
 
+	var tileCacheCell = document.createElement('td');
+	tileCacheCell.id = 'doctilecache' + doc['pid'];
+	tileCacheCell.innerText = (doc['tileCacheHits'] || 0) + ' / ' + (doc['tileCacheMisses'] || 0) + ' / ' + (doc['tileCacheEvictions'] || 0);
+	if (add === true) { row.appendChild(tileCacheCell); } else { row.cells[0] = tileCacheCell; }
+	tileCacheCell.className = 'has-text-centered';
+
 	// TODO: Is activeViews always the same with viewer count? We will hide this for now. If they are not same, this will be added to Users column like: 1/2 active/user(s).
 	if (add === true) {
 		var viewsCell = document.createElement('td');
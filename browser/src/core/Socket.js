@@ -18,6 +18,12 @@ app.definitions.Socket = L.Class.extend({
 	// Will be set from lokitversion message
 	TunnelledDialogImageCacheSize: 0,
 
+	// Will be set from knowntilecache message
+	KnownTileCacheSize: 0,
+
+	// Keyframes sent with a hash, for knowntile: messages; most recent first.
+	_knownTiles: [],
+
 	getParameterValue: function (s) {
 		var i = s.indexOf('=');
 		if (i === -1)
@@ -437,6 +443,59 @@ app.definitions.Socket = L.Class.extend({
 		return img;
 	},
 
+	// Keep the keyframe of a tile: message sent with a hash, the server
+	// mirrors this cache to know what it can send as knowntile: messages.
+	_keepKnownTile: function (e) {
+		if (this.KnownTileCacheSize <= 0 || e.textMsg.indexOf(' hash=') === -1)
+			return;
+
+		var hash = this.parseServerCmd(e.textMsg).hash;
+
+		for (var i = 0; i < this._knownTiles.length; i++) {
+			if (this._knownTiles[i].hash === hash)
+				return;
+		}
+
+		if (this._knownTiles.length >= this.KnownTileCacheSize)
+			this._knownTiles.pop();
+
+		// slice() so we don't hold on to the whole message.
+		this._knownTiles.unshift({ hash: hash, rawData: e.image.rawData.slice() });
+	},
+
+	// A knowntile: message is a tile: whose keyframe we have from another
+	// tile, followed by any deltas on top of it.
+	_extractKnownTile: function (e) {
+		var hash = this.parseServerCmd(e.textMsg).hash;
+		var keyframe = null;
+		for (var i = 0; i < this._knownTiles.length; i++) {
+			if (this._knownTiles[i].hash === hash) {
+				keyframe = this._knownTiles[i].rawData;
+				break;
+			}
+		}
+
+		if (!keyframe) {
+			var message = 'knowntile: message for hash ' + hash + ' not cached here in the client';
+			if (L.Browser.cypressTest)
+				throw new Error(message);
+			this.sendMessage('ERROR ' + message);
+			keyframe = new Uint8Array(0);
+		}
+
+		var deltas = e.imgBytes ? e.imgBytes.subarray(e.imgIndex) : new Uint8Array(0);
+		var rawData = keyframe;
+		if (deltas.length > 0) {
+			rawData = new Uint8Array(keyframe.length + deltas.length);
+			rawData.set(keyframe, 0);
+			rawData.set(deltas, keyframe.length);
+		}
+
+		e.textMsg = 'tile:' + e.textMsg.substring('knowntile:'.length);
+		e.image = { rawData: rawData, isKeyframe: true };
+		e.imageIsComplete = true;
+	},
+
 	_extractTextImg: function (e) {
 
 		if (typeof (e.data) === 'string')
@@ -450,6 +509,21 @@ app.definitions.Socket = L.Class.extend({
 			return true;
 		};
 
+		// Done here, rather than in _onMessage, to keep step with the tiles.
+		if (e.textMsg.startsWith('knowntilecache ')) {
+			this.KnownTileCacheSize = parseInt(e.textMsg.substring('knowntilecache '.length));
+			this._knownTiles = [];
+			// Accept the offer: the server only sends hashes once we did.
+			if (this.KnownTileCacheSize > 0)
+				this.sendMessage('knowntilecache ' + this.KnownTileCacheSize);
+			return;
+		}
+
+		if (e.textMsg.startsWith('knowntile:')) {
+			this._extractKnownTile(e);
+			return;
+		}
+
 		var isTile = e.textMsg.startsWith('tile:');
 		var isDelta = e.textMsg.startsWith('delta:');
 		if (!isTile && !isDelta &&
@@ -467,6 +541,8 @@ app.definitions.Socket = L.Class.extend({
 			e.image = { rawData: e.imgBytes.subarray(e.imgIndex),
 				    isKeyframe: isTile };
 			e.imageIsComplete = true;
+			if (isTile)
+				this._keepKnownTile(e);
 			return;
 		}
 
@@ -584,6 +660,10 @@ app.definitions.Socket = L.Class.extend({
 		else if (textMsg.startsWith('enabletraceeventlogging ')) {
 			this.enableTraceEventLogging = true;
 		}
+		else if (textMsg.startsWith('knowntilecache ')) {
+			// Handled as it arrives, in _extractTextImg.
+			return;
+		}
 		else if (textMsg.startsWith('osinfo ')) {
 			var osInfo = textMsg.replace('osinfo ', '');
 			var osInfoElement = document.getElementById('os-info');
@@ -52,6 +52,12 @@ bool getBool(const std::string& key, const bool def)
     return Config ? Config->getBool(key, def) : def;
 }
 
+int getInt(const std::string& key, const int def)
+{
+    assert(Config && "Config is not initialized.");
+    return Config ? Config->getInt(key, def) : def;
+}
+
 bool isSslEnabled()
 {
 #if ENABLE_SSL
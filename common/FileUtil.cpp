@@ -11,8 +11,9 @@
 
 #include <dirent.h>
 #include <exception>
-#include <ftw.h>
+#include <sys/stat.h>
 #include <stdexcept>
+#include <sys/mman.h>
 #include <sys/time.h>
 #ifdef __linux__
 #include <sys/vfs.h>
@@ -24,6 +25,7 @@
 #endif
 
 #include <fcntl.h>
+#include <unistd.h>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
@@ -31,6 +33,7 @@
 #include <fstream>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #if HAVE_STD_FILESYSTEM
 # if HAVE_STD_FILESYSTEM_EXPERIMENTAL
@@ -230,22 +233,66 @@ namespace FileUtil
         return dstPath;
     }
 
-#if 1 // !HAVE_STD_FILESYSTEM
-    static int nftw_cb(const char *fpath, const struct stat*, int type, struct FTW*)
+    /// Removes the contents of the directory open as @dirFd, which it closes.
+    static std::size_t removeDirContents(int dirFd)
     {
-        if (type == FTW_DP)
+        DIR* dir = fdopendir(dirFd);
+        if (!dir)
         {
-            rmdir(fpath);
+            close(dirFd);
+            return 0;
         }
-        else if (type == FTW_F || type == FTW_SL)
+
+        // Read it all before changing it.
+        std::vector<std::pair<std::string, bool>> entries;
+        while (const struct dirent* entry = readdir(dir))
         {
-            unlink(fpath);
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+
+            bool isDir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                isDir = fstatat(dirFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                        && S_ISDIR(st.st_mode);
+            }
+
+            entries.emplace_back(entry->d_name, isDir);
         }
 
-        // Always continue even when things go wrong.
-        return 0;
+        std::size_t count = 0;
+        for (const auto& entry : entries)
+        {
+            if (entry.second)
+            {
+                const int fd = openat(dirFd, entry.first.c_str(),
+                                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd >= 0)
+                    count += removeDirContents(fd);
+            }
+
+            // Always continue even when things go wrong.
+            if (unlinkat(dirFd, entry.first.c_str(), entry.second ? AT_REMOVEDIR : 0) == 0)
+                ++count;
+        }
+
+        closedir(dir);
+        return count;
+    }
+
+    std::size_t removeTree(const std::string& path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            return 0;
+
+        std::size_t count = removeDirContents(fd);
+        if (rmdir(path.c_str()) == 0)
+            ++count;
+
+        return count;
     }
-#endif
 
     void removeFile(const std::string& path, const bool recursive)
     {
@@ -276,7 +323,7 @@ namespace FileUtil
             else
             {
                 // Directories only.
-                nftw(path.c_str(), nftw_cb, 128, FTW_DEPTH | FTW_PHYS);
+                removeTree(path);
             }
         }
         catch (const std::exception& e)
@@ -407,6 +454,47 @@ namespace FileUtil
                           std::istreambuf_iterator<char>(lhs.rdbuf()));
     }
 
+    std::shared_ptr<const void> mapFile(const std::string& path, const char*& data,
+                                        std::size_t& size)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            LOG_SYS("Failed to open [" << path << "] to map it");
+            return nullptr;
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            LOG_SYS("Failed to stat [" << path << "] to map it");
+            ::close(fd);
+            return nullptr;
+        }
+
+        // Empty files can't be mapped, and needn't be.
+        size = st.st_size;
+        if (size == 0)
+        {
+            ::close(fd);
+            data = nullptr;
+            return std::make_shared<char>(0);
+        }
+
+        void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // The mapping keeps the file.
+        if (addr == MAP_FAILED)
+        {
+            LOG_SYS("Failed to map [" << path << ']');
+            return nullptr;
+        }
+
+        data = static_cast<const char*>(addr);
+        const std::size_t length = size;
+        return std::shared_ptr<const void>(addr, [length](const void* mapped)
+                                           { ::munmap(const_cast<void*>(mapped), length); });
+    }
+
 } // namespace FileUtil
 
 namespace
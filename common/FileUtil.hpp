@@ -9,6 +9,7 @@
 
 #include <cerrno>
 #include <chrono>
+#include <memory>
 #include <string>
 #include <sys/stat.h>
 
@@ -67,6 +68,12 @@ namespace FileUtil
         removeFile(path.toString(), recursive);
     }
 
+    /// Removes the directory at @path and all it contains, without following
+    /// symlinks. Each directory is read in full, then its entries are removed
+    /// with unlinkat(2) relative to it, with no path lookups from the root.
+    /// Failures are skipped. Returns the number of entries removed.
+    std::size_t removeTree(const std::string& path);
+
     /// Returns true iff the directory is empty (or doesn't exist).
     bool isEmptyDirectory(const char* path);
     inline bool isEmptyDirectory(const std::string& path) { return isEmptyDirectory(path.c_str()); }
@@ -128,6 +135,11 @@ namespace FileUtil
     /// have equal size and every byte of their contents match.
     bool compareFileContents(const std::string& rhsPath, const std::string& lhsPath);
 
+    /// Maps the file at @path read-only into memory, and points @data and @size at it.
+    /// The mapping lasts as long as the returned owner. Returns nullptr on failure.
+    std::shared_ptr<const void> mapFile(const std::string& path, const char*& data,
+                                        std::size_t& size);
+
     /// File/Directory stat helper.
     class Stat
     {
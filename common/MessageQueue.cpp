@@ -28,32 +28,29 @@ void TileQueue::put_impl(const Payload& value)
     {
         const std::string msg = std::string(value.data(), value.size());
         LOG_TRC("Processing [" << COOLProtocol::getAbbreviatedMessage(msg)
-                               << "]. Before canceltiles have " << getQueue().size()
-                               << " in queue.");
-        const std::string seqs = msg.substr(12);
+                               << "]. Before canceltiles have " << size() << " in queue.");
+        const std::string seqs = msg.size() > 12 ? msg.substr(12) : std::string();
         StringVector tokens(StringVector::tokenize(seqs, ','));
-        getQueue().erase(std::remove_if(getQueue().begin(), getQueue().end(),
-                [&tokens](const Payload& v)
-                {
-                    const std::string s(v.data(), v.size());
-                    // Tile is for a thumbnail, don't cancel it
-                    if (s.find("id=") != std::string::npos)
-                        return false;
-                    for (size_t i = 0; i < tokens.size(); ++i)
-                    {
-                        if (s.find("ver=" + tokens[i]) != std::string::npos)
-                        {
-                            LOG_TRC("Matched " << tokens[i] << ", Removing [" << s << ']');
-                            return true;
-                        }
-                    }
-
-                    return false;
+        for (std::size_t i = 0; i < tokens.size(); ++i)
+        {
+            const auto pair = Util::i32FromString(tokens[i]);
+            if (!pair.second)
+                continue;
 
-                }), getQueue().end());
+            // Previews are not in the index, so they are not canceled.
+            auto range = _tilesByVersion.equal_range(pair.first);
+            while (range.first != range.second)
+            {
+                const TileMap::iterator it = _tiles.find((range.first++)->second);
+                assert(it != _tiles.end());
+                LOG_TRC("Matched " << tokens[i] << ", Removing ["
+                                   << it->second._tile.serialize("tile") << ']');
+                removeTile(it);
+            }
+        }
 
         // Don't push canceltiles into the queue.
-        LOG_TRC("After canceltiles have " << getQueue().size() << " in queue.");
+        LOG_TRC("After canceltiles have " << size() << " in queue.");
         return;
     }
     else if (firstToken == "tilecombine")
@@ -64,17 +61,22 @@ void TileQueue::put_impl(const Payload& value)
         const TileCombined tileCombined = TileCombined::parse(msg);
         for (const auto& tile : tileCombined.getTiles())
         {
-            const std::string newMsg = tile.serialize("tile");
-
-            removeTileDuplicate(newMsg);
-
-            MessageQueue::put_impl(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+            putTile(tile);
         }
         return;
     }
     else if (firstToken == "tile")
     {
-        removeTileDuplicate(std::string(value.data(), value.size()));
+        const std::string msg = std::string(value.data(), value.size());
+        const TileDesc tile = TileDesc::parse(msg);
+        if (tile.getId() < 0)
+        {
+            putTile(tile);
+            return;
+        }
+
+        // Previews stay in the queue, in order with the other messages.
+        removeTileDuplicate(msg);
 
         MessageQueue::put_impl(value);
         return;
@@ -98,13 +100,53 @@ void TileQueue::put_impl(const Payload& value)
     MessageQueue::put_impl(value);
 }
 
-void TileQueue::removeTileDuplicate(const std::string& tileMsg)
+void TileQueue::putTile(const TileDesc& tile)
 {
-    assert(COOLProtocol::matchPrefix("tile", tileMsg, /*ignoreWhitespace*/ true));
+    const TileKey key(tile);
 
     // Ver is always provided at this point and it is necessary to
     // return back to clients the last rendered version of a tile
     // in case there are new invalidations and requests while rendering.
+    // So the newer request replaces the older one, and goes to the end.
+    const TileMap::iterator it = _tiles.find(key);
+    if (it != _tiles.end())
+    {
+        LOG_TRC("Remove duplicate tile request: " << it->second._tile.serialize("tile") << " -> "
+                                                  << tile.serialize("tile"));
+        removeTile(it);
+    }
+
+    const uint64_t seq = _nextSeq++;
+    const TileMap::iterator added = _tiles.emplace(key, QueuedTile{ tile, seq, -1 }).first;
+    _tilesBySeq.emplace(seq, key);
+    _tilesByVersion.emplace(tile.getVersion(), key);
+    if (_visibleTilesValid)
+        indexVisibleTile(added);
+}
+
+void TileQueue::removeTile(TileMap::iterator it)
+{
+    _tilesBySeq.erase(it->second._seq);
+    if (it->second._visibleDistance >= 0)
+        _visibleTiles.erase(std::make_pair(it->second._visibleDistance, it->second._seq));
+
+    auto range = _tilesByVersion.equal_range(it->second._tile.getVersion());
+    for (; range.first != range.second; ++range.first)
+    {
+        if (!(range.first->second < it->first) && !(it->first < range.first->second))
+        {
+            _tilesByVersion.erase(range.first);
+            break;
+        }
+    }
+
+    _tiles.erase(it);
+}
+
+void TileQueue::removeTileDuplicate(const std::string& tileMsg)
+{
+    assert(COOLProtocol::matchPrefix("tile", tileMsg, /*ignoreWhitespace*/ true));
+
     // Here we compare duplicates without 'ver' since that's irrelevant.
     size_t newMsgPos = tileMsg.find(" ver");
     if (newMsgPos == std::string::npos)
@@ -119,7 +161,7 @@ void TileQueue::removeTileDuplicate(const std::string& tileMsg)
             strncmp(tileMsg.data(), it.data(), newMsgPos) == 0)
         {
             LOG_TRC("Remove duplicate tile request: " << std::string(it.data(), it.size()) << " -> " << COOLProtocol::getAbbreviatedMessage(tileMsg));
-            getQueue().erase(getQueue().begin() + i);
+            eraseMessage(i);
             break;
         }
     }
@@ -257,7 +299,7 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                             << msgW << ' ' << msgH << ' ' << msgPart);
 
                     // remove from the queue
-                    getQueue().erase(getQueue().begin() + i);
+                    eraseMessage(i);
                     continue;
                 }
 
@@ -293,7 +335,7 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                     performedMerge = true;
 
                     // remove from the queue
-                    getQueue().erase(getQueue().begin() + i);
+                    eraseMessage(i);
                     continue;
                 }
 
@@ -355,7 +397,7 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                     LOG_TRC("Remove obsolete uno command: "
                             << std::string(it.data(), it.size()) << " -> "
                             << COOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
+                    eraseMessage(i);
                     break;
                 }
             }
@@ -396,7 +438,7 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                     LOG_TRC("Remove obsolete callback: "
                             << std::string(it.data(), it.size()) << " -> "
                             << COOLProtocol::getAbbreviatedMessage(callbackMsg));
-                    getQueue().erase(getQueue().begin() + i);
+                    eraseMessage(i);
                     break;
                 }
                 else if (isViewCallback
@@ -414,7 +456,7 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
                         LOG_TRC("Remove obsolete view callback: "
                                 << std::string(it.data(), it.size()) << " -> "
                                 << COOLProtocol::getAbbreviatedMessage(callbackMsg));
-                        getQueue().erase(getQueue().begin() + i);
+                        eraseMessage(i);
                         break;
                     }
                 }
@@ -430,21 +472,6 @@ std::string TileQueue::removeCallbackDuplicate(const std::string& callbackMsg)
     return std::string();
 }
 
-int TileQueue::priority(const std::string& tileMsg)
-{
-    TileDesc tile = TileDesc::parse(tileMsg); //FIXME: Expensive, avoid.
-
-    for (int i = static_cast<int>(_viewOrder.size()) - 1; i >= 0; --i)
-    {
-        auto& cursor = _cursorPositions[_viewOrder[i]];
-        if (tile.intersectsWithRect(cursor.getX(), cursor.getY(), cursor.getWidth(),
-                                    cursor.getHeight()))
-            return i;
-    }
-
-    return -1;
-}
-
 void TileQueue::deprioritizePreviews()
 {
     for (size_t i = 0; i < getQueue().size(); ++i)
@@ -460,136 +487,202 @@ void TileQueue::deprioritizePreviews()
             break;
         }
 
-        getQueue().erase(getQueue().begin());
-        getQueue().push_back(front);
+        eraseMessage(0);
+        pushMessage(front);
     }
 }
 
-TileQueue::Payload TileQueue::get_impl()
+void TileQueue::forEachTileIn(const TileKey& group, int minY, int maxY, int minX, int maxX,
+                              const std::function<void(TileMap::iterator)>& func)
 {
-    LOG_TRC("MessageQueue depth: " << getQueue().size());
-
-    const Payload front = getQueue().front();
-
-    std::string msg(front.data(), front.size());
+    TileMap::iterator it = _tiles.lower_bound(TileKey(group, minY, minX));
+    while (it != _tiles.end() && it->first.sameGroup(group) && it->first._tilePosY <= maxY)
+    {
+        if (it->first._tilePosX < minX)
+        {
+            it = _tiles.lower_bound(TileKey(group, it->first._tilePosY, minX));
+        }
+        else if (it->first._tilePosX > maxX)
+        {
+            // Skip to the next row.
+            it = _tiles.upper_bound(TileKey(group, it->first._tilePosY, INT_MAX));
+        }
+        else
+        {
+            func(it++);
+        }
+    }
+}
 
-    std::string id;
-    bool isTile = COOLProtocol::matchPrefix("tile", msg);
-    bool isPreview = isTile && COOLProtocol::getTokenStringFromMessage(msg, "id", id);
-    if (!isTile || isPreview)
+void TileQueue::forEachTileIn(const CursorPosition& area,
+                              const std::function<void(TileMap::iterator)>& func)
+{
+    TileMap::iterator it = _tiles.begin();
+    while (it != _tiles.end())
     {
-        // Don't combine non-tiles or tiles with id.
-        LOG_TRC("MessageQueue res: " << COOLProtocol::getAbbreviatedMessage(msg));
-        getQueue().erase(getQueue().begin());
+        const TileKey group = it->first;
 
-        // de-prioritize the other tiles with id - usually the previews in
-        // Impress
-        if (isPreview)
-            deprioritizePreviews();
+        // The tiles that touch the area, as TileDesc::intersectsWithRect() has it.
+        forEachTileIn(group, area.getY() - group._tileHeight, area.getY() + area.getHeight(),
+                      area.getX() - group._tileWidth, area.getX() + area.getWidth(), func);
 
-        return front;
+        // Skip to the next group.
+        it = _tiles.upper_bound(TileKey(group, INT_MAX, INT_MAX));
     }
+}
 
-    // We are handling a tile; first try to find one that is at the cursor's
-    // position, otherwise handle the one that is at the front
-    int prioritized = 0;
-    int prioritySoFar = -1;
-    for (size_t i = 0; i < getQueue().size(); ++i)
+int64_t TileQueue::getVisibleDistance(const TileKey& key) const
+{
+    int64_t best = -1;
+    for (const auto& pair : _visibleAreas)
     {
-        auto& it = getQueue()[i];
-        const std::string prio(it.data(), it.size());
+        // The tiles that touch the area, as TileDesc::intersectsWithRect() has it.
+        const CursorPosition& area = pair.second;
+        if (key._part != area.getPart() || key._tilePosY < area.getY() - key._tileHeight
+            || key._tilePosY > area.getY() + area.getHeight()
+            || key._tilePosX < area.getX() - key._tileWidth
+            || key._tilePosX > area.getX() + area.getWidth())
+            continue;
+
+        // Without a cursor of its own, use that of the most recently active view.
+        auto cursorIt = _cursorPositions.find(pair.first);
+        if (cursorIt == _cursorPositions.end() && !_viewOrder.empty())
+            cursorIt = _cursorPositions.find(_viewOrder.back());
 
-        // avoid starving - stop the search when we reach a non-tile,
-        // otherwise we may keep growing the queue of unhandled stuff (both
-        // tiles and non-tiles)
-        if (!COOLProtocol::matchPrefix("tile", prio) ||
-            COOLProtocol::getTokenStringFromMessage(prio, "id", id))
+        int64_t distance = 0;
+        if (cursorIt != _cursorPositions.end())
         {
-            break;
+            const CursorPosition& cursor = cursorIt->second;
+            const int64_t dx = (2 * static_cast<int64_t>(key._tilePosX) + key._tileWidth)
+                               - (2 * static_cast<int64_t>(cursor.getX()) + cursor.getWidth());
+            const int64_t dy = (2 * static_cast<int64_t>(key._tilePosY) + key._tileHeight)
+                               - (2 * static_cast<int64_t>(cursor.getY()) + cursor.getHeight());
+            distance = dx * dx + dy * dy;
         }
 
-        const int p = priority(prio);
-        if (p > prioritySoFar)
-        {
-            prioritySoFar = p;
-            prioritized = i;
-            msg = prio;
+        if (best < 0 || distance < best)
+            best = distance;
+    }
 
-            // found the highest priority already?
-            if (prioritySoFar == static_cast<int>(_viewOrder.size()) - 1)
-            {
-                break;
-            }
-        }
+    return best;
+}
+
+void TileQueue::indexVisibleTile(TileMap::iterator it)
+{
+    it->second._visibleDistance = getVisibleDistance(it->first);
+    if (it->second._visibleDistance >= 0)
+        _visibleTiles.emplace(std::make_pair(it->second._visibleDistance, it->second._seq),
+                              it->first);
+}
+
+void TileQueue::updateVisibleTiles()
+{
+    _visibleTiles.clear();
+    for (TileMap::iterator it = _tiles.begin(); it != _tiles.end(); ++it)
+        indexVisibleTile(it);
+
+    _visibleTilesValid = true;
+}
+
+TileQueue::TileMap::iterator TileQueue::pickTile(uint64_t beforeSeq)
+{
+    // First the tiles at the cursors, of the most recently active view first.
+    for (int i = static_cast<int>(_viewOrder.size()) - 1; i >= 0; --i)
+    {
+        TileMap::iterator best = _tiles.end();
+        forEachTileIn(_cursorPositions[_viewOrder[i]],
+                      [&](TileMap::iterator it)
+                      {
+                          if (it->second._seq < beforeSeq
+                              && (best == _tiles.end() || it->second._seq < best->second._seq))
+                              best = it;
+                      });
+
+        if (best != _tiles.end())
+            return best;
     }
 
-    getQueue().erase(getQueue().begin() + prioritized);
+    // Then the tiles the views show, nearest to the cursor of the view.
+    if (!_visibleTilesValid)
+        updateVisibleTiles();
 
-    std::vector<TileDesc> tiles;
-    tiles.emplace_back(TileDesc::parse(msg));
+    for (const auto& pair : _visibleTiles)
+    {
+        if (pair.first.second < beforeSeq)
+            return _tiles.find(pair.second);
+    }
+
+    // Else the oldest.
+    return _tiles.find(_tilesBySeq.begin()->second);
+}
 
-    // Combine as many tiles as possible with the top one.
-    for (size_t i = 0; i < getQueue().size(); )
+TileQueue::Payload TileQueue::get_impl()
+{
+    LOG_TRC("MessageQueue depth: " << size());
+
+    // The other messages go in order with the tiles, and previews after
+    // the other tiles that came before them.
+    if (!getQueue().empty()
+        && (_tilesBySeq.empty() || _messageSeqs.front() < _tilesBySeq.begin()->first))
     {
-        auto& it = getQueue()[i];
-        msg = std::string(it.data(), it.size());
-        if (!COOLProtocol::matchPrefix("tile", msg) ||
+        const Payload front = getQueue().front();
+        eraseMessage(0);
+
+        const std::string msg(front.data(), front.size());
+        LOG_TRC("MessageQueue res: " << COOLProtocol::getAbbreviatedMessage(msg));
+
+        // de-prioritize the other tiles with id - usually the previews in
+        // Impress
+        std::string id;
+        if (COOLProtocol::matchPrefix("tile", msg) &&
             COOLProtocol::getTokenStringFromMessage(msg, "id", id))
-        {
-            // Don't combine non-tiles or tiles with id.
-            ++i;
-            continue;
-        }
+            deprioritizePreviews();
 
-        TileDesc tile2 = TileDesc::parse(msg);
-        LOG_TRC("Combining candidate: " << COOLProtocol::getAbbreviatedMessage(msg));
+        return front;
+    }
 
-        // Check if it's on the same row.
-        if (tiles[0].canCombine(tile2))
-        {
-            tiles.emplace_back(tile2);
-            getQueue().erase(getQueue().begin() + i);
-        }
-        else
-        {
-            ++i;
-        }
+    // We are handling a tile; first try to find one that is at the cursor's
+    // position, otherwise handle the one that is at the front. Avoid starving
+    // the other messages by taking only the tiles that came before them.
+    const TileMap::iterator top
+        = pickTile(getQueue().empty() ? UINT64_MAX : _messageSeqs.front());
+    const TileKey key = top->first;
+    const int gridX = key._tilePosX / key._tileWidth;
+
+    // Combine as many tiles as possible with the top one, see TileDesc::canCombine().
+    std::vector<TileMap::iterator> candidates;
+    forEachTileIn(key, key._tilePosY - key._tileHeight, key._tilePosY + key._tileHeight,
+                  std::max(0, gridX - 16) * key._tileWidth, (gridX + 17) * key._tileWidth - 1,
+                  [&](TileMap::iterator it)
+                  {
+                      if (it != top)
+                          candidates.push_back(it);
+                  });
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](TileMap::iterator a, TileMap::iterator b)
+              { return a->second._seq < b->second._seq; });
+
+    std::vector<TileDesc> tiles;
+    tiles.reserve(candidates.size() + 1);
+    tiles.push_back(top->second._tile);
+    removeTile(top);
+    for (const TileMap::iterator it : candidates)
+    {
+        assert(tiles[0].canCombine(it->second._tile));
+        tiles.push_back(it->second._tile);
+        removeTile(it);
     }
 
-    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << getQueue().size() << " in queue.");
+    LOG_TRC("Combined " << tiles.size() << " tiles, leaving " << size() << " in queue.");
 
     if (tiles.size() == 1)
     {
-        msg = tiles[0].serialize("tile");
+        const std::string msg = tiles[0].serialize("tile");
         LOG_TRC("MessageQueue res: " << COOLProtocol::getAbbreviatedMessage(msg));
         return Payload(msg.data(), msg.data() + msg.size());
     }
 
-    // n^2 but lists are short.
-    for (size_t i = 0; i < tiles.size() - 1; ++i)
-    {
-        const auto &a = tiles[i];
-        for (size_t j = i + 1; j < tiles.size();)
-        {
-            const auto &b = tiles[j];
-            assert(a.getPart() == b.getPart());
-            assert(a.getWidth() == b.getWidth());
-            assert(a.getHeight() == b.getHeight());
-            assert(a.getTileWidth() == b.getTileWidth());
-            assert(a.getTileHeight() == b.getTileHeight());
-            if (a.getTilePosX() == b.getTilePosX() &&
-                a.getTilePosY() == b.getTilePosY())
-            {
-                LOG_TRC("MessageQueue: dropping duplicate tile: " <<
-                        j << " vs. " << i << " at: " <<
-                        a.getTilePosX() << "," << b.getTilePosY());
-                tiles.erase(tiles.begin() + j);
-            }
-            else
-                j++;
-        }
-    }
-
     TileCombined combined = TileCombined::create(tiles);
     assert(!combined.hasDuplicates());
     std::string tileCombined = combined.serialize("tilecombine");
@@ -597,9 +690,38 @@ TileQueue::Payload TileQueue::get_impl()
     return Payload(tileCombined.data(), tileCombined.data() + tileCombined.size());
 }
 
+void TileQueue::clear_impl()
+{
+    MessageQueue::clear_impl();
+    _messageSeqs.clear();
+    _tiles.clear();
+    _tilesBySeq.clear();
+    _tilesByVersion.clear();
+    _visibleTiles.clear();
+}
+
+std::size_t TileQueue::size_impl() const
+{
+    return MessageQueue::size_impl() + _tiles.size();
+}
+
+void TileQueue::pushMessage(const Payload& value)
+{
+    MessageQueue::pushMessage(value);
+    _messageSeqs.push_back(_nextSeq++);
+}
+
+void TileQueue::eraseMessage(std::size_t index)
+{
+    MessageQueue::eraseMessage(index);
+    _messageSeqs.erase(_messageSeqs.begin() + index);
+}
+
 void TileQueue::dumpState(std::ostream& oss)
 {
     oss << "\ttileQueue:"
+        << "\n\t\ttiles: " << _tiles.size()
+        << "\n\t\tmessages: " << getQueue().size()
         << "\n\t\tcursorPositions:";
     for (const auto &it : _cursorPositions)
     {
@@ -612,6 +734,18 @@ void TileQueue::dumpState(std::ostream& oss)
             << " height: " << it.second.getHeight();
     }
 
+    oss << "\n\t\tvisibleAreas:";
+    for (const auto &it : _visibleAreas)
+    {
+        oss << "\n\t\t\tviewId: "
+            << it.first
+            << " part: " << it.second.getPart()
+            << " x: " << it.second.getX()
+            << " y: " << it.second.getY()
+            << " width: " << it.second.getWidth()
+            << " height: " << it.second.getHeight();
+    }
+
     oss << "\n\t\tviewOrder: [";
     std::string separator;
     for (const auto& viewId : _viewOrder)
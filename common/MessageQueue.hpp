@@ -9,6 +9,8 @@
 
 #include <stdexcept>
 #include <algorithm>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <map>
 #include <string>
@@ -16,6 +18,7 @@
 
 #include "Log.hpp"
 #include "Protocol.hpp"
+#include <TileDesc.hpp>
 
 /// Thread-safe message queue (FIFO).
 class MessageQueue
@@ -62,15 +65,21 @@ public:
     /// Get a message without waiting
     Payload pop()
     {
-        if (_queue.empty())
+        if (isEmpty())
             return Payload();
         return get_impl();
     }
 
     /// Anything in the queue ?
-    bool isEmpty()
+    bool isEmpty() const
     {
-        return _queue.empty();
+        return size_impl() == 0;
+    }
+
+    /// The number of messages queued.
+    std::size_t size() const
+    {
+        return size_impl();
     }
 
     /// Thread safe removal of all the pending messages.
@@ -94,7 +103,7 @@ protected:
             const std::string newMsg = combineTextInput(tokens);
             if (!newMsg.empty())
             {
-                _queue.push_back(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+                pushMessage(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
                 return;
             }
         }
@@ -103,26 +112,44 @@ protected:
             const std::string newMsg = combineRemoveText(tokens);
             if (!newMsg.empty())
             {
-                _queue.push_back(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
+                pushMessage(Payload(newMsg.data(), newMsg.data() + newMsg.size()));
                 return;
             }
         }
 
-        _queue.emplace_back(value);
+        pushMessage(value);
     }
 
     virtual Payload get_impl()
     {
         Payload result = _queue.front();
-        _queue.erase(_queue.begin());
+        eraseMessage(0);
         return result;
     }
 
-    void clear_impl()
+    virtual void clear_impl()
     {
         _queue.clear();
     }
 
+    virtual std::size_t size_impl() const
+    {
+        return _queue.size();
+    }
+
+    /// Appends @value to the queue. All additions and removals go through
+    /// these two, so a derived queue can keep its own index of the messages.
+    virtual void pushMessage(const Payload& value)
+    {
+        _queue.push_back(value);
+    }
+
+    /// Removes the message at @index of the queue.
+    virtual void eraseMessage(std::size_t index)
+    {
+        _queue.erase(_queue.begin() + index);
+    }
+
     std::vector<Payload>& getQueue() { return _queue; }
 
     /// Search the queue for a previous textinput message and if found, remove it and combine its
@@ -165,7 +192,7 @@ protected:
                 COOLProtocol::getTokenString(queuedTokens, "text", queuedText))
             {
                 // Remove the queued textinput message and combine it with the current one
-                getQueue().erase(getQueue().begin() + i);
+                eraseMessage(i);
 
                 std::string newMsg = queuedTokens[0] + " textinput id=" + id + " text=" + queuedText + text;
 
@@ -226,7 +253,7 @@ protected:
                 COOLProtocol::getTokenIntegerFromMessage(queuedMessage, "after", queuedAfter))
             {
                 // Remove the queued removetextcontext message and combine it with the current one
-                getQueue().erase(getQueue().begin() + i);
+                eraseMessage(i);
 
                 std::string newMsg = queuedTokens[0] + " removetextcontext id=" + id +
                     " before=" + std::to_string(queuedBefore + before) +
@@ -248,6 +275,14 @@ private:
 };
 
 /// MessageQueue specialized for priority handling of tiles.
+/// Tile requests are parsed once, when put, and kept in an index by their
+/// part, zoom and position rather than with the other messages. So finding
+/// the duplicate of a tile, the tiles to combine with it, and the tiles of
+/// a canceltiles are all O(log n), and large bursts of requests don't stall
+/// the kit. The other messages, including previews (tiles with an 'id'),
+/// stay in the queue, and everything is served in the order it came,
+/// except that the tiles near the views' cursors and in their visible
+/// areas go first, and the tiles that can be rendered together are.
 class TileQueue : public MessageQueue
 {
     friend class TileQueueTests;
@@ -281,6 +316,12 @@ private:
     };
 
 public:
+    TileQueue()
+        : _visibleTilesValid(true)
+        , _nextSeq(0)
+    {
+    }
+
     void updateCursorPosition(int viewId, int part, int x, int y, int width, int height)
     {
         const TileQueue::CursorPosition cursorPosition = CursorPosition(part, x, y, width, height);
@@ -304,8 +345,31 @@ public:
         }
 
         _viewOrder.push_back(viewId);
+        _visibleTilesValid = false;
     }
 
+    /// The view @viewId shows the area at @x, @y of @width and @height, in
+    /// twips, of the part @part.
+    void updateVisibleArea(int viewId, int part, int x, int y, int width, int height)
+    {
+        _visibleAreas[viewId] = CursorPosition(part, x, y, width, height);
+        _visibleTilesValid = false;
+    }
+
+    /// The view @viewId shows the same area of the part @part now.
+    void updateVisibleAreaPart(int viewId, int part)
+    {
+        const auto it = _visibleAreas.find(viewId);
+        if (it != _visibleAreas.end() && it->second.getPart() != part)
+        {
+            const CursorPosition& area = it->second;
+            it->second = CursorPosition(part, area.getX(), area.getY(), area.getWidth(),
+                                        area.getHeight());
+            _visibleTilesValid = false;
+        }
+    }
+
+    /// Forgets the cursor and visible area of the view @viewId.
     void removeCursorPosition(int viewId)
     {
         const auto view = std::find(_viewOrder.begin(), _viewOrder.end(), viewId);
@@ -315,6 +379,8 @@ public:
         }
 
         _cursorPositions.erase(viewId);
+        _visibleAreas.erase(viewId);
+        _visibleTilesValid = false;
     }
 
     void dumpState(std::ostream& oss);
@@ -324,8 +390,93 @@ protected:
 
     virtual Payload get_impl() override;
 
+    virtual void clear_impl() override;
+
+    virtual std::size_t size_impl() const override;
+
+    virtual void pushMessage(const Payload& value) override;
+
+    virtual void eraseMessage(std::size_t index) override;
+
 private:
-    /// Search the queue for a duplicate tile and remove it (if present).
+    /// Where a tile is in the index: the tiles that can be combined, of the
+    /// same view, part and zoom, are next to each other, by row then column.
+    struct TileKey
+    {
+        explicit TileKey(const TileDesc& tile)
+            : _viewId(tile.getNormalizedViewId())
+            , _part(tile.getPart())
+            , _width(tile.getWidth())
+            , _height(tile.getHeight())
+            , _tileWidth(tile.getTileWidth())
+            , _tileHeight(tile.getTileHeight())
+            , _tilePosY(tile.getTilePosY())
+            , _tilePosX(tile.getTilePosX())
+        {
+        }
+
+        /// The position @tilePosX, @tilePosY in the group of @other.
+        TileKey(const TileKey& other, int tilePosY, int tilePosX)
+            : TileKey(other)
+        {
+            _tilePosY = tilePosY;
+            _tilePosX = tilePosX;
+        }
+
+        bool sameGroup(const TileKey& other) const
+        {
+            return _viewId == other._viewId && _part == other._part && _width == other._width
+                   && _height == other._height && _tileWidth == other._tileWidth
+                   && _tileHeight == other._tileHeight;
+        }
+
+        bool operator<(const TileKey& other) const
+        {
+            if (_viewId != other._viewId)
+                return _viewId < other._viewId;
+            if (_part != other._part)
+                return _part < other._part;
+            if (_width != other._width)
+                return _width < other._width;
+            if (_height != other._height)
+                return _height < other._height;
+            if (_tileWidth != other._tileWidth)
+                return _tileWidth < other._tileWidth;
+            if (_tileHeight != other._tileHeight)
+                return _tileHeight < other._tileHeight;
+            if (_tilePosY != other._tilePosY)
+                return _tilePosY < other._tilePosY;
+            return _tilePosX < other._tilePosX;
+        }
+
+        int _viewId;
+        int _part;
+        int _width;
+        int _height;
+        int _tileWidth;
+        int _tileHeight;
+        int _tilePosY;
+        int _tilePosX;
+    };
+
+    struct QueuedTile
+    {
+        TileDesc _tile;
+        /// When the request came, among all the messages.
+        uint64_t _seq;
+        /// See getVisibleDistance(), as of when it was indexed in _visibleTiles.
+        int64_t _visibleDistance;
+    };
+
+    using TileMap = std::map<TileKey, QueuedTile>;
+
+    /// Queues @tile, replacing any request for the same tile.
+    void putTile(const TileDesc& tile);
+
+    /// Removes the tile at @it from the queue and the indexes.
+    void removeTile(TileMap::iterator it);
+
+    /// Search the queue for a duplicate preview tile and remove it (if present).
     void removeTileDuplicate(const std::string& tileMsg);
 
     /// Search the queue for a duplicate callback and remove it (if present).
@@ -340,17 +491,54 @@ private:
     /// the queue.
     void deprioritizePreviews();
 
-    /// Priority of the given tile message.
-    /// -1 means the lowest prio (the tile does not intersect any of the cursors),
-    /// the higher the number, the bigger is priority [up to _viewOrder.size()-1].
-    int priority(const std::string& tileMsg);
+    /// The tile to render next, of those that came before @beforeSeq.
+    /// The tiles at the cursor of the most recently active view go first,
+    /// then those at the other views' cursors, then those in a visible
+    /// area, nearest to the cursor of its view, and else the oldest.
+    TileMap::iterator pickTile(uint64_t beforeSeq);
+
+    /// Calls @func with the tiles of the group of @group, in the rows from
+    /// @minY to @maxY and the columns from @minX to @maxX, all inclusive.
+    void forEachTileIn(const TileKey& group, int minY, int maxY, int minX, int maxX,
+                       const std::function<void(TileMap::iterator)>& func);
+
+    /// Calls @func with the tiles intersecting @area, of any view and zoom.
+    void forEachTileIn(const CursorPosition& area,
+                       const std::function<void(TileMap::iterator)>& func);
+
+    /// How far the tile @key is from the cursor of the nearest view that
+    /// shows it, squared, or -1 when no view shows it.
+    int64_t getVisibleDistance(const TileKey& key) const;
+
+    /// Adds the tile at @it to _visibleTiles, when a view shows it.
+    void indexVisibleTile(TileMap::iterator it);
+
+    /// Rebuilds _visibleTiles, after a cursor or a visible area changed.
+    void updateVisibleTiles();
 
 private:
     std::map<int, CursorPosition> _cursorPositions;
 
+    /// The area each view shows.
+    std::map<int, CursorPosition> _visibleAreas;
+
     /// Check the views in the order of how the editing (cursor movement) has
     /// been happening (0 == oldest, size() - 1 == newest).
     std::vector<int> _viewOrder;
+
+    /// The requested tiles, and by the order they came in, and by version.
+    TileMap _tiles;
+    std::map<uint64_t, TileKey> _tilesBySeq;
+    std::multimap<int, TileKey> _tilesByVersion;
+
+    /// The tiles the views show, nearest to the cursor first, then oldest.
+    /// Rebuilt on the next get when _visibleTilesValid is false.
+    std::map<std::pair<int64_t, uint64_t>, TileKey> _visibleTiles;
+    bool _visibleTilesValid;
+
+    /// When each of the other messages in the queue came.
+    std::deque<uint64_t> _messageSeqs;
+    uint64_t _nextSeq;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
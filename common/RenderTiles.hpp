@@ -8,49 +8,69 @@
 #pragma once
 
 #include <cassert>
+#include <atomic>
+#include <deque>
+#include <map>
 #include <memory>
-#include <queue>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 #include <common/SpookyV2.h>
+#include <sys/mman.h>
 
 #include "Png.hpp"
 #include "Delta.hpp"
 #include "Rectangle.hpp"
 #include "TileDesc.hpp"
 
+/// A work-stealing thread pool: work is spread over per-thread queues,
+/// and threads that run dry steal from the back of the others' queues.
+/// A batch of work can be left running with a completion, which is run
+/// on the owning thread by finish(), so that the owner can render the
+/// next batch while the previous one is still being compressed.
 class ThreadPool {
+    typedef std::function<void()> ThreadFn;
+
+    struct WorkQueue {
+        std::mutex _mutex;
+        std::deque<ThreadFn> _work;
+    };
+
+    /// One queue per thread, the first being the owner's.
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::vector<std::thread> _threads;
     std::mutex _mutex;
     std::condition_variable _cond;
     std::condition_variable _complete;
-    typedef std::function<void()> ThreadFn;
-    std::queue<ThreadFn> _work;
-    std::vector<std::thread> _threads;
-    size_t _working;
-    bool   _shutdown;
+    /// Work items pushed but not yet picked up.
+    std::atomic<size_t> _queued;
+    /// Work items pushed but not yet finished.
+    std::atomic<size_t> _pending;
+    std::atomic<size_t> _steals;
+    size_t _nextQueue;
+    ThreadFn _completion;
+    bool _shutdown;
+
 public:
     ThreadPool()
-        : _working(0),
+        : _queued(0),
+          _pending(0),
+          _steals(0),
+          _nextQueue(0),
           _shutdown(false)
     {
-        int maxConcurrency = 2;
-#if MOBILEAPP && !defined(GTKAPP)
-        maxConcurrency = std::max<int>(std::thread::hardware_concurrency(), 2);
-#else
-        const char *max = getenv("MAX_CONCURRENCY");
-        if (max)
-            maxConcurrency = atoi(max);
-#endif
+        const int maxConcurrency = getMaxConcurrency();
         LOG_TRC("PNG compression thread pool size " << maxConcurrency);
+        for (int i = 0; i < maxConcurrency; ++i)
+            _queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
         for (int i = 1; i < maxConcurrency; ++i)
-            _threads.push_back(std::thread(&ThreadPool::work, this));
+            _threads.push_back(std::thread(&ThreadPool::work, this, i));
     }
+
     ~ThreadPool()
     {
         {
             std::unique_lock< std::mutex > lock(_mutex);
-            assert(_working == 0);
             _shutdown = true;
         }
         _cond.notify_all();
@@ -58,107 +78,356 @@ public:
             it.join();
     }
 
+    /// The number of threads to use, including the owner's.
+    static int getMaxConcurrency()
+    {
+#if MOBILEAPP && !defined(GTKAPP)
+        return std::max<int>(std::thread::hardware_concurrency(), 2);
+#else
+        // Set by wsd from the config, and already capped to the available CPUs.
+        const char *max = getenv("MAX_CONCURRENCY");
+        if (max && atoi(max) > 0)
+            return atoi(max);
+        return std::max<int>(std::thread::hardware_concurrency(), 1);
+#endif
+    }
+
     size_t count() const
     {
-        return _work.size();
+        return _pending;
     }
 
+    /// Queues work to be run by run() or runAsync().
     void pushWork(const ThreadFn &fn)
     {
+        WorkQueue &queue = *_queues[_nextQueue++ % _queues.size()];
+        {
+            std::unique_lock< std::mutex > lock(queue._mutex);
+            queue._work.push_back(fn);
+        }
+        ++_pending;
+        ++_queued;
+    }
+
+    /// Runs all queued work, helping on this thread, and waits for it to complete.
+    void run()
+    {
+        start();
+
+        while (tryRunOne(0))
+            ;
+
         std::unique_lock< std::mutex > lock(_mutex);
-        assert(_working == 0);
-        _work.push(fn);
+        _complete.wait(lock, [this]() { return _pending == 0; });
     }
 
-    void runOne(std::unique_lock< std::mutex >& lock)
+    /// Starts the queued work in the background; @completion is run
+    /// on this thread by the next finish(), once all of it is done.
+    void runAsync(const ThreadFn &completion)
     {
-        assert(!_work.empty());
+        assert(!_completion && "Must finish() the previous batch first");
+        _completion = completion;
+        start();
+    }
 
-        ThreadFn fn = _work.front();
-        _work.pop();
-        _working++;
-        lock.unlock();
+    /// Waits for work started by runAsync(), if any, and runs its completion.
+    void finish()
+    {
+        if (!_completion)
+            return;
 
-        try {
-            fn();
-        } catch(...) {
-            LOG_ERR("Exception in thread pool execution.");
-        }
+        run();
 
-        lock.lock();
-        _working--;
-        if (_work.empty() && _working == 0)
-            _complete.notify_all();
+        ThreadFn completion;
+        std::swap(completion, _completion);
+        completion();
     }
 
-    void run()
+    void dumpState(std::ostream& oss)
     {
-        std::unique_lock< std::mutex > lock(_mutex);
-        assert(_working == 0);
+        oss << "\tthreadPool:"
+            << "\n\t\tshutdown: " << _shutdown
+            << "\n\t\tpending: " << _pending
+            << "\n\t\tqueued: " << _queued
+            << "\n\t\tsteals: " << _steals
+            << "\n\t\tbatch in flight: " << !!_completion
+            << "\n\t\tthread count " << _threads.size()
+            << "\n";
+    }
 
+    /// Wakes the threads to begin on the queued work.
+    void start()
+    {
         // Avoid notifying threads if we don't need to.
-        bool useThreads = _threads.size() > 1 && _work.size() > 1;
-        if (useThreads)
+        if (!_threads.empty() && _queued > 0)
+        {
+            std::unique_lock< std::mutex > lock(_mutex);
             _cond.notify_all();
+        }
+    }
 
-        while(!_work.empty())
-            runOne(lock);
+private:
+    /// Takes work from our own queue, else steals some; returns false if there is none.
+    bool tryRunOne(size_t self)
+    {
+        ThreadFn fn;
+        for (size_t i = 0; i < _queues.size() && !fn; ++i)
+        {
+            WorkQueue &queue = *_queues[(self + i) % _queues.size()];
+            std::unique_lock< std::mutex > lock(queue._mutex);
+            if (queue._work.empty())
+                continue;
 
-        if (useThreads && (_working > 0 || !_work.empty()))
-            _complete.wait(lock, [this]() { return _working == 0 && _work.empty(); } );
+            if (i == 0)
+            {
+                fn = std::move(queue._work.front());
+                queue._work.pop_front();
+            }
+            else
+            {
+                fn = std::move(queue._work.back());
+                queue._work.pop_back();
+                ++_steals;
+            }
+            --_queued;
+        }
 
-        assert(_working==0);
-        assert(_work.empty());
-    }
+        if (!fn)
+            return false;
 
-    void work()
-    {
-        std::unique_lock< std::mutex > lock(_mutex);
-        while (!_shutdown)
+        try {
+            fn();
+        } catch(...) {
+            LOG_ERR("Exception in thread pool execution.");
+        }
+
+        if (--_pending == 0)
         {
-            _cond.wait(lock);
-            if (!_shutdown && !_work.empty())
-                runOne(lock);
+            std::unique_lock< std::mutex > lock(_mutex);
+            _complete.notify_all();
         }
+
+        return true;
     }
 
-    void dumpState(std::ostream& oss)
+    void work(size_t self)
     {
-        oss << "\tthreadPool:"
-            << "\n\t\tshutdown: " << _shutdown
-            << "\n\t\tworking: " << _working
-            << "\n\t\twork count: " << count()
-            << "\n\t\tthread count " << _threads.size()
-            << "\n";
+        while (true)
+        {
+            {
+                std::unique_lock< std::mutex > lock(_mutex);
+                _cond.wait(lock, [this]() { return _shutdown || _queued > 0; });
+                if (_shutdown)
+                    return;
+            }
+
+            while (tryRunOne(self))
+                ;
+        }
     }
 };
 
 namespace RenderTiles
 {
+    /// Recycles the large pixmaps we paint into, in size classes 1.25x
+    /// apart, rather than page-faulting fresh memory in for each render.
+    class BufferPool {
+        std::mutex _mutex;
+        /// Free buffers by their capacity.
+        std::map<size_t, std::vector<unsigned char *>> _free;
+        size_t _freeBytes;
+        size_t _maxFreeBytes;
+        size_t _allocated;
+        size_t _reused;
+        size_t _released;
+        size_t _inUse;
+
+        /// Size classes start at one 256x256 tile.
+        static constexpr size_t MinCapacity = 256 * 256 * 4;
+        static constexpr size_t PageSize = 4096;
+        /// Large enough for the kernel to back it with huge pages.
+        static constexpr size_t HugePageSize = 2 * 1024 * 1024;
+
+        BufferPool() :
+            _freeBytes(0),
+            _maxFreeBytes(64 * 1024 * 1024),
+            _allocated(0),
+            _reused(0),
+            _released(0),
+            _inUse(0)
+        {
+        }
+
+        static size_t getCapacity(size_t size)
+        {
+            // Page-rounded, so a large pixmap wastes at most a quarter.
+            size_t capacity = MinCapacity;
+            while (capacity < size)
+                capacity = (capacity + capacity / 4 + PageSize - 1) / PageSize * PageSize;
+            return capacity;
+        }
+
+    public:
+        static BufferPool& get()
+        {
+            static BufferPool pool;
+            return pool;
+        }
+
+        /// Returns a buffer of at least @size bytes and sets its @capacity.
+        /// Fresh buffers are zero; recycled ones are only cleared if @zero.
+        unsigned char *acquire(size_t size, size_t &capacity, bool zero)
+        {
+            capacity = getCapacity(size);
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                ++_inUse;
+                auto it = _free.find(capacity);
+                if (it != _free.end() && !it->second.empty())
+                {
+                    unsigned char *data = it->second.back();
+                    it->second.pop_back();
+                    _freeBytes -= capacity;
+                    ++_reused;
+                    lock.unlock();
+
+                    if (zero)
+                        memset(data, 0, size);
+                    return data;
+                }
+                ++_allocated;
+            }
+
+            // mmap gives us zeroed, page-aligned memory.
+            void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (data == MAP_FAILED)
+            {
+                LOG_SYS("Failed to allocate pixmap buffer of " << capacity << " bytes");
+                std::unique_lock<std::mutex> lock(_mutex);
+                --_inUse;
+                return nullptr;
+            }
+#ifdef MADV_HUGEPAGE
+            if (capacity >= HugePageSize)
+                madvise(data, capacity, MADV_HUGEPAGE);
+#endif
+            return static_cast<unsigned char *>(data);
+        }
+
+        /// Returns a buffer to the pool, or unmaps it if the pool is full.
+        void release(unsigned char *data, size_t capacity)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                --_inUse;
+                if (_freeBytes + capacity <= _maxFreeBytes)
+                {
+                    _free[capacity].push_back(data);
+                    _freeBytes += capacity;
+                    return;
+                }
+                ++_released;
+            }
+            munmap(data, capacity);
+        }
+
+        void dumpState(std::ostream& oss)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            oss << "\tpixmap buffer pool:"
+                << "\n\t\tallocated: " << _allocated
+                << "\n\t\treused: " << _reused
+                << "\n\t\treleased: " << _released
+                << "\n\t\tin use: " << _inUse
+                << "\n\t\tfree bytes: " << _freeBytes << " of max " << _maxFreeBytes;
+            for (const auto &it : _free)
+                oss << "\n\t\tsize class " << it.first << ": " << it.second.size() << " free";
+            oss << "\n";
+        }
+    };
+
+    /// Recycles the vectors the encoded tiles of a batch are gathered in,
+    /// so their capacity carries over from one batch to the next.
+    class OutputPool {
+        std::mutex _mutex;
+        std::vector<std::vector<char>> _free;
+
+        /// Enough for the batches in flight while the next one paints.
+        static constexpr size_t MaxFree = 4;
+        /// Larger vectors are freed, not to hold on to a rare huge combine.
+        static constexpr size_t MaxFreeCapacity = 16 * 1024 * 1024;
+
+        OutputPool() = default;
+
+    public:
+        static OutputPool& get()
+        {
+            static OutputPool pool;
+            return pool;
+        }
+
+        std::vector<char> acquire()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_free.empty())
+                return std::vector<char>();
+
+            std::vector<char> output = std::move(_free.back());
+            _free.pop_back();
+            return output;
+        }
+
+        void release(std::vector<char>&& output)
+        {
+            if (output.capacity() > MaxFreeCapacity)
+                return;
+
+            output.clear();
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_free.size() < MaxFree)
+                _free.push_back(std::move(output));
+        }
+    };
+
     struct Buffer {
         unsigned char *_data;
+        size_t _capacity;
         Buffer()
         {
             _data = nullptr;
+            _capacity = 0;
         }
-        Buffer(size_t x, size_t y) :
+        Buffer(size_t x, size_t y, bool zero = true) :
             Buffer()
         {
-            allocate(x, y);
+            allocate(x, y, zero);
         }
-        void allocate(size_t x, size_t y)
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        void allocate(size_t x, size_t y, bool zero = true)
         {
             assert(!_data);
-            _data = static_cast<unsigned char *>(calloc(x * y, 4));
+            _data = BufferPool::get().acquire(x * y * 4, _capacity, zero);
         }
         ~Buffer()
         {
             if (_data)
-                free (_data);
+                BufferPool::get().release(_data, _capacity);
         }
         unsigned char *data() { return _data; }
     };
 
+    /// Combines smaller than this, in bytes, are always painted in one go.
+    constexpr size_t MinBandedPixmapSize = 4 * 1024 * 1024;
+
+    /// Whether large combines are painted and compressed band by band.
+    inline bool isBandedRendering()
+    {
+        static const bool banded = getenv("BANDED_RENDERING") && !strcmp(getenv("BANDED_RENDERING"), "true");
+        return banded;
+    }
+
     static void pushRendered(std::vector<TileDesc> &renderedTiles,
                              const TileDesc &desc, TileWireId wireId, size_t imgSize)
     {
@@ -167,6 +436,63 @@ namespace RenderTiles
         renderedTiles.back().setImgSize(imgSize);
     }
 
+    /// Whether a recycled pixmap must be cleared before LOK paints into it
+    /// with @mode. LOK erases its device to transparent before painting
+    /// BGRA tiles, but not when painting premultiplied RGBA.
+    inline bool needsClearPixmap(LibreOfficeKitTileMode mode)
+    {
+        return mode != LOK_TILEMODE_BGRA;
+    }
+
+    /// A painted tilecombine and its tiles, compressed in the ThreadPool.
+    struct RenderedBatch {
+        RenderedBatch(size_t x, size_t y, LibreOfficeKitTileMode mode) :
+            _pixmap(x, y, needsClearPixmap(mode)),
+            _output(OutputPool::get().acquire())
+        {
+        }
+        ~RenderedBatch()
+        {
+            OutputPool::get().release(std::move(_output));
+        }
+        Buffer _pixmap;
+        std::mutex _mutex;
+        std::vector<char> _output;
+        std::vector<TileDesc> _renderedTiles;
+    };
+
+    /// Sends the header and the already encoded tiles of @batch as
+    /// separate slices, the payload is never copied into the message.
+    static void sendRendered(RenderedBatch &batch, const TileCombined &tileCombined, bool combined,
+                             const std::function<void (const char *header, size_t headerLength,
+                                                       const char *data, size_t length)>& outputMessage)
+    {
+        const std::vector<char> &output = batch._output;
+
+        std::string tileMsg;
+        if (combined)
+        {
+            tileMsg = tileCombined.serialize("tilecombine:", "\n", batch._renderedTiles);
+
+            LOG_TRC("Sending back painted tiles for " << tileMsg << " of size " << output.size() << " bytes) for: " << tileMsg);
+
+            outputMessage(tileMsg.data(), tileMsg.size(), output.data(), output.size());
+        }
+        else
+        {
+            size_t outputOffset = 0;
+            for (auto &i : batch._renderedTiles)
+            {
+                tileMsg = i.serialize("tile:", "\n");
+                outputMessage(tileMsg.data(), tileMsg.size(), output.data() + outputOffset, i.getImgSize());
+                outputOffset += i.getImgSize();
+            }
+        }
+    }
+
+    /// Paints the tilecombine and queues compressing its tiles in @pngPool.
+    /// The tiles are sent by the next pngPool.finish(), which the caller must
+    /// do before anything that could be reordered with them.
     bool doRender(std::shared_ptr<lok::Document> document,
                   DeltaGenerator &deltaGen,
                   TileCombined &tileCombined,
@@ -177,7 +503,8 @@ namespace RenderTiles
                                             size_t pixmapWidth, size_t pixmapHeight,
                                             int pixelWidth, int pixelHeight,
                                             LibreOfficeKitTileMode mode)>& blendWatermark,
-                  const std::function<void (const char *buffer, size_t length)>& outputMessage,
+                  const std::function<void (const char *header, size_t headerLength,
+                                            const char *data, size_t length)>& outputMessage,
                   unsigned mobileAppDocId,
                   int canonicalViewId)
     {
@@ -222,161 +549,164 @@ namespace RenderTiles
         if (pixmapWidth > 4096 || pixmapHeight > 4096)
             LOG_WRN("Unusual extremely large tile combine of size " << pixmapWidth << 'x' << pixmapHeight);
 
-        RenderTiles::Buffer pixmap(pixmapWidth, pixmapHeight);
+        const auto mode = static_cast<LibreOfficeKitTileMode>(document->getTileMode());
 
-        // Render the whole area
-        const double area = pixmapWidth * pixmapHeight;
-        const auto start = std::chrono::steady_clock::now();
-        LOG_TRC("Calling paintPartTile(" << (void*)pixmap.data() << ')');
-        document->paintPartTile(pixmap.data(),
-                                tileCombined.getPart(),
-                                pixmapWidth, pixmapHeight,
-                                renderArea.getLeft(), renderArea.getTop(),
-                                renderArea.getWidth(), renderArea.getHeight());
-        auto duration = std::chrono::steady_clock::now() - start;
-        const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
-        const double elapsedMics = elapsedMs.count() * 1000.; // Need MPixels/sec, use Pixels/mics.
-        LOG_DBG("paintPartTile at ("
-                << renderArea.getLeft() << ", " << renderArea.getTop() << "), ("
-                << renderArea.getWidth() << ", " << renderArea.getHeight() << ") "
-                << " rendered in " << elapsedMs << " (" << area / elapsedMics << " MP/s).");
+        // Shared with the compression work, which may outlive this call.
+        auto batch = std::make_shared<RenderedBatch>(pixmapWidth, pixmapHeight, mode);
+        unsigned char *pixmapData = batch->_pixmap.data();
+        if (!pixmapData)
+        {
+            LOG_ERR("Failed to allocate pixmap of size " << pixmapWidth << 'x' << pixmapHeight);
+            return false;
+        }
 
         (void) mobileAppDocId;
 
-        const auto mode = static_cast<LibreOfficeKitTileMode>(document->getTileMode());
-
         const size_t pixmapSize = 4 * pixmapWidth * pixmapHeight;
-        std::vector<char> output;
-        output.reserve(pixmapSize);
+        batch->_output.reserve(pixmapSize);
 
-        // Compress the area as tiles
-        std::vector<TileDesc> renderedTiles;
-        std::vector<TileWireId> renderingIds;
+        // Paint large combines a row of tiles at a time, compressing each band while the next
+        // is painted. LOK serializes painting, so the bands themselves cannot paint in parallel.
+        const size_t bandRows = (isBandedRendering() && pixmapSize >= MinBandedPixmapSize) ? 1 : tilesByY;
 
-        size_t tileIndex = 0;
+        const double area = pixmapWidth * pixmapHeight;
+        const auto start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::duration paintDuration{};
 
-        std::mutex pngMutex;
+        size_t tileIndex = 0;
 
-        for (const Util::Rectangle& tileRect : tileRecs)
+        for (size_t bandY = 0; bandY < tilesByY; bandY += bandRows)
         {
-            const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
-            const size_t positionY = (tileRect.getTop() - renderArea.getTop()) / tileCombined.getTileHeight();
-
-            const int offsetX = positionX * pixelWidth;
-            const int offsetY = positionY * pixelHeight;
-
-            // FIXME: should this be in the delta / compression thread ?
-            blendWatermark(pixmap.data(), offsetX, offsetY,
-                           pixmapWidth, pixmapHeight,
-                           pixelWidth, pixelHeight,
-                           mode);
-
-            // FIXME: prettify this.
-            bool forceKeyframe = tiles[tileIndex].getOldWireId() == 0;
-
-            // FIXME: we should perhaps increment only on a plausible edit
-            static TileWireId nextId = 0;
-            TileWireId wireId = ++nextId;
-
-            bool skipCompress = false;
-            if (!skipCompress)
+            const size_t rows = std::min(bandRows, tilesByY - bandY);
+            unsigned char *bandData = pixmapData + bandY * pixelHeight * pixmapWidth * 4;
+
+            // Render the band
+            const auto bandStart = std::chrono::steady_clock::now();
+            LOG_TRC("Calling paintPartTile(" << (void*)bandData << ')');
+            document->paintPartTile(bandData,
+                                    tileCombined.getPart(),
+                                    pixmapWidth, rows * pixelHeight,
+                                    renderArea.getLeft(),
+                                    renderArea.getTop() + bandY * tileCombined.getTileHeight(),
+                                    renderArea.getWidth(), rows * tileCombined.getTileHeight());
+            paintDuration += std::chrono::steady_clock::now() - bandStart;
+
+            // The previous batch was compressed while we painted; send it before queueing
+            // ours, so tiles go out in order and no two batches delta the same tile at once.
+            if (bandY == 0)
+                pngPool.finish();
+
+            for (size_t i = 0; i < tileRecs.size(); ++i)
             {
-                renderingIds.push_back(wireId);
-
-                LOG_TRC("Queued encoding of tile #" << tileIndex << " at (" << positionX << ',' << positionY << ") with " <<
-                        (forceKeyframe?"force keyframe" : "allow delta") << ", wireId: " << wireId);
-
-                // Queue to be executed later in parallel inside 'run'
-                pngPool.pushWork([=,&output,&pixmap,&tiles,&renderedTiles,
-                                  &pngMutex,&deltaGen]()
-                    {
-                        auto data = std::shared_ptr<std::vector< char >>(new std::vector< char >());
-                        data->reserve(pixmapWidth * pixmapHeight * 1);
-
-                        // FIXME: don't try to store & create deltas for read-only documents.
-                        if (tiles[tileIndex].getId() < 0) // not a preview
+                const Util::Rectangle& tileRect = tileRecs[i];
+                const size_t positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
+                const size_t positionY = (tileRect.getTop() - renderArea.getTop()) / tileCombined.getTileHeight();
+                if (positionY < bandY || positionY >= bandY + rows)
+                    continue;
+
+                const int offsetX = positionX * pixelWidth;
+                const int offsetY = positionY * pixelHeight;
+
+                // FIXME: should this be in the delta / compression thread ?
+                blendWatermark(pixmapData, offsetX, offsetY,
+                               pixmapWidth, pixmapHeight,
+                               pixelWidth, pixelHeight,
+                               mode);
+
+                // FIXME: prettify this.
+                bool forceKeyframe = tiles[i].getOldWireId() == 0;
+
+                // FIXME: we should perhaps increment only on a plausible edit
+                static TileWireId nextId = 0;
+                TileWireId wireId = ++nextId;
+
+                bool skipCompress = false;
+                if (!skipCompress)
+                {
+                    LOG_TRC("Queued encoding of tile #" << tileIndex << " at (" << positionX << ',' << positionY << ") with " <<
+                            (forceKeyframe?"force keyframe" : "allow delta") << ", wireId: " << wireId);
+
+                    const TileDesc tile = tiles[i];
+                    const int part = tileCombined.getPart();
+
+                    // Queue to be executed later in parallel, while we render the next batch
+                    pngPool.pushWork([=,&deltaGen]()
                         {
-                            // Can we create a delta ?
-                            LOG_TRC("Compress new tile #" << tileIndex);
-                            deltaGen.compressOrDelta(pixmap.data(), offsetX, offsetY,
-                                                     pixelWidth, pixelHeight,
-                                                     pixmapWidth, pixmapHeight,
-                                                     TileLocation(
-                                                         tileRect.getLeft(),
-                                                         tileRect.getTop(),
-                                                         tileRect.getWidth(),
-                                                         tileCombined.getPart(),
-                                                         canonicalViewId
-                                                         ),
-                                                     *data, wireId, forceKeyframe);
-                        }
-                        else
-                        {
-                            // FIXME: write our own trivial PNG encoding code using deflate.
-                            LOG_TRC("Encode a new png for tile #" << tileIndex);
-                            if (!Png::encodeSubBufferToPNG(pixmap.data(), offsetX, offsetY, pixelWidth, pixelHeight,
-                                                           pixmapWidth, pixmapHeight, *data, mode))
+                            // Reused by each thread for all its tiles.
+                            static thread_local std::vector<char> tileData;
+                            tileData.clear();
+                            std::vector<char> *data = &tileData;
+
+                            // FIXME: don't try to store & create deltas for read-only documents.
+                            if (tile.getId() < 0) // not a preview
                             {
-                                // FIXME: Return error.
-                                // sendTextFrameAndLogError("error: cmd=tile kind=failure");
-                                LOG_ERR("Failed to encode tile into PNG.");
-                                return;
+                                // Can we create a delta ?
+                                LOG_TRC("Compress new tile #" << tileIndex);
+                                deltaGen.compressOrDelta(pixmapData, offsetX, offsetY,
+                                                         pixelWidth, pixelHeight,
+                                                         pixmapWidth, pixmapHeight,
+                                                         TileLocation(
+                                                             tileRect.getLeft(),
+                                                             tileRect.getTop(),
+                                                             tileRect.getWidth(),
+                                                             part,
+                                                             canonicalViewId
+                                                             ),
+                                                         *data, wireId, forceKeyframe);
+                            }
+                            else
+                            {
+                                // FIXME: write our own trivial PNG encoding code using deflate.
+                                LOG_TRC("Encode a new png for tile #" << tileIndex);
+                                if (!Png::encodeSubBufferToPNG(pixmapData, offsetX, offsetY, pixelWidth, pixelHeight,
+                                                               pixmapWidth, pixmapHeight, *data, mode))
+                                {
+                                    // FIXME: Return error.
+                                    // sendTextFrameAndLogError("error: cmd=tile kind=failure");
+                                    LOG_ERR("Failed to encode tile into PNG.");
+                                    return;
+                                }
                             }
-                        }
 
-                        LOG_TRC("Tile " << tileIndex << " is " << data->size() << " bytes.");
-                        std::unique_lock<std::mutex> pngLock(pngMutex);
-                        output.insert(output.end(), data->begin(), data->end());
-                        pushRendered(renderedTiles, tiles[tileIndex], wireId, data->size());
-                    });
+                            LOG_TRC("Tile " << tileIndex << " is " << data->size() << " bytes.");
+                            std::unique_lock<std::mutex> pngLock(batch->_mutex);
+                            batch->_output.insert(batch->_output.end(), data->begin(), data->end());
+                            pushRendered(batch->_renderedTiles, tile, wireId, data->size());
+                        });
+                }
+                tileIndex++;
             }
-            tileIndex++;
-        }
 
-        pngPool.run();
+            if (rows < tilesByY)
+                pngPool.start();
+        }
 
-        duration = std::chrono::steady_clock::now() - start;
-        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
-        LOG_DBG("rendering tiles at (" << renderArea.getLeft() << ", " << renderArea.getTop()
-                                       << "), (" << renderArea.getWidth() << ", "
-                                       << renderArea.getHeight() << ") "
-                                       << " took " << elapsed << " (including the paintPartTile).");
+        const auto elapsedMics = std::chrono::duration_cast<std::chrono::microseconds>(paintDuration);
+        LOG_DBG("paintPartTile at ("
+                << renderArea.getLeft() << ", " << renderArea.getTop() << "), ("
+                << renderArea.getWidth() << ", " << renderArea.getHeight() << ") "
+                << " rendered in " << elapsedMics << " in " << (tilesByY + bandRows - 1) / bandRows
+                << " bands (" << area / std::max<double>(elapsedMics.count(), 1) << " MP/s).");
 
         if (tileIndex == 0)
             return false;
 
-        std::string tileMsg;
-        if (combined)
-        {
-            tileMsg = tileCombined.serialize("tilecombine:", "\n", renderedTiles);
+        // Sent by the next pngPool.finish(), on this thread.
+        pngPool.runAsync([=, &deltaGen]()
+            {
+                const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start);
+                LOG_DBG("rendering tiles at (" << renderArea.getLeft() << ", " << renderArea.getTop()
+                                               << "), (" << renderArea.getWidth() << ", "
+                                               << renderArea.getHeight() << ") "
+                                               << " took " << elapsed << " (including the paintPartTile).");
 
-            LOG_TRC("Sending back painted tiles for " << tileMsg << " of size " << output.size() << " bytes) for: " << tileMsg);
+                sendRendered(*batch, tileCombined, combined, outputMessage);
 
-            std::unique_ptr<char[]> response;
-            const size_t responseSize = tileMsg.size() + output.size();
-            response.reset(new char[responseSize]);
-            std::copy(tileMsg.begin(), tileMsg.end(), response.get());
-            std::copy(output.begin(), output.end(), response.get() + tileMsg.size());
-            outputMessage(response.get(), responseSize);
-        }
-        else
-        {
-            size_t outputOffset = 0;
-            for (auto &i : renderedTiles)
-            {
-                tileMsg = i.serialize("tile:", "\n");
-                const size_t responseSize = tileMsg.size() + i.getImgSize();
-                std::unique_ptr<char[]> response;
-                response.reset(new char[responseSize]);
-                std::copy(tileMsg.begin(), tileMsg.end(), response.get());
-                std::copy(output.begin() + outputOffset, output.begin() + outputOffset + i.getImgSize(), response.get() + tileMsg.size());
-                outputMessage(response.get(), responseSize);
-                outputOffset += i.getImgSize();
-            }
-        }
+                // Should we do this more frequently? and/orshould we defer it?
+                deltaGen.rebalanceDeltas();
+            });
 
-        // Should we do this more frequently? and/orshould we defer it?
-        deltaGen.rebalanceDeltas();
         return true;
     }
 }
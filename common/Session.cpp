@@ -70,6 +70,20 @@ bool Session::sendBinaryFrame(const char *buffer, int length)
     return _protocol->sendBinaryMessage(buffer, length) >= length;
 }
 
+bool Session::sendSharedBinaryFrame(const std::shared_ptr<const void>& owner, const char* buffer,
+                                    int length)
+{
+    if (!_protocol)
+    {
+        LOG_TRC("ERR - missing protocol " << getName() << ": Send: " << std::to_string(length)
+                                          << " shared binary bytes");
+        return false;
+    }
+
+    LOG_TRC("Send: " << std::to_string(length) << " shared binary bytes");
+    return _protocol->sendSharedBinaryMessage(owner, buffer, length) >= length;
+}
+
 void Session::parseDocOptions(const StringVector& tokens, int& part, std::string& timestamp, std::string& doctemplate)
 {
     // First token is the "load" command itself.
@@ -275,6 +289,18 @@ void Session::getIOStats(uint64_t &sent, uint64_t &recv)
     _protocol->getIOStats(sent, recv);
 }
 
+void Session::getCompressionStats(uint64_t &raw, uint64_t &compressed)
+{
+    if (!_protocol)
+    {
+        raw = 0;
+        compressed = 0;
+        return;
+    }
+
+    _protocol->getCompressionStats(raw, compressed);
+}
+
 void Session::dumpState(std::ostream& os)
 {
     os << "\n\t\tid: " << _id
@@ -88,6 +88,11 @@ public:
 
     /// overridden to prepend client ids on messages by the Kit
     virtual bool sendBinaryFrame(const char* buffer, int length);
+
+    /// Sends a binary frame of @buffer, which @owner keeps alive and unchanged,
+    /// without copying it when possible.
+    bool sendSharedBinaryFrame(const std::shared_ptr<const void>& owner, const char* buffer,
+                               int length);
     virtual bool sendTextFrame(const char* buffer, const int length);
 
     /// Get notified that the underlying transports disconnected
@@ -181,6 +186,9 @@ public:
 
     void getIOStats(uint64_t &sent, uint64_t &recv);
 
+    /// Get the bytes of the messages compressed for the client, before and after.
+    void getCompressionStats(uint64_t &raw, uint64_t &compressed);
+
     void setUserId(const std::string& userId) { _userId = userId; }
 
     const std::string& getUserId() const { return _userId; }
@@ -407,7 +407,8 @@ public:
     /// Called when a new client session is added to a DocumentBroker.
     virtual void onDocBrokerAddSession(const std::string&, const std::shared_ptr<ClientSession>&) {}
 
-    /// Called when a client session is removed to a DocumentBroker.
+    /// Called when a client session is removed to a DocumentBroker,
+    /// including while it is still loading.
     virtual void onDocBrokerRemoveSession(const std::string&, const std::shared_ptr<ClientSession>&)
     {
     }
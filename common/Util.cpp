@@ -12,6 +12,7 @@
 #include <csignal>
 #include <sys/poll.h>
 #ifdef __linux__
+#  include <sched.h>
 #  include <sys/prctl.h>
 #  include <sys/syscall.h>
 #  include <sys/vfs.h>
@@ -371,6 +372,61 @@ namespace Util
         return totalMemKb;
     }
 
+    int getAvailableCpuCount()
+    {
+        int cpus = 0;
+#ifdef __linux__
+        // Honours sched_setaffinity & cpusets, unlike hardware_concurrency().
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            cpus = CPU_COUNT(&set);
+        else
+            LOG_SYS("sched_getaffinity failed, will count all the CPUs");
+#endif
+        if (cpus <= 0)
+            cpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+
+        // cgroup v2 "<quota> <period>" or "max <period>", else v1 quota & period.
+        long quota = -1;
+        long period = 0;
+        FILE* file = fopen("/sys/fs/cgroup/cpu.max", "r");
+        if (file != nullptr)
+        {
+            char line[256] = { 0 };
+            if (fgets(line, sizeof(line), file) && !startsWith(line, "max", 3))
+                sscanf(line, "%ld %ld", &quota, &period);
+            fclose(file);
+        }
+        else
+        {
+            file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+            if (file != nullptr)
+            {
+                if (fscanf(file, "%ld", &quota) != 1)
+                    quota = -1;
+                fclose(file);
+            }
+
+            file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+            if (file != nullptr)
+            {
+                if (fscanf(file, "%ld", &period) != 1)
+                    period = 0;
+                fclose(file);
+            }
+        }
+
+        if (quota > 0 && period > 0)
+        {
+            // Round up: a quota of 1.5 CPUs can keep two threads partly busy.
+            const long quotaCpus = (quota + period - 1) / period;
+            cpus = std::min<long>(cpus, std::max<long>(quotaCpus, 1));
+        }
+
+        return cpus;
+    }
+
     std::pair<std::size_t, std::size_t> getPssAndDirtyFromSMaps(FILE* file)
     {
         std::size_t numPSSKb = 0;
@@ -199,6 +199,10 @@ namespace Util
     /// Returns the total physical memory (in kB) available in the system
     size_t getTotalSystemMemoryKb();
 
+    /// Returns the number of CPUs this process may use: the online CPUs
+    /// in our affinity mask, further limited by any cgroup CPU quota.
+    int getAvailableCpuCount();
+
     /// Returns the process PSS in KB (works only when we have perms for /proc/pid/smaps).
     size_t getMemoryUsagePSS(const pid_t pid);
 
@@ -989,6 +989,13 @@ bool ChildSession::clientVisibleArea(const StringVector& tokens)
     getLOKitDocument()->setView(_viewId);
 
     getLOKitDocument()->setClientVisibleArea(x, y, width, height);
+
+    // Render the tiles the view shows before the others.
+    int part = 0;
+    if (getLOKitDocument()->getDocumentType() != LOK_DOCTYPE_TEXT)
+        part = getLOKitDocument()->getPart();
+
+    _docManager->getTileQueue()->updateVisibleArea(_viewId, part, x, y, width, height);
     return true;
 }
 
@@ -2504,6 +2511,7 @@ bool ChildSession::setClientPart(const StringVector& tokens)
     if (getLOKitDocument()->getDocumentType() != LOK_DOCTYPE_TEXT && part != getLOKitDocument()->getPart())
     {
         getLOKitDocument()->setPart(part);
+        _docManager->getTileQueue()->updateVisibleAreaPart(_viewId, part);
     }
 
     return true;
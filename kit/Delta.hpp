@@ -13,6 +13,7 @@
 #include <zlib.h>
 #include <Log.hpp>
 #include <Common.hpp>
+#include <DeltaSimd.hpp>
 
 #define ENABLE_DELTAS 1
 
@@ -53,6 +54,61 @@ struct TileLocation {
     }
 };
 
+/// A raw deflate stream that is reset rather than re-created per tile,
+/// along with the scratch buffers used to feed it.
+class DeflateContext
+{
+    z_stream _zstr;
+    bool _valid;
+
+public:
+    /// Scratch space for unpremultiplied pixels, reused across tiles.
+    std::vector<unsigned char> _scratch;
+
+    DeflateContext(int level)
+    {
+        memset((void *)&_zstr, 0, sizeof (_zstr));
+        _valid = deflateInit2(&_zstr, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!_valid)
+            LOG_ERR("Failed to init deflate");
+    }
+
+    DeflateContext(const DeflateContext&) = delete;
+    DeflateContext& operator=(const DeflateContext&) = delete;
+
+    ~DeflateContext()
+    {
+        if (_valid)
+            deflateEnd(&_zstr);
+    }
+
+    /// Compresses @size bytes of @data, appending the stream to @output.
+    bool compress(const unsigned char *data, size_t size, std::vector<char>& output)
+    {
+        if (!_valid || deflateReset(&_zstr) != Z_OK)
+            return false;
+
+        // Let zlib write directly into the output.
+        const size_t oldSize = output.size();
+        const uLong maxCompressed = deflateBound(&_zstr, size);
+        output.resize(oldSize + maxCompressed);
+
+        _zstr.next_in = const_cast<Bytef *>(data);
+        _zstr.avail_in = size;
+        _zstr.next_out = reinterpret_cast<Bytef *>(&output[oldSize]);
+        _zstr.avail_out = maxCompressed;
+
+        if (deflate(&_zstr, Z_FINISH) != Z_STREAM_END)
+        {
+            output.resize(oldSize);
+            return false;
+        }
+
+        output.resize(oldSize + maxCompressed - _zstr.avail_out);
+        return true;
+    }
+};
+
 /// A quick and dirty, thread-safe delta generator for last tile changes
 class DeltaGenerator {
 
@@ -81,17 +137,8 @@ class DeltaGenerator {
         {
             assert ((width & 0x1) == 0); // copy 64bits at a time.
 
-            const uint64_t *src = reinterpret_cast<const uint64_t *>(from);
-            uint64_t *dest = reinterpret_cast<uint64_t *>(to);
-
             // We get the hash ~for free as we copy - with a cheap hash.
-            uint64_t crc = 0x7fffffff - 1;
-            for (unsigned int x = 0; x < (width>>1); ++x)
-            {
-                crc = (crc << 7) + crc + src[x];
-                dest[x] = src[x];
-            }
-            return crc;
+            return DeltaSimd::best().copyWithCrc(to, from, width);
         }
 
         DeltaData (TileWireId wid,
@@ -233,6 +280,48 @@ class DeltaGenerator {
     std::unordered_set<std::shared_ptr<DeltaData>, DeltaHasher, DeltaCompare> _deltaEntries;
     size_t _maxEntries;
 
+  public:
+    /// The deflate level used to compress tiles, trading bandwidth for CPU.
+    /// All of them are plain raw deflate streams, so the client is unaffected.
+    enum class Compression
+    {
+        Default, ///< Balanced size vs. CPU.
+        Fast,    ///< Fastest matching: slightly larger tiles.
+        None     ///< Stored blocks only: ~no CPU, for fast networks.
+    };
+
+    /// The compression selected via the TILE_COMPRESSION environment.
+    static Compression getDefaultCompression()
+    {
+        const char *mode = getenv("TILE_COMPRESSION");
+        if (mode && !strcmp(mode, "fast"))
+            return Compression::Fast;
+        if (mode && !strcmp(mode, "none"))
+            return Compression::None;
+        return Compression::Default;
+    }
+
+  private:
+    Compression _compression;
+
+    /// Per-thread persistent deflate state, for deltas or keyframes.
+    DeflateContext& getDeflateContext(bool delta)
+    {
+        static thread_local std::unique_ptr<DeflateContext> contexts[3][2];
+
+        std::unique_ptr<DeflateContext> &context = contexts[static_cast<int>(_compression)][delta];
+        if (!context)
+        {
+            int level = delta ? Z_DEFAULT_COMPRESSION : Z_BEST_SPEED + 1;
+            if (_compression == Compression::Fast)
+                level = Z_BEST_SPEED;
+            else if (_compression == Compression::None)
+                level = Z_NO_COMPRESSION;
+            context.reset(new DeflateContext(level));
+        }
+        return *context;
+    }
+
     void rebalanceDeltasT()
     {
         if (_deltaEntries.size() > _maxEntries)
@@ -255,44 +344,7 @@ class DeltaGenerator {
     static void
     unpremult_copy (unsigned char *dest, const unsigned char *srcBytes, unsigned int count)
     {
-        const uint32_t *src = reinterpret_cast<const uint32_t *>(srcBytes);
-
-        for (unsigned int i = 0; i < count; ++i)
-        {
-            // Profile me: avoid math for runs of duplicate pixels
-            // possibly we should RLE earlier ?
-            if (i > 0 && src[i-1] == src[i])
-            {
-                std::memcpy (dest, dest - 4, 4);
-                dest += 4;
-                continue;
-            }
-
-            uint32_t pix;
-            uint8_t  alpha;
-
-            std::memcpy (&pix, src + i, sizeof (uint32_t));
-
-            alpha = (pix & 0xff000000) >> 24;
-            if (alpha == 255)
-            {
-                dest[0] = ((pix & 0xff0000) >> 16);
-                dest[1] = ((pix & 0x00ff00) >>  8);
-                dest[2] = ((pix & 0x0000ff) >>  0);
-                dest[3] = 255;
-            }
-            else if (alpha == 0)
-                dest[0] = dest[1] = dest[2] = dest[3] = 0;
-
-            else
-            {
-                dest[0] = (((pix & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-                dest[1] = (((pix & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-                dest[2] = (((pix & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
-                dest[3] = alpha;
-            }
-            dest += 4;
-        }
+        DeltaSimd::best().unpremultCopy(dest, srcBytes, count);
     }
 
     bool makeDelta(
@@ -366,20 +418,17 @@ class DeltaGenerator {
             // Our row is just that different:
             const DeltaBitmapRow &curRow = cur.getRow(y);
             const DeltaBitmapRow &prevRow = prev.getRow(y);
+            const DeltaSimd::Kernels &kernels = DeltaSimd::best();
             for (int x = 0; x < prev.getWidth();)
             {
-                int same;
-                for (same = 0; same + x < prev.getWidth() &&
-                         prevRow._pixels[x+same] == curRow._pixels[x+same];)
-                    ++same;
-
-                x += same;
-
-                int diff;
-                for (diff = 0; diff + x < prev.getWidth() &&
-                         (prevRow._pixels[x+diff] != curRow._pixels[x+diff] || diff < 3) &&
-                         diff < 254;)
-                    ++diff;
+                x += kernels.countSame(prevRow._pixels + x, curRow._pixels + x,
+                                       prev.getWidth() - x);
+
+                // Runs are at least 3 pixels, and at most 254, long.
+                int diff = std::min(prev.getWidth() - x, 254);
+                if (diff > 3)
+                    diff = 3 + kernels.countDiff(prevRow._pixels + x + 3,
+                                                 curRow._pixels + x + 3, diff - 3);
                 if (diff > 0)
                 {
                     output.push_back('d');
@@ -413,47 +462,33 @@ class DeltaGenerator {
         return false; // Disable transmission for now; just send keyframes.
 #endif
 
-        z_stream zstr;
-        memset((void *)&zstr, 0, sizeof (zstr));
-
-        if (deflateInit2 (&zstr, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-                          -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
-            LOG_ERR("Failed to init deflate");
-            return false;
-        }
-
-        // FIXME: avoid allocation & make this more efficient.
-        uLong maxCompressed = compressBound(output.size());
-        Bytef *compressed = (Bytef *)malloc(maxCompressed);
-
-        zstr.next_in = (Bytef *)output.data();
-        zstr.avail_in = output.size();
-        zstr.next_out = compressed;
-        zstr.avail_out = maxCompressed;
-
-        if (!compressed || deflate(&zstr, Z_FINISH) != Z_STREAM_END) {
+        outStream.push_back('D');
+        const size_t oldSize = outStream.size();
+        if (!getDeflateContext(true).compress(reinterpret_cast<unsigned char *>(output.data()),
+                                              output.size(), outStream))
+        {
             LOG_ERR("Failed to compress delta of size " << output.size());
+            outStream.resize(oldSize - 1);
             return false;
         }
 
-        deflateEnd(&zstr);
-
-        uLong compSize = maxCompressed - zstr.avail_out;
-        LOG_TRC("Compressed delta of size " << output.size() << " to size " << compSize);
-//                << Util::dumpHex(std::string((char *)compressed, compSize)));
-
-        // FIXME: should get zlib to drop it directly in really.
-        outStream.push_back('D');
-        size_t oldSize = outStream.size();
-        outStream.resize(oldSize + compSize);
-        memcpy(&outStream[oldSize], compressed, compSize);
-        free (compressed);
+        LOG_TRC("Compressed delta of size " << output.size() << " to size "
+                << outStream.size() - oldSize);
 
         return true;
     }
 
   public:
-    DeltaGenerator() {}
+    DeltaGenerator()
+        : _maxEntries(0)
+        , _compression(getDefaultCompression())
+    {
+    }
+
+    void setCompression(Compression compression)
+    {
+        _compression = compression;
+    }
 
     /// Re-balances the cache size to fit the number of sessions
     void rebalanceDeltas(ssize_t limit = -1)
@@ -551,62 +586,28 @@ class DeltaGenerator {
                          bufferWidth, bufferHeight,
                          loc, output, wid, forceKeyframe))
         {
-            // FIXME: should stream it in =)
-
-            // FIXME: get sizes right [!] ...
-            z_stream zstr;
-            memset((void *)&zstr, 0, sizeof (zstr));
+            DeflateContext &context = getDeflateContext(false);
 
-            if (deflateInit2 (&zstr, Z_BEST_SPEED + 1, Z_DEFLATED,
-                              -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            // Unpremultiply the whole tile, then deflate it in one go.
+            const size_t rowSize = (size_t)width * 4;
+            context._scratch.resize(rowSize * height);
+            for (int y = 0; y < height; ++y)
             {
-                LOG_ERR("Failed to init deflate");
-                return 0;
+                unpremult_copy(&context._scratch[y * rowSize],
+                               (Bytef *)pixmap + ((startY + y) * bufferWidth * 4) + (startX * 4), width);
             }
 
-            uLong maxCompressed = compressBound((uLong)width * height * 4);
-            Bytef *compressed = (Bytef *)malloc(maxCompressed);
-            if (!compressed)
+            output.push_back('Z');
+            const size_t oldSize = output.size();
+            if (!context.compress(context._scratch.data(), context._scratch.size(), output))
             {
-                LOG_ERR("Failed to allocate buffer of size " << maxCompressed << " to compress into");
+                LOG_ERR("failed to compress image ");
+                output.resize(oldSize - 1);
                 return 0;
             }
 
-            zstr.next_out = compressed;
-            zstr.avail_out = maxCompressed;
-
-            unsigned char fixedupLine[width * 4];
-
-            // FIXME: should we RLE in pixels first ?
-            for (int y = 0; y < height; ++y)
-            {
-                unpremult_copy(fixedupLine, (Bytef *)pixmap + ((startY + y) * bufferWidth * 4) + (startX * 4), width);
-
-                zstr.next_in = fixedupLine;
-                zstr.avail_in = width * 4;
-
-                bool lastRow = (y == height - 1);
-                int flushFlag = lastRow ? Z_FINISH : Z_NO_FLUSH;
-                int expected = lastRow ? Z_STREAM_END : Z_OK;
-                if (deflate(&zstr,  flushFlag) != expected)
-                {
-                    LOG_ERR("failed to compress image ");
-                    return 0;
-                }
-            }
-
-            deflateEnd(&zstr);
-
-            uLong compSize = maxCompressed - zstr.avail_out;
-            LOG_TRC("Compressed image of size " << (width * height * 4) << " to size " << compSize);
-//                    << Util::dumpHex(std::string((char *)compressed, compSize)));
-
-            // FIXME: get zlib to drop it directly into this buffer really.
-            output.push_back('Z');
-            size_t oldSize = output.size();
-            output.resize(oldSize + compSize);
-            memcpy(&output[oldSize], compressed, compSize);
-            free (compressed);
+            LOG_TRC("Compressed image of size " << (width * height * 4) << " to size "
+                    << output.size() - oldSize);
         }
 
         return output.size();
@@ -0,0 +1,409 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// Pixel kernels of the DeltaGenerator, with SSE2 / AVX2 variants
+// selected at run-time. The scalar versions are the reference:
+// every variant must produce bit-identical results to them.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <immintrin.h>
+#  define DELTA_SIMD_X86 1
+#else
+#  define DELTA_SIMD_X86 0
+#endif
+
+namespace DeltaSimd
+{
+    /// The row hash is a polynomial: crc = crc * 129 + word, over 64-bit words.
+    constexpr uint64_t HashSeed = 0x7fffffff - 1;
+    constexpr uint64_t HashMul = 129;
+
+    /// HashMul^n modulo 2^64.
+    inline uint64_t hashMulPow(uint64_t n)
+    {
+        uint64_t result = 1;
+        uint64_t base = HashMul;
+        for (; n; n >>= 1)
+        {
+            if (n & 1)
+                result *= base;
+            base *= base;
+        }
+        return result;
+    }
+
+    /// The available instruction set variants.
+    enum class Isa
+    {
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    /// A consistent set of kernels for one instruction set.
+    struct Kernels
+    {
+        const char* _name;
+        /// Copies width (even) pixels and returns the hash of the row.
+        uint64_t (*copyWithCrc)(uint32_t* to, const uint32_t* from, unsigned int width);
+        /// Number of leading pixels that are identical in a and b.
+        unsigned int (*countSame)(const uint32_t* a, const uint32_t* b, unsigned int count);
+        /// Number of leading pixels that differ between a and b.
+        unsigned int (*countDiff)(const uint32_t* a, const uint32_t* b, unsigned int count);
+        /// Unpremultiplies and converts native endian ARGB => RGBA bytes.
+        void (*unpremultCopy)(unsigned char* dest, const unsigned char* src, unsigned int count);
+    };
+
+    namespace Scalar
+    {
+        inline uint64_t hashWords(uint64_t crc, uint64_t* dest, const uint64_t* src,
+                                  unsigned int from, unsigned int to)
+        {
+            for (unsigned int x = from; x < to; ++x)
+            {
+                crc = (crc << 7) + crc + src[x];
+                dest[x] = src[x];
+            }
+            return crc;
+        }
+
+        inline uint64_t copyWithCrc(uint32_t* to, const uint32_t* from, unsigned int width)
+        {
+            return hashWords(HashSeed, reinterpret_cast<uint64_t*>(to),
+                             reinterpret_cast<const uint64_t*>(from), 0, width >> 1);
+        }
+
+        inline unsigned int countSame(const uint32_t* a, const uint32_t* b, unsigned int count)
+        {
+            unsigned int i = 0;
+            while (i < count && a[i] == b[i])
+                ++i;
+            return i;
+        }
+
+        inline unsigned int countDiff(const uint32_t* a, const uint32_t* b, unsigned int count)
+        {
+            unsigned int i = 0;
+            while (i < count && a[i] != b[i])
+                ++i;
+            return i;
+        }
+
+        inline void unpremultCopy(unsigned char* dest, const unsigned char* srcBytes,
+                                  unsigned int count)
+        {
+            const uint32_t* src = reinterpret_cast<const uint32_t*>(srcBytes);
+
+            for (unsigned int i = 0; i < count; ++i)
+            {
+                // Avoid math for runs of duplicate pixels
+                if (i > 0 && src[i - 1] == src[i])
+                {
+                    std::memcpy(dest, dest - 4, 4);
+                    dest += 4;
+                    continue;
+                }
+
+                uint32_t pix;
+                uint8_t alpha;
+
+                std::memcpy(&pix, src + i, sizeof(uint32_t));
+
+                alpha = (pix & 0xff000000) >> 24;
+                if (alpha == 255)
+                {
+                    dest[0] = ((pix & 0xff0000) >> 16);
+                    dest[1] = ((pix & 0x00ff00) >> 8);
+                    dest[2] = ((pix & 0x0000ff) >> 0);
+                    dest[3] = 255;
+                }
+                else if (alpha == 0)
+                    dest[0] = dest[1] = dest[2] = dest[3] = 0;
+
+                else
+                {
+                    dest[0] = (((pix & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
+                    dest[1] = (((pix & 0x00ff00) >> 8) * 255 + alpha / 2) / alpha;
+                    dest[2] = (((pix & 0x0000ff) >> 0) * 255 + alpha / 2) / alpha;
+                    dest[3] = alpha;
+                }
+                dest += 4;
+            }
+        }
+    } // namespace Scalar
+
+#if DELTA_SIMD_X86
+    // The hash is split into N interleaved lanes, each multiplied by 129^N per step,
+    // which recombine into exactly the scalar polynomial. 129^4 fits in 32 bits,
+    // so a 64x32 multiply built from two pmuludq is sufficient.
+
+    namespace SSE2
+    {
+        __attribute__((target("sse2"))) inline __m128i mulLanes(__m128i a, __m128i k)
+        {
+            const __m128i lo = _mm_mul_epu32(a, k);
+            const __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), k);
+            return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        }
+
+        __attribute__((target("sse2")))
+        inline uint64_t copyWithCrc(uint32_t* to, const uint32_t* from, unsigned int width)
+        {
+            const uint64_t* src = reinterpret_cast<const uint64_t*>(from);
+            uint64_t* dest = reinterpret_cast<uint64_t*>(to);
+            const unsigned int words = width >> 1;
+            const unsigned int blocks = words / 4;
+
+            uint64_t crc = HashSeed;
+            if (blocks > 0)
+            {
+                // Two independent accumulators hide the multiply latency.
+                const uint64_t mul2 = HashMul * HashMul;
+                const __m128i k = _mm_set1_epi64x(mul2 * mul2);
+                __m128i acc0 = _mm_setzero_si128();
+                __m128i acc1 = _mm_setzero_si128();
+                for (unsigned int i = 0; i < blocks; ++i)
+                {
+                    const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+                    const __m128i v1
+                        = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4 + 2));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4), v0);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4 + 2), v1);
+                    acc0 = _mm_add_epi64(mulLanes(acc0, k), v0);
+                    acc1 = _mm_add_epi64(mulLanes(acc1, k), v1);
+                }
+
+                uint64_t lanes[4];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc0);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes + 2), acc1);
+                crc = crc * hashMulPow(blocks * 4) + lanes[0] * mul2 * HashMul
+                      + lanes[1] * mul2 + lanes[2] * HashMul + lanes[3];
+            }
+
+            return Scalar::hashWords(crc, dest, src, blocks * 4, words);
+        }
+
+        __attribute__((target("sse2")))
+        inline unsigned int countSame(const uint32_t* a, const uint32_t* b, unsigned int count)
+        {
+            unsigned int i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                const __m128i eq
+                    = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                      _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+                const unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+                if (mask != 0xf)
+                    return i + __builtin_ctz(~mask & 0xf);
+            }
+            return i + Scalar::countSame(a + i, b + i, count - i);
+        }
+
+        __attribute__((target("sse2")))
+        inline unsigned int countDiff(const uint32_t* a, const uint32_t* b, unsigned int count)
+        {
+            unsigned int i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                const __m128i eq
+                    = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)),
+                                      _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+                const unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+                if (mask != 0)
+                    return i + __builtin_ctz(mask);
+            }
+            return i + Scalar::countDiff(a + i, b + i, count - i);
+        }
+
+        /// Blocks that are entirely opaque or entirely transparent need no division,
+        /// which is by far the common case; mixed blocks go through the scalar path.
+        __attribute__((target("sse2")))
+        inline void unpremultCopy(unsigned char* dest, const unsigned char* src, unsigned int count)
+        {
+            const __m128i alphaMask = _mm_set1_epi32(0xff000000);
+            const __m128i agMask = _mm_set1_epi32(0xff00ff00);
+            const __m128i lowMask = _mm_set1_epi32(0x000000ff);
+
+            unsigned int i = 0;
+            for (; i + 4 <= count; i += 4)
+            {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+                const __m128i alpha = _mm_and_si128(v, alphaMask);
+                __m128i* out = reinterpret_cast<__m128i*>(dest + i * 4);
+                if (_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(alpha, alphaMask))) == 0xf)
+                {
+                    // ARGB => ABGR as a native word, ie. RGBA bytes.
+                    const __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), lowMask);
+                    const __m128i b = _mm_slli_epi32(_mm_and_si128(v, lowMask), 16);
+                    _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(v, agMask),
+                                                       _mm_or_si128(r, b)));
+                }
+                else if (_mm_movemask_ps(_mm_castsi128_ps(
+                             _mm_cmpeq_epi32(alpha, _mm_setzero_si128()))) == 0xf)
+                    _mm_storeu_si128(out, _mm_setzero_si128());
+                else
+                    Scalar::unpremultCopy(dest + i * 4, src + i * 4, 4);
+            }
+            Scalar::unpremultCopy(dest + i * 4, src + i * 4, count - i);
+        }
+    } // namespace SSE2
+
+    namespace AVX2
+    {
+        __attribute__((target("avx2"))) inline __m256i mulLanes(__m256i a, __m256i k)
+        {
+            const __m256i lo = _mm256_mul_epu32(a, k);
+            const __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), k);
+            return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+        }
+
+        __attribute__((target("avx2")))
+        inline uint64_t copyWithCrc(uint32_t* to, const uint32_t* from, unsigned int width)
+        {
+            const uint64_t* src = reinterpret_cast<const uint64_t*>(from);
+            uint64_t* dest = reinterpret_cast<uint64_t*>(to);
+            const unsigned int words = width >> 1;
+            const unsigned int blocks = words / 4;
+
+            uint64_t crc = HashSeed;
+            if (blocks > 0)
+            {
+                const uint64_t mul2 = HashMul * HashMul;
+                const __m256i k = _mm256_set1_epi64x(mul2 * mul2);
+                __m256i acc = _mm256_setzero_si256();
+                for (unsigned int i = 0; i < blocks; ++i)
+                {
+                    const __m256i v
+                        = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i * 4), v);
+                    acc = _mm256_add_epi64(mulLanes(acc, k), v);
+                }
+
+                uint64_t lanes[4];
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+                crc = crc * hashMulPow(blocks * 4) + lanes[0] * mul2 * HashMul
+                      + lanes[1] * mul2 + lanes[2] * HashMul + lanes[3];
+            }
+
+            return Scalar::hashWords(crc, dest, src, blocks * 4, words);
+        }
+
+        __attribute__((target("avx2")))
+        inline unsigned int countSame(const uint32_t* a, const uint32_t* b, unsigned int count)
+        {
+            unsigned int i = 0;
+            for (; i + 8 <= count; i += 8)
+            {
+                const __m256i eq = _mm256_cmpeq_epi32(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+                const unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+                if (mask != 0xff)
+                    return i + __builtin_ctz(~mask & 0xff);
+            }
+            return i + SSE2::countSame(a + i, b + i, count - i);
+        }
+
+        __attribute__((target("avx2")))
+        inline unsigned int countDiff(const uint32_t* a, const uint32_t* b, unsigned int count)
+        {
+            unsigned int i = 0;
+            for (; i + 8 <= count; i += 8)
+            {
+                const __m256i eq = _mm256_cmpeq_epi32(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+                const unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+                if (mask != 0)
+                    return i + __builtin_ctz(mask);
+            }
+            return i + SSE2::countDiff(a + i, b + i, count - i);
+        }
+
+        __attribute__((target("avx2")))
+        inline void unpremultCopy(unsigned char* dest, const unsigned char* src, unsigned int count)
+        {
+            const __m256i alphaMask = _mm256_set1_epi32(0xff000000);
+            // Byte shuffle ARGB (BGRA in memory) => RGBA, per 128bit lane.
+            const __m256i swizzle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13,
+                                                     12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11,
+                                                     14, 13, 12, 15);
+
+            unsigned int i = 0;
+            for (; i + 8 <= count; i += 8)
+            {
+                const __m256i v
+                    = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+                const __m256i alpha = _mm256_and_si256(v, alphaMask);
+                __m256i* out = reinterpret_cast<__m256i*>(dest + i * 4);
+                if (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(alpha, alphaMask)))
+                    == 0xff)
+                    _mm256_storeu_si256(out, _mm256_shuffle_epi8(v, swizzle));
+                else if (_mm256_movemask_ps(_mm256_castsi256_ps(
+                             _mm256_cmpeq_epi32(alpha, _mm256_setzero_si256())))
+                         == 0xff)
+                    _mm256_storeu_si256(out, _mm256_setzero_si256());
+                else
+                    SSE2::unpremultCopy(dest + i * 4, src + i * 4, 8);
+            }
+            SSE2::unpremultCopy(dest + i * 4, src + i * 4, count - i);
+        }
+    } // namespace AVX2
+#endif // DELTA_SIMD_X86
+
+    inline bool isSupported(Isa isa)
+    {
+        switch (isa)
+        {
+            case Isa::Scalar:
+                return true;
+#if DELTA_SIMD_X86
+            case Isa::SSE2:
+                return __builtin_cpu_supports("sse2");
+            case Isa::AVX2:
+                return __builtin_cpu_supports("avx2");
+#endif
+            default:
+                return false;
+        }
+    }
+
+    /// The kernels for @isa, which must be supported.
+    inline const Kernels& getKernels(Isa isa)
+    {
+        static const Kernels scalar = { "scalar", Scalar::copyWithCrc, Scalar::countSame,
+                                        Scalar::countDiff, Scalar::unpremultCopy };
+#if DELTA_SIMD_X86
+        static const Kernels sse2 = { "sse2", SSE2::copyWithCrc, SSE2::countSame, SSE2::countDiff,
+                                      SSE2::unpremultCopy };
+        static const Kernels avx2 = { "avx2", AVX2::copyWithCrc, AVX2::countSame, AVX2::countDiff,
+                                      AVX2::unpremultCopy };
+        if (isa == Isa::AVX2)
+            return avx2;
+        if (isa == Isa::SSE2)
+            return sse2;
+#endif
+        (void)isa;
+        return scalar;
+    }
+
+    /// The fastest kernels this CPU supports, detected once.
+    inline const Kernels& best()
+    {
+        static const Kernels& kernels = isSupported(Isa::AVX2)   ? getKernels(Isa::AVX2)
+                                        : isSupported(Isa::SSE2) ? getKernels(Isa::SSE2)
+                                                                 : getKernels(Isa::Scalar);
+        return kernels;
+    }
+} // namespace DeltaSimd
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
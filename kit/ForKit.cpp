@@ -14,15 +14,21 @@
 #ifndef __FreeBSD__
 #include <sys/capability.h>
 #endif
+#include <poll.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 
+#include <algorithm>
 #include <atomic>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
 #include <map>
+#include <string_view>
 #include <thread>
 #include <chrono>
 
@@ -68,6 +74,21 @@ static std::atomic<unsigned> ForkCounter(0);
 static std::map<pid_t, std::string> childJails;
 /// The jails that need cleaning up. This should be small.
 static std::vector<std::string> cleanupJailPaths;
+/// The process removing jails in the background, see startJailReaper().
+static pid_t JailReaperPid = -1;
+/// Our end of the socket to the jail reaper, -1 to remove jails ourselves.
+static int JailReaperFd = -1;
+/// How many jails made from the template to keep ready, 0 when not in use.
+static std::size_t PreparedJailTarget = 0;
+/// The jails the reaper made from the template, ready to be renamed for new kits.
+static std::deque<std::string> preparedJails;
+/// How many jails we asked the reaper to prepare, that it hasn't sent back yet.
+static std::size_t pendingJailCount = 0;
+
+/// Asks the jail reaper to prepare a jail; anything else it receives is a jail to remove.
+static constexpr char PrepareJailRequest[] = "prepare";
+/// The jail reaper's reply when it couldn't prepare a jail, instead of its path.
+static constexpr char PrepareJailFailed[] = "failed";
 
 #ifndef KIT_IN_PROCESS
 int ClientPortNumber = DEFAULT_CLIENT_PORT_NUMBER;
@@ -309,6 +330,17 @@ static void cleanupChildren()
                 ++segFaultCount;
             }
         }
+        else if (exitedChildPid == JailReaperPid)
+        {
+            LOG_WRN("Jail reaper " << exitedChildPid << " has exited, will remove jails inline.");
+            JailReaperPid = -1;
+            pendingJailCount = 0;
+            if (JailReaperFd >= 0)
+            {
+                close(JailReaperFd);
+                JailReaperFd = -1;
+            }
+        }
         else
         {
             LOG_ERR("Unknown child " << exitedChildPid << " has exited");
@@ -349,11 +381,32 @@ static void cleanupChildren()
 #endif
     }
 
-    // Now delete the jails.
+    // Now delete the jails, in the background when we can.
     auto i = cleanupJailPaths.size();
     while (i-- > 0)
     {
         const std::string path = cleanupJailPaths[i];
+        if (JailReaperFd >= 0)
+        {
+            if (send(JailReaperFd, path.data(), path.size(), MSG_DONTWAIT | MSG_NOSIGNAL)
+                == static_cast<ssize_t>(path.size()))
+            {
+                cleanupJailPaths.erase(cleanupJailPaths.begin() + i);
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // The queue is full, keep the rest for later rather than wait.
+                LOG_DBG("Jail reaper is busy, " << i + 1 << " jails left to remove.");
+                break;
+            }
+
+            LOG_SYS("Failed to queue jail [" << path << "] for removal, will remove jails inline");
+            close(JailReaperFd);
+            JailReaperFd = -1;
+        }
+
         JailUtil::removeJail(path);
         const FileUtil::Stat st(path);
         if (st.good() && st.isDirectory())
@@ -363,6 +416,190 @@ static void cleanupChildren()
     }
 }
 
+#ifndef KIT_IN_PROCESS
+/// How long the jail reaper waits before retrying the jails it failed to remove.
+static constexpr int JailRetryIntervalMs = 5000;
+
+/// Removes the jails it receives on @fd, and prepares jails under @childRoot
+/// when asked, until forkit closes it.
+static void runJailReaper(int fd, const std::string& childRoot)
+{
+    Util::setThreadName("jail_reaper");
+    LOG_INF("Jail reaper started.");
+
+    std::vector<std::string> batch;
+    std::size_t prepareCount = 0;
+    // The jails we failed to remove, say while still in use, retried on each wakeup.
+    std::vector<std::string> retry;
+    char buffer[PATH_MAX];
+    for (;;)
+    {
+        // Wait for a jail, or until it's time to retry the ones left over.
+        pollfd pfd = { fd, POLLIN, 0 };
+        const int ready = poll(&pfd, 1, retry.empty() ? -1 : JailRetryIntervalMs);
+        if (ready < 0 && errno != EINTR)
+        {
+            LOG_SYS("Jail reaper failed to poll");
+            break;
+        }
+
+        // Take all those queued.
+        bool done = false;
+        if (ready > 0)
+        {
+            ssize_t len;
+            while ((len = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+            {
+                if (std::string_view(buffer, len) == PrepareJailRequest)
+                    ++prepareCount;
+                else
+                    batch.emplace_back(buffer, len);
+            }
+
+            // Forkit is gone.
+            done = len == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+
+        // Forkit waits for prepared jails, so make those first.
+        for (; prepareCount > 0 && !done; --prepareCount)
+        {
+            std::string path = prepareJail(childRoot);
+            if (path.empty())
+                path = PrepareJailFailed;
+
+            if (send(fd, path.data(), path.size(), MSG_NOSIGNAL)
+                != static_cast<ssize_t>(path.size()))
+            {
+                LOG_SYS("Jail reaper failed to send the prepared jail [" << path << ']');
+                if (path != PrepareJailFailed)
+                    batch.emplace_back(path);
+            }
+        }
+
+        batch.insert(batch.end(), retry.begin(), retry.end());
+        retry.clear();
+        if (!batch.empty())
+        {
+            for (const std::string& path : batch)
+            {
+                JailUtil::removeJail(path);
+                const FileUtil::Stat st(path);
+                if (st.good() && st.isDirectory())
+                    retry.emplace_back(path);
+            }
+
+            LOG_DBG("Jail reaper removed " << batch.size() - retry.size() << " jails, "
+                                           << retry.size() << " left to retry.");
+            batch.clear();
+        }
+
+        if (done)
+            break;
+    }
+
+    if (!retry.empty())
+        LOG_WRN("Jail reaper could not remove " << retry.size() << " jails.");
+
+    LOG_INF("Jail reaper finished.");
+    Log::shutdown();
+    std::_Exit(EX_OK);
+}
+
+/// Forks the jail reaper, so removing the jails of exited kits, which
+/// unmounts them and deletes whole trees, doesn't hold up forking new ones.
+/// It also makes jails from the template ahead of time, see refillPreparedJails().
+/// Forkit must stay single-threaded to fork safely, so this is a process.
+/// Jails are sent one per datagram, and the socket buffer bounds the queue.
+/// Must run before we connect to WSD, so the reaper doesn't hold that socket,
+/// and after setupJailTemplate(), so it has the template.
+static void startJailReaper(const std::string& childRoot)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+        LOG_SYS("Failed to create the jail reaper socket, will remove jails inline");
+        return;
+    }
+
+    const pid_t pid = fork();
+    if (!pid)
+    {
+        // Child
+        close(0);
+        close(fds[0]);
+        runJailReaper(fds[1], childRoot);
+    }
+
+    close(fds[1]);
+    if (pid < 0)
+    {
+        LOG_SYS("Failed to fork the jail reaper, will remove jails inline");
+        close(fds[0]);
+        return;
+    }
+
+    LOG_INF("Forked jail reaper [" << pid << ']');
+    JailReaperPid = pid;
+    JailReaperFd = fds[0];
+}
+#endif
+
+/// Takes the jails the reaper prepared since last time, and asks for as many
+/// more as it takes to have PreparedJailTarget ready or on the way.
+static void refillPreparedJails()
+{
+    if (JailReaperFd < 0)
+        return;
+
+    char buffer[PATH_MAX];
+    ssize_t len;
+    while (pendingJailCount > 0
+           && (len = recv(JailReaperFd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+    {
+        --pendingJailCount;
+        if (std::string_view(buffer, len) != PrepareJailFailed)
+            preparedJails.emplace_back(buffer, len);
+        else if (PreparedJailTarget > 0)
+        {
+            // Don't ask again, as it'll most likely fail again.
+            LOG_ERR("Jail reaper failed to prepare a jail from the template, will "
+                    "link/copy each jail from now on.");
+            PreparedJailTarget = 0;
+        }
+    }
+
+    constexpr ssize_t requestLen = sizeof(PrepareJailRequest) - 1;
+    while (preparedJails.size() + pendingJailCount < PreparedJailTarget
+           && send(JailReaperFd, PrepareJailRequest, requestLen, MSG_DONTWAIT | MSG_NOSIGNAL)
+                  == requestLen)
+    {
+        ++pendingJailCount;
+    }
+}
+
+/// Renames a prepared jail, if we have one, to @jailPath for a kit about to be forked.
+static bool usePreparedJail(const std::string& jailPath)
+{
+    refillPreparedJails();
+    if (preparedJails.empty())
+        return false;
+
+    const std::string path = std::move(preparedJails.front());
+    preparedJails.pop_front();
+    refillPreparedJails();
+
+    if (::rename(path.c_str(), jailPath.c_str()) != 0)
+    {
+        LOG_SYS("Failed to rename the prepared jail [" << path << "] to [" << jailPath << "].");
+        cleanupJailPaths.emplace_back(path);
+        return false;
+    }
+
+    LOG_DBG("Renamed the prepared jail [" << path << "] to [" << jailPath << "], "
+                                          << preparedJails.size() << " left.");
+    return true;
+}
+
 static int createLibreOfficeKit(const std::string& childRoot,
                                 const std::string& sysTemplate,
                                 const std::string& loTemplate,
@@ -380,6 +617,9 @@ static int createLibreOfficeKit(const std::string& childRoot,
     LOG_DBG("Forking a coolkit process with jailId: " << jailId << " as spare coolkit #"
                                                       << spareKitId << '.');
 
+    // Hand it the jail made ahead from the template, if we have one.
+    const bool preparedJail = usePreparedJail(childRoot + '/' + jailId);
+
     const pid_t pid = fork();
     if (!pid)
     {
@@ -388,6 +628,10 @@ static int createLibreOfficeKit(const std::string& childRoot,
         // Close the pipe from coolwsd
         close(0);
 
+        // Only forkit may have jails removed.
+        if (JailReaperFd >= 0)
+            close(JailReaperFd);
+
 #ifndef KIT_IN_PROCESS
         UnitKit::get().postFork();
 #endif
@@ -413,6 +657,8 @@ static int createLibreOfficeKit(const std::string& childRoot,
         if (pid < 0)
         {
             LOG_SYS("Fork failed");
+            if (preparedJail)
+                JailUtil::removeJail(childRoot + '/' + jailId);
         }
         else
         {
@@ -460,6 +706,9 @@ void forkLibreOfficeKit(const std::string& childRoot,
             }
         }
     }
+
+    // Ask for the jails used by these to be made again, while we wait.
+    refillPreparedJails();
 }
 
 #ifndef KIT_IN_PROCESS
@@ -707,8 +956,26 @@ int main(int argc, char** argv)
     const auto conf = std::getenv("COOL_CONFIG");
     config::initialize(std::string(conf ? conf : std::string()));
     EnableExperimental = config::getBool("experimental_features", false);
+
+    // Jails are mounted when they can be, otherwise made from a template if configured.
+    if (!NoCapsForKit && !JailUtil::isBindMountingEnabled()
+        && config::getString("jail_provisioning", "link") == "template")
+    {
+        if (setupJailTemplate(childRoot, sysTemplate, loTemplate))
+        {
+            // As many as the kits we keep spare, so a burst of forks finds them ready.
+            int target = config::getInt("num_prespawn_children", 1);
+            if (config::getBool("prespawn.adaptive", false))
+                target = std::max(target, config::getInt("prespawn.max_children", 10));
+            PreparedJailTarget = std::max(target, 1);
+        }
+    }
 #endif
 
+    // The reaper prepares the jails, out of our way.
+    startJailReaper(childRoot);
+    refillPreparedJails();
+
     Util::setThreadName("forkit");
 
     LOG_INF("Preinit stage OK.");
@@ -14,7 +14,9 @@
 #include <dlfcn.h>
 #ifdef __linux__
 #include <ftw.h>
+#include <sys/ioctl.h>
 #include <sys/vfs.h>
+#include <linux/fs.h>
 #include <linux/magic.h>
 #include <sys/capability.h>
 #include <sys/sysmacros.h>
@@ -140,6 +142,11 @@ static uint64_t AnonymizationSalt = 82589933;
 /// system root, not the jail.
 static std::string JailRoot;
 
+#if !MOBILEAPP
+/// The kind of document this kit warmed up for while spare, if any.
+static std::string WarmDocumentType;
+#endif
+
 #if !MOBILEAPP
 static void flushTraceEventRecordings();
 #endif
@@ -159,7 +166,8 @@ namespace
     enum class LinkOrCopyType
     {
         All,
-        LO
+        LO,
+        Template
     };
     LinkOrCopyType linkOrCopyType;
     std::string sourceForLinkOrCopy;
@@ -171,6 +179,9 @@ namespace
     unsigned linkOrCopyFileCount = 0; // Track to help quantify the link-or-copy performance.
     constexpr unsigned SlowLinkOrCopyLimitInSecs = 2; // After this many seconds, start spamming the logs.
 
+    /// The jail tree built once by setupJailTemplate(), empty when not in use.
+    std::string JailTemplatePath;
+
     bool detectSlowStackingFileSystem(const std::string &directory)
     {
 #ifdef __linux__
@@ -206,6 +217,8 @@ namespace
                 return "LibreOffice";
             case LinkOrCopyType::All:
                 return "all";
+            case LinkOrCopyType::Template:
+                return "template";
             default:
                 assert(!"Unknown LinkOrCopyType.");
                 return "unknown";
@@ -229,7 +242,7 @@ namespace
                 strcmp(path, "share/config/wizard") != 0 &&
                 strcmp(path, "readmes") != 0 &&
                 strcmp(path, "help") != 0;
-        default: // LinkOrCopyType::All
+        default: // LinkOrCopyType::All, Template
             return true;
         }
     }
@@ -283,18 +296,58 @@ namespace
             }
             return true;
         }
-        default: // LinkOrCopyType::All
+        default: // LinkOrCopyType::All, Template
             return true;
         }
     }
 
+    /// Copies @fpath to @newPath sharing its data blocks (a reflink),
+    /// where the file system supports it.
+    bool cloneFile(const char* fpath, const std::string& newPath)
+    {
+#ifdef FICLONE
+        const int src = ::open(fpath, O_RDONLY | O_CLOEXEC);
+        if (src < 0)
+            return false;
+
+        struct stat st;
+        bool cloned = false;
+        if (::fstat(src, &st) == 0)
+        {
+            const int dst = ::open(newPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                                   st.st_mode & 07777);
+            if (dst >= 0)
+            {
+                cloned = ::ioctl(dst, FICLONE, src) == 0;
+                ::close(dst);
+                if (!cloned)
+                    ::unlink(newPath.c_str());
+            }
+        }
+
+        ::close(src);
+        return cloned;
+#else
+        (void)fpath;
+        (void)newPath;
+        return false;
+#endif
+    }
+
     void linkOrCopyFile(const char* fpath, const std::string& newPath)
     {
         ++linkOrCopyFileCount;
         if (linkOrCopyVerboseLogging)
             LOG_INF("Linking file \"" << fpath << "\" to \"" << newPath << '"');
 
-        if (!forceInitialCopy)
+        if (linkOrCopyType == LinkOrCopyType::Template)
+        {
+            // The template is on the jails' file system, so links only fail
+            // when a file has too many (EMLINK) or they are restricted.
+            if (link(fpath, newPath.c_str()) == 0 || cloneFile(fpath, newPath))
+                return;
+        }
+        else if (!forceInitialCopy)
         {
             // first try a simple hard-link
             if (link(fpath, newPath.c_str()) == 0)
@@ -304,7 +357,8 @@ namespace
 
         // incrementally build our 'linkable/' copy nearby
         static bool canChown = true; // only if we can get permissions right
-        if ((forceInitialCopy || errno == EXDEV) && canChown)
+        if (linkOrCopyType != LinkOrCopyType::Template && (forceInitialCopy || errno == EXDEV)
+            && canChown)
         {
             // then copy somewhere closer and hard link from there
             if (!forceInitialCopy)
@@ -455,10 +509,14 @@ namespace
         return FTW_CONTINUE;
     }
 
-    void linkOrCopy(std::string source,
+    /// Links or copies the tree at @source to @destination, stashing copies in
+    /// @linkable to link from. Logs the files / second when slow, or with @logRate.
+    /// Returns false when the tree couldn't be walked.
+    bool linkOrCopy(std::string source,
                     const Poco::Path& destination,
                     std::string linkable,
-                    LinkOrCopyType type)
+                    LinkOrCopyType type,
+                    bool logRate = false)
     {
         std::string resolved = FileUtil::realpath(source);
         if (resolved != source)
@@ -479,14 +537,17 @@ namespace
         linkableForLinkOrCopy = linkable;
         linkOrCopyFileCount = 0;
         linkOrCopyStartTime = std::chrono::steady_clock::now();
-        forceInitialCopy = detectSlowStackingFileSystem(destination.toString());
+        // Links from our template are fast even on stacking file systems, it is there already.
+        forceInitialCopy = type != LinkOrCopyType::Template
+                           && detectSlowStackingFileSystem(destination.toString());
 
-        if (nftw(source.c_str(), linkOrCopyFunction, 10, FTW_ACTIONRETVAL|FTW_PHYS) == -1)
+        const int result = nftw(source.c_str(), linkOrCopyFunction, 10, FTW_ACTIONRETVAL|FTW_PHYS);
+        if (result == -1)
         {
             LOG_ERR("linkOrCopy: nftw() failed for '" << source << '\'');
         }
 
-        if (linkOrCopyVerboseLogging)
+        if (linkOrCopyVerboseLogging || logRate)
         {
             linkOrCopyVerboseLogging = false;
             const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -498,6 +559,8 @@ namespace
                                           << " finished in " << seconds << " seconds, or " << rate
                                           << " files / second.");
         }
+
+        return result == 0;
     }
 
 #ifndef __FreeBSD__
@@ -543,6 +606,78 @@ namespace
 #endif // BUILDING_TESTS
 } // namespace
 
+#ifndef BUILDING_TESTS
+bool setupJailTemplate(const std::string& childRoot, const std::string& sysTemplate,
+                       const std::string& loTemplate)
+{
+    const std::string templatePath = childRoot + "/template";
+    const std::string buildPath = templatePath + ".new";
+    const auto startTime = std::chrono::steady_clock::now();
+
+    // Left over from an earlier forkit.
+    for (const std::string& path : { buildPath, templatePath })
+    {
+        if (FileUtil::Stat(path).exists())
+            JailUtil::removeJail(path);
+    }
+
+    const Poco::Path buildDir = Poco::Path::forDirectory(buildPath);
+    Poco::File(buildDir).createDirectories();
+    Poco::Path loDir(buildDir, JailUtil::LO_JAIL_SUBPATH);
+    loDir.makeDirectory();
+
+    const std::string linkablePath = childRoot + "/linkable";
+    if (!linkOrCopy(sysTemplate, buildDir, linkablePath, LinkOrCopyType::All, /*logRate=*/true)
+        || !linkOrCopy(loTemplate, loDir, linkablePath, LinkOrCopyType::LO, /*logRate=*/true))
+    {
+        LOG_ERR("Failed to build the jail template in [" << buildPath
+                                                         << "], will link/copy each jail.");
+        JailUtil::removeJail(buildPath);
+        return false;
+    }
+
+    // Marked before linking it into every jail, so they are all removed as copies.
+    JailUtil::markJailCopied(buildPath);
+
+    // Only a complete template is ever used.
+    if (::rename(buildPath.c_str(), templatePath.c_str()) != 0)
+    {
+        LOG_SYS("Failed to rename the jail template [" << buildPath << "] to [" << templatePath
+                                                       << "], will link/copy each jail.");
+        JailUtil::removeJail(buildPath);
+        return false;
+    }
+
+    JailTemplatePath = templatePath;
+    LOG_INF("Built the jail template [" << templatePath << "] in "
+                                        << std::chrono::duration_cast<std::chrono::milliseconds>(
+                                               std::chrono::steady_clock::now() - startTime));
+    return true;
+}
+
+std::string prepareJail(const std::string& childRoot)
+{
+    if (JailTemplatePath.empty())
+        return std::string();
+
+    const std::string path = childRoot + "/prepared-" + Util::rng::getFilename(16);
+    const Poco::Path dir = Poco::Path::forDirectory(path);
+    Poco::File(dir).createDirectories();
+    if (!linkOrCopy(JailTemplatePath, dir, std::string(), LinkOrCopyType::Template,
+                    /*logRate=*/true))
+    {
+        // Don't retry on every spawn, as it'll most likely fail again.
+        LOG_ERR("Failed to prepare a jail from the template in ["
+                << path << "], will link/copy each jail from now on.");
+        JailUtil::removeJail(path);
+        JailTemplatePath.clear();
+        return std::string();
+    }
+
+    return path;
+}
+#endif // BUILDING_TESTS
+
 #endif // !MOBILEAPP
 
 /// A document container.
@@ -635,6 +770,22 @@ public:
         return true;
     }
 
+    /// Post a message made of @header followed by @data, without copying them together.
+    bool postMessage(const char* header, int headerSize, const char* data, int size,
+                     const WSOpCode code) const
+    {
+        LOG_TRC("postMessage called with: " << getAbbreviatedMessage(header, headerSize));
+        if (!_websocketHandler)
+        {
+            LOG_ERR("Child Doc: Bad socket while sending ["
+                    << getAbbreviatedMessage(header, headerSize) << "].");
+            return false;
+        }
+
+        _websocketHandler->sendMessage(header, headerSize, data, size, code, /*flush=*/true);
+        return true;
+    }
+
     bool createSession(const std::string& sessionId, int canonicalViewId)
     {
         try
@@ -798,8 +949,9 @@ public:
                                                pixelWidth, pixelHeight, mode);
         };
 
-        const auto postMessageFunc = [&](const char* buffer, std::size_t length) {
-            postMessage(buffer, length, WSOpCode::Binary);
+        const auto postMessageFunc = [&](const char* header, std::size_t headerLength,
+                                         const char* data, std::size_t length) {
+            postMessage(header, headerLength, data, length, WSOpCode::Binary);
         };
 
         if (!RenderTiles::doRender(_loKitDocument, _deltaGen, tileCombined, _pngPool,
@@ -1329,6 +1481,11 @@ private:
             const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(duration);
             LOG_DBG("Returned lokit::documentLoad(" << FileUtil::anonymizeUrl(pURL) << ") in "
                                                     << elapsed);
+#if !MOBILEAPP
+            if (_loKitDocument && _loKitDocument->get())
+                sendTextFrame("loadtime: warm=" + (WarmDocumentType.empty() ? "none" : WarmDocumentType)
+                              + " duration=" + std::to_string(elapsed.count()));
+#endif
 #ifdef IOS
             DocumentData::get(_mobileAppDocId).loKitDocument = _loKitDocument.get();
 #endif
@@ -1592,6 +1749,11 @@ public:
 
                 const StringVector tokens = StringVector::tokenize(input.data(), input.size());
 
+                // Keep compressing the last tiles while we paint more; anything
+                // else must be ordered after them.
+                if (!tokens.equals(0, "tile") && !tokens.equals(0, "tilecombine"))
+                    _pngPool.finish();
+
                 if (tokens.equals(0, "eof"))
                 {
                     LOG_INF("Received EOF. Finishing.");
@@ -1697,6 +1859,8 @@ public:
                 }
             }
 
+            // Send any tiles still being compressed.
+            _pngPool.finish();
         }
         catch (const std::exception& exc)
         {
@@ -1783,6 +1947,7 @@ public:
         oss << "\n";
 
         _pngPool.dumpState(oss);
+        RenderTiles::BufferPool::get().dumpState(oss);
         _sessions.dumpState(oss);
 
         _deltaGen.dumpState(oss);
@@ -1848,8 +2013,9 @@ private:
 
     std::atomic<bool> _stop;
 
-    ThreadPool _pngPool;
     DeltaGenerator _deltaGen;
+    // After _deltaGen, which its threads use, to be destroyed before it.
+    ThreadPool _pngPool;
 
     std::condition_variable _cvLoading;
     int _editorId;
@@ -2259,6 +2425,13 @@ protected:
             }
         }
 
+#if !MOBILEAPP
+        else if (tokens.equals(0, "warmup") && tokens.size() == 2)
+        {
+            if (!_document)
+                warmUp(tokens[1]);
+        }
+#endif
         else if (tokens.equals(0, "exit"))
         {
 #if !MOBILEAPP
@@ -2340,6 +2513,45 @@ protected:
 #endif
         _ksPoll.reset();
     }
+
+private:
+#if !MOBILEAPP
+    /// Loads and closes an empty document of @type, see WarmupPolicy,
+    /// so its component is ready for the document we will get.
+    void warmUp(const std::string& type)
+    {
+        std::string factory;
+        if (type == "text")
+            factory = "swriter";
+        else if (type == "spreadsheet")
+            factory = "scalc";
+        else if (type == "presentation")
+            factory = "simpress";
+        else if (type == "drawing")
+            factory = "sdraw";
+        else
+        {
+            LOG_ERR("Unknown document type to warm up for: " << type);
+            return;
+        }
+
+        const std::string url = "private:factory/" + factory;
+        LOG_DBG("Warming up with lokit::documentLoad(" << url << ')');
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<lok::Document> warmDocument(_loKit->documentLoad(url.c_str(), ""));
+        if (!warmDocument || !warmDocument->get())
+        {
+            LOG_WRN("Failed to warm up for " << type << " documents: " << _loKit->getError());
+            return;
+        }
+
+        warmDocument.reset();
+        WarmDocumentType = type;
+        LOG_INF("Warmed up for " << type << " documents in "
+                                 << std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now() - start));
+    }
+#endif
 };
 
 void documentViewCallback(const int type, const char* payload, void* data)
@@ -2597,14 +2809,23 @@ void lokit_main(
 
             if (!bindMount)
             {
-                LOG_INF("Mounting is disabled, will link/copy " << sysTemplate << " -> "
-                                                                << jailPathStr);
+                if (JailUtil::isJailCopied(jailPathStr))
+                {
+                    // Forkit renamed a jail made from the template into place.
+                    LOG_INF("Mounting is disabled, using the jail prepared from the template at "
+                            << jailPathStr);
+                }
+                else
+                {
+                    LOG_INF("Mounting is disabled, will link/copy " << sysTemplate << " -> "
+                                                                    << jailPathStr);
 
-                const std::string linkablePath = childRoot + "/linkable";
+                    const std::string linkablePath = childRoot + "/linkable";
 
-                linkOrCopy(sysTemplate, jailPath, linkablePath, LinkOrCopyType::All);
+                    linkOrCopy(sysTemplate, jailPath, linkablePath, LinkOrCopyType::All);
 
-                linkOrCopy(loTemplate, loJailDestPath, linkablePath, LinkOrCopyType::LO);
+                    linkOrCopy(loTemplate, loJailDestPath, linkablePath, LinkOrCopyType::LO);
+                }
 
                 // Update the dynamic files inside the jail.
                 if (!JailUtil::SysTemplate::updateDynamicFiles(jailPathStr))
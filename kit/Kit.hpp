@@ -131,6 +131,18 @@ void forkLibreOfficeKit(const std::string& childRoot,
                         const std::string& loTemplate,
                         int limit = 0);
 
+#if !MOBILEAPP
+/// Builds the tree of a jail once, into a template under @childRoot, for
+/// prepareJail() to make the jails from. See jail_provisioning in coolwsd.xml.
+/// Returns false when that failed, and each jail is linked/copied as usual.
+bool setupJailTemplate(const std::string& childRoot, const std::string& sysTemplate,
+                       const std::string& loTemplate);
+
+/// Makes a jail from the template under @childRoot, for a kit to be renamed into.
+/// Returns its path, or empty when there is no template or that failed.
+std::string prepareJail(const std::string& childRoot);
+#endif
+
 /// Anonymize the basename of filenames, preserving the path and extension.
 std::string anonymizeUrl(const std::string& url);
 
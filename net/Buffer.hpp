@@ -8,14 +8,16 @@
 #pragma once
 
 #include <assert.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
 #include <ostream>
 #include <vector>
 
 #include <Util.hpp>
 
-// Blocks -> we can share from client -> server ... etc.
-// headers / and a 'writeV' etc. =)
-
 /**
  * Encapsulate data we need to write.
  */
@@ -129,4 +131,189 @@ public:
     }
 };
 
+/**
+ * Encapsulate data we need to write, as a list of segments.
+ * Appending never moves what is already queued, and erasing what
+ * was written never shuffles down the rest, however much a slow
+ * peer lets pile up. Small appends are copied into chunks, large
+ * ones get a segment of their own, and shared blobs are referenced
+ * rather than copied. The segments are written with writev.
+ */
+class ChunkedBuffer
+{
+    struct Segment
+    {
+        /// Our own storage, or null for shared data.
+        std::unique_ptr<char[]> _chunk;
+        /// Keeps shared data alive.
+        std::shared_ptr<const void> _owner;
+        const char* _data;
+        std::size_t _size;
+        /// Bytes of our storage from _data, for appending.
+        std::size_t _capacity;
+    };
+
+    std::deque<Segment> _segments;
+    std::size_t _size;
+
+    /// The tail segment, if we can append to it.
+    Segment* getWritableTail()
+    {
+        if (_segments.empty() || !_segments.back()._chunk)
+            return nullptr;
+
+        Segment& tail = _segments.back();
+        return tail._size < tail._capacity ? &tail : nullptr;
+    }
+
+    void addChunk(const char* data, std::size_t len, std::size_t capacity)
+    {
+        Segment segment;
+        segment._chunk.reset(new char[capacity]);
+        memcpy(segment._chunk.get(), data, len);
+        segment._data = segment._chunk.get();
+        segment._size = len;
+        segment._capacity = capacity;
+        _segments.push_back(std::move(segment));
+    }
+
+public:
+    /// The size of the chunks small appends are gathered in.
+    static constexpr std::size_t ChunkSize = 16 * 1024;
+
+    /// Shared data shorter than this is cheaper to copy.
+    static constexpr std::size_t MinSharedSize = 4 * 1024;
+
+    ChunkedBuffer() : _size(0)
+    {
+    }
+
+    std::size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    /// The first contiguous block of data.
+    const char *getBlock() const
+    {
+        return _segments.empty() ? nullptr : _segments.front()._data;
+    }
+
+    std::size_t getBlockSize() const
+    {
+        return _segments.empty() ? 0 : _segments.front()._size;
+    }
+
+    /// Fills up to @maxCount of @iov with the first segments, covering at most
+    /// @maxBytes. Returns the number of entries filled.
+    int getIOVec(iovec* iov, int maxCount, std::size_t maxBytes) const
+    {
+        int count = 0;
+        for (const Segment& segment : _segments)
+        {
+            if (count >= maxCount || maxBytes == 0)
+                break;
+
+            const std::size_t len = std::min(segment._size, maxBytes);
+            iov[count].iov_base = const_cast<char*>(segment._data);
+            iov[count].iov_len = len;
+            maxBytes -= len;
+            ++count;
+        }
+
+        return count;
+    }
+
+    void eraseFirst(std::size_t len)
+    {
+        assert(len <= _size);
+        len = std::min(len, _size); // Avoid accidental damage.
+        _size -= len;
+
+        while (len > 0)
+        {
+            Segment& front = _segments.front();
+            if (len < front._size)
+            {
+                front._data += len;
+                front._size -= len;
+                front._capacity -= len;
+                break;
+            }
+
+            len -= front._size;
+            _segments.pop_front();
+        }
+    }
+
+    void append(const char *data, const int len)
+    {
+        if (len <= 0)
+            return;
+
+        std::size_t remaining = len;
+        Segment* tail = getWritableTail();
+        if (tail)
+        {
+            const std::size_t room = std::min(tail->_capacity - tail->_size, remaining);
+            memcpy(const_cast<char*>(tail->_data) + tail->_size, data, room);
+            tail->_size += room;
+            data += room;
+            remaining -= room;
+        }
+
+        if (remaining > 0)
+            addChunk(data, remaining, std::max(remaining, ChunkSize));
+
+        _size += len;
+    }
+
+    void append(const std::string& s) { append(s.c_str(), s.size()); }
+
+    /// Append a literal string, with compile-time size capturing.
+    template <std::size_t N> void append(const char (&s)[N])
+    {
+        static_assert(N > 1, "Cannot append empty strings.");
+        append(s, N - 1); // Minus null termination.
+    }
+
+    /// Append @len bytes of @data without copying them, holding on to @owner,
+    /// which keeps @data alive and unchanged, until they are written.
+    void append(const std::shared_ptr<const void>& owner, const char *data, std::size_t len)
+    {
+        if (len < MinSharedSize || !owner)
+        {
+            append(data, len);
+            return;
+        }
+
+        Segment segment;
+        segment._owner = owner;
+        segment._data = data;
+        segment._size = len;
+        segment._capacity = 0;
+        _segments.push_back(std::move(segment));
+        _size += len;
+    }
+
+    void dumpHex(std::ostream &os, const char *legend, const char *prefix) const
+    {
+        if (size() > 0)
+            os << prefix << "ChunkedBuffer size: " << size() << " segments: " << _segments.size()
+               << '\n';
+
+        std::vector<char> data;
+        data.reserve(size());
+        for (const Segment& segment : _segments)
+            data.insert(data.end(), segment._data, segment._data + segment._size);
+
+        if (data.size() > 0)
+            Util::dumpHex(os, data, legend, prefix);
+    }
+
+    void clear()
+    {
+        _segments.clear();
+        _size = 0;
+    }
+};
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
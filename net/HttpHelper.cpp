@@ -44,19 +44,14 @@ void sendErrorAndShutdown(int errorCode, const std::shared_ptr<StreamSocket>& so
 }
 
 void sendUncompressedFileContent(const std::shared_ptr<StreamSocket>& socket,
-                                 const std::string& path, const int bufferSize)
+                                 const std::string& path)
 {
-    std::ifstream file(path, std::ios::binary);
-    std::unique_ptr<char[]> buf(new char[bufferSize]);
-    do
-    {
-        file.read(&buf[0], bufferSize);
-        const int size = file.gcount();
-        if (size > 0)
-            socket->send(&buf[0], size, true);
-        else
-            break;
-    } while (file);
+    // The mapped pages are written out as they are, with no copy in user space.
+    const char* data = nullptr;
+    std::size_t size = 0;
+    std::shared_ptr<const void> mapping = FileUtil::mapFile(path, data, size);
+    if (mapping)
+        socket->send(std::move(mapping), data, size);
 }
 
 void sendDeflatedFileContent(const std::shared_ptr<StreamSocket>& socket, const std::string& path,
@@ -114,12 +109,8 @@ void sendFileAndShutdown(const std::shared_ptr<StreamSocket>& socket, const std:
     response->setContentType(mediaType);
     response->add("X-Content-Type-Options", "nosniff");
 
-    int bufferSize = std::min<std::size_t>(st.size(), Socket::MaximumSendBufferSize);
     if (static_cast<long>(st.size()) >= socket->getSendBufferSize())
-    {
-        socket->setSocketBufferSize(bufferSize);
-        bufferSize = socket->getSendBufferSize();
-    }
+        socket->setSocketBufferSize(std::min<std::size_t>(st.size(), Socket::MaximumSendBufferSize));
 
     // Disable deflate for now - until we can cache deflated data.
     // FIXME: IE/Edge doesn't work well with deflate, so check with
@@ -132,7 +123,7 @@ void sendFileAndShutdown(const std::shared_ptr<StreamSocket>& socket, const std:
         socket->send(*response);
 
         if (!headerOnly)
-            sendUncompressedFileContent(socket, path, bufferSize);
+            sendUncompressedFileContent(socket, path);
     }
     else
     {
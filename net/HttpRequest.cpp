@@ -12,8 +12,11 @@
 #include <Poco/MemoryStream.h>
 #include <Poco/Net/HTTPResponse.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
+#include <iterator>
 #include <fstream>
 #include <memory>
 #include <sstream>
@@ -301,6 +304,9 @@ FieldParseState StatusLine::parse(const char* p, int64_t& len)
     return FieldParseState::Valid;
 }
 
+std::atomic<std::size_t> Request::BodyBufferPeak(0);
+std::atomic<uint64_t> Request::BodySendFileBytes(0);
+
 int64_t Request::readData(const char* p, const int64_t len)
 {
     uint64_t available = len;
@@ -405,9 +411,15 @@ int64_t Request::readData(const char* p, const int64_t len)
             // A payload in a GET request "has no defined semantics".
             return len - available;
         }
+        else if (_verb == VERB_POST)
+        {
+            // The body, of the Content-Length given, is left to the caller,
+            // once we have the whole header.
+            return read > 0 ? len - available : 0;
+        }
         else
         {
-            // TODO: Implement POST and HEAD support.
+            // TODO: Implement HEAD support.
             LOG_ERR("Unsupported HTTP Method [" << _verb << ']');
             return -1;
         }
@@ -685,6 +697,175 @@ std::shared_ptr<Session> Session::create(std::string host, Protocol protocol, in
     return std::shared_ptr<Session>(new Session(std::move(host), protocol, port));
 }
 
+namespace
+{
+/// Holds a pooled connection while it is idle, in no poll.
+class IdleConnection final : public SimpleSocketHandler
+{
+public:
+    void onConnect(const std::shared_ptr<StreamSocket>&) override {}
+    void handleIncomingMessage(SocketDisposition&) override {}
+    int getPollEvents(std::chrono::steady_clock::time_point, int64_t&) override { return POLLIN; }
+    void performWrites(std::size_t) override {}
+};
+
+/// True when nothing came from the peer of an idle @socket: no data, nor the end of the stream.
+bool isIdleSocketOpen(const StreamSocket& socket)
+{
+#if !MOBILEAPP
+    char byte;
+    const ssize_t len = ::recv(socket.getFD(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#else
+    (void)socket;
+    return false;
+#endif
+}
+} // namespace
+
+void Session::returnToPool(SocketDisposition& disposition)
+{
+    std::shared_ptr<SessionPool> pool = _pool.lock();
+    std::shared_ptr<StreamSocket> socket = _socket.lock();
+    if (!pool || !socket || !isConnected())
+        return;
+
+    // Only the clean end of an HTTP/1.1 exchange leaves the connection usable.
+    const StatusLine& statusLine = _response->statusLine();
+    if (_request.stage() != Request::Stage::Finished
+        || Util::iequal(_request.get("Connection"), "close") || statusLine.versionMajor() != 1
+        || statusLine.versionMinor() < 1 || !socket->getInBuffer().empty()
+        || !socket->getOutBuffer().empty())
+    {
+        return;
+    }
+
+    // Our next request will connect again, possibly taking this connection back.
+    LOG_TRC('#' << socket->getFD() << ": Returning connection to " << _host << ':' << _port
+                << " to the pool");
+    _socket.reset();
+    _connected = false;
+
+    const std::string key = SessionPool::getKey(_host, _port, isSecure());
+    disposition.setMove(
+        [pool, key](const std::shared_ptr<Socket>& moved)
+        {
+            std::shared_ptr<StreamSocket> idle = std::static_pointer_cast<StreamSocket>(moved);
+            idle->setHandler(std::make_shared<IdleConnection>());
+            pool->release(key, idle);
+        });
+}
+
+std::shared_ptr<StreamSocket> Session::connectPooled()
+{
+    std::shared_ptr<SessionPool> pool = _pool.lock();
+    if (!pool)
+        return nullptr;
+
+    std::shared_ptr<StreamSocket> socket = pool->take(SessionPool::getKey(_host, _port, isSecure()));
+    if (!socket)
+    {
+        ++pool->_newCount;
+        return nullptr;
+    }
+
+    LOG_TRC('#' << socket->getFD() << ": Reusing pooled connection to " << _host << ':' << _port);
+    socket->setHandler(shared_from_this());
+    return socket;
+}
+
+void SessionPool::clear()
+{
+    std::map<std::string, std::vector<Idle>> idle;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        idle.swap(_idle);
+    }
+
+    // The sockets are closed here, outside the lock.
+}
+
+std::size_t SessionPool::getIdleCount() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::size_t count = 0;
+    for (const auto& pair : _idle)
+        count += pair.second.size();
+
+    return count;
+}
+
+std::shared_ptr<StreamSocket> SessionPool::take(const std::string& key)
+{
+    std::vector<Idle> closed;
+    std::shared_ptr<StreamSocket> socket;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        expire(std::chrono::steady_clock::now(), closed);
+
+        const auto it = _idle.find(key);
+        if (it == _idle.end())
+            return nullptr;
+
+        // The most recently used is the least likely to have been closed by the server.
+        while (!socket && !it->second.empty())
+        {
+            Idle idle = std::move(it->second.back());
+            it->second.pop_back();
+            if (isIdleSocketOpen(*idle._socket))
+                socket = std::move(idle._socket);
+            else
+                closed.push_back(std::move(idle));
+        }
+
+        if (it->second.empty())
+            _idle.erase(it);
+    }
+
+    if (socket)
+        ++_reuseCount;
+
+    return socket;
+}
+
+void SessionPool::release(const std::string& key, const std::shared_ptr<StreamSocket>& socket)
+{
+    std::vector<Idle> closed;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        expire(std::chrono::steady_clock::now(), closed);
+
+        std::vector<Idle>& idle = _idle[key];
+        if (idle.size() < _maxIdlePerHost)
+        {
+            idle.push_back(Idle{ socket, std::chrono::steady_clock::now() });
+            return;
+        }
+    }
+
+    // The socket is closed when the last reference to it goes.
+    LOG_TRC('#' << socket->getFD() << ": Closing connection to " << key
+                << ", the pool has enough idle ones");
+}
+
+void SessionPool::expire(std::chrono::steady_clock::time_point now, std::vector<Idle>& expired)
+{
+    for (auto it = _idle.begin(); it != _idle.end();)
+    {
+        std::vector<Idle>& idle = it->second;
+        const auto end = std::find_if(idle.begin(), idle.end(), [&](const Idle& entry)
+                                      { return now - entry._since < _idleTimeout; });
+        std::move(idle.begin(), end, std::back_inserter(expired));
+        idle.erase(idle.begin(), end);
+
+        if (idle.empty())
+            it = _idle.erase(it);
+        else
+            ++it;
+    }
+}
+
 } // namespace http
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
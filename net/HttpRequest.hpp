@@ -7,16 +7,24 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <iostream>
 #include <fstream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <vector>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
+#include <unistd.h>
 
 #include <Common.hpp>
 #include <common/StateEnum.hpp>
@@ -106,7 +114,12 @@ static_assert(false, "config.h must be included in the .cpp being compiled");
 // a generic callback to provide the payload
 // data to upload, whereupon the file contents
 // will be set in the body of the POST request
-// message.
+// message. Either way the body is read as the
+// socket takes it, a buffer at a time, and a
+// file body is sent with sendfile(2), without
+// copying it to us at all, where the socket
+// allows. So uploads of large files take no
+// more memory than small ones.
 // To download a file via GET, http::Response
 // has saveBodyToFile() member that accepts
 // a path to file where the response body
@@ -133,6 +146,16 @@ static_assert(false, "config.h must be included in the .cpp being compiled");
 // with the async case. Indeed, internally
 // the async logic is used, which
 // guarantees consistency.
+//
+// A Session keeps its connection open between
+// its own requests. To share open connections
+// between Sessions, such as those of different
+// documents, on different polls and threads,
+// create the Sessions with http::SessionPool.
+// When a request completes, the connection is
+// then taken out of its poll and kept idle in
+// the pool, for the next Session to the same
+// host to take when it connects.
 
 namespace http
 {
@@ -370,7 +393,8 @@ public:
         return cookies;
     }
 
-    bool writeData(Buffer& out) const
+    /// Serializes the header into @out, a Buffer or ChunkedBuffer.
+    template <typename T> bool writeData(T& out) const
     {
         // Note: we don't add the end-of-header '\r\n'
         // to allow for manually extending the headers.
@@ -480,30 +504,52 @@ public:
     {
         _header.setContentLength(size);
         _bodyReaderCb = std::move(bodyReaderCb);
+        _bodyFile.reset();
     }
 
     /// Set the file to send as the body of the request.
     void setBodyFile(const std::string& path)
     {
-        //FIXME: use generalized lambda capture to move the ifstream, available in C++14.
-        auto ifs = std::make_shared<std::ifstream>(path, std::ios::binary);
-
-        ifs->seekg(0, std::ios_base::end);
-        const int64_t size = ifs->tellg();
-        ifs->seekg(0, std::ios_base::beg);
+        auto file = std::make_shared<BodyFile>(path);
+        const int64_t size = file->getSize();
+        if (size < 0)
+        {
+            LOG_ERR("Failed to open [" << path << "] to send as the HTTP request body");
+            setBodySource([](char*, int64_t) -> int64_t { return -1; }, 0);
+            return;
+        }
 
+        // The reader and sendfile(2) share the file offset, either can go on.
         setBodySource(
-            [=](char* buf, int64_t len) -> int64_t
+            [file](char* buf, int64_t len) -> int64_t
             {
-                ifs->read(buf, len);
-                return ifs->gcount();
+                ssize_t n;
+                while ((n = ::read(file->getFD(), buf, len)) < 0 && errno == EINTR)
+                    ;
+                return n;
             },
             size);
+        _bodyFile = std::move(file);
     }
 
+    /// The file descriptor of the body set by setBodyFile(), or -1.
+    int getBodyFileFD() const { return _bodyFile ? _bodyFile->getFD() : -1; }
+
+    /// Marks the body as sent, when it was sent without writeData().
+    void setBodySent() { _stage = Stage::Finished; }
+
+    /// The most bytes queued to send, as of writing some of the body,
+    /// by any request so far. Bounded by the socket send buffer size.
+    static std::size_t getBodyBufferPeak() { return BodyBufferPeak; }
+
+    /// The body bytes sent with sendfile(2), by all requests so far.
+    static uint64_t getBodySendFileBytes() { return BodySendFileBytes; }
+    static void addBodySendFileBytes(uint64_t bytes) { BodySendFileBytes += bytes; }
+
     Stage stage() const { return _stage; }
 
-    bool writeData(Buffer& out, std::size_t capacity)
+    /// Writes the header, and up to about @capacity bytes of the body, to @out.
+    template <typename T> bool writeData(T& out, std::size_t capacity)
     {
         if (_stage == Stage::Header)
         {
@@ -529,11 +575,13 @@ public:
             // Get the data to write into the socket
             // from the client's callback. This is
             // used to upload files, or other data.
+            // Never more than the socket takes, lest we buffer the whole body.
             char buffer[64 * 1024];
             std::size_t wrote = 0;
-            do
+            while (wrote < capacity)
             {
-                const int64_t read = _bodyReaderCb(buffer, sizeof(buffer));
+                const int64_t read
+                    = _bodyReaderCb(buffer, std::min(sizeof(buffer), capacity - wrote));
                 if (read < 0)
                 {
                     LOG_ERR("Error reading the data to send as the HTTP request body: " << read);
@@ -544,13 +592,17 @@ public:
                 {
                     LOG_TRC("performWrites (request body): finished, total: " << wrote);
                     _stage = Stage::Finished;
-                    return true;
+                    break;
                 }
 
                 out.append(buffer, read);
                 wrote += read;
                 LOG_TRC("performWrites (request body): " << read << " bytes, total: " << wrote);
-            } while (wrote < capacity);
+            }
+
+            std::size_t peak = BodyBufferPeak;
+            while (out.size() > peak && !BodyBufferPeak.compare_exchange_weak(peak, out.size()))
+                ;
         }
 
         return true;
@@ -562,12 +614,48 @@ public:
     int64_t readData(const char* p, int64_t len);
 
 private:
+    /// A file open for reading, closed with the last copy of its request.
+    class BodyFile
+    {
+    public:
+        explicit BodyFile(const std::string& path)
+            : _fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC))
+            , _size(-1)
+        {
+            struct stat st;
+            if (_fd >= 0 && ::fstat(_fd, &st) == 0)
+                _size = st.st_size;
+        }
+
+        BodyFile(const BodyFile&) = delete;
+        BodyFile& operator=(const BodyFile&) = delete;
+
+        ~BodyFile()
+        {
+            if (_fd >= 0)
+                ::close(_fd);
+        }
+
+        int getFD() const { return _fd; }
+
+        /// The size of the file, or -1 when it couldn't be opened.
+        int64_t getSize() const { return _size; }
+
+    private:
+        const int _fd;
+        int64_t _size;
+    };
+
     Header _header;
     std::string _url; //< The URL to request, without hostname.
     std::string _verb; //< Used as-is, but only POST supported.
     std::string _version; //< The protocol version, currently 1.1.
     IoReadFunc _bodyReaderCb;
+    std::shared_ptr<BodyFile> _bodyFile; //< Set by setBodyFile().
     Stage _stage;
+
+    static std::atomic<std::size_t> BodyBufferPeak;
+    static std::atomic<uint64_t> BodySendFileBytes;
 };
 
 /// HTTP Status Line is the first line of a response sent by a server.
@@ -635,7 +723,7 @@ public:
     /// Returns the state and clobbers the len on succcess to the number of bytes read.
     FieldParseState parse(const char* p, int64_t& len);
 
-    bool writeData(Buffer& out) const
+    template <typename T> bool writeData(T& out) const
     {
         out.append(_httpVersion);
         out.append(" ");
@@ -787,7 +875,7 @@ public:
     int64_t readData(const char* p, int64_t len);
 
     /// Serializes the Server Response into the given buffer.
-    bool writeData(Buffer& out) const
+    template <typename T> bool writeData(T& out) const
     {
         _statusLine.writeData(out);
         _header.writeData(out);
@@ -847,10 +935,14 @@ private:
     FinishedCallback _finishedCallback; //< Called when response is finished.
 };
 
+class SessionPool;
+
 /// A client socket to make asynchronous HTTP requests.
 /// Designed to be reused for multiple requests.
 class Session final : public ProtocolHandlerInterface
 {
+    friend class SessionPool;
+
 public:
     STATE_ENUM(Protocol, HttpUnencrypted, HttpSsl, );
 
@@ -1058,31 +1150,23 @@ public:
                                  << req.getUrl());
 
         newRequest(req);
+        return asyncRequestImpl(poll);
+    }
 
-        if (!isConnected())
-        {
-            std::shared_ptr<StreamSocket> socket = connect();
-            if (!socket)
-            {
-                LOG_ERR("Failed to connect to " << _host << ':' << _port);
-                return false;
-            }
+    /// Start an asynchronous request on the given SocketPoll to download a file
+    /// to the given path. As with syncDownload(), an error response body, if any,
+    /// is stored in memory instead. See asyncRequest().
+    bool asyncDownload(const Request& req, const std::string& saveToFilePath, SocketPoll& poll)
+    {
+        LOG_TRC("asyncDownload: " << req.getVerb() << ' ' << host() << ':' << port() << ' '
+                                  << req.getUrl());
 
-            LOG_ASSERT_MSG(_socket.lock(), "Connect must set the _socket member.");
-            LOG_ASSERT_MSG(_socket.lock()->getFD() == socket->getFD(),
-                           "Socket FD's mismatch after connect().");
-            LOG_TRC('#' << socket->getFD() << ": Connected");
-            poll.insertNewSocket(socket);
-        }
-        else
-        {
-            // Technically, there is a race here. The socket can
-            // get disconnected and removed right after isConnected.
-            // In that case, we will timeout and no request will be sent.
-            poll.wakeupWorld();
-        }
+        newRequest(req);
 
-        return true;
+        if (!saveToFilePath.empty())
+            _response->saveBodyToFile(saveToFilePath);
+
+        return asyncRequestImpl(poll);
     }
 
     void asyncShutdown()
@@ -1107,6 +1191,35 @@ public:
 
 
 private:
+    /// Dispatch the request set up by newRequest() on the given SocketPoll.
+    bool asyncRequestImpl(SocketPoll& poll)
+    {
+        if (!isConnected())
+        {
+            std::shared_ptr<StreamSocket> socket = connect();
+            if (!socket)
+            {
+                LOG_ERR("Failed to connect to " << _host << ':' << _port);
+                return false;
+            }
+
+            LOG_ASSERT_MSG(_socket.lock(), "Connect must set the _socket member.");
+            LOG_ASSERT_MSG(_socket.lock()->getFD() == socket->getFD(),
+                           "Socket FD's mismatch after connect().");
+            LOG_TRC('#' << socket->getFD() << ": Connected");
+            poll.insertNewSocket(socket);
+        }
+        else
+        {
+            // Technically, there is a race here. The socket can
+            // get disconnected and removed right after isConnected.
+            // In that case, we will timeout and no request will be sent.
+            poll.wakeupWorld();
+        }
+
+        return true;
+    }
+
     /// Make a synchronous request.
     bool syncRequestImpl(SocketPoll& poller)
     {
@@ -1265,15 +1378,22 @@ private:
             disposition.setClosed();
             onDisconnect();
         }
+        else if (_response->state() == Response::State::Complete && !_pool.expired())
+        {
+            returnToPool(disposition);
+        }
     }
 
+    /// Hands our connection, now idle, to the pool. See SessionPool.
+    void returnToPool(SocketDisposition& disposition);
+
     void performWrites(std::size_t capacity) override
     {
         // We may get called after disconnecting and freeing the Socket instance.
         std::shared_ptr<StreamSocket> socket = _socket.lock();
         if (socket)
         {
-            Buffer& out = socket->getOutBuffer();
+            ChunkedBuffer& out = socket->getOutBuffer();
             LOG_TRC('#' << socket->getFD() << ": performWrites: " << out.size()
                         << " bytes, capacity: " << capacity);
 
@@ -1305,8 +1425,9 @@ private:
     std::shared_ptr<StreamSocket> connect()
     {
         _socket.reset(); // Reset to make sure we are disconnected.
-        std::shared_ptr<StreamSocket> socket =
-            net::connect(_host, _port, isSecure(), shared_from_this());
+        std::shared_ptr<StreamSocket> socket = connectPooled();
+        if (!socket)
+            socket = net::connect(_host, _port, isSecure(), shared_from_this());
 
         // When used with proxy.php we may indeed get nullptr here.
         // assert(socket && "Unexpected nullptr returned from net::connect");
@@ -1339,6 +1460,9 @@ private:
         }
     }
 
+    /// Takes an open connection to our host from the pool, if any.
+    std::shared_ptr<StreamSocket> connectPooled();
+
     int sendTextMessage(const char*, const size_t, bool) const override { return 0; }
     int sendBinaryMessage(const char*, const size_t, bool) const override { return 0; }
 
@@ -1352,9 +1476,81 @@ private:
     Request _request;
     FinishedCallback _onFinished;
     std::shared_ptr<Response> _response;
+    std::weak_ptr<SessionPool> _pool; //< Set when created by a SessionPool.
     std::weak_ptr<StreamSocket> _socket; //< Must be the last member.
 };
 
+/// Open connections to HTTP servers, kept between requests, and shared by
+/// all the Sessions it creates, on any poll and thread. When a request of
+/// such a Session completes, and the connection may be reused, the socket
+/// leaves its poll and waits here, idle, for the next Session to the same
+/// host, which then saves the TCP and TLS handshakes. Idle connections are
+/// closed after a timeout, or when the server closed them first.
+class SessionPool final : public std::enable_shared_from_this<SessionPool>
+{
+public:
+    /// Keeps up to @maxIdlePerHost idle connections to each host, for @idleTimeout.
+    SessionPool(std::size_t maxIdlePerHost, std::chrono::milliseconds idleTimeout)
+        : _maxIdlePerHost(maxIdlePerHost)
+        , _idleTimeout(idleTimeout)
+        , _newCount(0)
+        , _reuseCount(0)
+    {
+    }
+
+    SessionPool(const SessionPool&) = delete;
+    SessionPool& operator=(const SessionPool&) = delete;
+
+    /// Creates a Session, as Session::create(), that reuses our connections.
+    std::shared_ptr<Session> create(std::string host, Session::Protocol protocol, int port = 0)
+    {
+        std::shared_ptr<Session> session = Session::create(std::move(host), protocol, port);
+        session->_pool = shared_from_this();
+        return session;
+    }
+
+    /// Closes all the idle connections.
+    void clear();
+
+    /// The number of idle connections, to all hosts.
+    std::size_t getIdleCount() const;
+
+    /// The connections made by our Sessions, and those they took from the pool.
+    uint64_t getNewCount() const { return _newCount; }
+    uint64_t getReuseCount() const { return _reuseCount; }
+
+private:
+    friend class Session;
+
+    struct Idle
+    {
+        std::shared_ptr<StreamSocket> _socket;
+        std::chrono::steady_clock::time_point _since;
+    };
+
+    /// Returns an idle connection to @key, from getKey(), or nullptr.
+    std::shared_ptr<StreamSocket> take(const std::string& key);
+
+    /// Keeps @socket, idle and in no poll, for the next Session to @key.
+    void release(const std::string& key, const std::shared_ptr<StreamSocket>& socket);
+
+    /// Moves the connections idle for too long from _idle to @expired.
+    void expire(std::chrono::steady_clock::time_point now, std::vector<Idle>& expired);
+
+    static std::string getKey(const std::string& host, const std::string& port, bool secure)
+    {
+        return (secure ? "https://" : "http://") + host + ':' + port;
+    }
+
+    const std::size_t _maxIdlePerHost;
+    const std::chrono::milliseconds _idleTimeout;
+    mutable std::mutex _mutex;
+    /// The idle connections by getKey(), the most recently used last.
+    std::map<std::string, std::vector<Idle>> _idle;
+    std::atomic<uint64_t> _newCount;
+    std::atomic<uint64_t> _reuseCount;
+};
+
 /// HTTP Get a URL synchronously.
 inline const std::shared_ptr<const http::Response>
 get(const std::string& url, std::chrono::milliseconds timeout = Session::getDefaultTimeout())
@@ -9,6 +9,7 @@
 
 #include "Socket.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <ctype.h>
 #include <iomanip>
@@ -20,6 +21,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#if ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #ifdef __FreeBSD__
 #include <sys/ucred.h>
 #endif
@@ -45,10 +52,12 @@
 
 // Bug in pre C++17 where static constexpr must be defined. Fixed in C++17.
 constexpr std::chrono::microseconds SocketPoll::DefaultPollTimeoutMicroS;
+constexpr std::chrono::microseconds SocketPoll::IdleSweepMicroS;
 constexpr std::chrono::microseconds WebSocketHandler::InitialPingDelayMicroS;
 constexpr std::chrono::microseconds WebSocketHandler::PingFrequencyMicroS;
 
 std::atomic<bool> SocketPoll::InhibitThreadChecks(false);
+std::atomic<SocketPoll::PollBackend> SocketPoll::Backend(SocketPoll::PollBackend::Poll);
 std::atomic<bool> Socket::InhibitThreadChecks(false);
 
 #define SOCKET_ABSTRACT_UNIX_NAME "0coolwsd-"
@@ -170,6 +179,7 @@ namespace {
 SocketPoll::SocketPoll(std::string threadName)
     : _name(std::move(threadName)),
       _pollStartIndex(0),
+      _epollFd(-1),
       _stop(false),
       _threadStarted(0),
       _threadFinished(false),
@@ -213,6 +223,8 @@ SocketPoll::~SocketPoll()
     }
 
 #if !MOBILEAPP
+    if (_epollFd >= 0)
+        ::close(_epollFd);
     ::close(_wakeup[0]);
     ::close(_wakeup[1]);
 #else
@@ -232,6 +244,13 @@ bool SocketPoll::startThread()
     {
         _threadFinished = false;
         _stop = false;
+        if (_worker)
+        {
+            LOG_TRC("Running SocketPoll " << _name << " on " << _worker->name());
+            _worker->attach(this);
+            return true;
+        }
+
         try
         {
             LOG_TRC("Creating thread for SocketPoll " << _name);
@@ -274,7 +293,12 @@ void SocketPoll::joinThread()
         stop();
     }
 
-    if (_threadStarted && _thread.joinable())
+    if (_threadStarted && _worker)
+    {
+        _worker->detach(this);
+        _threadStarted = 0;
+    }
+    else if (_threadStarted && _thread.joinable())
     {
         if (_thread.get_id() == std::this_thread::get_id())
             LOG_ERR("DEADLOCK PREVENTED: joining own thread!");
@@ -298,9 +322,7 @@ void SocketPoll::pollingThreadEntry()
         // Invoke the virtual implementation.
         pollingThread();
 
-        // Release sockets.
-        _pollSockets.clear();
-        _newSockets.clear();
+        releaseSockets();
     }
     catch (const std::exception& exc)
     {
@@ -311,51 +333,81 @@ void SocketPoll::pollingThreadEntry()
     LOG_INF("Finished polling thread [" << _name << "].");
 }
 
-int SocketPoll::poll(int64_t timeoutMaxMicroS)
+namespace
+{
+/// poll(2) on @count @fds, retrying on EINTR.
+int pollFds(pollfd* fds, std::size_t count, int64_t timeoutMaxMicroS)
 {
-    if (_runOnClientThread)
-        checkAndReThread();
-    else
-        assertCorrectThread();
-
-#if ENABLE_DEBUG
-    // perturb - to rotate errors among several busy sockets.
-    socketErrorCount++;
-#endif
-
-    std::chrono::steady_clock::time_point now =
-        std::chrono::steady_clock::now();
-
-    // The events to poll on change each spin of the loop.
-    setupPollFds(now, timeoutMaxMicroS);
-    const size_t size = _pollSockets.size();
-
     int rc;
     do
     {
 #if !MOBILEAPP
 #  if HAVE_PPOLL
-        LOG_TRC("ppoll start, timeoutMicroS: " << timeoutMaxMicroS << " size " << size);
+        LOG_TRC("ppoll start, timeoutMicroS: " << timeoutMaxMicroS << " size " << count - 1);
         timeoutMaxMicroS = std::max(timeoutMaxMicroS, (int64_t)0);
         struct timespec timeout;
         timeout.tv_sec = timeoutMaxMicroS / (1000 * 1000);
         timeout.tv_nsec = (timeoutMaxMicroS % (1000 * 1000)) * 1000;
-        rc = ::ppoll(&_pollFds[0], size + 1, &timeout, nullptr);
+        rc = ::ppoll(fds, count, &timeout, nullptr);
 #  else
         int timeoutMaxMs = (timeoutMaxMicroS + 9999) / 1000;
         LOG_TRC("Legacy Poll start, timeoutMs: " << timeoutMaxMs);
-        rc = ::poll(&_pollFds[0], size + 1, std::max(timeoutMaxMs,0));
+        rc = ::poll(fds, count, std::max(timeoutMaxMs,0));
 #  endif
 #else
         LOG_TRC("SocketPoll Poll");
         int timeoutMaxMs = (timeoutMaxMicroS + 9999) / 1000;
-        rc = fakeSocketPoll(&_pollFds[0], size + 1, std::max(timeoutMaxMs,0));
+        rc = fakeSocketPoll(fds, count, std::max(timeoutMaxMs,0));
 #endif
     }
     while (rc < 0 && errno == EINTR);
+
+    return rc;
+}
+}
+
+void SocketPoll::releaseSockets()
+{
+    for (const auto& socket : _pollSockets)
+        removeFromEPoll(*socket);
+    _pollSockets.clear();
+    _newSockets.clear();
+}
+
+int SocketPoll::poll(int64_t timeoutMaxMicroS)
+{
+    if (_runOnClientThread)
+        checkAndReThread();
+    else
+        assertCorrectThread();
+
+#if ENABLE_DEBUG
+    // perturb - to rotate errors among several busy sockets.
+    socketErrorCount++;
+#endif
+
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+
+    // The events to poll on change each spin of the loop.
+    setupPollFds(now, timeoutMaxMicroS);
+    const size_t size = _pollSockets.size();
+
+    int rc;
+    const bool epoll = isEPoll();
+    if (epoll)
+        rc = epollWait(timeoutMaxMicroS);
+    else
+        rc = pollFds(_pollFds.data(), size + 1, timeoutMaxMicroS);
     LOG_TRC("Poll completed with " << rc << " live polls max (" <<
             timeoutMaxMicroS << "us)" << ((rc==0) ? "(timedout)" : ""));
 
+    return dispatchPoll(now, size, rc, epoll);
+}
+
+int SocketPoll::dispatchPoll(std::chrono::steady_clock::time_point now, std::size_t size, int rc,
+                             bool epoll)
+{
     // First process the wakeup pipe (always the last entry).
     if (_pollFds[size].revents)
     {
@@ -374,9 +426,12 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
             _pollSockets.insert(_pollSockets.end(),
                                 _newSockets.begin(), _newSockets.end());
 
-            // Update thread ownership.
+            // Update thread ownership, they are not in our epoll set yet.
             for (auto &i : _newSockets)
+            {
                 i->setThreadOwner(std::this_thread::get_id());
+                i->_epollEvents = -1;
+            }
 
             _newSockets.clear();
 
@@ -435,29 +490,44 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
                     << " at index " << _pollStartIndex << " (of " << size << "): " << std::hex
                     << _pollFds[i].revents << std::dec);
 
-        size_t previ = size;
-        while (previ != _pollStartIndex)
+        // With epoll we skip the sockets with nothing to do, but for
+        // the odd handler that doesn't tell us its timeouts.
+        const int64_t elapsedMicroS
+            = std::chrono::duration_cast<std::chrono::microseconds>(newNow - now).count();
+        const bool idleSweep = epoll && newNow - _lastIdleSweep >= IdleSweepMicroS;
+        if (idleSweep)
+            _lastIdleSweep = newNow;
+
+        // Visit every socket once, from _pollStartIndex downwards.
+        for (size_t visited = 0; visited < size; ++visited)
         {
-            SocketDisposition disposition(_pollSockets[i]);
-            try
+            if (!epoll || idleSweep || _pollFds[i].revents || _pollTimeouts[i] <= elapsedMicroS
+                || _pollSockets[i]->hasPendingWork())
             {
-                _pollSockets[i]->handlePoll(disposition, newNow,
-                                            _pollFds[i].revents);
-            }
-            catch (const std::exception& exc)
-            {
-                LOG_ERR('#' << _pollFds[i].fd << ": Error while handling poll at " << i << " in "
-                            << _name << ": " << exc.what());
-                disposition.setClosed();
-                rc = -1;
-            }
+                SocketDisposition disposition(_pollSockets[i]);
+                try
+                {
+                    _pollSockets[i]->handlePoll(disposition, newNow,
+                                                _pollFds[i].revents);
+                }
+                catch (const std::exception& exc)
+                {
+                    LOG_ERR('#' << _pollFds[i].fd << ": Error while handling poll at " << i
+                                << " in " << _name << ": " << exc.what());
+                    disposition.setClosed();
+                    rc = -1;
+                }
 
-            if (!disposition.isContinue())
-                toErase.push_back(i);
+                if (!disposition.isContinue())
+                {
+                    // Leave our epoll set before another poll can take the socket.
+                    removeFromEPoll(*_pollSockets[i]);
+                    toErase.push_back(i);
+                }
 
-            disposition.execute();
+                disposition.execute();
+            }
 
-            previ = i;
             if (i == 0)
                 i = size - 1;
             else
@@ -482,6 +552,314 @@ int SocketPoll::poll(int64_t timeoutMaxMicroS)
     return rc;
 }
 
+void SocketPoll::setPollBackend(PollBackend backend)
+{
+#if !ENABLE_EPOLL
+    if (backend == PollBackend::EPoll)
+    {
+        LOG_WRN("epoll is not available, using poll");
+        backend = PollBackend::Poll;
+    }
+#endif
+    Backend = backend;
+}
+
+bool SocketPoll::isEPoll()
+{
+#if ENABLE_EPOLL
+    if (_epollFd >= 0)
+        return true;
+
+    if (Backend != PollBackend::EPoll)
+        return false;
+
+    _epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (_epollFd < 0)
+    {
+        LOG_SYS("Failed to create epoll instance for " << _name << ", using poll");
+        return false;
+    }
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr; // Not a socket.
+    if (::epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeup[0], &event) < 0)
+    {
+        LOG_SYS("Failed to add wakeup pipe to epoll for " << _name << ", using poll");
+        ::close(_epollFd);
+        _epollFd = -1;
+        return false;
+    }
+
+    LOG_DBG("Using epoll for " << _name);
+    _lastIdleSweep = std::chrono::steady_clock::now();
+    return true;
+#else
+    return false;
+#endif
+}
+
+int SocketPoll::epollWait(int64_t timeoutMaxMicroS)
+{
+#if ENABLE_EPOLL
+    const size_t size = _pollSockets.size();
+
+    // Only tell the kernel about the changes, the interest set persists.
+    for (size_t i = 0; i < size; ++i)
+    {
+        Socket& socket = *_pollSockets[i];
+        const int events = _pollFds[i].events;
+        if (socket._epollEvents == events)
+            continue;
+
+        int op = (socket._epollEvents < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+        socket._epollEvents = events;
+
+        const int fd = _pollFds[i].fd;
+        epoll_event event;
+        event.events = static_cast<uint32_t>(events); // The POLL* and EPOLL* bits match.
+        event.data.ptr = &socket;
+        int rc = ::epoll_ctl(_epollFd, op, fd, &event);
+        if (rc < 0 && (errno == EEXIST || errno == ENOENT))
+        {
+            // A recycled fd, or one closed behind our back; either way, take it as it is.
+            op = (errno == EEXIST ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+            rc = ::epoll_ctl(_epollFd, op, fd, &event);
+        }
+
+        if (rc < 0)
+            LOG_SYS('#' << fd << ": Failed to set epoll events to 0x" << std::hex << events
+                        << std::dec << " in " << _name);
+    }
+
+    // More than this many ready sockets are reported on the next spin.
+    constexpr int MaxEvents = 256;
+    epoll_event ready[MaxEvents];
+
+    const int timeoutMaxMs = (std::max<int64_t>(timeoutMaxMicroS, 0) + 999) / 1000;
+    LOG_TRC("epoll start, timeoutMs: " << timeoutMaxMs << " size " << size);
+    int rc;
+    do
+    {
+        rc = ::epoll_wait(_epollFd, ready, MaxEvents, timeoutMaxMs);
+    }
+    while (rc < 0 && errno == EINTR);
+
+    for (int n = 0; n < rc; ++n)
+    {
+        const Socket* socket = static_cast<const Socket*>(ready[n].data.ptr);
+        if (socket == nullptr)
+        {
+            _pollFds[size].revents = POLLIN;
+            continue;
+        }
+
+        // Sockets leave the set before they leave _pollSockets, see removeFromEPoll().
+        const size_t index = socket->_pollIndex;
+        if (index < size && _pollSockets[index].get() == socket)
+            _pollFds[index].revents = static_cast<short>(ready[n].events);
+        else
+            LOG_WRN('#' << socket->getFD() << ": epoll event for unknown socket in " << _name);
+    }
+
+    return rc;
+#else
+    (void)timeoutMaxMicroS;
+    return -1;
+#endif
+}
+
+void SocketPoll::removeFromEPoll(Socket& socket)
+{
+#if ENABLE_EPOLL
+    if (_epollFd < 0 || socket._epollEvents < 0)
+        return;
+
+    socket._epollEvents = -1;
+
+    // Fails harmlessly if the socket is closed already.
+    epoll_event event;
+    ::epoll_ctl(_epollFd, EPOLL_CTL_DEL, socket.getFD(), &event);
+#else
+    (void)socket;
+#endif
+}
+
+void SocketPollWorker::attach(SocketPoll* poll)
+{
+    ++_guestCount;
+    addCallback([this, poll]()
+                {
+                    LOG_DBG("Running SocketPoll " << poll->name() << " on " << name());
+                    poll->_owner = std::this_thread::get_id();
+                    const auto now = std::chrono::steady_clock::now();
+                    _guests.push_back(Guest{ poll, now, now, false, 0, 0 });
+                });
+}
+
+void SocketPollWorker::detach(SocketPoll* poll)
+{
+    if (std::this_thread::get_id() == getThreadOwner())
+    {
+        // One of our polls is joined from another one, finish it right away.
+        for (std::size_t index = 0; index < _guests.size(); ++index)
+        {
+            if (_guests[index]._poll == poll)
+                finishGuest(index);
+        }
+
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_finishMutex);
+    while (!poll->_threadFinished)
+    {
+        if (!isAlive())
+        {
+            LOG_WRN("SocketPollWorker " << name() << " stopped before finishing "
+                                        << poll->name());
+            poll->_threadFinished = true;
+            break;
+        }
+
+        _finishCV.wait_for(lock, std::chrono::milliseconds(100));
+    }
+}
+
+void SocketPollWorker::finishGuest(std::size_t index)
+{
+    SocketPoll* poll = _guests[index]._poll;
+    _guests[index]._poll = nullptr;
+
+    LOG_DBG("Finished running SocketPoll " << poll->name() << " on " << name());
+    poll->releaseSockets();
+    --_guestCount;
+
+    {
+        std::lock_guard<std::mutex> lock(_finishMutex);
+        poll->_threadFinished = true;
+    }
+
+    // The poll may be gone from here on.
+    _finishCV.notify_all();
+}
+
+void SocketPollWorker::pollingThread()
+{
+    while (continuePolling())
+    {
+        const auto now = std::chrono::steady_clock::now();
+
+        // Our own wakeup pipe, to attach new polls.
+        int64_t timeoutMaxMicroS = DefaultPollTimeoutMicroS.count();
+        setupPollFds(now, timeoutMaxMicroS);
+        _allFds.assign(_pollFds.begin(), _pollFds.end());
+
+        // Then the sockets of all the polls, with the earliest timeout.
+        for (Guest& guest : _guests)
+        {
+            int64_t timeoutMicroS = std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::microseconds>(guest._stepTime - now)
+                       .count());
+            guest._start = _allFds.size();
+            guest._count = 0;
+            if (guest._pollSockets)
+            {
+                guest._poll->setupPollFds(now, timeoutMicroS);
+                _allFds.insert(_allFds.end(), guest._poll->_pollFds.begin(),
+                               guest._poll->_pollFds.end());
+                guest._count = guest._poll->_pollFds.size();
+            }
+
+            guest._dueTime = now + std::chrono::microseconds(timeoutMicroS);
+            timeoutMaxMicroS = std::min(timeoutMaxMicroS, timeoutMicroS);
+        }
+
+        const std::size_t polled = _guests.size();
+        const int rc = pollFds(_allFds.data(), _allFds.size(), timeoutMaxMicroS);
+        LOG_TRC("Poll of " << polled << " polls in " << name() << " completed with " << rc);
+
+        for (std::size_t i = 0; i < _pollFds.size(); ++i)
+            _pollFds[i].revents = _allFds[i].revents;
+        dispatchPoll(now, _pollFds.size() - 1, rc, false);
+
+        // Dispatch and step the polls with events or a timeout due, and the new ones.
+        for (std::size_t index = 0; index < _guests.size(); ++index)
+        {
+            SocketPoll* poll = _guests[index]._poll;
+            if (!poll)
+                continue;
+
+            const std::size_t start = _guests[index]._start;
+            const std::size_t count = index < polled ? _guests[index]._count : 0;
+            bool ready = index >= polled || std::chrono::steady_clock::now() >= _guests[index]._dueTime;
+            for (std::size_t i = 0; !ready && i < count; ++i)
+                ready = _allFds[start + i].revents != 0;
+
+            if (!ready)
+                continue;
+
+            int64_t timeoutMicroS = 0;
+            bool pollSockets = false;
+            bool more = false;
+            try
+            {
+                if (count > 0)
+                {
+                    for (std::size_t i = 0; i < count; ++i)
+                        poll->_pollFds[i].revents = _allFds[start + i].revents;
+                    poll->dispatchPoll(now, count - 1, rc, false);
+                }
+
+                more = poll->pollingStep(timeoutMicroS, pollSockets);
+            }
+            catch (const std::exception& exc)
+            {
+                LOG_ERR("Exception in polling [" << poll->name() << "] on " << name() << ": "
+                                                 << exc.what());
+            }
+
+            if (!_guests[index]._poll)
+                continue; // Finished meanwhile.
+
+            if (!more)
+                finishGuest(index);
+            else
+            {
+                _guests[index]._stepTime
+                    = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutMicroS);
+                _guests[index]._pollSockets = pollSockets;
+            }
+        }
+
+        _guests.erase(std::remove_if(_guests.begin(), _guests.end(),
+                                     [](const Guest& guest) { return !guest._poll; }),
+                      _guests.end());
+    }
+
+    // Don't leave anyone waiting for us.
+    for (std::size_t index = 0; index < _guests.size(); ++index)
+    {
+        if (_guests[index]._poll)
+            finishGuest(index);
+    }
+
+    _guests.clear();
+}
+
+void SocketPollWorker::dumpState(std::ostream& os)
+{
+    // FIXME: NOT thread-safe! _guests is modified from the polling thread!
+    os << "\n  SocketPollWorker [" << name() << "] running " << _guestCount << " polls:";
+    for (const Guest& guest : _guests)
+    {
+        if (guest._poll)
+            os << "\n    " << guest._poll->name();
+    }
+
+    SocketPoll::dumpState(os);
+}
+
 void SocketPoll::wakeupWorld()
 {
     for (const auto& fd : getWakeupsArray())
@@ -662,6 +1040,9 @@ void WebSocketHandler::dumpState(std::ostream& os)
     os << (_shuttingDown ? "shutd " : "alive ");
 #if !MOBILEAPP
     os << std::setw(5) << _pingTimeUs/1000. << "ms ";
+    if (_deflate)
+        os << "deflate " << _deflate->getRawBytes() << " -> " << _deflate->getCompressedBytes()
+           << " bytes ";
 #endif
     if (_wsPayload.size() > 0)
         Util::dumpHex(os, _wsPayload, "\t\tws queued payload:\n", "\t\t");
@@ -712,16 +1093,59 @@ bool StreamSocket::send(const http::Response& response)
 
 bool StreamSocket::send(http::Request& request)
 {
-    if (request.writeData(_outBuffer, getSendBufferCapacity()))
+    // Once the header is out, a body file goes to the socket with sendfile(2),
+    // rather than through our buffer.
+    const bool bodyFile = request.getBodyFileFD() >= 0 && canSendFile();
+    if (request.writeData(_outBuffer, bodyFile ? 0 : getSendBufferCapacity()))
     {
         flush();
-        return true;
+        if (!bodyFile || request.stage() != http::Request::Stage::Body || !_outBuffer.empty()
+            || sendBodyFile(request))
+            return true;
     }
-    else
+
+    shutdown();
+    return false;
+}
+
+bool StreamSocket::sendBodyFile(http::Request& request)
+{
+#if !MOBILEAPP && defined(__linux__)
+    std::size_t capacity = std::max(getSendBufferSize(), 1);
+    while (capacity > 0)
     {
-        shutdown();
-        return false;
+        const ssize_t sent = ::sendfile(getFD(), request.getBodyFileFD(), nullptr, capacity);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // Go on when the socket takes more.
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+
+            LOG_SYS("Failed to send the HTTP request body file");
+            return false;
+        }
+
+        if (sent == 0)
+        {
+            LOG_TRC("performWrites (request body): finished with sendfile");
+            request.setBodySent();
+            return true;
+        }
+
+        LOG_TRC("performWrites (request body): " << sent << " bytes with sendfile");
+        _bytesSent += sent;
+        http::Request::addBodySendFileBytes(sent);
+        capacity -= std::min<std::size_t>(capacity, sent);
     }
+
+    return true;
+#else
+    (void)request;
+    return false;
+#endif
 }
 
 bool StreamSocket::sendAndShutdown(http::Response& response)
@@ -741,7 +1165,7 @@ void SocketPoll::dumpState(std::ostream& os)
     // FIXME: NOT thread-safe! _pollSockets is modified from the polling thread!
     os << "\n  SocketPoll:";
     os << "\n    Poll [" << _pollSockets.size() << "] - wakeup r: "
-       << _wakeup[0] << " w: " << _wakeup[1] << '\n';
+       << _wakeup[0] << " w: " << _wakeup[1] << (_epollFd >= 0 ? " (epoll)" : "") << '\n';
     if (_newCallbacks.size() > 0)
         os << "\tcallbacks: " << _newCallbacks.size() << '\n';
     os << "\tfd\tevents\trsize\twsize\n";
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -19,6 +20,7 @@
 #include <cerrno>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
@@ -29,6 +31,12 @@
 #include <sstream>
 #include <thread>
 
+#if !MOBILEAPP && HAVE_SYS_EPOLL_H
+#define ENABLE_EPOLL 1
+#else
+#define ENABLE_EPOLL 0
+#endif
+
 #include "Common.hpp"
 #include "FakeSocket.hpp"
 #include "Log.hpp"
@@ -65,6 +73,7 @@ namespace Poco
 
 class Socket;
 class SocketPoll;
+class SocketPollWorker;
 
 /// Helper to allow us to easily defer the movement of a socket
 /// between polls to clarify thread ownership.
@@ -195,6 +204,10 @@ public:
     /// Do we have internally queued incoming / outgoing data ?
     virtual bool hasBuffered() const { return false; }
 
+    /// Should handlePoll() be called even without events or a timeout
+    /// due, eg. to process input we have already read ?
+    virtual bool hasPendingWork() const { return false; }
+
     /// manage latency issues around packet aggregation
     void setNoDelay()
     {
@@ -373,6 +386,8 @@ protected:
         setNoDelay();
         _ignoreInput = false;
         _sendBufferSize = DefaultSendBufferSize;
+        _epollEvents = -1;
+        _pollIndex = 0;
         _owner = std::this_thread::get_id();
         LOG_TRC("Created socket. Thread affinity set to " << Log::to_string(_owner));
 
@@ -391,6 +406,8 @@ protected:
     inline void logPrefix(std::ostream& os) const { os << '#' << _fd << ": "; }
 
 private:
+    friend class SocketPoll;
+
     std::string _clientAddress;
     const int _fd;
 
@@ -399,6 +416,11 @@ private:
 
     int _sendBufferSize;
 
+    /// The events we are registered with in the epoll set of our SocketPoll, or -1.
+    int _epollEvents;
+    /// Our index in the _pollFds of our SocketPoll, to find us from epoll events.
+    std::size_t _pollIndex;
+
     /// We check the owner even in the release builds, needs to be always correct.
     std::thread::id _owner;
 };
@@ -469,6 +491,16 @@ public:
     /// 0 for closed/invalid socket, and -1 for other errors.
     virtual int sendBinaryMessage(const char *data, const size_t len, bool flush = false) const = 0;
 
+    /// Sends a binary message whose @data @owner keeps alive and unchanged,
+    /// so that it can be queued without a copy.
+    /// Returns as sendBinaryMessage().
+    virtual int sendSharedBinaryMessage(const std::shared_ptr<const void>& /*owner*/,
+                                        const char* data, const size_t len,
+                                        bool flush = false) const
+    {
+        return sendBinaryMessage(data, len, flush);
+    }
+
     /// Shutdown the socket and specify if the endpoint is going away or not (useful for WS).
     /// Optionally provide a message sent in the close frame (useful for WS).
     virtual void shutdown(bool goingAway = false,
@@ -476,6 +508,13 @@ public:
 
     virtual void getIOStats(uint64_t &sent, uint64_t &recv) = 0;
 
+    /// Get the bytes of the messages compressed for sending, before and after.
+    virtual void getCompressionStats(uint64_t &raw, uint64_t &compressed)
+    {
+        raw = 0;
+        compressed = 0;
+    }
+
     /// Append pretty printed internal state to a line
     virtual void dumpState(std::ostream& os) { os << '\n'; }
 };
@@ -573,13 +612,11 @@ private:
 /// Handles non-blocking socket event polling.
 /// Only polls on N-Sockets and invokes callback and
 /// doesn't manage buffers or client data.
-/// Note: uses poll(2) since it has very good performance
-/// compared to epoll up to a few hundred sockets and
-/// doesn't suffer select(2)'s poor API. Since this will
-/// be used per-document we don't expect to have several
-/// hundred users on same document to suffer poll(2)'s
-/// scalability limit. Meanwhile, epoll(2)'s high
-/// overhead to adding/removing sockets is not helpful.
+/// Note: uses poll(2) by default since it has very good
+/// performance compared to epoll up to a few hundred sockets
+/// and doesn't suffer select(2)'s poor API. Polls with more
+/// sockets than that, like the WebServerPoll of a busy server,
+/// do better with the epoll(7) backend, see PollBackend.
 class SocketPoll
 {
 public:
@@ -591,6 +628,31 @@ public:
     static constexpr std::chrono::microseconds DefaultPollTimeoutMicroS = std::chrono::seconds(5);
     static std::atomic<bool> InhibitThreadChecks;
 
+    /// How poll() waits for and dispatches socket events.
+    enum class PollBackend
+    {
+        /// poll(2) on all the sockets, calling handlePoll() of each on every spin.
+        Poll,
+        /// epoll(7) on a persistent interest set, calling handlePoll() only of
+        /// the sockets with events, a timeout due, or pending work.
+        EPoll
+    };
+
+    /// Set the backend of all SocketPolls, at startup. Each poll picks it
+    /// up when it first polls. Falls back to Poll if EPoll is unavailable.
+    static void setPollBackend(PollBackend backend);
+    static PollBackend getPollBackend() { return Backend; }
+
+    /// Parses "poll" or "epoll", anything else is Poll.
+    static PollBackend parsePollBackend(const std::string& name)
+    {
+        return name == "epoll" ? PollBackend::EPoll : PollBackend::Poll;
+    }
+
+    /// With epoll, how often we still call handlePoll() of idle sockets,
+    /// for the timeouts of handlers that don't report them in getPollEvents().
+    static constexpr std::chrono::microseconds IdleSweepMicroS = std::chrono::seconds(1);
+
     /// Stop the polling thread.
     void stop()
     {
@@ -624,6 +686,7 @@ public:
             LOG_DBG("Removing socket #" << socket->getFD() << " from " << _name);
             ASSERT_CORRECT_SOCKET_THREAD(socket);
             socket->resetThreadOwner();
+            removeFromEPoll(*socket);
 
             _pollSockets.pop_back();
         }
@@ -796,6 +859,10 @@ public:
     /// Stop and join the polling thread before returning (if active)
     void joinThread();
 
+    /// Have @worker run us on its thread, together with other polls,
+    /// instead of a thread of our own. Must be set before startThread().
+    void setWorker(const std::shared_ptr<SocketPollWorker>& worker) { _worker = worker; }
+
     /// Called to prevent starting own poll thread
     /// when polling is done on the client's thread.
     /// Mutually exclusive with startThread().
@@ -831,26 +898,54 @@ protected:
         return false;
     }
 
+    /// Called by our SocketPollWorker in place of pollingThread(): once at
+    /// the start and then after each of our polls. Returns false when done,
+    /// otherwise sets the timeout of our next poll, and whether to poll our
+    /// sockets at all, or only wait for the timeout.
+    virtual bool pollingStep(int64_t& timeoutMicroS, bool& pollSockets)
+    {
+        timeoutMicroS = DefaultPollTimeoutMicroS.count();
+        pollSockets = true;
+        return continuePolling();
+    }
+
 private:
+    friend class SocketPollWorker;
+
     /// Actual poll implementation
     int poll(int64_t timeoutMaxMicroS);
 
+    /// Handle the results of a poll of _pollFds, of @size sockets.
+    int dispatchPoll(std::chrono::steady_clock::time_point now, std::size_t size, int rc,
+                     bool epoll);
+
+    /// Drop our sockets once we stop polling for good.
+    void releaseSockets();
+
     /// Initialize the poll fds array with the right events
     void setupPollFds(std::chrono::steady_clock::time_point now,
                       int64_t &timeoutMaxMicroS)
     {
         const size_t size = _pollSockets.size();
+        const int64_t pollTimeoutMicroS = timeoutMaxMicroS;
 
         _pollFds.resize(size + 1); // + wakeup pipe
+        _pollTimeouts.resize(size);
 
         for (size_t i = 0; i < size; ++i)
         {
-            int events = _pollSockets[i]->getPollEvents(now, timeoutMaxMicroS);
+            // Note which sockets want a timeout, for readiness-only dispatch.
+            int64_t socketTimeoutMicroS = pollTimeoutMicroS;
+            int events = _pollSockets[i]->getPollEvents(now, socketTimeoutMicroS);
             assert(events >= 0 && "The events bitmask must be non-negative, where 0 means skip all events.");
+            timeoutMaxMicroS = std::min(timeoutMaxMicroS, socketTimeoutMicroS);
+            _pollTimeouts[i] = socketTimeoutMicroS < pollTimeoutMicroS ? socketTimeoutMicroS
+                                                                       : INT64_MAX;
 
             if (_pollSockets[i]->ignoringInput())
                 events &= ~POLLIN; // mask out input.
 
+            _pollSockets[i]->_pollIndex = i;
             _pollFds[i].fd = _pollSockets[i]->getFD();
             _pollFds[i].events = events;
             _pollFds[i].revents = 0;
@@ -864,10 +959,22 @@ private:
         _pollFds[size].revents = 0;
     }
 
+    /// Does this poll use epoll ? Sets it up on first use.
+    bool isEPoll();
+
+    /// Re-register the sockets whose events in _pollFds changed, wait,
+    /// and fill in the revents of _pollFds. Returns as poll(2) does.
+    int epollWait(int64_t timeoutMaxMicroS);
+
+    /// Drop @socket from the epoll interest set, if we use one.
+    void removeFromEPoll(Socket& socket);
+
     /// The polling thread entry.
     /// Used to set the thread name and mark the thread as stopped when done.
     void pollingThreadEntry();
 
+    static std::atomic<PollBackend> Backend;
+
     /// Debug name used for logging.
     const std::string _name;
 
@@ -884,6 +991,14 @@ private:
     std::vector<CallbackFn> _newCallbacks;
     /// The fds to poll.
     std::vector<pollfd> _pollFds;
+    /// In how many microseconds each of _pollSockets wants a timeout, or INT64_MAX.
+    std::vector<int64_t> _pollTimeouts;
+
+    /// The epoll instance, or -1 when using poll(2). Each socket keeps the
+    /// events it is registered with, and the events carry the socket.
+    int _epollFd;
+    /// When we last called handlePoll() of all sockets, with epoll.
+    std::chrono::steady_clock::time_point _lastIdleSweep;
 
     /// Flag the thread to stop.
     std::atomic<bool> _stop;
@@ -893,6 +1008,8 @@ private:
     std::atomic<bool> _threadFinished;
     std::atomic<bool> _runOnClientThread;
     std::thread::id _owner;
+    /// Runs us, if we don't have a thread of our own.
+    std::shared_ptr<SocketPollWorker> _worker;
 };
 
 /// A SocketPoll that will stop polling and
@@ -909,6 +1026,64 @@ public:
     }
 };
 
+/// Runs many SocketPolls on its one thread, for N:M scheduling of polls
+/// onto a fixed set of threads. The sockets of all of them are waited on
+/// with a single poll(2), then each poll with events or a timeout due is
+/// dispatched, and stepped (see SocketPoll::pollingStep()). The polls keep
+/// their own sockets and callbacks, and have our thread for affinity.
+/// Runs until stopped, so that its polls can finish in their own time.
+class SocketPollWorker final : public SocketPoll
+{
+public:
+    SocketPollWorker(const std::string& threadName)
+        : SocketPoll(threadName)
+        , _guestCount(0)
+    {
+    }
+
+    ~SocketPollWorker() { joinThread(); }
+
+    /// Start running @poll, from any thread.
+    void attach(SocketPoll* poll);
+
+    /// Stop running @poll, and wait until it is done,
+    /// unless called from our thread. From any thread.
+    void detach(SocketPoll* poll);
+
+    /// The number of polls we run, to balance the load.
+    std::size_t getGuestCount() const { return _guestCount; }
+
+    void pollingThread() override;
+
+    void dumpState(std::ostream& os) override;
+
+private:
+    /// Finish with the poll at @index, from our thread.
+    void finishGuest(std::size_t index);
+
+    struct Guest
+    {
+        SocketPoll* _poll;
+        /// When it wants the next step, poll or not.
+        std::chrono::steady_clock::time_point _stepTime;
+        /// When it wants the next step, including its sockets' timeouts.
+        std::chrono::steady_clock::time_point _dueTime;
+        /// Are its sockets polled, and where they are in _allFds.
+        bool _pollSockets;
+        std::size_t _start;
+        std::size_t _count;
+    };
+
+    /// The polls we run, only used from our thread.
+    std::vector<Guest> _guests;
+    /// The fds of all of the polls, and our own wakeup pipe.
+    std::vector<pollfd> _allFds;
+    std::atomic<std::size_t> _guestCount;
+    /// To wait for the polls to finish.
+    std::mutex _finishMutex;
+    std::condition_variable _finishCV;
+};
+
 /// A plain, non-blocking, data streaming socket.
 class StreamSocket : public Socket,
                      public std::enable_shared_from_this<StreamSocket>
@@ -1006,6 +1181,11 @@ public:
         return !_outBuffer.empty() || !_inBuffer.empty();
     }
 
+    bool hasPendingWork() const override
+    {
+        return !_inBuffer.empty() || _closed;
+    }
+
     /// Send data to the socket peer.
     void send(const char* data, const int len, const bool doFlush = true)
     {
@@ -1024,6 +1204,69 @@ public:
         send(str.data(), str.size(), doFlush);
     }
 
+    /// Send @len bytes of @data, which @owner keeps alive, without copying them.
+    void send(std::shared_ptr<const void> owner, const char* data, const std::size_t len,
+              const bool doFlush = true)
+    {
+        ASSERT_CORRECT_SOCKET_THREAD(this);
+        if (data != nullptr && len > 0)
+        {
+            _outBuffer.append(std::move(owner), data, len);
+            if (doFlush)
+                writeOutgoingData();
+        }
+    }
+
+    /// Send the concatenation of @iovcnt slices to the socket peer.
+    /// When nothing is buffered, writes straight from the slices, and only
+    /// what the kernel doesn't take is copied into the output buffer.
+    void send(const iovec* iov, const int iovcnt, const bool doFlush = true)
+    {
+        ASSERT_CORRECT_SOCKET_THREAD(this);
+        ssize_t written = 0;
+        bool flushed = false;
+        if (doFlush && _outBuffer.empty())
+        {
+            int last_errno = 0;
+            do
+            {
+                written = writeDataV(iov, iovcnt);
+                if (written < 0)
+                    last_errno = errno;
+            }
+            while (written < 0 && last_errno == EINTR);
+
+            if (written < 0 && last_errno != EAGAIN && last_errno != EWOULDBLOCK)
+                LOG_SYS_ERRNO(last_errno, "Socket writev returned " << written);
+            else if (written > 0)
+            {
+                LOG_TRC("Wrote " << written << " bytes from " << iovcnt << " slices");
+                _bytesSent += written;
+            }
+
+            flushed = (written != 0);
+            written = std::max<ssize_t>(written, 0);
+            errno = last_errno;
+        }
+
+        // Buffer the remainder; poll will flush it (or handle errors).
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            const ssize_t len = iov[i].iov_len;
+            if (written >= len)
+            {
+                written -= len;
+                continue;
+            }
+
+            _outBuffer.append(static_cast<const char*>(iov[i].iov_base) + written, len - written);
+            written = 0;
+        }
+
+        if (doFlush && !flushed && !_outBuffer.empty())
+            writeOutgoingData();
+    }
+
     /// Sends HTTP response.
     /// Adds Date and User-Agent.
     void send(Poco::Net::HTTPResponse& response);
@@ -1033,6 +1276,10 @@ public:
     /// Will shutdown the socket upon error and return false.
     bool send(http::Request& request);
 
+    /// Sends some of the body file of @request with sendfile(2), as much as
+    /// the socket takes. Returns false on error.
+    bool sendBodyFile(http::Request& request);
+
     /// Send an http::Response and flush.
     /// Does not add any fields to the header.
     /// Will shutdown the socket upon error and return false.
@@ -1255,7 +1502,7 @@ public:
 
     Buffer& getInBuffer() { return _inBuffer; }
 
-    Buffer& getOutBuffer()
+    ChunkedBuffer& getOutBuffer()
     {
         return _outBuffer;
     }
@@ -1404,6 +1651,9 @@ protected:
     }
 
 public:
+    /// The most segments of the output buffer written in one go.
+    static constexpr int MaxWriteSegments = 64;
+
     /// Override to write data out to socket.
     /// Returns the last return from writeData.
     virtual int writeOutgoingData()
@@ -1417,11 +1667,15 @@ public:
             do
             {
                 // Writing much more than we can absorb in the kernel causes wastage.
-                const int size = std::min((int)_outBuffer.getBlockSize(), getSendBufferSize());
-                if (size == 0)
+                iovec iov[MaxWriteSegments];
+                const int count = _outBuffer.getIOVec(iov, MaxWriteSegments, getSendBufferSize());
+                if (count == 0)
                     break;
 
-                len = writeData(_outBuffer.getBlock(), size);
+                // Gather the segments in one call, if we can.
+                len = (count > 1 ? writeDataV(iov, count) : 0);
+                if (len == 0)
+                    len = writeData(static_cast<const char*>(iov[0].iov_base), iov[0].iov_len);
                 if (len < 0)
                     last_errno = errno; // Save only on error.
 
@@ -1435,7 +1689,10 @@ public:
                 else // Success.
                     LOG_TRC("Wrote " << len << " bytes of " << _outBuffer.size() << " buffered data"
 #ifdef LOG_SOCKET_DATA
-                            << (len ? Util::dumpHex(std::string(_outBuffer.getBlock(), len), ":\n")
+                            << (len ? Util::dumpHex(std::string(_outBuffer.getBlock(),
+                                                                std::min<std::size_t>(
+                                                                    len, _outBuffer.getBlockSize())),
+                                                    ":\n")
                                     : std::string())
 #endif
                     );
@@ -1545,6 +1802,36 @@ protected:
 #endif
     }
 
+    /// Override to write vectored data to socket differently.
+    /// Returns the number of bytes written, which may be 0 when
+    /// the implementation can't write from slices directly.
+    virtual ssize_t writeDataV(const iovec* iov, const int iovcnt)
+    {
+        ASSERT_CORRECT_SOCKET_THREAD(this);
+#if !MOBILEAPP
+#if ENABLE_DEBUG
+        if (simulateSocketError(false))
+            return -1;
+#endif
+        return ::writev(getFD(), iov, iovcnt);
+#else
+        (void)iov;
+        (void)iovcnt;
+        return 0;
+#endif
+    }
+
+    /// Whether we can write a file to the socket with sendfile(2), which
+    /// leaves the data in the kernel. Not when we encrypt in user space.
+    virtual bool canSendFile() const
+    {
+#if !MOBILEAPP && defined(__linux__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
     void setShutdownSignalled()
     {
         _shutdownSignalled = true;
@@ -1574,7 +1861,7 @@ private:
     std::shared_ptr<ProtocolHandlerInterface> _socketHandler;
 
     Buffer _inBuffer;
-    Buffer _outBuffer;
+    ChunkedBuffer _outBuffer;
 
     uint64_t _bytesSent;
     uint64_t _bytesRecvd;
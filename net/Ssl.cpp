@@ -177,8 +177,70 @@ SslContext::SslContext(const std::string& certFilePath, const std::string& keyFi
     }
 }
 
+bool SslContext::setKtls(bool enable)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (enable)
+        SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+    else
+        SSL_CTX_clear_options(_ctx, SSL_OP_ENABLE_KTLS);
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+void SslContext::setSessionResumption(bool enable)
+{
+    if (enable)
+    {
+        // We keep the sessions ourselves, by host, as OpenSSL doesn't look them up for clients.
+        SSL_CTX_set_app_data(_ctx, this);
+        SSL_CTX_set_session_cache_mode(_ctx,
+                                       SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(_ctx, &SslContext::onNewSession);
+    }
+    else
+    {
+        SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_sess_set_new_cb(_ctx, nullptr);
+
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+        for (const auto& pair : _sessions)
+            SSL_SESSION_free(pair.second);
+        _sessions.clear();
+    }
+}
+
+void SslContext::resumeSession(SSL* ssl, const std::string& host)
+{
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    const auto it = _sessions.find(host);
+    if (it != _sessions.end())
+        SSL_set_session(ssl, it->second); // Otherwise it's a full handshake, as without.
+}
+
+int SslContext::onNewSession(SSL* ssl, SSL_SESSION* session)
+{
+    SslContext* context = static_cast<SslContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (!context || !host)
+        return 0;
+
+    // We take the reference OpenSSL gives us, and drop that of the session we replace.
+    std::lock_guard<std::mutex> lock(context->_sessionsMutex);
+    SSL_SESSION*& entry = context->_sessions[host];
+    if (entry)
+        SSL_SESSION_free(entry);
+    entry = session;
+    return 1;
+}
+
 SslContext::~SslContext()
 {
+    for (const auto& pair : _sessions)
+        SSL_SESSION_free(pair.second);
+
     SSL_CTX_free(_ctx);
     EVP_cleanup();
     ERR_free_strings();
@@ -11,6 +11,7 @@
 
 #include <atomic>
 #include <cassert>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -49,11 +50,26 @@ public:
 
     ssl::CertificateVerification verification() const { return _verification; }
 
+    /// Offloads the record layer of new connections to the kernel (kTLS)
+    /// when the negotiated cipher and the kernel allow it.
+    /// Returns false when this OpenSSL has no kTLS support.
+    bool setKtls(bool enable);
+
+    /// Keeps the session of the last connection to each host, to resume
+    /// it on the next, with an abbreviated handshake. For client contexts.
+    void setSessionResumption(bool enable);
+
+    /// Sets the session kept for @host on @ssl, before it connects, if any.
+    void resumeSession(SSL* ssl, const std::string& host);
+
 private:
     void initDH();
     void initECDH();
     void shutdown();
 
+    /// Called by OpenSSL with each new session of a client connection.
+    static int onNewSession(SSL* ssl, SSL_SESSION* session);
+
     std::string getLastErrorMsg();
 
     // Multithreading support for OpenSSL.
@@ -66,6 +82,10 @@ private:
 private:
     SSL_CTX* _ctx;
     const ssl::CertificateVerification _verification;
+
+    std::mutex _sessionsMutex;
+    /// The sessions to resume, by host, each holding a reference.
+    std::map<std::string, SSL_SESSION*> _sessions;
 };
 
 namespace ssl
@@ -87,6 +107,13 @@ public:
 
     static void uninitializeServerContext() { ServerInstance.reset(); }
 
+    /// Enables or disables kTLS for new server connections.
+    static bool setServerKtls(bool enable)
+    {
+        assert(isServerContextInitialized() && "Server SslContext is not initialized");
+        return ServerInstance->setKtls(enable);
+    }
+
     /// Returns true iff the Server SslContext has been initialized.
     static bool isServerContextInitialized() { return !!ServerInstance; }
 
@@ -121,6 +148,20 @@ public:
         return ClientInstance->newSsl();
     }
 
+    /// Enables or disables the resumption of TLS sessions by client connections.
+    static void setClientSessionResumption(bool enable)
+    {
+        assert(isClientContextInitialized() && "Client SslContext is not initialized");
+        ClientInstance->setSessionResumption(enable);
+    }
+
+    /// Sets the session to resume, if any, on the client connection @ssl to @host.
+    static void resumeClientSession(SSL* ssl, const std::string& host)
+    {
+        if (isClientContextInitialized())
+            ClientInstance->resumeSession(ssl, host);
+    }
+
 private:
     static std::unique_ptr<SslContext> ServerInstance;
     static std::unique_ptr<SslContext> ClientInstance;
@@ -28,6 +28,7 @@ public:
         , _ssl(nullptr)
         , _sslWantsTo(SslWantsTo::Neither)
         , _doHandshake(true)
+        , _ktlsSend(false)
     {
         LOG_TRC("SslStreamSocket ctor #" << fd);
 
@@ -60,6 +61,9 @@ public:
 
         if (isClient)
         {
+            if (!hostname().empty())
+                ssl::Manager::resumeClientSession(_ssl, hostname());
+
             SSL_set_connect_state(_ssl);
             if (SSL_connect(_ssl) == 0)
                 LOG_DBG("SslStreamSocket connect #" << getFD() << " failed ");
@@ -99,6 +103,13 @@ public:
         return std::string();
     }
 
+    /// True when the kernel encrypts what we write (kTLS), so we write plaintext
+    /// to the socket directly. Set once the handshake is complete.
+    bool isKtlsSend() const { return _ktlsSend; }
+
+    /// With kTLS the kernel encrypts files sent with sendfile(2) too.
+    bool canSendFile() const override { return _ktlsSend && StreamSocket::canSendFile(); }
+
     /// Shutdown the TLS/SSL connection properly.
     void closeConnection() override
     {
@@ -160,6 +171,10 @@ public:
 
         assert (len > 0); // Never write 0 bytes.
 
+        // The kernel frames and encrypts the records, OpenSSL need not see the data.
+        if (_ktlsSend)
+            return StreamSocket::writeData(buf, len);
+
 #if ENABLE_DEBUG
         if (simulateSocketError(false))
             return -1;
@@ -167,6 +182,32 @@ public:
         return handleSslState(SSL_write(_ssl, buf, len));
     }
 
+    /// SSL_write needs the plaintext contiguous, so gather small slices
+    /// into one record, rather than writing a short record for each.
+    virtual ssize_t writeDataV(const iovec* iov, const int iovcnt) override
+    {
+        ASSERT_CORRECT_SOCKET_THREAD(this);
+
+        if (_ktlsSend)
+            return StreamSocket::writeDataV(iov, iovcnt);
+
+        // A retry after SSL_ERROR_WANT_WRITE must start with the same bytes, and
+        // be no shorter; the data stays queued in the same order until written.
+        if (iovcnt == 1 || iov[0].iov_len >= MaxRecordSize)
+            return writeData(static_cast<const char*>(iov[0].iov_base), iov[0].iov_len);
+
+        char record[MaxRecordSize];
+        std::size_t size = 0;
+        for (int i = 0; i < iovcnt && size < MaxRecordSize; ++i)
+        {
+            const std::size_t len = std::min(iov[i].iov_len, MaxRecordSize - size);
+            memcpy(record + size, iov[i].iov_base, len);
+            size += len;
+        }
+
+        return writeData(record, size);
+    }
+
     int getPollEvents(std::chrono::steady_clock::time_point now,
                       int64_t & timeoutMaxMicroS) override
     {
@@ -242,6 +283,14 @@ private:
                     closeConnection();
                     return 0;
                 }
+
+#ifdef SSL_OP_ENABLE_KTLS
+                // Reads stay with SSL_read, which handles the non-data records
+                // (alerts, tickets, key updates) a plain read would choke on.
+                _ktlsSend = BIO_get_ktls_send(SSL_get_wbio(_ssl));
+                if (_ktlsSend)
+                    LOG_DBG("kTLS send offload active on #" << getFD());
+#endif
             }
         }
 
@@ -423,6 +472,9 @@ private:
     }
 
 private:
+    /// The most plaintext a TLS record carries.
+    static constexpr std::size_t MaxRecordSize = 16 * 1024;
+
     BIO* _bio;
     SSL* _ssl;
     ssl::CertificateVerification _verification; //< The certificate verification requirement.
@@ -433,6 +485,8 @@ private:
     /// We must do the handshake during the first
     /// read or write in non-blocking.
     bool _doHandshake;
+    /// Whether the kernel does the encryption of our writes.
+    bool _ktlsSend;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
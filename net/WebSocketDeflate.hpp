@@ -0,0 +1,356 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "common/Common.hpp"
+#include "common/Log.hpp"
+#include "common/Util.hpp"
+
+/// The permessage-deflate WebSocket extension (RFC 7692) of one connection.
+/// Messages are deflated with a raw stream that, unless the peer asked for
+/// no context takeover, keeps its window from one message to the next, so
+/// the repetitive JSON and status messages compress very well.
+class WebSocketDeflate
+{
+public:
+    /// The server-wide settings, see net.ws_compression in coolwsd.xml.
+    struct Config
+    {
+        Config()
+            : _enabled(false)
+            , _windowBits(MAX_WBITS)
+        {
+        }
+
+        bool _enabled;
+        /// The largest LZ77 window we use, and ask clients to use, 9 to 15.
+        int _windowBits;
+        /// The first tokens of binary messages that are already compressed.
+        std::vector<std::string> _skipBinary;
+    };
+
+    static Config& config()
+    {
+        static Config Settings;
+        return Settings;
+    }
+
+    /// Messages shorter than this are sent as they are.
+    static constexpr std::size_t MinMessageSize = 64;
+
+    /// The largest message we inflate: a few bytes can inflate to gigabytes.
+    static constexpr std::size_t MaxInflatedSize = MAX_MESSAGE_SIZE;
+
+    /// The outcome of inflating a message.
+    enum class Inflated
+    {
+        Ok,
+        Invalid,
+        TooBig
+    };
+
+    /// The parameters agreed for a connection.
+    struct Params
+    {
+        Params()
+            : _serverNoContextTakeover(false)
+            , _clientNoContextTakeover(false)
+            , _serverMaxWindowBits(MAX_WBITS)
+            , _clientMaxWindowBits(MAX_WBITS)
+        {
+        }
+
+        bool _serverNoContextTakeover;
+        bool _clientNoContextTakeover;
+        int _serverMaxWindowBits;
+        int _clientMaxWindowBits;
+    };
+
+    /// Picks the first permessage-deflate offer in the client's Sec-WebSocket-Extensions
+    /// @header that we can accept, with our window limited to @maxWindowBits.
+    /// Returns false when there is none, otherwise fills @params and the header value
+    /// to respond with in @response.
+    static bool negotiate(const std::string& header, int maxWindowBits, Params& params,
+                          std::string& response)
+    {
+        maxWindowBits = std::max(9, std::min(maxWindowBits, MAX_WBITS));
+
+        for (const std::string& offer : Util::splitStringToVector(header, ','))
+        {
+            std::vector<std::string> tokens = Util::splitStringToVector(offer, ';');
+            if (tokens.empty() || Util::trim(tokens[0]) != "permessage-deflate")
+                continue;
+
+            Params offered;
+            bool clientWindowOffered = false;
+            bool serverWindowOffered = false;
+            bool valid = true;
+            for (std::size_t i = 1; i < tokens.size() && valid; ++i)
+            {
+                std::string name = tokens[i];
+                std::string value;
+                const std::size_t equals = name.find('=');
+                if (equals != std::string::npos)
+                {
+                    value = name.substr(equals + 1);
+                    name.resize(equals);
+                    Util::trim(value);
+                    if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                        value = value.substr(1, value.size() - 2);
+                }
+
+                Util::trim(name);
+                if (name == "server_no_context_takeover" && value.empty()
+                    && !offered._serverNoContextTakeover)
+                {
+                    offered._serverNoContextTakeover = true;
+                }
+                else if (name == "client_no_context_takeover" && value.empty()
+                         && !offered._clientNoContextTakeover)
+                {
+                    offered._clientNoContextTakeover = true;
+                }
+                else if (name == "server_max_window_bits" && !serverWindowOffered)
+                {
+                    // zlib can't produce raw streams with a 256-byte window.
+                    serverWindowOffered = true;
+                    offered._serverMaxWindowBits = parseWindowBits(value);
+                    valid = offered._serverMaxWindowBits >= 9;
+                }
+                else if (name == "client_max_window_bits" && !clientWindowOffered)
+                {
+                    // Without a value the client only says it can take a limit.
+                    clientWindowOffered = true;
+                    offered._clientMaxWindowBits
+                        = value.empty() ? MAX_WBITS : parseWindowBits(value);
+                    valid = offered._clientMaxWindowBits >= 8;
+                }
+                else
+                    valid = false;
+            }
+
+            if (!valid)
+            {
+                LOG_DBG("Declining permessage-deflate offer [" << offer << ']');
+                continue;
+            }
+
+            params = offered;
+            params._serverMaxWindowBits = std::min(offered._serverMaxWindowBits, maxWindowBits);
+
+            response = "permessage-deflate";
+            if (params._serverNoContextTakeover)
+                response += "; server_no_context_takeover";
+            if (params._clientNoContextTakeover)
+                response += "; client_no_context_takeover";
+            if (params._serverMaxWindowBits < MAX_WBITS)
+                response += "; server_max_window_bits=" + std::to_string(params._serverMaxWindowBits);
+            if (clientWindowOffered)
+            {
+                params._clientMaxWindowBits
+                    = std::min(params._clientMaxWindowBits, maxWindowBits);
+                response += "; client_max_window_bits=" + std::to_string(params._clientMaxWindowBits);
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    /// Whether a message of @len bytes starting with @data is worth deflating.
+    static bool isCompressible(const char* data, std::size_t len, bool binary)
+    {
+        if (len < MinMessageSize)
+            return false;
+
+        if (binary)
+        {
+            for (const std::string& token : config()._skipBinary)
+            {
+                if (len >= token.size() && std::memcmp(data, token.data(), token.size()) == 0)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// The @params as negotiated, and whether we are the client.
+    WebSocketDeflate(const Params& params, bool isClient)
+        : _resetDeflate(isClient ? params._clientNoContextTakeover
+                                 : params._serverNoContextTakeover)
+        , _resetInflate(isClient ? params._serverNoContextTakeover
+                                 : params._clientNoContextTakeover)
+        , _rawBytes(0)
+        , _compressedBytes(0)
+    {
+        std::memset(&_deflate, 0, sizeof(_deflate));
+        std::memset(&_inflate, 0, sizeof(_inflate));
+
+        // The window we send with is the one the peer limited us to.
+        const int deflateBits
+            = isClient ? params._clientMaxWindowBits : params._serverMaxWindowBits;
+        _deflateValid = deflateInit2(&_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                     -std::max(9, deflateBits), 8, Z_DEFAULT_STRATEGY)
+                        == Z_OK;
+        _inflateValid = inflateInit2(&_inflate, -MAX_WBITS) == Z_OK;
+        if (!_deflateValid || !_inflateValid)
+            LOG_ERR("Failed to init permessage-deflate streams");
+    }
+
+    WebSocketDeflate(const WebSocketDeflate&) = delete;
+    WebSocketDeflate& operator=(const WebSocketDeflate&) = delete;
+
+    ~WebSocketDeflate()
+    {
+        if (_deflateValid)
+            deflateEnd(&_deflate);
+        if (_inflateValid)
+            inflateEnd(&_inflate);
+    }
+
+    /// Deflates the @len bytes of @data as one message, into @output.
+    bool compress(const char* data, std::size_t len, std::vector<char>& output)
+    {
+        if (!_deflateValid || (_resetDeflate && deflateReset(&_deflate) != Z_OK))
+            return false;
+
+        output.clear();
+        output.resize(deflateBound(&_deflate, len) + 16);
+
+        _deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        _deflate.avail_in = len;
+        _deflate.next_out = reinterpret_cast<Bytef*>(output.data());
+        _deflate.avail_out = output.size();
+
+        // The sync flush ends the message on a byte boundary, without closing the stream.
+        if (deflate(&_deflate, Z_SYNC_FLUSH) != Z_OK || _deflate.avail_in != 0
+            || _deflate.avail_out == 0)
+        {
+            // We can't tell what the peer has seen of a stream that failed midway.
+            LOG_ERR("Failed to deflate WebSocket message of " << len << " bytes");
+            deflateEnd(&_deflate);
+            _deflateValid = false;
+            return false;
+        }
+
+        output.resize(output.size() - _deflate.avail_out);
+
+        // Every message ends in the empty stored block of the flush, which isn't sent.
+        if (output.size() >= 4 && std::memcmp(&output[output.size() - 4], "\0\0\xff\xff", 4) == 0)
+            output.resize(output.size() - 4);
+
+        _rawBytes += len;
+        _compressedBytes += output.size();
+        return true;
+    }
+
+    /// Inflates the @len bytes of a compressed message in @data into @output,
+    /// giving up as soon as that would be more than @maxSize bytes.
+    Inflated decompress(const char* data, std::size_t len, std::vector<char>& output,
+                        std::size_t maxSize = MaxInflatedSize)
+    {
+        if (!_inflateValid || (_resetInflate && inflateReset(&_inflate) != Z_OK))
+            return Inflated::Invalid;
+
+        // Restore the tail of the flush, which the sender dropped.
+        static const char Tail[4] = { 0, 0, static_cast<char>(0xff), static_cast<char>(0xff) };
+        output.clear();
+        Inflated result = inflateChunk(data, len, output, maxSize);
+        if (result == Inflated::Ok)
+            result = inflateChunk(Tail, sizeof(Tail), output, maxSize);
+
+        if (result != Inflated::Ok)
+        {
+            // The stream is left midway through a message, it can't go on.
+            inflateEnd(&_inflate);
+            _inflateValid = false;
+        }
+
+        return result;
+    }
+
+    /// The bytes of the messages we compressed, before and after.
+    uint64_t getRawBytes() const { return _rawBytes; }
+    uint64_t getCompressedBytes() const { return _compressedBytes; }
+
+private:
+    static int parseWindowBits(const std::string& value)
+    {
+        if (value.size() < 1 || value.size() > 2
+            || value.find_first_not_of("0123456789") != std::string::npos)
+            return 0;
+
+        const int bits = std::stoi(value);
+        return bits >= 8 && bits <= MAX_WBITS ? bits : 0;
+    }
+
+    Inflated inflateChunk(const char* data, std::size_t len, std::vector<char>& output,
+                          std::size_t maxSize)
+    {
+        _inflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        _inflate.avail_in = len;
+
+        // Go on while there is input, or output that didn't fit.
+        _inflate.avail_out = 0;
+        while (_inflate.avail_in > 0 || _inflate.avail_out == 0)
+        {
+            const std::size_t oldSize = output.size();
+            if (oldSize > maxSize)
+            {
+                LOG_ERR("WebSocket message inflates to more than " << maxSize << " bytes");
+                return Inflated::TooBig;
+            }
+
+            // Never more than a byte over the limit, enough to tell it's exceeded.
+            output.resize(oldSize + std::min(std::max<std::size_t>(len * 4, 4096),
+                                             maxSize + 1 - oldSize));
+            _inflate.next_out = reinterpret_cast<Bytef*>(&output[oldSize]);
+            _inflate.avail_out = output.size() - oldSize;
+
+            const int rc = inflate(&_inflate, Z_SYNC_FLUSH);
+            output.resize(output.size() - _inflate.avail_out);
+            if (rc != Z_OK && rc != Z_BUF_ERROR)
+            {
+                LOG_ERR("Failed to inflate WebSocket message: " << rc);
+                return Inflated::Invalid;
+            }
+
+            if (rc == Z_BUF_ERROR)
+                break; // No progress possible.
+        }
+
+        if (output.size() > maxSize)
+        {
+            LOG_ERR("WebSocket message inflates to more than " << maxSize << " bytes");
+            return Inflated::TooBig;
+        }
+
+        return _inflate.avail_in == 0 ? Inflated::Ok : Inflated::Invalid;
+    }
+
+    z_stream _deflate;
+    z_stream _inflate;
+    bool _deflateValid;
+    bool _inflateValid;
+    /// Whether each message starts a new stream, with no context taken over.
+    const bool _resetDeflate;
+    const bool _resetInflate;
+    uint64_t _rawBytes;
+    uint64_t _compressedBytes;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -18,6 +18,9 @@
 #include "common/Util.hpp"
 #include "Socket.hpp"
 #include <net/HttpRequest.hpp>
+#if !MOBILEAPP
+#include <net/WebSocketDeflate.hpp>
+#endif
 
 #include <Poco/MemoryStream.h>
 #include <Poco/Net/HTTPRequest.h>
@@ -35,8 +38,12 @@ private:
     int _pingTimeUs;
     bool _isMasking;
     bool _inFragmentBlock;
+    /// Whether the message being received is compressed.
+    bool _inflateMessage;
     /// The security key. Meaningful only for clients.
     const std::string _key;
+    /// The permessage-deflate state, when negotiated.
+    std::unique_ptr<WebSocketDeflate> _deflate;
 #endif
 
     std::vector<char> _wsPayload;
@@ -47,6 +54,7 @@ protected:
     struct WSFrameMask
     {
         static constexpr unsigned char Fin = 0x80;
+        static constexpr unsigned char Rsv1 = 0x40;
         static constexpr unsigned char Mask = 0x80;
     };
 
@@ -65,6 +73,7 @@ public:
         _pingTimeUs(0),
         _isMasking(isClient && isMasking),
         _inFragmentBlock(false),
+        _inflateMessage(false),
         _key(isClient ? PublicComputeAccept::generateKey() : std::string()),
 #endif
         _shuttingDown(false),
@@ -86,6 +95,7 @@ public:
         , _pingTimeUs(0)
         , _isMasking(false)
         , _inFragmentBlock(false)
+        , _inflateMessage(false)
         , _key(std::string())
 #endif
         , _shuttingDown(false)
@@ -220,6 +230,19 @@ protected:
         }
     }
 
+    void getCompressionStats(uint64_t &raw, uint64_t &compressed) override
+    {
+        raw = 0;
+        compressed = 0;
+#if !MOBILEAPP
+        if (_deflate)
+        {
+            raw = _deflate->getRawBytes();
+            compressed = _deflate->getCompressedBytes();
+        }
+#endif
+    }
+
 public:
     void shutdown(const StatusCodes statusCode = StatusCodes::NORMAL_CLOSE,
                   const std::string& statusMessage = std::string())
@@ -237,6 +260,7 @@ public:
         _wsPayload.clear();
 #if !MOBILEAPP
         _inFragmentBlock = false;
+        _inflateMessage = false;
 #endif
         _shuttingDown = false;
     }
@@ -261,6 +285,7 @@ private:
 
         unsigned char *p = reinterpret_cast<unsigned char*>(&socket->getInBuffer()[0]);
         const bool fin = p[0] & 0x80;
+        const bool rsv1 = p[0] & WSFrameMask::Rsv1;
         const WSOpCode code = static_cast<WSOpCode>(p[0] & 0x0f);
         const bool hasMask = p[1] & 0x80;
         size_t payloadLen = p[1] & 0x7f;
@@ -345,6 +370,12 @@ private:
                 shutdown(StatusCodes::PROTOCOL_ERROR);
                 return true;
             }
+            if (rsv1)
+            {
+                LOG_ERR('#' << socket->getFD() << ": A control frame cannot be compressed.");
+                shutdown(StatusCodes::PROTOCOL_ERROR);
+                return true;
+            }
 
             switch (code)
             {
@@ -417,6 +448,16 @@ private:
             return true;
         }
 
+        if (rsv1 && (code == WSOpCode::Continuation || !_deflate))
+        {
+            LOG_ERR('#' << socket->getFD() << ": Only the first fragment of a message can be compressed, and only with permessage-deflate.");
+            shutdown(StatusCodes::PROTOCOL_ERROR);
+            return true;
+        }
+
+        if (code != WSOpCode::Continuation)
+            _inflateMessage = rsv1;
+
         //Process data frame
         readPayload(data, payloadLen, mask, _wsPayload);
 #else
@@ -439,6 +480,31 @@ private:
         {
             // If is final fragment then process the accumulated message.
 
+            if (_inflateMessage)
+            {
+                std::vector<char> message;
+                const WebSocketDeflate::Inflated inflated
+                    = _deflate->decompress(_wsPayload.data(), _wsPayload.size(), message);
+                if (inflated == WebSocketDeflate::Inflated::TooBig)
+                {
+                    LOG_ERR('#' << socket->getFD() << ": Compressed message of "
+                                << _wsPayload.size() << " bytes inflates to more than "
+                                << WebSocketDeflate::MaxInflatedSize << " bytes.");
+                    shutdown(StatusCodes::PAYLOAD_TOO_BIG);
+                    return true;
+                }
+                else if (inflated != WebSocketDeflate::Inflated::Ok)
+                {
+                    LOG_ERR('#' << socket->getFD() << ": Invalid compressed message of "
+                                << _wsPayload.size() << " bytes.");
+                    shutdown(StatusCodes::PROTOCOL_ERROR);
+                    return true;
+                }
+
+                _wsPayload.swap(message);
+                _inflateMessage = false;
+            }
+
             try
             {
                 handleMessage(_wsPayload);
@@ -625,6 +691,46 @@ public:
         return sendMessage(data, len, WSOpCode::Binary, flush);
     }
 
+    /// Implementation of the ProtocolHandlerInterface.
+    /// Unless it is to be masked or compressed, the payload is queued
+    /// by reference, rather than copied into the output buffer.
+    int sendSharedBinaryMessage(const std::shared_ptr<const void>& owner, const char* data,
+                                const size_t len, bool flush = false) const override
+    {
+#if !MOBILEAPP
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        if (!owner || len < ChunkedBuffer::MinSharedSize || _isMasking || _shuttingDown
+            || !socket || socket->isClosed()
+            || (_deflate && WebSocketDeflate::isCompressible(data, len, /*binary=*/true)))
+        {
+            return sendMessage(data, len, WSOpCode::Binary, flush);
+        }
+
+        int unitReturn = -1;
+        if (!Util::isFuzzing()
+            && UnitBase::get().filterSendWebSocketMessage(data, len, WSOpCode::Binary, flush,
+                                                          unitReturn))
+            return unitReturn;
+
+        ASSERT_CORRECT_SOCKET_THREAD(socket);
+
+        char scratch[16];
+        const int slen = buildFrameHeader(
+            len, WSFrameMask::Fin | static_cast<unsigned char>(WSOpCode::Binary), scratch);
+
+        ChunkedBuffer& out = socket->getOutBuffer();
+        out.append(scratch, slen);
+        out.append(owner, data, len);
+        if (flush)
+            socket->writeOutgoingData();
+
+        return slen + len;
+#else
+        (void)owner;
+        return sendMessage(data, len, WSOpCode::Binary, flush);
+#endif
+    }
+
     /// Sends a WebSocket message of WPOpCode type.
     /// Returns the number of bytes written (including frame overhead) on success,
     /// 0 for closed socket, and -1 for other errors.
@@ -638,18 +744,63 @@ public:
         //TODO: Support fragmented messages.
 
         std::shared_ptr<StreamSocket> socket = _socket.lock();
+#if !MOBILEAPP
+        if (_deflate && (code == WSOpCode::Text || code == WSOpCode::Binary)
+            && WebSocketDeflate::isCompressible(data, len, code == WSOpCode::Binary))
+        {
+            std::vector<char> compressed;
+            if (_deflate->compress(data, len, compressed))
+                return sendFrame(socket, compressed.data(), compressed.size(),
+                                 WSFrameMask::Fin | WSFrameMask::Rsv1
+                                     | static_cast<unsigned char>(code),
+                                 flush);
+        }
+#endif
         return sendFrame(socket, data, len, WSFrameMask::Fin | static_cast<unsigned char>(code), flush);
     }
 
+    /// Sends a WebSocket message whose payload is @header followed by @data.
+    /// When flushing an unmasked, uncompressed frame, the payload is written
+    /// directly from the two slices, rather than being concatenated beforehand.
+    /// Returns as sendMessage() above.
+    int sendMessage(const char* header, const size_t headerLen, const char* data,
+                    const size_t len, const WSOpCode code, const bool flush) const
+    {
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+#if !MOBILEAPP
+        if (flush && !_isMasking && !_deflate && !_shuttingDown && !UnitBase::isUnitTesting() && socket
+            && !socket->isClosed() && headerLen > 0)
+        {
+            ASSERT_CORRECT_SOCKET_THREAD(socket);
+
+            char scratch[16];
+            const int slen = buildFrameHeader(headerLen + len,
+                                              WSFrameMask::Fin | static_cast<unsigned char>(code),
+                                              scratch);
+
+            const iovec iov[3] = { { scratch, static_cast<size_t>(slen) },
+                                   { const_cast<char*>(header), headerLen },
+                                   { const_cast<char*>(data), len } };
+            socket->send(iov, len > 0 ? 3 : 2);
+            return slen + headerLen + len;
+        }
+#endif
+
+        std::vector<char> message;
+        message.reserve(headerLen + len);
+        message.insert(message.end(), header, header + headerLen);
+        message.insert(message.end(), data, data + len);
+        return sendMessage(message.data(), message.size(), code, flush);
+    }
+
 protected:
 
 #if !MOBILEAPP
-    /// Builds a websocket frame based on data and flags received as parameters.
-    /// The frame is output in 'out' parameter
-    void buildFrame(const char* data, const uint64_t len, unsigned char flags, Buffer &out) const
+    /// Writes the frame header for @len payload bytes into @scratch,
+    /// excluding any mask. Returns the header size.
+    int buildFrameHeader(const uint64_t len, unsigned char flags, char (&scratch)[16]) const
     {
         int slen = 0;
-        char scratch[16];
 
         // All unfragmented frames must have the Fin bit.
         scratch[slen++] = WSFrameMask::Fin | flags;
@@ -679,6 +830,15 @@ protected:
         }
 
         assert(slen <= static_cast<int>(sizeof(scratch)));
+        return slen;
+    }
+
+    /// Builds a websocket frame based on data and flags received as parameters.
+    /// The frame is output in 'out' parameter
+    void buildFrame(const char* data, const uint64_t len, unsigned char flags, ChunkedBuffer& out) const
+    {
+        char scratch[16];
+        const int slen = buildFrameHeader(len, flags, scratch);
         out.append(scratch, slen);
 
         if (_isMasking)
@@ -729,7 +889,7 @@ protected:
         }
 
         ASSERT_CORRECT_SOCKET_THREAD(socket);
-        Buffer& out = socket->getOutBuffer();
+        ChunkedBuffer& out = socket->getOutBuffer();
 
         LOG_TRC("WebSocketHandler::sendFrame: Writing to #"
                 << socket->getFD() << ' ' << len << " bytes in addition to " << out.size()
@@ -895,6 +1055,17 @@ protected:
         LOG_INF('#' << socket.getFD() << ": WebSocket version: " << wsVersion << ", key: [" << wsKey
                     << "], protocol: [" << wsProtocol << "].");
 
+        std::string extensions;
+        const WebSocketDeflate::Config& deflateConfig = WebSocketDeflate::config();
+        WebSocketDeflate::Params deflateParams;
+        if (deflateConfig._enabled
+            && WebSocketDeflate::negotiate(req.get("Sec-WebSocket-Extensions", ""),
+                                           deflateConfig._windowBits, deflateParams, extensions))
+        {
+            LOG_DBG('#' << socket.getFD() << ": Using WebSocket extension [" << extensions << ']');
+            _deflate = std::make_unique<WebSocketDeflate>(deflateParams, /*isClient=*/false);
+        }
+
 #if ENABLE_DEBUG
         if (std::getenv("COOL_ZERO_BUFFER_SIZE"))
             socket.setSocketBufferSize(0);
@@ -904,6 +1075,8 @@ protected:
         httpResponse.set("Upgrade", "websocket");
         httpResponse.set("Connection", "Upgrade");
         httpResponse.set("Sec-WebSocket-Accept", PublicComputeAccept::doComputeAccept(wsKey));
+        if (_deflate)
+            httpResponse.set("Sec-WebSocket-Extensions", extensions);
         LOG_TRC('#' << socket.getFD()
                     << ": Sending WS Upgrade response: " << httpResponse.header().toString());
         socket.send(httpResponse);
@@ -9,6 +9,8 @@
 
 #include <test/lokassert.hpp>
 
+#include <chrono>
+
 #include <Delta.hpp>
 #include <Util.hpp>
 #include <Png.hpp>
@@ -22,11 +24,15 @@ class DeltaTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testDeltaSequence);
     CPPUNIT_TEST(testRandomDeltas);
 #endif
+    CPPUNIT_TEST(testDeltaKernels);
+    CPPUNIT_TEST(testTileCompression);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testDeltaSequence();
     void testRandomDeltas();
+    void testDeltaKernels();
+    void testTileCompression();
 
     std::vector<char> loadPng(const char *relpath,
                               png_uint_32& height,
@@ -226,6 +232,173 @@ void DeltaTests::testRandomDeltas()
 {
 }
 
+/// Checks each SIMD kernel matches the scalar one, and reports their throughput.
+void DeltaTests::testDeltaKernels()
+{
+    png_uint_32 height, width, rowBytes;
+    std::vector<char> text = DeltaTests::loadPng(TDOC "/delta-text.png", height, width, rowBytes);
+    std::vector<char> text2 = DeltaTests::loadPng(TDOC "/delta-text2.png", height, width, rowBytes);
+    LOK_ASSERT_EQUAL(text.size(), text2.size());
+
+    const auto *pixels = reinterpret_cast<const uint32_t *>(text.data());
+    const auto *pixels2 = reinterpret_cast<const uint32_t *>(text2.data());
+    const size_t count = width * height;
+
+    // Add some translucent pixels to exercise the unpremultiply math.
+    std::vector<uint32_t> translucent(pixels, pixels + count);
+    for (size_t i = 0; i < count; i += 7)
+        translucent[i] = (translucent[i] & 0x00ffffff) | ((i % 253) << 24);
+
+    const DeltaSimd::Kernels &scalar = DeltaSimd::getKernels(DeltaSimd::Isa::Scalar);
+    for (const auto isa : { DeltaSimd::Isa::Scalar, DeltaSimd::Isa::SSE2, DeltaSimd::Isa::AVX2 })
+    {
+        if (!DeltaSimd::isSupported(isa))
+            continue;
+
+        const DeltaSimd::Kernels &kernels = DeltaSimd::getKernels(isa);
+
+        // Row lengths that leave every possible tail.
+        std::vector<uint32_t> copy(width), copyScalar(width);
+        for (png_uint_32 rowWidth = 0; rowWidth <= width; rowWidth += 2)
+        {
+            const uint32_t *row = pixels + (rowWidth % height) * width;
+            LOK_ASSERT_EQUAL(scalar.copyWithCrc(copyScalar.data(), row, rowWidth),
+                             kernels.copyWithCrc(copy.data(), row, rowWidth));
+            LOK_ASSERT(std::equal(copy.begin(), copy.begin() + rowWidth, copyScalar.begin()));
+        }
+
+        for (size_t x = 0; x < count; x += 61)
+        {
+            const unsigned int len = std::min<size_t>(count - x, 300);
+            LOK_ASSERT_EQUAL(scalar.countSame(pixels + x, pixels2 + x, len),
+                             kernels.countSame(pixels + x, pixels2 + x, len));
+            LOK_ASSERT_EQUAL(scalar.countDiff(pixels + x, pixels2 + x, len),
+                             kernels.countDiff(pixels + x, pixels2 + x, len));
+        }
+
+        std::vector<unsigned char> rgba(count * 4), rgbaScalar(count * 4);
+        const auto *src = reinterpret_cast<const unsigned char *>(translucent.data());
+        scalar.unpremultCopy(rgbaScalar.data(), src, count);
+        kernels.unpremultCopy(rgba.data(), src, count);
+        LOK_ASSERT(rgba == rgbaScalar);
+
+        // Micro-benchmark each kernel over the tile.
+        constexpr int iterations = 200;
+        const double mpixels = double(count) * iterations / 1e6;
+        const auto report = [&](const char *kernel, std::chrono::steady_clock::time_point start)
+        {
+            const auto elapsed = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start);
+            std::cout << "Delta kernel " << kernels._name << ' ' << kernel << ": "
+                      << mpixels / elapsed.count() << " MPixel/s\n";
+        };
+
+        uint64_t crc = 0;
+        std::vector<uint32_t> tile(count);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+            for (png_uint_32 y = 0; y < height; ++y)
+                crc += kernels.copyWithCrc(tile.data() + y * width, pixels + y * width, width);
+        report("copyWithCrc", start);
+
+        size_t runs = 0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+            for (size_t x = 0; x < count; ++runs)
+            {
+                x += kernels.countSame(pixels + x, pixels2 + x, count - x);
+                x += kernels.countDiff(pixels + x, pixels2 + x, count - x);
+            }
+        report("countSame/Diff", start);
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+            kernels.unpremultCopy(rgba.data(), reinterpret_cast<const unsigned char *>(pixels),
+                                  count);
+        report("unpremultCopy", start);
+
+        // Keep the results alive.
+        LOK_ASSERT(crc != 0 || runs != 0 || rgba[0] != 1);
+    }
+}
+
+/// Compares the tile compression modes on the tile corpora, reporting bytes/tile and µs/tile.
+void DeltaTests::testTileCompression()
+{
+    constexpr auto testname = __func__;
+
+    // Split the test images into 256x256 tiles.
+    std::vector<std::vector<char>> tiles;
+    for (const char *name : { "/delta-text.png", "/delta-text2.png",
+                              "/calc_render_0_512x512.3840,0.7680x7680.png" })
+    {
+        png_uint_32 height, width, rowBytes;
+        std::vector<char> image = loadPng((std::string(TDOC) + name).c_str(), height, width, rowBytes);
+        for (png_uint_32 tileY = 0; tileY + 256 <= height; tileY += 256)
+        {
+            for (png_uint_32 tileX = 0; tileX + 256 <= width; tileX += 256)
+            {
+                std::vector<char> tile;
+                for (png_uint_32 y = tileY; y < tileY + 256; ++y)
+                    tile.insert(tile.end(), image.begin() + (y * width + tileX) * 4,
+                                image.begin() + (y * width + tileX + 256) * 4);
+                tiles.push_back(tile);
+            }
+        }
+    }
+    LOK_ASSERT_EQUAL(size_t(6), tiles.size());
+
+    for (const auto compression : { DeltaGenerator::Compression::Default,
+                                    DeltaGenerator::Compression::Fast,
+                                    DeltaGenerator::Compression::None })
+    {
+        DeltaGenerator gen;
+        gen.setCompression(compression);
+
+        constexpr int iterations = 20;
+        size_t bytes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            for (size_t t = 0; t < tiles.size(); ++t)
+            {
+                std::vector<char> output;
+                LOK_ASSERT(gen.compressOrDelta(reinterpret_cast<unsigned char *>(tiles[t].data()),
+                                               0, 0, 256, 256, 256, 256,
+                                               TileLocation(t, 0, 256, 0, 1), output, i + 1,
+                                               true) > 0);
+                LOK_ASSERT_EQUAL('Z', output[0]);
+                bytes += output.size();
+
+                // The keyframe must inflate back to the whole tile.
+                if (i == 0)
+                {
+                    Blob blob = std::make_shared<BlobData>(output.begin() + 1, output.end());
+                    Blob img = DeltaGenerator::expand(blob);
+                    LOK_ASSERT(img);
+                    LOK_ASSERT_EQUAL(size_t(256 * 256 * 4), img->size());
+                }
+            }
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+        const size_t count = iterations * tiles.size();
+        std::cout << "Tile compression " << static_cast<int>(compression) << ": " << bytes / count << " bytes/tile, "
+                  << double(elapsed.count()) / count << " us/tile\n";
+
+        // Deltas must still apply with either compression.
+        std::vector<char> delta;
+        LOK_ASSERT(gen.createDelta(reinterpret_cast<unsigned char *>(tiles[0].data()), 0, 0,
+                                   256, 256, 256, 256, TileLocation(1, 2, 3, 0, 1), delta, 1,
+                                   false) == false);
+        LOK_ASSERT(gen.createDelta(reinterpret_cast<unsigned char *>(tiles[1].data()), 0, 0,
+                                   256, 256, 256, 256, TileLocation(1, 2, 3, 0, 1), delta, 2,
+                                   false) == true);
+        std::vector<char> reText2 = applyDelta(tiles[0], 256, 256, delta, testname);
+        assertEqual(reText2, tiles[1], 256, 256, testname);
+    }
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(DeltaTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
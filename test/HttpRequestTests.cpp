@@ -21,7 +21,9 @@
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <fstream>
 #include <string>
+#include <vector>
 #include <test/lokassert.hpp>
 
 #if ENABLE_SSL
@@ -60,6 +62,8 @@ class HttpRequestTests final : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTimeout);
     CPPUNIT_TEST(testOnFinished_Complete);
     CPPUNIT_TEST(testOnFinished_Timeout);
+    CPPUNIT_TEST(testSessionPool);
+    CPPUNIT_TEST(testLargePost);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -76,6 +80,8 @@ class HttpRequestTests final : public CPPUNIT_NS::TestFixture
     void testTimeout();
     void testOnFinished_Complete();
     void testOnFinished_Timeout();
+    void testSessionPool();
+    void testLargePost();
 
     static constexpr std::chrono::seconds DefTimeoutSeconds{ 5 };
 
@@ -699,6 +705,120 @@ void HttpRequestTests::testOnFinished_Timeout()
     LOK_ASSERT(httpResponse->state() == http::Response::State::Timeout);
 }
 
+void HttpRequestTests::testSessionPool()
+{
+    constexpr auto testname = __func__;
+
+    const Poco::URI uri(_localUri);
+    const http::Session::Protocol protocol = helpers::haveSsl()
+                                                 ? http::Session::Protocol::HttpSsl
+                                                 : http::Session::Protocol::HttpUnencrypted;
+
+    auto pool = std::make_shared<http::SessionPool>(4, std::chrono::seconds(10));
+
+    // Each request gets a new Session, as the storage code does, but one connection.
+    constexpr int count = 5;
+    for (int i = 0; i < count; ++i)
+    {
+        const std::string body = "pooled" + std::to_string(i);
+        http::Request httpRequest("/echo/" + body);
+
+        auto httpSession = pool->create(uri.getHost(), protocol, uri.getPort());
+        httpSession->setTimeout(DefTimeoutSeconds);
+
+        const std::shared_ptr<const http::Response> httpResponse
+            = httpSession->syncRequest(httpRequest);
+        LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+        LOK_ASSERT_EQUAL(200U, httpResponse->statusLine().statusCode());
+        LOK_ASSERT_EQUAL(body, httpResponse->getBody());
+        LOK_ASSERT_EQUAL(static_cast<std::size_t>(1), pool->getIdleCount());
+    }
+
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(1), pool->getNewCount());
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(count - 1), pool->getReuseCount());
+
+    // An async request on another poll takes the same connection.
+    SocketPoll pollThread("PooledReqPoll");
+    pollThread.startThread();
+
+    auto httpSession = pool->create(uri.getHost(), protocol, uri.getPort());
+    httpSession->setTimeout(DefTimeoutSeconds);
+
+    std::condition_variable cv;
+    std::mutex mutex;
+    bool finished = false;
+    httpSession->setFinishedHandler([&](const std::shared_ptr<http::Session>&) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        cv.notify_all();
+    });
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        LOK_ASSERT(httpSession->asyncRequest(http::Request("/echo/async"), pollThread));
+        cv.wait_for(lock, DefTimeoutSeconds, [&]() { return finished; });
+    }
+
+    // The connection is moved back to the pool by the poll thread.
+    pollThread.joinThread();
+
+    LOK_ASSERT(httpSession->response()->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL(std::string("async"), httpSession->response()->getBody());
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(1), pool->getNewCount());
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(count), pool->getReuseCount());
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(1), pool->getIdleCount());
+
+    // Idle connections go away with the pool.
+    pool->clear();
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), pool->getIdleCount());
+}
+
+void HttpRequestTests::testLargePost()
+{
+    constexpr auto testname = __func__;
+
+    // Write the test data to file, far larger than any socket buffer.
+    constexpr std::size_t size = 32 * 1024 * 1024;
+    const std::string path = FileUtil::getSysTempDirectoryPath() + "/test_http_large_post";
+    uint64_t sum = 0;
+    {
+        std::vector<char> data(size);
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            data[i] = static_cast<char>((i * 7) % 253);
+            sum += static_cast<unsigned char>(data[i]);
+        }
+
+        std::ofstream ofs(path, std::ios::binary);
+        ofs.write(data.data(), data.size());
+    }
+
+    http::Request httpRequest("/count", http::Request::VERB_POST);
+    httpRequest.setBodyFile(path);
+
+    const uint64_t sendFileBytes = http::Request::getBodySendFileBytes();
+
+    auto httpSession = http::Session::create(_localUri);
+    httpSession->setTimeout(std::chrono::seconds(30));
+
+    const std::shared_ptr<const http::Response> httpResponse
+        = httpSession->syncRequest(httpRequest);
+    FileUtil::removeFile(path);
+
+    // The server got it all, as it was.
+    LOK_ASSERT(httpResponse->state() == http::Response::State::Complete);
+    LOK_ASSERT_EQUAL(200U, httpResponse->statusLine().statusCode());
+    LOK_ASSERT_EQUAL(std::to_string(size) + ':' + std::to_string(sum), httpResponse->getBody());
+
+    // Without ever buffering more than a socket buffer or so.
+    LOK_ASSERT(http::Request::getBodyBufferPeak() <= 2 * 1024 * 1024);
+
+    // Plain sockets don't buffer any of it.
+    if (!helpers::haveSsl())
+        LOK_ASSERT_EQUAL(static_cast<uint64_t>(size),
+                         http::Request::getBodySendFileBytes() - sendFileBytes);
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(HttpRequestTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -12,6 +12,7 @@
 #include <common/Log.hpp>
 #include <common/Util.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <string>
 
@@ -23,7 +24,12 @@ static_assert(false, "config.h must be included in the .cpp being compiled");
 class ServerRequestHandler final : public SimpleSocketHandler
 {
 public:
-    ServerRequestHandler() {}
+    ServerRequestHandler()
+        : _bodyRemaining(0)
+        , _bodyReceived(0)
+        , _bodySum(0)
+    {
+    }
 
 private:
     /// Set the socket associated with this ResponseClient.
@@ -46,6 +52,12 @@ private:
         LOG_TRC('#' << socket->getFD() << " handleIncomingMessage.");
 
         Buffer& data = socket->getInBuffer();
+        if (_bodyRemaining > 0)
+        {
+            readBody(socket);
+            return;
+        }
+
         LOG_TRC('#' << socket->getFD() << " handleIncomingMessage: buffer has ["
                     << std::string(data.data(), data.size()));
 
@@ -155,6 +167,14 @@ private:
                 socket->send(response);
             }
         }
+        else if (request.getVerb() == http::Request::VERB_POST && request.getUrl() == "/count")
+        {
+            // Counts the body, and sends back its size and the sum of its bytes.
+            _bodyRemaining = std::max<int64_t>(request.header().getContentLength(), 0);
+            _bodyReceived = 0;
+            _bodySum = 0;
+            readBody(socket);
+        }
         else
         {
             http::Response response(http::StatusLine(501));
@@ -163,6 +183,25 @@ private:
         }
     }
 
+    /// Consumes the body of a /count request, and responds once it has it all.
+    void readBody(const std::shared_ptr<StreamSocket>& socket)
+    {
+        Buffer& data = socket->getInBuffer();
+        const std::size_t len = std::min<std::size_t>(data.size(), _bodyRemaining);
+        for (std::size_t i = 0; i < len; ++i)
+            _bodySum += static_cast<unsigned char>(data.data()[i]);
+
+        data.eraseFirst(len);
+        _bodyReceived += len;
+        _bodyRemaining -= len;
+        if (_bodyRemaining == 0)
+        {
+            http::Response response(http::StatusLine(200));
+            response.setBody(std::to_string(_bodyReceived) + ':' + std::to_string(_bodySum));
+            socket->send(response);
+        }
+    }
+
     int getPollEvents(std::chrono::steady_clock::time_point /* now */,
                       int64_t& /* timeoutMaxMs */) override
     {
@@ -178,7 +217,7 @@ private:
             return;
         }
 
-        Buffer& out = socket->getOutBuffer();
+        ChunkedBuffer& out = socket->getOutBuffer();
         LOG_TRC("performWrites: " << out.size() << " bytes.");
         socket->flush();
     }
@@ -186,6 +225,10 @@ private:
 private:
     // The socket that owns us (we can't own it).
     std::weak_ptr<StreamSocket> _socket;
+    /// The state of the /count request body being read.
+    int64_t _bodyRemaining;
+    uint64_t _bodyReceived;
+    uint64_t _bodySum;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,414 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include <test/lokassert.hpp>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <net/Socket.hpp>
+
+/// SocketPoll backend tests, and a benchmark of many idle connections.
+class SocketPollTests : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(SocketPollTests);
+    CPPUNIT_TEST(testIdleConnections);
+    CPPUNIT_TEST(testPollWorker);
+    CPPUNIT_TEST(testSegmentedWrites);
+    CPPUNIT_TEST(testEPollSockets);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testIdleConnections();
+    void testPollWorker();
+    void testSegmentedWrites();
+    void testEPollSockets();
+};
+
+namespace
+{
+/// Counts the calls to handlePoll() of its socket, and the bytes read.
+class CountingHandler final : public SimpleSocketHandler
+{
+public:
+    CountingHandler()
+        : _dispatched(0)
+        , _received(0)
+    {
+    }
+
+    void onConnect(const std::shared_ptr<StreamSocket>& socket) override { _socket = socket; }
+
+    void handleIncomingMessage(SocketDisposition&) override
+    {
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        if (socket)
+        {
+            _received += socket->getInBuffer().size();
+            socket->getInBuffer().clear();
+        }
+    }
+
+    int getPollEvents(std::chrono::steady_clock::time_point, int64_t&) override { return POLLIN; }
+
+    void performWrites(std::size_t) override {}
+
+    // Called on each handlePoll() of a StreamSocket.
+    void checkTimeout(std::chrono::steady_clock::time_point) override { ++_dispatched; }
+
+    std::atomic<std::size_t> _dispatched;
+    std::atomic<std::size_t> _received;
+
+private:
+    std::weak_ptr<StreamSocket> _socket;
+};
+
+/// Counts its steps when run by a SocketPollWorker.
+class GuestPoll final : public SocketPoll
+{
+public:
+    GuestPoll(const std::string& name)
+        : SocketPoll(name)
+        , _steps(0)
+        , _stepThread(std::thread::id())
+    {
+    }
+
+    bool pollingStep(int64_t& timeoutMicroS, bool& pollSockets) override
+    {
+        ++_steps;
+        _stepThread = std::this_thread::get_id();
+        return SocketPoll::pollingStep(timeoutMicroS, pollSockets);
+    }
+
+    std::atomic<std::size_t> _steps;
+    std::atomic<std::thread::id> _stepThread;
+};
+
+struct BenchResult
+{
+    std::chrono::microseconds _elapsed;
+    std::size_t _idleDispatched;
+    std::size_t _busyReceived;
+};
+
+/// Drives @idleCount silent and @busyCount chatty socketpair connections
+/// through @rounds of polling with the given backend.
+BenchResult runBench(SocketPoll::PollBackend backend, std::size_t idleCount,
+                     std::size_t busyCount, std::size_t rounds)
+{
+    SocketPoll::setPollBackend(backend);
+
+    SocketPoll poll("PollBench");
+    poll.runOnClientThread();
+
+    std::vector<int> peers;
+    std::vector<std::shared_ptr<CountingHandler>> handlers;
+    for (std::size_t i = 0; i < idleCount + busyCount; ++i)
+    {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+            break;
+
+        auto handler = std::make_shared<CountingHandler>();
+        handlers.push_back(handler);
+        peers.push_back(fds[1]);
+        poll.insertNewSocket(StreamSocket::create<StreamSocket>("localhost", fds[0], false, handler));
+    }
+
+    // Take in the new sockets, then start counting.
+    poll.poll(std::chrono::microseconds(0));
+    for (auto& handler : handlers)
+        handler->_dispatched = 0;
+
+    const std::size_t busyStart = handlers.size() - std::min(busyCount, handlers.size());
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t round = 0; round < rounds; ++round)
+    {
+        for (std::size_t i = busyStart; i < peers.size(); ++i)
+        {
+            if (::write(peers[i], "x", 1) != 1)
+                std::cerr << "Failed to write to busy peer " << i << std::endl;
+        }
+
+        poll.poll(std::chrono::milliseconds(100));
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    BenchResult result{ elapsed, 0, 0 };
+    for (std::size_t i = 0; i < handlers.size(); ++i)
+    {
+        if (i < busyStart)
+            result._idleDispatched += handlers[i]->_dispatched;
+        else
+            result._busyReceived += handlers[i]->_received;
+    }
+
+    poll.removeSockets();
+    for (const int fd : peers)
+        ::close(fd);
+
+    SocketPoll::setPollBackend(SocketPoll::PollBackend::Poll);
+    return result;
+}
+}
+
+void SocketPollTests::testIdleConnections()
+{
+    constexpr auto testname = __func__;
+
+    // Two fds per connection, keep well within our limit.
+    rlimit limit;
+    LOK_ASSERT_EQUAL(0, ::getrlimit(RLIMIT_NOFILE, &limit));
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, 16384);
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+        ::getrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    constexpr std::size_t busyCount = 4;
+    constexpr std::size_t rounds = 200;
+    const std::size_t idleCount
+        = std::min<std::size_t>(4000, (limit.rlim_cur - 64) / 2) - busyCount;
+
+    const BenchResult poll = runBench(SocketPoll::PollBackend::Poll, idleCount, busyCount, rounds);
+    std::cout << "SocketPoll poll backend, " << idleCount << " idle + " << busyCount
+              << " busy connections, " << rounds << " rounds: " << poll._elapsed.count()
+              << " us, idle dispatches: " << poll._idleDispatched << std::endl;
+
+    // All the busy data is delivered, and every socket is dispatched each spin.
+    LOK_ASSERT_EQUAL(busyCount * rounds, poll._busyReceived);
+    LOK_ASSERT(poll._idleDispatched >= idleCount * rounds);
+
+#if ENABLE_EPOLL
+    const BenchResult epoll = runBench(SocketPoll::PollBackend::EPoll, idleCount, busyCount, rounds);
+    std::cout << "SocketPoll epoll backend, " << idleCount << " idle + " << busyCount
+              << " busy connections, " << rounds << " rounds: " << epoll._elapsed.count()
+              << " us, idle dispatches: " << epoll._idleDispatched << std::endl;
+
+    // Same data, but the idle sockets are only visited by the periodic sweep.
+    LOK_ASSERT_EQUAL(busyCount * rounds, epoll._busyReceived);
+    const std::size_t sweeps = 1 + epoll._elapsed / SocketPoll::IdleSweepMicroS;
+    LOK_ASSERT(epoll._idleDispatched <= idleCount * sweeps);
+#endif
+}
+
+void SocketPollTests::testPollWorker()
+{
+    constexpr auto testname = __func__;
+
+    auto worker = std::make_shared<SocketPollWorker>("PollWorker");
+    worker->startThread();
+
+    // A few polls, with a few connections each, all on the one thread.
+    constexpr std::size_t pollCount = 8;
+    constexpr std::size_t socketCount = 4;
+    std::vector<std::unique_ptr<GuestPoll>> polls;
+    std::vector<std::shared_ptr<CountingHandler>> handlers;
+    std::vector<int> peers;
+    for (std::size_t i = 0; i < pollCount; ++i)
+    {
+        polls.push_back(std::make_unique<GuestPoll>("Guest" + std::to_string(i)));
+        polls.back()->setWorker(worker);
+        LOK_ASSERT(polls.back()->startThread());
+
+        for (std::size_t j = 0; j < socketCount; ++j)
+        {
+            int fds[2];
+            LOK_ASSERT_EQUAL(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                             0, fds));
+            auto handler = std::make_shared<CountingHandler>();
+            handlers.push_back(handler);
+            peers.push_back(fds[1]);
+            polls.back()->insertNewSocket(
+                StreamSocket::create<StreamSocket>("localhost", fds[0], false, handler));
+        }
+    }
+
+    LOK_ASSERT_EQUAL(pollCount, worker->getGuestCount());
+
+    constexpr std::size_t rounds = 10;
+    for (std::size_t round = 0; round < rounds; ++round)
+    {
+        for (const int fd : peers)
+            LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(fd, "x", 1));
+    }
+
+    // Every socket gets all its data, with no thread of its own.
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    std::size_t received = 0;
+    while (received < rounds * peers.size() && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        received = 0;
+        for (const auto& handler : handlers)
+            received += handler->_received;
+    }
+
+    LOK_ASSERT_EQUAL(rounds * peers.size(), received);
+
+    for (const auto& poll : polls)
+    {
+        LOK_ASSERT(poll->isAlive());
+        LOK_ASSERT(poll->_steps > 0);
+        LOK_ASSERT(poll->_stepThread.load() == worker->getThreadOwner());
+    }
+
+    // The polls finish and detach, and the worker goes on.
+    for (auto& poll : polls)
+    {
+        poll->joinThread();
+        LOK_ASSERT(!poll->isAlive());
+    }
+
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), worker->getGuestCount());
+    LOK_ASSERT(worker->isAlive());
+
+    polls.clear();
+    worker->joinThread();
+    for (const int fd : peers)
+        ::close(fd);
+}
+
+void SocketPollTests::testSegmentedWrites()
+{
+    constexpr auto testname = __func__;
+
+    int fds[2];
+    LOK_ASSERT_EQUAL(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+
+    SocketPoll poll("SegmentedWrites");
+    poll.runOnClientThread();
+    auto handler = std::make_shared<CountingHandler>();
+    auto socket = StreamSocket::create<StreamSocket>("localhost", fds[0], false, handler);
+    poll.insertNewSocket(socket);
+    poll.poll(std::chrono::microseconds(0));
+
+    // Many small messages and shared blobs, more than the kernel takes at once.
+    std::string expected;
+    std::vector<std::shared_ptr<std::vector<char>>> blobs;
+    for (int i = 0; i < 200; ++i)
+    {
+        const std::string message = "message " + std::to_string(i) + '\n';
+        socket->getOutBuffer().append(message);
+        expected += message;
+
+        auto blob = std::make_shared<std::vector<char>>(8192 + i, static_cast<char>('a' + i % 26));
+        socket->getOutBuffer().append(blob, blob->data(), blob->size());
+        expected.append(blob->data(), blob->size());
+        blobs.push_back(blob);
+    }
+
+    blobs.clear(); // The buffer keeps them alive.
+
+    std::string received;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (received.size() < expected.size() && std::chrono::steady_clock::now() < deadline)
+    {
+        poll.poll(std::chrono::milliseconds(10));
+
+        char buf[64 * 1024];
+        const ssize_t len = ::read(fds[1], buf, sizeof(buf));
+        if (len > 0)
+            received.append(buf, len);
+    }
+
+    LOK_ASSERT_EQUAL(expected.size(), received.size());
+    LOK_ASSERT(expected == received);
+    LOK_ASSERT(socket->getOutBuffer().empty());
+
+    poll.removeSockets();
+    ::close(fds[1]);
+}
+
+void SocketPollTests::testEPollSockets()
+{
+#if ENABLE_EPOLL
+    constexpr auto testname = __func__;
+
+    SocketPoll::setPollBackend(SocketPoll::PollBackend::EPoll);
+
+    SocketPoll first("EPollFirst");
+    first.runOnClientThread();
+    SocketPoll second("EPollSecond");
+    second.runOnClientThread();
+
+    std::vector<int> peers;
+    std::vector<std::shared_ptr<CountingHandler>> handlers;
+    std::vector<std::shared_ptr<StreamSocket>> sockets;
+    for (int i = 0; i < 3; ++i)
+    {
+        int fds[2];
+        LOK_ASSERT_EQUAL(0, ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                         0, fds));
+        handlers.push_back(std::make_shared<CountingHandler>());
+        peers.push_back(fds[1]);
+        sockets.push_back(
+            StreamSocket::create<StreamSocket>("localhost", fds[0], false, handlers.back()));
+        first.insertNewSocket(sockets.back());
+    }
+
+    first.poll(std::chrono::microseconds(0));
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(3), first.getSocketCount());
+
+    // Polls until @handler has @count bytes, or gives up.
+    const auto waitReceived = [](SocketPoll& poll, const CountingHandler& handler,
+                                 std::size_t count)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (handler._received < count && std::chrono::steady_clock::now() < deadline)
+            poll.poll(std::chrono::milliseconds(10));
+        return handler._received.load();
+    };
+
+    // The first socket goes, the events of the others still reach them.
+    ::close(peers[0]);
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (first.getSocketCount() > 2 && std::chrono::steady_clock::now() < deadline)
+        first.poll(std::chrono::milliseconds(10));
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(2), first.getSocketCount());
+
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[2], "x", 1));
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(1), waitReceived(first, *handlers[2], 1));
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), handlers[1]->_received.load());
+
+    // A socket moves to another epoll set, and back.
+    first.removeSockets();
+    second.insertNewSocket(sockets[1]);
+    second.poll(std::chrono::microseconds(0));
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[1], "x", 1));
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(1), waitReceived(second, *handlers[1], 1));
+
+    second.removeSockets();
+    first.insertNewSocket(sockets[1]);
+    first.poll(std::chrono::microseconds(0));
+    LOK_ASSERT_EQUAL(static_cast<ssize_t>(1), ::write(peers[1], "x", 1));
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(2), waitReceived(first, *handlers[1], 2));
+
+    first.removeSockets();
+    ::close(peers[1]);
+    ::close(peers[2]);
+
+    SocketPoll::setPollBackend(SocketPoll::PollBackend::Poll);
+#endif
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SocketPollTests);
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,221 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include <test/lokassert.hpp>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <net/Socket.hpp>
+#if ENABLE_SSL
+#include <net/SslSocket.hpp>
+#endif
+
+/// SslStreamSocket tests, and a loopback throughput benchmark with and without kTLS,
+/// when COOL_BENCHMARK is set.
+class SslSocketTests : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(SslSocketTests);
+    CPPUNIT_TEST(testKtlsThroughput);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testKtlsThroughput();
+};
+
+#if ENABLE_SSL
+namespace
+{
+constexpr std::size_t BlobSize = 256 * 1024;
+
+/// Sends @total bytes of a shared blob as fast as the socket takes them.
+class BlastHandler final : public SimpleSocketHandler
+{
+public:
+    BlastHandler(std::size_t total)
+        : _blob(std::make_shared<std::vector<char>>(BlobSize))
+        , _remaining(total)
+    {
+        for (std::size_t i = 0; i < BlobSize; ++i)
+            (*_blob)[i] = static_cast<char>(i % 251);
+    }
+
+    void onConnect(const std::shared_ptr<StreamSocket>& socket) override { _socket = socket; }
+
+    void handleIncomingMessage(SocketDisposition&) override
+    {
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        if (socket)
+            socket->getInBuffer().clear();
+    }
+
+    int getPollEvents(std::chrono::steady_clock::time_point, int64_t&) override
+    {
+        return POLLIN | (_remaining > 0 ? POLLOUT : 0);
+    }
+
+    void performWrites(std::size_t) override
+    {
+        std::shared_ptr<StreamSocket> socket = _socket.lock();
+        if (!socket)
+            return;
+
+        // Keep a few blobs queued, without copying them.
+        ChunkedBuffer& out = socket->getOutBuffer();
+        while (_remaining > 0 && out.size() < 4 * BlobSize)
+        {
+            const std::size_t len = std::min(_remaining, BlobSize);
+            out.append(_blob, _blob->data(), len);
+            _remaining -= len;
+        }
+    }
+
+private:
+    std::weak_ptr<StreamSocket> _socket;
+    std::shared_ptr<std::vector<char>> _blob;
+    std::size_t _remaining;
+};
+
+struct BenchResult
+{
+    std::chrono::microseconds _elapsed;
+    std::size_t _received;
+    bool _valid;
+    bool _ktls;
+};
+
+/// Serves @total bytes over a loopback TCP connection from an SslStreamSocket,
+/// read by a blocking OpenSSL client, with kTLS as given by @ktls.
+BenchResult runBench(bool ktls, std::size_t total)
+{
+    BenchResult result{ std::chrono::microseconds(0), 0, true, false };
+
+    ssl::Manager::setServerKtls(ktls);
+
+    const int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&addr), addrLen) < 0
+        || ::listen(listener, 1) < 0
+        || ::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addrLen) < 0)
+    {
+        result._valid = false;
+        return result;
+    }
+
+    const int clientFd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (::connect(clientFd, reinterpret_cast<sockaddr*>(&addr), addrLen) < 0)
+    {
+        result._valid = false;
+        ::close(clientFd);
+        ::close(listener);
+        return result;
+    }
+
+    const int serverFd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    ::close(listener);
+
+    SocketPoll poll("KtlsBench");
+    poll.startThread();
+    auto socket = StreamSocket::create<SslStreamSocket>(std::string(), serverFd, false,
+                                                        std::make_shared<BlastHandler>(total));
+    poll.insertNewSocket(socket);
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    SSL* ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, clientFd);
+
+    if (SSL_connect(ssl) == 1)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<char> buf(64 * 1024);
+        while (result._received < total)
+        {
+            const int len = SSL_read(ssl, buf.data(), buf.size());
+            if (len <= 0)
+                break;
+
+            // Every byte is where the blob puts it.
+            for (int i = 0; i < len; ++i)
+            {
+                const std::size_t offset = (result._received + i) % BlobSize;
+                result._valid = result._valid && buf[i] == static_cast<char>(offset % 251);
+            }
+
+            result._received += len;
+        }
+
+        result._elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+    }
+
+    poll.joinThread();
+    result._ktls = socket->isKtlsSend();
+    socket.reset();
+
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    ::close(clientFd);
+
+    ssl::Manager::setServerKtls(false);
+    return result;
+}
+}
+#endif
+
+void SslSocketTests::testKtlsThroughput()
+{
+#if ENABLE_SSL
+    constexpr auto testname = __func__;
+
+    if (!ssl::Manager::isServerContextInitialized())
+    {
+        std::cerr << "No server SslContext, skipping " << testname << std::endl;
+        return;
+    }
+
+    // A few megabytes check correctness; set COOL_BENCHMARK to measure throughput.
+    const bool benchmark = std::getenv("COOL_BENCHMARK") != nullptr;
+    const std::size_t total = (benchmark ? 256 : 4) * 1024 * 1024;
+    for (const bool ktls : { false, true })
+    {
+        const BenchResult result = runBench(ktls, total);
+        LOK_ASSERT_EQUAL(total, result._received);
+        LOK_ASSERT(result._valid);
+
+        // Without kTLS in the kernel (the tls module), OpenSSL quietly does the work.
+        LOK_ASSERT(ktls || !result._ktls);
+
+        if (!benchmark)
+            continue;
+
+        const double seconds = std::max<double>(result._elapsed.count(), 1) / 1e6;
+        std::cout << "TLS loopback, kTLS " << (ktls ? "requested" : "off") << " ("
+                  << (result._ktls ? "active" : "inactive") << "): " << total / (1024 * 1024)
+                  << " MB in " << result._elapsed.count() << " us, "
+                  << static_cast<int>(total / (1024 * 1024) / seconds) << " MB/s" << std::endl;
+    }
+#endif
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SslSocketTests);
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
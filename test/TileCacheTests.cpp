@@ -27,6 +27,8 @@
 #include <countcoolkits.hpp>
 #include <helpers.hpp>
 #include <test.hpp>
+#include <chrono>
+#include <limits>
 #include <sstream>
 #include <random>
 
@@ -68,6 +70,8 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testDesc);
     CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testInvalidateScaling);
+    CPPUNIT_TEST(testEvictionPolicy);
     CPPUNIT_TEST(testSimpleCombine);
     CPPUNIT_TEST(testSize);
     CPPUNIT_TEST(testCancelTiles);
@@ -105,6 +109,8 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
 
     void testDesc();
     void testSimple();
+    void testInvalidateScaling();
+    void testEvictionPolicy();
     void testSimpleCombine();
     void testSize();
     void testCancelTiles();
@@ -270,6 +276,135 @@ void TileCacheTests::testSimple()
     LOK_ASSERT_MESSAGE("found tile when none was expected", !tileData || !tileData->isValid());
 }
 
+void TileCacheTests::testInvalidateScaling()
+{
+    constexpr auto testname = __func__;
+
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    const int nviewid = 0;
+    const std::vector<int> tileSizes = { 1920, 3840, 7680 };
+    std::vector<char> data = genRandomData(64);
+    data[0] = 'Z';
+
+    // A few parts at a few zoom levels, growing the number of pages.
+    for (const int rows : { 16, 128, 512 })
+    {
+        TileCache tc("doc.odt", std::chrono::system_clock::time_point());
+        tc.setMaxCacheSize(std::numeric_limits<size_t>::max());
+
+        size_t count = 0;
+        for (int part = 0; part < 4; ++part)
+        {
+            for (const int tileSize : tileSizes)
+            {
+                const int scaledRows = rows * 3840 / tileSize;
+                for (int row = 0; row < scaledRows; ++row)
+                {
+                    for (int col = 0; col < 4 * 3840 / tileSize; ++col)
+                    {
+                        TileDesc tile(nviewid, part, 256, 256, col * tileSize, row * tileSize,
+                                      tileSize, tileSize, -1, 0, -1, false);
+                        tc.saveTileAndNotify(tile, data.data(), data.size());
+                        ++count;
+                    }
+                }
+            }
+        }
+
+        // Invalidate a small area, as when typing.
+        constexpr int iterations = 1000;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+        {
+            const int y = (i * 7919) % (rows * 3840);
+            tc.invalidateTiles("invalidatetiles: part=0 x=4000 y=" + std::to_string(y) +
+                                   " width=500 height=200",
+                               nviewid);
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+        std::cout << "TileCache invalidation with " << count << " tiles: "
+                  << elapsed.count() / double(iterations) << " us\n";
+
+        // Only the intersecting tiles are hit.
+        const int y = 3840 * (rows / 2) + 100;
+        TileDesc hit(nviewid, 0, 256, 256, 3840, 3840 * (rows / 2), 3840, 3840, -1, 0, -1, false);
+        TileDesc otherPart(nviewid, 1, 256, 256, 3840, 3840 * (rows / 2), 3840, 3840, -1, 0, -1, false);
+        TileDesc otherRow(nviewid, 0, 256, 256, 3840, 3840 * (rows / 2 + 2), 3840, 3840, -1, 0, -1, false);
+        TileDesc otherColumn(nviewid, 0, 256, 256, 3 * 3840, 3840 * (rows / 2), 3840, 3840, -1, 0, -1, false);
+        tc.saveTileAndNotify(hit, data.data(), data.size());
+        tc.saveTileAndNotify(otherRow, data.data(), data.size());
+        tc.saveTileAndNotify(otherColumn, data.data(), data.size());
+        tc.invalidateTiles("invalidatetiles: part=0 x=4000 y=" + std::to_string(y) +
+                               " width=500 height=200",
+                           nviewid);
+
+        LOK_ASSERT(!tc.lookupTile(hit)->isValid());
+        LOK_ASSERT(tc.lookupTile(otherPart)->isValid());
+        LOK_ASSERT(tc.lookupTile(otherRow)->isValid());
+        LOK_ASSERT(tc.lookupTile(otherColumn)->isValid());
+
+        tc.invalidateTiles("invalidatetiles: EMPTY", nviewid);
+        LOK_ASSERT(!tc.lookupTile(otherPart)->isValid());
+        LOK_ASSERT(!tc.lookupTile(otherRow)->isValid());
+    }
+}
+
+void TileCacheTests::testEvictionPolicy()
+{
+    constexpr auto testname = __func__;
+
+    if (isStandalone())
+    {
+        if (!UnitWSD::init(UnitWSD::UnitType::Wsd, ""))
+            throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    std::vector<char> data = genRandomData(1024);
+    data[0] = 'Z';
+
+    const auto makeTile = [](int row)
+    {
+        return TileDesc(0, 0, 256, 256, 0, row * 3840, 3840, 3840, -1, 0, -1, false);
+    };
+
+    for (const auto policy : { TileCache::EvictionPolicy::LRU, TileCache::EvictionPolicy::Viewport })
+    {
+        TileCache tc("doc.odt", std::chrono::system_clock::time_point());
+        // Rows 10 and 11 are in view.
+        tc.setEvictionPolicy(policy, [](const TileDesc& tile)
+                             { return tile.getTilePosY() >= 10 * 3840 && tile.getTilePosY() < 12 * 3840; });
+        tc.setMaxCacheSize(std::numeric_limits<size_t>::max());
+
+        for (int row = 0; row < 32; ++row)
+            tc.saveTileAndNotify(makeTile(row), data.data(), data.size());
+
+        // Use the first tiles again, so they are the most recent.
+        for (int row = 0; row < 4; ++row)
+            LOK_ASSERT(tc.lookupTile(makeTile(row))->isValid());
+        LOK_ASSERT(!tc.lookupTile(makeTile(100)));
+        LOK_ASSERT_EQUAL(uint64_t(4), tc.getStats()._hits);
+        LOK_ASSERT_EQUAL(uint64_t(1), tc.getStats()._misses);
+
+        // Each of these evicts an eighth of what we have now.
+        tc.setMaxCacheSize(tc.getMemorySize() / 2);
+        tc.saveTileAndNotify(makeTile(32), data.data(), data.size());
+
+        LOK_ASSERT(tc.getStats()._evictions > 0);
+        for (int row = 0; row < 4; ++row)
+            LOK_ASSERT_MESSAGE("recently used tile evicted", tc.lookupTile(makeTile(row)));
+        LOK_ASSERT_MESSAGE("least recently used tile kept", !tc.lookupTile(makeTile(4)));
+
+        const bool inView = tc.lookupTile(makeTile(10)) && tc.lookupTile(makeTile(11));
+        LOK_ASSERT_EQUAL(policy == TileCache::EvictionPolicy::Viewport, inView);
+    }
+}
+
 void TileCacheTests::testSimpleCombine()
 {
     const std::string testname = "simpleCombine-";
@@ -26,6 +26,8 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testTileRecombining);
     CPPUNIT_TEST(testViewOrder);
     CPPUNIT_TEST(testPreviewsDeprioritization);
+    CPPUNIT_TEST(testCancelTiles);
+    CPPUNIT_TEST(testVisibleAreaPriority);
     CPPUNIT_TEST(testSenderQueue);
     CPPUNIT_TEST(testSenderQueueTileDeduplication);
     CPPUNIT_TEST(testInvalidateViewCursorDeduplication);
@@ -41,6 +43,8 @@ class TileQueueTests : public CPPUNIT_NS::TestFixture
     void testTileRecombining();
     void testViewOrder();
     void testPreviewsDeprioritization();
+    void testCancelTiles();
+    void testVisibleAreaPriority();
     void testSenderQueue();
     void testSenderQueueTileDeduplication();
     void testInvalidateViewCursorDeduplication();
@@ -142,7 +146,7 @@ void TileQueueTests::testTileRecombining()
     queue.put("tilecombine nviewid=0 part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840");
 
     // the tilecombine's get merged, resulting in 3 "tile" messages
-    LOK_ASSERT_EQUAL(3, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(3, static_cast<int>(queue.size()));
 
     // but when we later extract that, it is just one "tilecombine" message
     LOK_ASSERT_EQUAL_STR(
@@ -151,7 +155,7 @@ void TileQueueTests::testTileRecombining()
         queue.get());
 
     // and nothing remains in the queue
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
 }
 
 void TileQueueTests::testViewOrder()
@@ -179,7 +183,7 @@ void TileQueueTests::testViewOrder()
     for (auto &tile : tiles)
         queue.put(tile);
 
-    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.size()));
 
     // should result in the 3, 2, 1, 0 order of the tiles thanks to the cursor
     // positions
@@ -213,7 +217,7 @@ void TileQueueTests::testPreviewsDeprioritization()
     }
 
     // stays empty after all is done
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
 
     // re-ordering case - put previews and normal tiles to the queue and get
     // everything back again but this time the tiles have to interleave with
@@ -240,7 +244,7 @@ void TileQueueTests::testPreviewsDeprioritization()
     LOK_ASSERT_EQUAL_STR(previews[3], queue.get());
 
     // stays empty after all is done
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
 
     // cursor positioning case - the cursor position should not prioritize the
     // previews
@@ -253,7 +257,104 @@ void TileQueueTests::testPreviewsDeprioritization()
     LOK_ASSERT_EQUAL_STR(previews[0], queue.get());
 
     // stays empty after all is done
-    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
+}
+
+void TileQueueTests::testCancelTiles()
+{
+    constexpr auto testname = __func__;
+
+    TileQueue queue;
+
+    const std::vector<std::string> tiles =
+    {
+        "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=12",
+        "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=253440 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=123",
+        "tile nviewid=0 part=0 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=12 id=0"
+    };
+
+    for (auto &tile : tiles)
+        queue.put(tile);
+
+    LOK_ASSERT_EQUAL(3, static_cast<int>(queue.size()));
+
+    // only the tile of exactly that version goes, and not the preview
+    queue.put("canceltiles 12");
+
+    LOK_ASSERT_EQUAL(2, static_cast<int>(queue.size()));
+    LOK_ASSERT_EQUAL_STR(tiles[1], queue.get());
+    LOK_ASSERT_EQUAL_STR(tiles[2], queue.get());
+
+    // a newer request for the same tile replaces the older one, and its version
+    queue.put(tiles[0]);
+    queue.put("tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=13");
+    queue.put("canceltiles 12");
+
+    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.size()));
+
+    queue.put("canceltiles 11,13");
+
+    LOK_ASSERT_EQUAL(0, static_cast<int>(queue.size()));
+}
+
+void TileQueueTests::testVisibleAreaPriority()
+{
+    constexpr auto testname = __func__;
+
+    TileQueue queue;
+
+    const std::vector<std::string> tiles =
+    {
+        "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=-1",
+        "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=253440 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=-1",
+        "tile nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=261120 tilewidth=3840 tileheight=3840 oldwid=0 wid=0 ver=-1"
+    };
+
+    // the tiles the view shows go first
+    queue.updateVisibleArea(0, 0, 0, 250000, 10000, 20000);
+
+    queue.put(tiles[0]);
+    queue.put(tiles[1]);
+
+    LOK_ASSERT_EQUAL_STR(tiles[1], queue.get());
+    LOK_ASSERT_EQUAL_STR(tiles[0], queue.get());
+
+    // and of those, the nearest to the cursor
+    queue.updateCursorPosition(0, 0, 0, 280000, 10, 100);
+
+    queue.put(tiles[0]);
+    queue.put(tiles[1]);
+    queue.put(tiles[2]);
+
+    LOK_ASSERT_EQUAL_STR(tiles[2], queue.get());
+    LOK_ASSERT_EQUAL_STR(tiles[1], queue.get());
+    LOK_ASSERT_EQUAL_STR(tiles[0], queue.get());
+
+    // when the view goes, so does its area
+    queue.removeCursorPosition(0);
+
+    queue.put(tiles[0]);
+    queue.put(tiles[1]);
+
+    LOK_ASSERT_EQUAL_STR(tiles[0], queue.get());
+    LOK_ASSERT_EQUAL_STR(tiles[1], queue.get());
+
+    // the area is of one part only
+    queue.updateVisibleArea(1, 1, 0, 250000, 10000, 20000);
+
+    queue.put(tiles[0]);
+    queue.put(tiles[1]);
+
+    LOK_ASSERT_EQUAL_STR(tiles[0], queue.get());
+    LOK_ASSERT_EQUAL_STR(tiles[1], queue.get());
+
+    queue.updateVisibleAreaPart(1, 0);
+
+    queue.put(tiles[0]);
+    queue.put(tiles[1]);
+
+    LOK_ASSERT_EQUAL_STR(tiles[1], queue.get());
+    LOK_ASSERT_EQUAL_STR(tiles[0], queue.get());
 }
 
 void TileQueueTests::testSenderQueue()
@@ -420,7 +521,7 @@ void TileQueueTests::testCallbackInvalidation()
     queue.put("callback all 0 284, 1418, 11105, 275, 0");
     queue.put("callback all 0 4299, 1418, 7090, 275, 0");
 
-    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.size()));
 
     LOK_ASSERT_EQUAL_STR("callback all 0 284, 1418, 11105, 275, 0", queue.get());
 
@@ -430,11 +531,11 @@ void TileQueueTests::testCallbackInvalidation()
     queue.put("callback all 0 4299, 10418, 7090, 275, 0");
     queue.put("callback all 0 4299, 20418, 7090, 275, 0");
 
-    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(4, static_cast<int>(queue.size()));
 
     queue.put("callback all 0 EMPTY, 0");
 
-    LOK_ASSERT_EQUAL(2, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(2, static_cast<int>(queue.size()));
     LOK_ASSERT_EQUAL_STR("callback all 0 4299, 1418, 7090, 275, 1", queue.get());
     LOK_ASSERT_EQUAL_STR("callback all 0 EMPTY, 0", queue.get());
 }
@@ -449,7 +550,7 @@ void TileQueueTests::testCallbackIndicatorValue()
     queue.put("callback all 10 25");
     queue.put("callback all 10 50");
 
-    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.size()));
     LOK_ASSERT_EQUAL_STR("callback all 10 50", queue.get());
 }
 
@@ -463,7 +564,7 @@ void TileQueueTests::testCallbackPageSize()
     queue.put("callback all 13 12474, 188626");
     queue.put("callback all 13 12474, 205748");
 
-    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.getQueue().size()));
+    LOK_ASSERT_EQUAL(1, static_cast<int>(queue.size()));
     LOK_ASSERT_EQUAL_STR("callback all 13 12474, 205748", queue.get());
 }
 
@@ -488,7 +589,7 @@ void TileQueueTests::testCallbackModifiedStatusIsSkipped()
         queue.put(msg);
     }
 
-    LOK_ASSERT_EQUAL(static_cast<size_t>(4), queue.getQueue().size());
+    LOK_ASSERT_EQUAL(static_cast<size_t>(4), queue.size());
 
     LOK_ASSERT_EQUAL_STR(messages[0], queue.get());
     LOK_ASSERT_EQUAL_STR(messages[1], queue.get());
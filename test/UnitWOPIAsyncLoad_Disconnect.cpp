@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include <mutex>
+#include <vector>
+
+#include "HttpRequest.hpp"
+#include "Util.hpp"
+#include "lokassert.hpp"
+
+#include <WopiTestServer.hpp>
+#include <COOLWSD.hpp>
+#include <Log.hpp>
+#include <Unit.hpp>
+#include <UnitHTTP.hpp>
+#include <helpers.hpp>
+#include <Poco/Net/HTTPRequest.h>
+
+/// Test disconnecting while the document is loading.
+/// Two sessions join and we hold their CheckFileInfo
+/// responses until the first one disconnects. The late
+/// file info of the first must be dropped, the second
+/// must load, and the document must unload cleanly
+/// once the second disconnects too.
+class UnitWOPIAsyncLoad_Disconnect : public WopiTestServer
+{
+    STATE_ENUM(Phase, Load, WaitCheckFileInfo, WaitRemoveSession, ReleaseCheckFileInfo,
+               WaitLoadStatus, WaitDestroy)
+    _phase;
+
+    /// Guards the held CheckFileInfo requests, which are
+    /// received on the server poll and released by the test.
+    std::mutex _mutex;
+    std::vector<std::pair<std::shared_ptr<StreamSocket>, std::string>> _held;
+
+public:
+    UnitWOPIAsyncLoad_Disconnect()
+        : WopiTestServer("UnitWOPIAsyncLoad_Disconnect")
+        , _phase(Phase::Load)
+    {
+    }
+
+    bool handleCheckFileInfoRequest(const Poco::Net::HTTPRequest& request,
+                                    std::shared_ptr<StreamSocket>& socket) override
+    {
+        LOG_TST("Holding the CheckFileInfo response");
+        std::lock_guard<std::mutex> lock(_mutex);
+        _held.emplace_back(socket, request.getURI());
+        return true;
+    }
+
+    void assertGetFileRequest(const Poco::Net::HTTPRequest& /*request*/) override
+    {
+        LOK_ASSERT_MESSAGE("Expected to be in Phase::WaitLoadStatus",
+                           _phase == Phase::WaitLoadStatus);
+    }
+
+    void onDocBrokerRemoveSession(const std::string& docKey,
+                                  const std::shared_ptr<ClientSession>& session) override
+    {
+        LOG_TST("Removed session [" << session->getId() << "] from [" << docKey << ']');
+        if (_phase == Phase::WaitRemoveSession)
+            TRANSITION_STATE(_phase, Phase::ReleaseCheckFileInfo);
+    }
+
+    bool onDocumentLoaded(const std::string& message) override
+    {
+        LOG_TST("Doc (" << toString(_phase) << "): [" << message << ']');
+        LOK_ASSERT_MESSAGE("Expected to be in Phase::WaitLoadStatus",
+                           _phase == Phase::WaitLoadStatus);
+
+        LOK_ASSERT_EQUAL(std::size_t(2), getCountCheckFileInfo());
+        LOK_ASSERT_EQUAL(std::size_t(1), getCountGetFile());
+
+        TRANSITION_STATE(_phase, Phase::WaitDestroy);
+
+        LOG_TST("Closing the second connection.");
+        deleteSocketAt(1);
+
+        return true;
+    }
+
+    void onDocBrokerDestroy(const std::string& docKey) override
+    {
+        LOK_ASSERT_MESSAGE("Expected to be in Phase::WaitDestroy", _phase == Phase::WaitDestroy);
+        passTest("Document [" + docKey + "] loaded for the remaining session and closed cleanly.");
+    }
+
+    void invokeWSDTest() override
+    {
+        switch (_phase)
+        {
+            case Phase::Load:
+            {
+                TRANSITION_STATE(_phase, Phase::WaitCheckFileInfo);
+
+                LOG_TST("Load: initWebsocket.");
+                initWebsocket("/wopi/files/0?access_token=anything");
+                addWebSocket();
+
+                WSD_CMD_BY_CONNECTION_INDEX(0, "load url=" + getWopiSrc());
+                WSD_CMD_BY_CONNECTION_INDEX(1, "load url=" + getWopiSrc());
+                break;
+            }
+            case Phase::WaitCheckFileInfo:
+            {
+                {
+                    // Wait for both sessions to check the file info.
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (_held.size() < 2)
+                        break;
+                }
+
+                TRANSITION_STATE(_phase, Phase::WaitRemoveSession);
+
+                LOG_TST("Closing the first connection while loading.");
+                deleteSocketAt(0);
+                break;
+            }
+            case Phase::WaitRemoveSession:
+                break;
+            case Phase::ReleaseCheckFileInfo:
+            {
+                TRANSITION_STATE(_phase, Phase::WaitLoadStatus);
+
+                LOG_TST("Releasing the CheckFileInfo responses");
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (auto& held : _held)
+                {
+                    std::shared_ptr<StreamSocket> socket = std::move(held.first);
+                    const std::string uri = held.second;
+                    COOLWSD::getWebServerPoll()->addCallback(
+                        [this, socket, uri]() mutable
+                        {
+                            Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri);
+                            WopiTestServer::handleCheckFileInfoRequest(request, socket);
+                        });
+                }
+
+                _held.clear();
+                break;
+            }
+            case Phase::WaitLoadStatus:
+                break;
+            case Phase::WaitDestroy:
+                break;
+        }
+    }
+};
+
+UnitBase* unit_create_wsd(void) { return new UnitWOPIAsyncLoad_Disconnect(); }
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,142 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include "HttpRequest.hpp"
+#include "Util.hpp"
+#include "lokassert.hpp"
+
+#include <WopiTestServer.hpp>
+#include <Log.hpp>
+#include <Unit.hpp>
+#include <UnitHTTP.hpp>
+#include <helpers.hpp>
+#include <Poco/Net/HTTPRequest.h>
+
+/// Test failing to load from storage.
+/// First CheckFileInfo fails, then, on loading
+/// again, GetFile fails. Each time the client
+/// must get the error as the connection is
+/// closed, and the document must unload cleanly.
+class UnitWOPIAsyncLoad_Fail : public WopiTestServer
+{
+    STATE_ENUM(Phase, FailCheckFileInfo, WaitCheckFileInfoDestroy, FailGetFile,
+               WaitGetFileDestroy)
+    _phase;
+
+public:
+    UnitWOPIAsyncLoad_Fail()
+        : WopiTestServer("UnitWOPIAsyncLoad_Fail")
+        , _phase(Phase::FailCheckFileInfo)
+    {
+    }
+
+    bool handleCheckFileInfoRequest(const Poco::Net::HTTPRequest& request,
+                                    std::shared_ptr<StreamSocket>& socket) override
+    {
+        if (_phase == Phase::WaitCheckFileInfoDestroy)
+        {
+            LOG_TST("Failing CheckFileInfo");
+            http::Response httpResponse(http::StatusLine(500));
+            httpResponse.set("Content-Length", "0");
+            socket->sendAndShutdown(httpResponse);
+            return true;
+        }
+
+        return WopiTestServer::handleCheckFileInfoRequest(request, socket);
+    }
+
+    bool handleGetFileRequest(const Poco::Net::HTTPRequest& /*request*/,
+                              std::shared_ptr<StreamSocket>& socket) override
+    {
+        LOK_ASSERT_MESSAGE("Expected to be in Phase::WaitGetFileDestroy",
+                           _phase == Phase::WaitGetFileDestroy);
+
+        LOG_TST("Failing GetFile");
+        http::Response httpResponse(http::StatusLine(500));
+        httpResponse.set("Content-Length", "0");
+        socket->sendAndShutdown(httpResponse);
+        return true;
+    }
+
+    bool onDocumentLoaded(const std::string& message) override
+    {
+        LOK_ASSERT_FAIL("Unexpected load: " + message);
+        return true;
+    }
+
+    void onDocBrokerDestroy(const std::string& docKey) override
+    {
+        LOG_TST("Destroyed [" << docKey << "] in " << toString(_phase));
+        switch (_phase)
+        {
+            case Phase::WaitCheckFileInfoDestroy:
+            {
+                LOK_ASSERT_EQUAL(std::size_t(1), getCountCheckFileInfo());
+                LOK_ASSERT_EQUAL(std::size_t(0), getCountGetFile());
+
+                // Load again, to fail on GetFile this time.
+                TRANSITION_STATE(_phase, Phase::FailGetFile);
+                break;
+            }
+            case Phase::WaitGetFileDestroy:
+            {
+                LOK_ASSERT_EQUAL(std::size_t(2), getCountCheckFileInfo());
+                LOK_ASSERT_EQUAL(std::size_t(1), getCountGetFile());
+
+                passTest("Document [" + docKey + "] failed to load and unloaded cleanly.");
+                break;
+            }
+            default:
+                LOK_ASSERT_FAIL("Unexpected destruction in " + toString(_phase));
+                break;
+        }
+    }
+
+    /// Load the document and expect the connection to be closed with the error.
+    void loadAndExpectError()
+    {
+        LOG_TST("Load: initWebsocket.");
+        initWebsocket("/wopi/files/0?access_token=anything");
+
+        WSD_CMD("load url=" + getWopiSrc());
+
+        std::string message;
+        const int statusCode
+            = helpers::getErrorCode(*getWs()->getCOOLWebSocket(), message, getTestname());
+        LOK_ASSERT_EQUAL(static_cast<int>(Poco::Net::WebSocket::WS_POLICY_VIOLATION), statusCode);
+        LOK_ASSERT_EQUAL(std::string("error: cmd=storage kind=loadfailed"), message);
+    }
+
+    void invokeWSDTest() override
+    {
+        switch (_phase)
+        {
+            case Phase::FailCheckFileInfo:
+            {
+                TRANSITION_STATE(_phase, Phase::WaitCheckFileInfoDestroy);
+                loadAndExpectError();
+                break;
+            }
+            case Phase::WaitCheckFileInfoDestroy:
+                break;
+            case Phase::FailGetFile:
+            {
+                TRANSITION_STATE(_phase, Phase::WaitGetFileDestroy);
+                loadAndExpectError();
+                break;
+            }
+            case Phase::WaitGetFileDestroy:
+                break;
+        }
+    }
+};
+
+UnitBase* unit_create_wsd(void) { return new UnitWOPIAsyncLoad_Fail(); }
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,138 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include <mutex>
+#include <vector>
+
+#include "HttpRequest.hpp"
+#include "Util.hpp"
+#include "lokassert.hpp"
+
+#include <WopiTestServer.hpp>
+#include <COOLWSD.hpp>
+#include <Log.hpp>
+#include <Unit.hpp>
+#include <UnitHTTP.hpp>
+#include <helpers.hpp>
+#include <Poco/Net/HTTPRequest.h>
+
+/// Test joining a document while it's loading.
+/// We hold the CheckFileInfo responses until both
+/// sessions have joined and are waiting on them.
+/// Both must load and only the first must download
+/// the document.
+class UnitWOPIAsyncLoad_Join : public WopiTestServer
+{
+    STATE_ENUM(Phase, Load, WaitCheckFileInfo, WaitLoadStatus, Done) _phase;
+
+    /// Guards the held CheckFileInfo requests, which are
+    /// received on the server poll and released by the test.
+    std::mutex _mutex;
+    std::vector<std::pair<std::shared_ptr<StreamSocket>, std::string>> _held;
+
+    std::size_t _loadedCount;
+
+public:
+    UnitWOPIAsyncLoad_Join()
+        : WopiTestServer("UnitWOPIAsyncLoad_Join")
+        , _phase(Phase::Load)
+        , _loadedCount(0)
+    {
+    }
+
+    bool handleCheckFileInfoRequest(const Poco::Net::HTTPRequest& request,
+                                    std::shared_ptr<StreamSocket>& socket) override
+    {
+        LOG_TST("Holding the CheckFileInfo response");
+        std::lock_guard<std::mutex> lock(_mutex);
+        _held.emplace_back(socket, request.getURI());
+        return true;
+    }
+
+    void assertGetFileRequest(const Poco::Net::HTTPRequest& /*request*/) override
+    {
+        LOK_ASSERT_MESSAGE("Expected to be in Phase::WaitLoadStatus",
+                           _phase == Phase::WaitLoadStatus);
+        LOK_ASSERT_EQUAL_MESSAGE("Expected a single download", std::size_t(1), getCountGetFile());
+    }
+
+    bool onDocumentLoaded(const std::string& message) override
+    {
+        LOG_TST("Doc (" << toString(_phase) << "): [" << message << ']');
+        LOK_ASSERT_MESSAGE("Expected to be in Phase::WaitLoadStatus",
+                           _phase == Phase::WaitLoadStatus);
+
+        if (++_loadedCount == 2)
+        {
+            LOK_ASSERT_EQUAL(std::size_t(2), getCountCheckFileInfo());
+            LOK_ASSERT_EQUAL(std::size_t(1), getCountGetFile());
+
+            TRANSITION_STATE(_phase, Phase::Done);
+            passTest("Both sessions loaded after joining while loading.");
+        }
+
+        return true;
+    }
+
+    void invokeWSDTest() override
+    {
+        switch (_phase)
+        {
+            case Phase::Load:
+            {
+                TRANSITION_STATE(_phase, Phase::WaitCheckFileInfo);
+
+                LOG_TST("Load: initWebsocket.");
+                initWebsocket("/wopi/files/0?access_token=anything");
+                addWebSocket();
+
+                WSD_CMD_BY_CONNECTION_INDEX(0, "load url=" + getWopiSrc());
+                WSD_CMD_BY_CONNECTION_INDEX(1, "load url=" + getWopiSrc());
+                break;
+            }
+            case Phase::WaitCheckFileInfo:
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+
+                // Wait for both sessions to check the file info.
+                if (_held.size() < 2)
+                    break;
+
+                LOK_ASSERT_EQUAL(std::size_t(0), getCountGetFile());
+                LOK_ASSERT_EQUAL(std::size_t(0), _loadedCount);
+
+                TRANSITION_STATE(_phase, Phase::WaitLoadStatus);
+
+                LOG_TST("Releasing the CheckFileInfo responses");
+                for (auto& held : _held)
+                {
+                    std::shared_ptr<StreamSocket> socket = std::move(held.first);
+                    const std::string uri = held.second;
+                    COOLWSD::getWebServerPoll()->addCallback(
+                        [this, socket, uri]() mutable
+                        {
+                            Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri);
+                            WopiTestServer::handleCheckFileInfoRequest(request, socket);
+                        });
+                }
+
+                _held.clear();
+                break;
+            }
+            case Phase::WaitLoadStatus:
+                break;
+            case Phase::Done:
+                break;
+        }
+    }
+};
+
+UnitBase* unit_create_wsd(void) { return new UnitWOPIAsyncLoad_Join(); }
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
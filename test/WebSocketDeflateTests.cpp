@@ -0,0 +1,231 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <config.h>
+
+#include <test/lokassert.hpp>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <string>
+#include <vector>
+
+#include <net/WebSocketDeflate.hpp>
+
+/// permessage-deflate negotiation and framing tests.
+class WebSocketDeflateTests : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(WebSocketDeflateTests);
+    CPPUNIT_TEST(testNegotiate);
+    CPPUNIT_TEST(testContextTakeover);
+    CPPUNIT_TEST(testNoContextTakeover);
+    CPPUNIT_TEST(testSkipBinary);
+    CPPUNIT_TEST(testInflateLimit);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testNegotiate();
+    void testContextTakeover();
+    void testNoContextTakeover();
+    void testSkipBinary();
+    void testInflateLimit();
+};
+
+namespace
+{
+std::string roundTrip(WebSocketDeflate& sender, WebSocketDeflate& receiver,
+                      const std::string& message, std::size_t& compressedSize)
+{
+    std::vector<char> compressed;
+    if (!sender.compress(message.data(), message.size(), compressed))
+        return "<compress failed>";
+
+    compressedSize = compressed.size();
+
+    std::vector<char> inflated;
+    if (receiver.decompress(compressed.data(), compressed.size(), inflated)
+        != WebSocketDeflate::Inflated::Ok)
+        return "<decompress failed>";
+
+    return std::string(inflated.begin(), inflated.end());
+}
+
+const std::string StateMessage
+    = "statechanged: {\"commandName\":\".uno:StateBold\",\"state\":\"false\","
+      "\"viewId\":0,\"commandValues\":{\"fontName\":\"Liberation Sans\"}}";
+}
+
+void WebSocketDeflateTests::testNegotiate()
+{
+    constexpr auto testname = __func__;
+
+    WebSocketDeflate::Params params;
+    std::string response;
+
+    // What browsers send.
+    LOK_ASSERT(WebSocketDeflate::negotiate("permessage-deflate; client_max_window_bits", 15,
+                                           params, response));
+    LOK_ASSERT_EQUAL(std::string("permessage-deflate; client_max_window_bits=15"), response);
+    LOK_ASSERT(!params._serverNoContextTakeover);
+    LOK_ASSERT_EQUAL(15, params._serverMaxWindowBits);
+
+    // Our window limit is applied to both sides, when the client can take it.
+    LOK_ASSERT(WebSocketDeflate::negotiate("permessage-deflate; client_max_window_bits", 10,
+                                           params, response));
+    LOK_ASSERT_EQUAL(std::string("permessage-deflate; server_max_window_bits=10; "
+                                 "client_max_window_bits=10"),
+                     response);
+
+    LOK_ASSERT(WebSocketDeflate::negotiate(
+        "permessage-deflate; server_no_context_takeover; server_max_window_bits=\"12\"", 15,
+        params, response));
+    LOK_ASSERT_EQUAL(std::string("permessage-deflate; server_no_context_takeover; "
+                                 "server_max_window_bits=12"),
+                     response);
+    LOK_ASSERT(params._serverNoContextTakeover);
+    LOK_ASSERT_EQUAL(12, params._serverMaxWindowBits);
+
+    // Unknown or duplicate parameters, or windows we can't do, decline that offer only.
+    LOK_ASSERT(!WebSocketDeflate::negotiate("permessage-deflate; server_max_window_bits=8", 15,
+                                            params, response));
+    LOK_ASSERT(!WebSocketDeflate::negotiate("permessage-deflate; foo", 15, params, response));
+    LOK_ASSERT(!WebSocketDeflate::negotiate(
+        "permessage-deflate; server_no_context_takeover; server_no_context_takeover", 15, params,
+        response));
+    LOK_ASSERT(WebSocketDeflate::negotiate(
+        "permessage-deflate; server_max_window_bits=16, permessage-deflate", 15, params,
+        response));
+    LOK_ASSERT_EQUAL(std::string("permessage-deflate"), response);
+
+    LOK_ASSERT(!WebSocketDeflate::negotiate("x-webkit-deflate-frame", 15, params, response));
+    LOK_ASSERT(!WebSocketDeflate::negotiate("", 15, params, response));
+}
+
+void WebSocketDeflateTests::testContextTakeover()
+{
+    constexpr auto testname = __func__;
+
+    WebSocketDeflate::Params params;
+    WebSocketDeflate server(params, false);
+    WebSocketDeflate client(params, true);
+
+    std::size_t first = 0;
+    LOK_ASSERT_EQUAL(StateMessage, roundTrip(server, client, StateMessage, first));
+
+    // The repeated message is found in the window and compresses to almost nothing.
+    std::size_t second = 0;
+    LOK_ASSERT_EQUAL(StateMessage, roundTrip(server, client, StateMessage, second));
+    LOK_ASSERT(second < first / 4);
+
+    // And the other way round.
+    std::size_t reply = 0;
+    const std::string message = "key type=input char=97 key=0 and some more text to compress";
+    LOK_ASSERT_EQUAL(message, roundTrip(client, server, message, reply));
+
+    // A large message whose output exceeds any initial guess.
+    const std::string large(1024 * 1024, 'x');
+    std::size_t largeSize = 0;
+    LOK_ASSERT_EQUAL(large, roundTrip(server, client, large, largeSize));
+    LOK_ASSERT(largeSize < large.size() / 100);
+
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(2 * StateMessage.size() + large.size()),
+                     server.getRawBytes());
+    LOK_ASSERT_EQUAL(static_cast<uint64_t>(first + second + largeSize),
+                     server.getCompressedBytes());
+
+    // Corrupt data is rejected.
+    std::vector<char> inflated;
+    const char garbage[] = "\xff\xff\xff\xff\xff\xff";
+    LOK_ASSERT(client.decompress(garbage, sizeof(garbage) - 1, inflated)
+               == WebSocketDeflate::Inflated::Invalid);
+}
+
+void WebSocketDeflateTests::testNoContextTakeover()
+{
+    constexpr auto testname = __func__;
+
+    WebSocketDeflate::Params params;
+    std::string response;
+    LOK_ASSERT(WebSocketDeflate::negotiate("permessage-deflate; server_no_context_takeover", 15,
+                                           params, response));
+    WebSocketDeflate server(params, false);
+    WebSocketDeflate client(params, true);
+
+    // Each message stands alone.
+    std::size_t first = 0;
+    LOK_ASSERT_EQUAL(StateMessage, roundTrip(server, client, StateMessage, first));
+    std::size_t second = 0;
+    LOK_ASSERT_EQUAL(StateMessage, roundTrip(server, client, StateMessage, second));
+    LOK_ASSERT_EQUAL(first, second);
+}
+
+void WebSocketDeflateTests::testSkipBinary()
+{
+    constexpr auto testname = __func__;
+
+    WebSocketDeflate::Config& config = WebSocketDeflate::config();
+    const std::vector<std::string> oldSkip = config._skipBinary;
+    config._skipBinary = { "tile:", "delta:" };
+
+    const std::string tile = "tile: nviewid=0 part=0 width=256 height=256 tileposx=0 tileposy=0 "
+                             "tilewidth=3840 tileheight=3840 ver=42\n\x89PNG";
+    LOK_ASSERT(!WebSocketDeflate::isCompressible(tile.data(), tile.size(), true));
+    LOK_ASSERT(WebSocketDeflate::isCompressible(tile.data(), tile.size(), false));
+    LOK_ASSERT(WebSocketDeflate::isCompressible(StateMessage.data(), StateMessage.size(), true));
+    LOK_ASSERT(!WebSocketDeflate::isCompressible("statechanged: x", 15, false));
+
+    config._skipBinary = oldSkip;
+}
+
+void WebSocketDeflateTests::testInflateLimit()
+{
+    constexpr auto testname = __func__;
+
+    WebSocketDeflate::Params params;
+    WebSocketDeflate sender(params, true);
+
+    // A megabyte of the same byte deflates to about a kilobyte.
+    const std::string large(1024 * 1024, 'x');
+    std::vector<char> compressed;
+    LOK_ASSERT(sender.compress(large.data(), large.size(), compressed));
+    LOK_ASSERT(compressed.size() < 4096);
+
+    // Exactly at the limit is fine.
+    {
+        WebSocketDeflate receiver(params, false);
+        std::vector<char> inflated;
+        LOK_ASSERT(receiver.decompress(compressed.data(), compressed.size(), inflated,
+                                       large.size())
+                   == WebSocketDeflate::Inflated::Ok);
+        LOK_ASSERT_EQUAL(large.size(), inflated.size());
+    }
+
+    // One byte less is not, and inflating stops there rather than at the end.
+    {
+        WebSocketDeflate receiver(params, false);
+        std::vector<char> inflated;
+        LOK_ASSERT(receiver.decompress(compressed.data(), compressed.size(), inflated,
+                                       large.size() - 1)
+                   == WebSocketDeflate::Inflated::TooBig);
+        LOK_ASSERT(inflated.size() <= large.size());
+
+        // The stream can't be used after that.
+        LOK_ASSERT(receiver.decompress(compressed.data(), compressed.size(), inflated)
+                   == WebSocketDeflate::Inflated::Invalid);
+    }
+
+    // A small limit stops a large message early.
+    {
+        WebSocketDeflate receiver(params, false);
+        std::vector<char> inflated;
+        LOK_ASSERT(receiver.decompress(compressed.data(), compressed.size(), inflated, 64 * 1024)
+                   == WebSocketDeflate::Inflated::TooBig);
+        LOK_ASSERT(inflated.size() <= 64 * 1024 + 1);
+    }
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(WebSocketDeflateTests);
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
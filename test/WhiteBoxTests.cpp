@@ -10,6 +10,9 @@
 #include <test/lokassert.hpp>
 #include <cppunit/TestAssert.h>
 #include <cstddef>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include <Auth.hpp>
 #include <ChildSession.hpp>
@@ -24,9 +27,14 @@
 
 #include <common/Message.hpp>
 #include <wsd/FileServer.hpp>
+#include <wsd/HtmlTemplate.hpp>
+#include <wsd/PrespawnPolicy.hpp>
+#include <wsd/WarmupPolicy.hpp>
 #include <net/Buffer.hpp>
 #include <net/NetUtil.hpp>
 
+#include <Poco/File.h>
+
 #include <chrono>
 #include <fstream>
 
@@ -47,16 +55,28 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testEmptyCellCursor);
     CPPUNIT_TEST(testTileDesc);
     CPPUNIT_TEST(testTileData);
+    CPPUNIT_TEST(testTileDataArena);
+    CPPUNIT_TEST(testTileKeyframeStore);
+    CPPUNIT_TEST(testClientKeyframeTracker);
     CPPUNIT_TEST(testRectanglesIntersect);
     CPPUNIT_TEST(testJson);
     CPPUNIT_TEST(testAnonymization);
     CPPUNIT_TEST(testIso8601Time);
     CPPUNIT_TEST(testClockAsString);
     CPPUNIT_TEST(testBufferClass);
+    CPPUNIT_TEST(testChunkedBufferClass);
     CPPUNIT_TEST(testHexify);
     CPPUNIT_TEST(testUIDefaults);
     CPPUNIT_TEST(testCSSVars);
+    CPPUNIT_TEST(testETagMatch);
+    CPPUNIT_TEST(testPreferredEncoding);
+    CPPUNIT_TEST(testMapFile);
+    CPPUNIT_TEST(testHtmlTemplate);
+    CPPUNIT_TEST(testPrespawnPolicy);
+    CPPUNIT_TEST(testWarmupPolicy);
+    CPPUNIT_TEST(testAvailableCpuCount);
     CPPUNIT_TEST(testStat);
+    CPPUNIT_TEST(testRemoveTree);
     CPPUNIT_TEST(testStringCompare);
     CPPUNIT_TEST(testParseUri);
     CPPUNIT_TEST(testParseUriUrl);
@@ -80,16 +100,28 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
     void testEmptyCellCursor();
     void testTileDesc();
     void testTileData();
+    void testTileDataArena();
+    void testTileKeyframeStore();
+    void testClientKeyframeTracker();
     void testRectanglesIntersect();
     void testJson();
     void testAnonymization();
     void testIso8601Time();
     void testClockAsString();
     void testBufferClass();
+    void testChunkedBufferClass();
     void testHexify();
     void testUIDefaults();
     void testCSSVars();
+    void testETagMatch();
+    void testPreferredEncoding();
+    void testMapFile();
+    void testHtmlTemplate();
+    void testPrespawnPolicy();
+    void testWarmupPolicy();
+    void testAvailableCpuCount();
     void testStat();
+    void testRemoveTree();
     void testStringCompare();
     void testParseUri();
     void testParseUriUrl();
@@ -675,6 +707,184 @@ void WhiteBoxTests::testTileData()
     LOK_ASSERT_EQUAL(std::string("baabaz"), Util::toString(out));
 }
 
+void WhiteBoxTests::testTileDataArena()
+{
+    constexpr auto testname = __func__;
+
+    auto arena = std::make_shared<TileArena>();
+    std::string expected;
+    {
+        std::string keyframe(3000, 'k');
+        keyframe[0] = 'Z';
+        TileData data(1, keyframe.data(), keyframe.size(), arena);
+        LOK_ASSERT_EQUAL(size_t(2999), data.size());
+        LOK_ASSERT_EQUAL(size_t(4096), data.getMemorySize());
+        expected = keyframe.substr(1);
+
+        // enough deltas to spill over several slabs.
+        for (int i = 0; i < 100; ++i)
+        {
+            std::string delta(40 + i, 'a' + i % 26);
+            delta[0] = 'D';
+            data.appendBlob(2 + i, delta.data(), delta.size());
+            expected += delta.substr(1);
+        }
+        LOK_ASSERT_EQUAL(expected.size(), data.size());
+        LOK_ASSERT_EQUAL(expected, Util::toString(data.data()));
+        LOK_ASSERT_EQUAL(data.getMemorySize(), arena->getAllocatedSize());
+
+        std::vector<char> out;
+        LOK_ASSERT_EQUAL(true, data.appendChangesSince(out, 1));
+        LOK_ASSERT_EQUAL(expected.substr(2999), Util::toString(out));
+
+        // the deltas are now ~3x the keyframe.
+        LOK_ASSERT_EQUAL(true, data.isDeltaChainTooLong(2.0));
+        LOK_ASSERT_EQUAL(false, data.isDeltaChainTooLong(3.0));
+
+        // a new keyframe compacts the chain, freeing slabs for reuse.
+        data.appendBlob(200, keyframe.data(), keyframe.size());
+        LOK_ASSERT_EQUAL(size_t(2999), data.size());
+        LOK_ASSERT_EQUAL(false, data.isDeltaChainTooLong(0.0));
+        LOK_ASSERT(arena->getFreeSize() > 0);
+    }
+    LOK_ASSERT_EQUAL(size_t(0), arena->getAllocatedSize());
+
+    // same sized keyframes reuse the same slabs.
+    const size_t freeSize = arena->getFreeSize();
+    {
+        std::string keyframe(3000, 'k');
+        keyframe[0] = 'Z';
+        TileData data(1, keyframe.data(), keyframe.size(), arena);
+        LOK_ASSERT_EQUAL(freeSize - 4096, arena->getFreeSize());
+    }
+    LOK_ASSERT_EQUAL(freeSize, arena->getFreeSize());
+
+    arena->setMaxFreeSize(0);
+    LOK_ASSERT_EQUAL(size_t(0), arena->getFreeSize());
+}
+
+void WhiteBoxTests::testTileKeyframeStore()
+{
+    constexpr auto testname = __func__;
+
+    auto store = std::make_shared<TileKeyframeStore>();
+    std::string blank(2000, 'b');
+    blank[0] = 'Z';
+    std::string other(2000, 'o');
+    other[0] = 'Z';
+    {
+        TileData first(1, blank.data(), blank.size(), nullptr, store);
+        TileData second(7, blank.data(), blank.size(), nullptr, store);
+        TileData third(3, other.data(), other.size(), nullptr, store);
+        LOK_ASSERT_EQUAL(size_t(2), store->count());
+        LOK_ASSERT_EQUAL(uint64_t(1), store->getHits());
+        LOK_ASSERT(first.getKeyframe() == second.getKeyframe());
+        LOK_ASSERT(first.getKeyframe() != third.getKeyframe());
+        LOK_ASSERT_EQUAL(first.getKeyframe()->_hash.toString(),
+                         second.getKeyframe()->_hash.toString());
+        LOK_ASSERT_EQUAL(size_t(32), first.getKeyframe()->_hash.toString().size());
+        // unshared keyframes, on a collision, are never named to clients.
+        LOK_ASSERT_EQUAL(std::string(), TileKeyframeStore::Hash{ 0, 0 }.toString());
+        LOK_ASSERT_EQUAL(true, second.isKeyframeOnly());
+
+        // deltas stay with their tile.
+        std::string delta(100, 'd');
+        delta[0] = 'D';
+        second.appendBlob(8, delta.data(), delta.size());
+        LOK_ASSERT_EQUAL(false, second.isKeyframeOnly());
+        LOK_ASSERT_EQUAL(blank.substr(1) + delta.substr(1), Util::toString(second.data()));
+        LOK_ASSERT_EQUAL(blank.substr(1), Util::toString(first.data()));
+
+        std::vector<char> out;
+        LOK_ASSERT_EQUAL(true, second.appendChangesSince(out, 7));
+        LOK_ASSERT_EQUAL(delta.substr(1), Util::toString(out));
+
+        // a new keyframe drops the shared one.
+        second.appendBlob(9, other.data(), other.size());
+        LOK_ASSERT(second.getKeyframe() == third.getKeyframe());
+        LOK_ASSERT_EQUAL(size_t(2), store->count());
+    }
+    LOK_ASSERT_EQUAL(size_t(0), store->count());
+}
+
+void WhiteBoxTests::testClientKeyframeTracker()
+{
+    constexpr auto testname = __func__;
+
+    constexpr int CacheSize = 64;
+    auto store = std::make_shared<TileKeyframeStore>();
+    std::vector<std::shared_ptr<const TileKeyframeStore::Keyframe>> keyframes;
+    std::vector<std::string> hashes;
+    for (int i = 0; i <= CacheSize + 1; ++i)
+    {
+        const std::string data = "keyframe #" + std::to_string(i);
+        keyframes.push_back(store->intern(data.data(), data.size()));
+        hashes.push_back(keyframes.back()->_hash.toString());
+    }
+
+    const auto tileMessage = [](const std::string& prefix, const std::string& hash,
+                                const std::string& payload)
+    {
+        const TileDesc desc(0, 0, 256, 256, 0, 0, 3840, 3840, -1, 0, -1, false);
+        const std::string header
+            = desc.serialize(prefix, hash.empty() ? "\n" : " hash=" + hash + "\n");
+        return header + payload;
+    };
+
+    const auto keyframe = [&keyframes](int i) { return Util::toString(keyframes[i]->_data); };
+
+    ClientKeyframeTracker tracker;
+    tracker.reset(CacheSize);
+
+    // As ClientSession::writeQueuedMessages() does.
+    const auto write = [&tracker](const std::string& queued)
+    {
+        std::vector<char> message(queued.begin(), queued.end());
+        const std::string firstLine = COOLProtocol::getFirstLine(message);
+        if (COOLProtocol::matchPrefix("knowntile:", firstLine))
+        {
+            std::vector<char> tile = tracker.expandKnownTile(firstLine, message);
+            if (!tile.empty())
+                message = std::move(tile);
+        }
+
+        tracker.written(COOLProtocol::getFirstLine(message));
+        return Util::toString(message);
+    };
+
+    write(tileMessage("tile:", hashes[0], keyframe(0)));
+    LOK_ASSERT(tracker.isKnown(hashes[0]));
+
+    // Queue more tiles than the client keeps before a knowntile: for the first,
+    // which is still known when queued; writing them pushes it out of the client.
+    std::vector<std::string> queue;
+    for (int i = 1; i <= CacheSize; ++i)
+        queue.push_back(tileMessage("tile:", hashes[i], keyframe(i)));
+    tracker.pin(keyframes[0]);
+    queue.push_back(tileMessage("knowntile:", hashes[0], "deltas"));
+
+    for (int i = 0; i < CacheSize; ++i)
+        LOK_ASSERT_EQUAL(queue[i], write(queue[i]));
+    LOK_ASSERT(!tracker.isKnown(hashes[0]));
+
+    // So the keyframe is sent after all; not for keeping, with deltas on top.
+    LOK_ASSERT_EQUAL(tileMessage("tile:", std::string(), keyframe(0) + "deltas"),
+                     write(queue.back()));
+    LOK_ASSERT(!tracker.isKnown(hashes[0]));
+
+    // A bare keyframe is for the client to keep again.
+    tracker.pin(keyframes[1]);
+    write(tileMessage("tile:", hashes[CacheSize + 1], keyframe(CacheSize + 1)));
+    LOK_ASSERT(!tracker.isKnown(hashes[1]));
+    LOK_ASSERT_EQUAL(tileMessage("tile:", hashes[1], keyframe(1)),
+                     write(tileMessage("knowntile:", hashes[1], std::string())));
+    LOK_ASSERT(tracker.isKnown(hashes[1]));
+
+    // Those the client still has are written as queued.
+    const std::string known = tileMessage("knowntile:", hashes[CacheSize], std::string());
+    LOK_ASSERT_EQUAL(known, write(known));
+}
+
 void WhiteBoxTests::testRectanglesIntersect()
 {
     constexpr auto testname = __func__;
@@ -995,6 +1205,93 @@ void WhiteBoxTests::testBufferClass()
     LOK_ASSERT_EQUAL(true, buf.empty());
 }
 
+namespace
+{
+constexpr int MaxIOVec = 64;
+
+/// Gathers what @buf would write, in at most @maxBytes.
+std::string gatherChunkedBuffer(const ChunkedBuffer& buf, std::size_t maxBytes = SIZE_MAX)
+{
+    iovec iov[MaxIOVec];
+    const int count = buf.getIOVec(iov, MaxIOVec, maxBytes);
+
+    std::string out;
+    for (int i = 0; i < count; ++i)
+        out.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    return out;
+}
+}
+
+void WhiteBoxTests::testChunkedBufferClass()
+{
+    constexpr auto testname = __func__;
+
+    ChunkedBuffer buf;
+    LOK_ASSERT_EQUAL(0UL, buf.size());
+    LOK_ASSERT_EQUAL(true, buf.empty());
+    LOK_ASSERT(buf.getBlock() == nullptr);
+    buf.eraseFirst(buf.size());
+    LOK_ASSERT_EQUAL(std::string(), gatherChunkedBuffer(buf));
+
+    // Small appends are gathered in one chunk.
+    std::string expected;
+    for (int i = 0; i < 100; ++i)
+    {
+        const std::string data = "message " + std::to_string(i) + '\n';
+        buf.append(data);
+        expected += data;
+    }
+
+    LOK_ASSERT_EQUAL(expected.size(), buf.size());
+    LOK_ASSERT_EQUAL(expected.size(), buf.getBlockSize());
+    LOK_ASSERT_EQUAL(expected, gatherChunkedBuffer(buf));
+
+    // Shared data is referenced, not copied.
+    auto blob = std::make_shared<std::vector<char>>(3 * ChunkedBuffer::ChunkSize, 'b');
+    buf.append(blob, blob->data(), blob->size());
+    buf.append("tail");
+    expected += std::string(blob->data(), blob->size()) + "tail";
+    LOK_ASSERT_EQUAL(expected.size(), buf.size());
+    LOK_ASSERT_EQUAL(expected, gatherChunkedBuffer(buf));
+    LOK_ASSERT_EQUAL(2L, blob.use_count());
+
+    iovec iov[MaxIOVec];
+    LOK_ASSERT_EQUAL(3, buf.getIOVec(iov, MaxIOVec, SIZE_MAX));
+    LOK_ASSERT(iov[1].iov_base == blob->data());
+
+    // Limited to what the socket can take.
+    LOK_ASSERT_EQUAL(expected.substr(0, 1000), gatherChunkedBuffer(buf, 1000));
+
+    // Erase across the segments.
+    buf.eraseFirst(10);
+    expected.erase(0, 10);
+    LOK_ASSERT_EQUAL(expected, gatherChunkedBuffer(buf));
+
+    const std::size_t firstChunk = buf.getBlockSize();
+    buf.eraseFirst(firstChunk + 100);
+    expected.erase(0, firstChunk + 100);
+    LOK_ASSERT_EQUAL(expected, gatherChunkedBuffer(buf));
+    LOK_ASSERT_EQUAL(blob->size() - 100, buf.getBlockSize());
+
+    buf.eraseFirst(buf.getBlockSize());
+    expected.erase(0, blob->size() - 100);
+    LOK_ASSERT_EQUAL(1L, blob.use_count());
+    LOK_ASSERT_EQUAL(std::string("tail"), gatherChunkedBuffer(buf));
+
+    // Large appends fill the tail chunk, then get a segment of their own.
+    const std::vector<char> dataLarge(5 * ChunkedBuffer::ChunkSize, 'x');
+    buf.append(dataLarge.data(), dataLarge.size());
+    LOK_ASSERT_EQUAL(dataLarge.size() + 4, buf.size());
+    LOK_ASSERT_EQUAL(ChunkedBuffer::ChunkSize, buf.getBlockSize());
+    LOK_ASSERT_EQUAL(2, buf.getIOVec(iov, MaxIOVec, SIZE_MAX));
+    LOK_ASSERT_EQUAL("tail" + std::string(dataLarge.begin(), dataLarge.end()),
+                     gatherChunkedBuffer(buf));
+
+    buf.clear();
+    LOK_ASSERT_EQUAL(0UL, buf.size());
+    LOK_ASSERT_EQUAL(true, buf.empty());
+}
+
 
 void WhiteBoxTests::testHexify()
 {
@@ -1059,6 +1356,260 @@ void WhiteBoxTests::testCSSVars()
                      FileServerRequestHandler::cssVarsToStyle("--co-somestyle-text=#123456;;--some-val=3453--some-other-val=4536;;"));
 }
 
+void WhiteBoxTests::testETagMatch()
+{
+    constexpr auto testname = __func__;
+
+    const std::string etag = "\"0123abcd-gzip\"";
+    LOK_ASSERT(FileServerRequestHandler::isETagMatch("\"0123abcd-gzip\"", etag));
+    LOK_ASSERT(FileServerRequestHandler::isETagMatch("W/\"0123abcd-gzip\"", etag));
+    LOK_ASSERT(FileServerRequestHandler::isETagMatch("\"other\", \"0123abcd-gzip\"", etag));
+    LOK_ASSERT(FileServerRequestHandler::isETagMatch(" * ", etag));
+
+    // Another representation, or a partial tag, is a different resource.
+    LOK_ASSERT(!FileServerRequestHandler::isETagMatch("\"0123abcd\"", etag));
+    LOK_ASSERT(!FileServerRequestHandler::isETagMatch("\"0123abcd-br\"", etag));
+    LOK_ASSERT(!FileServerRequestHandler::isETagMatch("0123abcd-gzip", etag));
+    LOK_ASSERT(!FileServerRequestHandler::isETagMatch("", etag));
+}
+
+void WhiteBoxTests::testPreferredEncoding()
+{
+    constexpr auto testname = __func__;
+
+    // What browsers send.
+    LOK_ASSERT_EQUAL(std::string("br"), FileServerRequestHandler::getPreferredEncoding(
+                                            "gzip, deflate, br", true, true));
+    LOK_ASSERT_EQUAL(std::string("gzip"), FileServerRequestHandler::getPreferredEncoding(
+                                              "gzip, deflate, br", false, true));
+    LOK_ASSERT_EQUAL(std::string("gzip"), FileServerRequestHandler::getPreferredEncoding(
+                                              "gzip, deflate", true, true));
+
+    // Quality values, including refusals.
+    LOK_ASSERT_EQUAL(std::string("gzip"), FileServerRequestHandler::getPreferredEncoding(
+                                              "br;q=0.5, gzip", true, true));
+    LOK_ASSERT_EQUAL(std::string("gzip"), FileServerRequestHandler::getPreferredEncoding(
+                                              "*, br;q=0", true, true));
+    LOK_ASSERT_EQUAL(std::string("br"), FileServerRequestHandler::getPreferredEncoding(
+                                            "*", true, true));
+    LOK_ASSERT_EQUAL(std::string("gzip"), FileServerRequestHandler::getPreferredEncoding(
+                                              "X-GZIP", true, true));
+    LOK_ASSERT_EQUAL(std::string(), FileServerRequestHandler::getPreferredEncoding(
+                                        "gzip;q=0, identity", true, true));
+    LOK_ASSERT_EQUAL(std::string(), FileServerRequestHandler::getPreferredEncoding(
+                                        "", true, true));
+    LOK_ASSERT_EQUAL(std::string(), FileServerRequestHandler::getPreferredEncoding(
+                                        "br, gzip", false, false));
+}
+
+void WhiteBoxTests::testMapFile()
+{
+    constexpr auto testname = __func__;
+
+    const std::string path = FileUtil::getSysTempDirectoryPath() + "/WhiteBoxTests-mapFile";
+    const std::string contents = "Mapped, not read.";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << contents;
+    }
+
+    const char* data = nullptr;
+    std::size_t size = 0;
+    std::shared_ptr<const void> mapping = FileUtil::mapFile(path, data, size);
+    LOK_ASSERT(mapping != nullptr);
+
+    // The mapping outlives the file.
+    FileUtil::removeFile(path);
+    LOK_ASSERT_EQUAL(contents, std::string(data, size));
+
+    LOK_ASSERT(FileUtil::mapFile(path, data, size) == nullptr);
+}
+
+void WhiteBoxTests::testHtmlTemplate()
+{
+    constexpr auto testname = __func__;
+
+    const std::string text = "<html lang=\"%LANG%\">100% <!--%STYLE%--> %HOST% %UNSET%\n"
+                             "<!--%SCRIPT%--> %HOST%/%ACCESS_TOKEN% %lower% %%";
+    const HtmlTemplate html(text);
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(7), html.getSlotCount());
+
+    HtmlTemplate::Values shared;
+    shared.set("%LANG%", "en");
+    shared.set("<!--%STYLE%-->", "<style></style>");
+    shared.set("%SCRIPT%", "%HOST%");
+
+    HtmlTemplate::Values values = shared;
+    values.set("%HOST%", "example.com");
+    values.set("%ACCESS_TOKEN%", "secret");
+
+    // Values aren't filled in themselves, and those without a slot are kept.
+    const std::string expected = "<html lang=\"en\">100% <style></style> example.com %UNSET%\n"
+                                 "<!--%HOST%--> example.com/secret %lower% %%";
+    LOK_ASSERT_EQUAL(expected, html.render(values));
+    LOK_ASSERT_EQUAL(text, html.render(HtmlTemplate::Values()));
+
+    // Only compressed once bound.
+    LOK_ASSERT(html.renderGzip(values).empty());
+
+    const HtmlTemplate bound = html.bind(shared);
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(4), bound.getSlotCount());
+    LOK_ASSERT_EQUAL(expected, bound.render(values));
+
+    const std::string gzip = bound.renderGzip(values);
+    LOK_ASSERT(!gzip.empty());
+
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+    LOK_ASSERT_EQUAL(Z_OK, inflateInit2(&strm, 16 + MAX_WBITS));
+    std::string inflated(expected.size() + 64, '\0');
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(gzip.data()));
+    strm.avail_in = gzip.size();
+    strm.next_out = reinterpret_cast<Bytef*>(&inflated[0]);
+    strm.avail_out = inflated.size();
+    // The trailer is checked too, so the whole stream is valid.
+    LOK_ASSERT_EQUAL(Z_STREAM_END, inflate(&strm, Z_FINISH));
+    inflated.resize(inflated.size() - strm.avail_out);
+    inflateEnd(&strm);
+    LOK_ASSERT_EQUAL(expected, inflated);
+}
+
+void WhiteBoxTests::testPrespawnPolicy()
+{
+    constexpr auto testname = __func__;
+
+    PrespawnPolicy policy;
+    policy.configure(false, 2, 10, 0);
+    auto now = std::chrono::steady_clock::now();
+
+    // Two kits requested, one arrives in 1.5 seconds.
+    policy.recordSpawnRequest(now, 2);
+    now += std::chrono::milliseconds(1500);
+    policy.recordSpawn(now, 100 * 1024 * 1024);
+
+    // A burst of opens doesn't move the fixed target.
+    for (int i = 0; i < 20; ++i)
+        policy.recordOpen(now, i % 4 == 0);
+    LOK_ASSERT_EQUAL(2U, policy.getTarget(now));
+
+    // Adaptive: about 2 opens a second, 1.5 seconds to spawn, so 3 and two deviations.
+    policy.configure(true, 2, 10, 0);
+    LOK_ASSERT_EQUAL(7U, policy.getTarget(now));
+
+    // Capped by the count, then the memory.
+    policy.configure(true, 2, 5, 0);
+    LOK_ASSERT_EQUAL(5U, policy.getTarget(now));
+    policy.configure(true, 2, 10, 300 * 1024 * 1024);
+    LOK_ASSERT_EQUAL(3U, policy.getTarget(now));
+
+    // But never below the minimum.
+    policy.configure(true, 2, 10, 100 * 1024);
+    LOK_ASSERT_EQUAL(2U, policy.getTarget(now));
+
+    // Back to the minimum once the opens stop.
+    policy.configure(true, 2, 10, 0);
+    LOK_ASSERT_EQUAL(2U, policy.getTarget(now + std::chrono::minutes(5)));
+
+    std::ostringstream oss;
+    policy.dumpMetrics(oss, now);
+    const std::string metrics = oss.str();
+    LOK_ASSERT(metrics.find("kit_spawn_duration_milliseconds_bucket{le=\"1000\"} 0\n")
+               != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_spawn_duration_milliseconds_bucket{le=\"2500\"} 1\n")
+               != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_spawn_duration_milliseconds_bucket{le=\"+Inf\"} 1\n")
+               != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_spawn_duration_milliseconds_sum 1500\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_prespawn_hit_count 5\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_prespawn_miss_count 15\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_prespawn_target_count 7\n") != std::string::npos);
+
+    // The unanswered request is forgotten, so a late kit isn't timed.
+    policy.resetSpawnRequests();
+    policy.recordSpawn(now + std::chrono::minutes(1), 0);
+    std::ostringstream after;
+    policy.dumpMetrics(after, now);
+    LOK_ASSERT(after.str().find("kit_spawn_duration_milliseconds_count 1\n") != std::string::npos);
+}
+
+void WhiteBoxTests::testWarmupPolicy()
+{
+    constexpr auto testname = __func__;
+
+    LOK_ASSERT_EQUAL(std::string("text"), WarmupPolicy::getDocumentType("report.DOCX"));
+    LOK_ASSERT_EQUAL(std::string("spreadsheet"), WarmupPolicy::getDocumentType("/a/b.ods"));
+    LOK_ASSERT_EQUAL(std::string("presentation"), WarmupPolicy::getDocumentType("talk.pptx"));
+    LOK_ASSERT_EQUAL(std::string("drawing"), WarmupPolicy::getDocumentType("scan.pdf"));
+    LOK_ASSERT_EQUAL(std::string(), WarmupPolicy::getDocumentType("/wopi/files/593_ocq"));
+    LOK_ASSERT_EQUAL(std::string(), WarmupPolicy::getDocumentType("/dir.odt/file"));
+    LOK_ASSERT_EQUAL(std::string(), WarmupPolicy::getDocumentType("image.png"));
+
+    WarmupPolicy policy;
+    LOK_ASSERT_EQUAL(std::string("text"), policy.pickType({}));
+
+    // Three spreadsheets for each text document: the spares follow the mix.
+    for (int i = 0; i < 8; ++i)
+        policy.recordLoad(i % 4 == 0 ? "a.odt" : "a.xlsx", std::string(),
+                          std::chrono::milliseconds(1000));
+    LOK_ASSERT_EQUAL(std::string("spreadsheet"), policy.pickType({}));
+    LOK_ASSERT_EQUAL(std::string("spreadsheet"), policy.pickType({ "spreadsheet" }));
+    LOK_ASSERT_EQUAL(std::string("text"), policy.pickType({ "spreadsheet", "spreadsheet" }));
+    LOK_ASSERT_EQUAL(std::string("spreadsheet"),
+                     policy.pickType({ "spreadsheet", "spreadsheet", "text" }));
+
+    // Warm loads are faster, and a kit warmed for another type is a miss.
+    policy.recordLoad("b.ods", "spreadsheet", std::chrono::milliseconds(400));
+    policy.recordLoad("c.ods", "spreadsheet", std::chrono::milliseconds(600));
+    policy.recordLoad("d.ods", "text", std::chrono::milliseconds(1300));
+    policy.recordLoad("e.bin", "text", std::chrono::milliseconds(5000));
+
+    std::ostringstream oss;
+    policy.dumpMetrics(oss);
+    const std::string metrics = oss.str();
+    LOK_ASSERT(metrics.find("kit_warm_spreadsheet_hit_count 2\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_spreadsheet_miss_count 1\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_spreadsheet_cold_count 6\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_spreadsheet_load_average_milliseconds 500\n")
+               != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_spreadsheet_cold_load_average_milliseconds 1042\n")
+               != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_spreadsheet_load_saving_milliseconds 542\n")
+               != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_text_hit_count 0\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_text_cold_count 2\n") != std::string::npos);
+    LOK_ASSERT(metrics.find("kit_warm_text_load_saving_milliseconds 0\n") != std::string::npos);
+}
+
+void WhiteBoxTests::testAvailableCpuCount()
+{
+    constexpr auto testname = __func__;
+
+    LOK_ASSERT(Util::getAvailableCpuCount() >= 1);
+
+#ifdef __linux__
+    // Pinned to a single CPU, we may only use that one.
+    cpu_set_t saved;
+    CPU_ZERO(&saved);
+    LOK_ASSERT_EQUAL(0, sched_getaffinity(0, sizeof(saved), &saved));
+
+    cpu_set_t single;
+    CPU_ZERO(&single);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &saved))
+        {
+            CPU_SET(cpu, &single);
+            break;
+        }
+    }
+
+    LOK_ASSERT_EQUAL(0, sched_setaffinity(0, sizeof(single), &single));
+    const int pinned = Util::getAvailableCpuCount();
+    LOK_ASSERT_EQUAL(0, sched_setaffinity(0, sizeof(saved), &saved));
+    LOK_ASSERT_EQUAL(1, pinned);
+#endif
+}
+
 void WhiteBoxTests::testStat()
 {
     constexpr auto testname = __func__;
@@ -1109,6 +1660,32 @@ void WhiteBoxTests::testStat()
     FileUtil::removeFile(tmpFile);
 }
 
+void WhiteBoxTests::testRemoveTree()
+{
+    constexpr auto testname = __func__;
+
+    const std::string root = FileUtil::getSysTempDirectoryPath() + "/test_remove_tree";
+    const std::string outside = FileUtil::getSysTempDirectoryPath() + "/test_remove_tree_outside";
+    FileUtil::removeFile(root, true);
+    FileUtil::removeFile(outside, true);
+
+    Poco::File(root + "/a/b/c").createDirectories();
+    Poco::File(outside).createDirectories();
+    std::ofstream(root + "/a/b/c/file");
+    std::ofstream(root + "/a/file");
+    std::ofstream(outside + "/file");
+    LOK_ASSERT_EQUAL(0, ::symlink(outside.c_str(), (root + "/a/link").c_str()));
+
+    // Everything in it, but nothing a link points to.
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(7), FileUtil::removeTree(root));
+    LOK_ASSERT(!FileUtil::Stat(root).exists());
+    LOK_ASSERT(FileUtil::Stat(outside + "/file").exists());
+
+    LOK_ASSERT_EQUAL(static_cast<std::size_t>(0), FileUtil::removeTree(root));
+    FileUtil::removeFile(outside, true);
+    LOK_ASSERT(!FileUtil::Stat(outside).exists());
+}
+
 void WhiteBoxTests::testStringCompare()
 {
     constexpr auto testname = __func__;
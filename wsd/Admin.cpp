@@ -705,6 +705,12 @@ void Admin::setViewLoadDuration(const std::string& docKey, const std::string& se
     addCallback([=]{ _model.setViewLoadDuration(docKey, sessionId, viewLoadDuration); });
 }
 
+void Admin::setViewCompressionStats(const std::string& docKey, const std::string& sessionId,
+                                    uint64_t raw, uint64_t compressed)
+{
+    addCallback([=]{ _model.setViewCompressionStats(docKey, sessionId, raw, compressed); });
+}
+
 void Admin::setDocWopiDownloadDuration(const std::string& docKey, std::chrono::milliseconds wopiDownloadDuration)
 {
     addCallback([=]{ _model.setDocWopiDownloadDuration(docKey, wopiDownloadDuration); });
@@ -715,6 +721,12 @@ void Admin::setDocWopiUploadDuration(const std::string& docKey, const std::chron
     addCallback([=]{ _model.setDocWopiUploadDuration(docKey, uploadDuration); });
 }
 
+void Admin::setDocTileCacheStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                                 uint64_t evictions)
+{
+    addCallback([=]{ _model.setDocTileCacheStats(docKey, hits, misses, evictions); });
+}
+
 void Admin::addSegFaultCount(unsigned segFaultCount)
 {
     addCallback([=]{ _model.addSegFaultCount(segFaultCount); });
@@ -137,8 +137,12 @@ public:
     void sendMetrics(const std::shared_ptr<StreamSocket>& socket, const std::shared_ptr<Poco::Net::HTTPResponse>& response);
 
     void setViewLoadDuration(const std::string& docKey, const std::string& sessionId, std::chrono::milliseconds viewLoadDuration);
+    void setViewCompressionStats(const std::string& docKey, const std::string& sessionId,
+                                 uint64_t raw, uint64_t compressed);
     void setDocWopiDownloadDuration(const std::string& docKey, std::chrono::milliseconds wopiDownloadDuration);
     void setDocWopiUploadDuration(const std::string& docKey, const std::chrono::milliseconds uploadDuration);
+    void setDocTileCacheStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                              uint64_t evictions);
     void addSegFaultCount(unsigned segFaultCount);
     void addLostKitsTerminated(unsigned lostKitsTerminated);
 
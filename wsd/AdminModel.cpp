@@ -24,6 +24,7 @@
 #include <Util.hpp>
 #include <wsd/COOLWSD.hpp>
 #include <wsd/Exceptions.hpp>
+#include <wsd/Storage.hpp>
 
 #include <fnmatch.h>
 #include <dirent.h>
@@ -64,6 +65,14 @@ void Document::setViewLoadDuration(const std::string& sessionId, std::chrono::mi
         it->second.setLoadDuration(viewLoadDuration);
 }
 
+void Document::setViewCompressionStats(const std::string& sessionId, uint64_t raw,
+                                       uint64_t compressed)
+{
+    std::map<std::string, View>::iterator it = _views.find(sessionId);
+    if (it != _views.end())
+        it->second.setCompressionStats(raw, compressed);
+}
+
 std::pair<std::time_t, std::string> Document::getSnapshot() const
 {
     std::time_t ct = std::time(nullptr);
@@ -786,6 +795,9 @@ std::string AdminModel::getDocuments() const
                 << "\"elapsedTime\"" << ':' << it.second->getElapsedTime() << ','
                 << "\"idleTime\"" << ':' << it.second->getIdleTime() << ','
                 << "\"modified\"" << ':' << '"' << (it.second->getModifiedStatus() ? "Yes" : "No") << '"' << ','
+                << "\"tileCacheHits\"" << ':' << it.second->getTileCacheHits() << ','
+                << "\"tileCacheMisses\"" << ':' << it.second->getTileCacheMisses() << ','
+                << "\"tileCacheEvictions\"" << ':' << it.second->getTileCacheEvictions() << ','
                 << "\"views\"" << ':' << '[';
             std::map<std::string, View> viewers = it.second->getViews();
             std::string separator;
@@ -840,6 +852,14 @@ void AdminModel::setViewLoadDuration(const std::string& docKey, const std::strin
         it->second->setViewLoadDuration(sessionId, viewLoadDuration);
 }
 
+void AdminModel::setViewCompressionStats(const std::string& docKey, const std::string& sessionId,
+                                         uint64_t raw, uint64_t compressed)
+{
+    auto it = _documents.find(docKey);
+    if (it != _documents.end())
+        it->second->setViewCompressionStats(sessionId, raw, compressed);
+}
+
 void AdminModel::setDocWopiDownloadDuration(const std::string& docKey, std::chrono::milliseconds wopiDownloadDuration)
 {
     auto it = _documents.find(docKey);
@@ -854,6 +874,14 @@ void AdminModel::setDocWopiUploadDuration(const std::string& docKey, const std::
         it->second->setWopiUploadDuration(wopiUploadDuration);
 }
 
+void AdminModel::setDocTileCacheStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                                      uint64_t evictions)
+{
+    auto it = _documents.find(docKey);
+    if (it != _documents.end())
+        it->second->setTileCacheStats(hits, misses, evictions);
+}
+
 void AdminModel::addSegFaultCount(unsigned segFaultCount)
 {
     _segFaultCount += segFaultCount;
@@ -1019,11 +1047,24 @@ struct DocumentAggregateStats
         _bytesRecvFromClients.Update(d.getRecvBytes(), active);
         _wopiDownloadDuration.Update(d.getWopiDownloadDuration().count(), active);
         _wopiUploadDuration.Update(d.getWopiUploadDuration().count(), active);
+        _tileCacheHits.Update(d.getTileCacheHits(), active);
+        _tileCacheMisses.Update(d.getTileCacheMisses(), active);
+        _tileCacheEvictions.Update(d.getTileCacheEvictions(), active);
 
         //View load duration
         for (const auto& v : d.getViews())
+        {
             _viewLoadDuration.Update(v.second.getLoadDuration().count(), active);
 
+            // Compressed size in percent of the original, for the views that use it.
+            if (v.second.getDeflateRawBytes() > 0)
+            {
+                _viewDeflateRatio.Update(v.second.getDeflateBytes() * 100
+                                             / v.second.getDeflateRawBytes(),
+                                         active);
+            }
+        }
+
         if (d.getBadBehaviorDetectionTime())
         {
             if (active)
@@ -1048,6 +1089,10 @@ struct DocumentAggregateStats
     ActiveExpiredStats _wopiDownloadDuration;
     ActiveExpiredStats _wopiUploadDuration;
     ActiveExpiredStats _viewLoadDuration;
+    ActiveExpiredStats _viewDeflateRatio;
+    ActiveExpiredStats _tileCacheHits;
+    ActiveExpiredStats _tileCacheMisses;
+    ActiveExpiredStats _tileCacheEvictions;
 
     int _resConsCount;
     int _resConsAbortCount;
@@ -1107,6 +1152,24 @@ void AdminModel::getMetrics(std::ostringstream &oss)
     oss << "coolwsd_memory_used_bytes " << Util::getMemoryUsagePSS(getpid()) * 1024 << std::endl;
     oss << std::endl;
 
+    const std::shared_ptr<const http::SessionPool> pool = StorageBase::getHttpSessionPool();
+    if (pool)
+    {
+        const uint64_t newCount = pool->getNewCount();
+        const uint64_t reuseCount = pool->getReuseCount();
+        oss << "wopi_connection_new_count " << newCount << std::endl;
+        oss << "wopi_connection_reused_count " << reuseCount << std::endl;
+        oss << "wopi_connection_idle_count " << pool->getIdleCount() << std::endl;
+        oss << "wopi_connection_reuse_percent "
+            << (newCount + reuseCount ? reuseCount * 100 / (newCount + reuseCount) : 0)
+            << std::endl;
+        oss << std::endl;
+    }
+
+    oss << "wopi_upload_buffer_peak_bytes " << http::Request::getBodyBufferPeak() << std::endl;
+    oss << "wopi_upload_sendfile_bytes " << http::Request::getBodySendFileBytes() << std::endl;
+    oss << std::endl;
+
     oss << "forkit_count " << getPidsFromProcName(std::regex("forkit"), nullptr) << std::endl;
     oss << "forkit_thread_count " << Util::getStatFromPid(_forKitPid, 19) << std::endl;
     oss << "forkit_cpu_time_seconds " << Util::getCpuUsage(_forKitPid) / sysconf (_SC_CLK_TCK) << std::endl;
@@ -1127,6 +1190,7 @@ void AdminModel::getMetrics(std::ostringstream &oss)
     PrintKitAggregateMetrics(oss, "thread_count", "", kitStats._threadCount);
     PrintKitAggregateMetrics(oss, "memory_used", "bytes", docStats._kitUsedMemory._active);
     PrintKitAggregateMetrics(oss, "cpu_time", "seconds", kitStats._cpuTime);
+    COOLWSD::getPrespawnMetrics(oss);
     oss << std::endl;
 
     oss << "document_resource_consuming_count " << docStats._resConsCount << std::endl;
@@ -1150,6 +1214,14 @@ void AdminModel::getMetrics(std::ostringstream &oss)
     PrintDocActExpMetrics(oss, "wopi_download_duration", "milliseconds", docStats._wopiDownloadDuration);
     oss << std::endl;
     PrintDocActExpMetrics(oss, "view_load_duration", "milliseconds", docStats._viewLoadDuration);
+    oss << std::endl;
+    PrintDocActExpMetrics(oss, "view_ws_compression_ratio", "percent", docStats._viewDeflateRatio);
+    oss << std::endl;
+    PrintDocActExpMetrics(oss, "tile_cache_hits", "", docStats._tileCacheHits);
+    oss << std::endl;
+    PrintDocActExpMetrics(oss, "tile_cache_misses", "", docStats._tileCacheMisses);
+    oss << std::endl;
+    PrintDocActExpMetrics(oss, "tile_cache_evictions", "", docStats._tileCacheEvictions);
 
     oss << std::endl;
     oss << "error_storage_space_low " << StorageSpaceLowException::count << "\n";
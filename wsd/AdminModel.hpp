@@ -31,6 +31,8 @@ public:
         , _userId(std::move(userId))
         , _start(std::time(nullptr))
         , _loadDuration(0)
+        , _deflateRawBytes(0)
+        , _deflateBytes(0)
     {
     }
 
@@ -41,6 +43,13 @@ public:
     bool isExpired() const { return _end != 0 && std::time(nullptr) >= _end; }
     std::chrono::milliseconds getLoadDuration() const { return _loadDuration; }
     void setLoadDuration(std::chrono::milliseconds loadDuration) { _loadDuration = loadDuration; }
+    void setCompressionStats(uint64_t raw, uint64_t compressed)
+    {
+        _deflateRawBytes = raw;
+        _deflateBytes = compressed;
+    }
+    uint64_t getDeflateRawBytes() const { return _deflateRawBytes; }
+    uint64_t getDeflateBytes() const { return _deflateBytes; }
 
 private:
     const std::string _sessionId;
@@ -49,6 +58,9 @@ private:
     const std::time_t _start;
     std::time_t _end = 0;
     std::chrono::milliseconds _loadDuration;
+    /// The messages sent with permessage-deflate, before and after compression.
+    uint64_t _deflateRawBytes;
+    uint64_t _deflateBytes;
 };
 
 struct DocCleanupSettings
@@ -150,6 +162,9 @@ public:
         , _recvBytes(0)
         , _wopiDownloadDuration(0)
         , _wopiUploadDuration(0)
+        , _tileCacheHits(0)
+        , _tileCacheMisses(0)
+        , _tileCacheEvictions(0)
         , _procSMaps(nullptr)
         , _lastTimeSMapsRead(0)
         , _isModified(false)
@@ -212,10 +227,20 @@ public:
     uint64_t getSentBytes() const { return _sentBytes; }
     uint64_t getRecvBytes() const { return _recvBytes; }
     void setViewLoadDuration(const std::string& sessionId, std::chrono::milliseconds viewLoadDuration);
+    void setViewCompressionStats(const std::string& sessionId, uint64_t raw, uint64_t compressed);
     void setWopiDownloadDuration(std::chrono::milliseconds wopiDownloadDuration) { _wopiDownloadDuration = wopiDownloadDuration; }
     std::chrono::milliseconds getWopiDownloadDuration() const { return _wopiDownloadDuration; }
     void setWopiUploadDuration(const std::chrono::milliseconds wopiUploadDuration) { _wopiUploadDuration = wopiUploadDuration; }
     std::chrono::milliseconds getWopiUploadDuration() const { return _wopiUploadDuration; }
+    void setTileCacheStats(uint64_t hits, uint64_t misses, uint64_t evictions)
+    {
+        _tileCacheHits = hits;
+        _tileCacheMisses = misses;
+        _tileCacheEvictions = evictions;
+    }
+    uint64_t getTileCacheHits() const { return _tileCacheHits; }
+    uint64_t getTileCacheMisses() const { return _tileCacheMisses; }
+    uint64_t getTileCacheEvictions() const { return _tileCacheEvictions; }
     void setProcSMapsFD(const int smapsFD) { _procSMaps = fdopen(smapsFD, "r"); }
     bool hasMemDirtyChanged() const { return _hasMemDirtyChanged; }
     void setMemDirtyChanged(bool changeStatus) { _hasMemDirtyChanged = changeStatus; }
@@ -256,6 +281,11 @@ private:
     std::chrono::milliseconds _wopiDownloadDuration;
     std::chrono::milliseconds _wopiUploadDuration;
 
+    /// Tile cache lookups and evictions for this document.
+    uint64_t _tileCacheHits;
+    uint64_t _tileCacheMisses;
+    uint64_t _tileCacheEvictions;
+
     FILE* _procSMaps;
     std::time_t _lastTimeSMapsRead;
 
@@ -377,8 +407,12 @@ public:
     void cleanupResourceConsumingDocs();
 
     void setViewLoadDuration(const std::string& docKey, const std::string& sessionId, std::chrono::milliseconds viewLoadDuration);
+    void setViewCompressionStats(const std::string& docKey, const std::string& sessionId,
+                                 uint64_t raw, uint64_t compressed);
     void setDocWopiDownloadDuration(const std::string& docKey, std::chrono::milliseconds wopiDownloadDuration);
     void setDocWopiUploadDuration(const std::string& docKey, const std::chrono::milliseconds wopiUploadDuration);
+    void setDocTileCacheStats(const std::string& docKey, uint64_t hits, uint64_t misses,
+                              uint64_t evictions);
     void addSegFaultCount(unsigned segFaultCount);
     void setForKitPid(pid_t pid) { _forKitPid = pid; }
     void addLostKitsTerminated(unsigned lostKitsTerminated);
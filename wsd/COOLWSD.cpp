@@ -123,6 +123,8 @@ using Poco::Net::PartHandler;
 #include "DocumentBroker.hpp"
 #include "Exceptions.hpp"
 #include "FileServer.hpp"
+#include "PrespawnPolicy.hpp"
+#include "WarmupPolicy.hpp"
 #include "ProxyRequestHandler.hpp"
 #include <common/JsonUtil.hpp>
 #include <common/FileUtil.hpp>
@@ -209,6 +211,12 @@ static std::vector<std::shared_ptr<ChildProcess> > NewChildren;
 
 static std::chrono::steady_clock::time_point LastForkRequestTime = std::chrono::steady_clock::now();
 static std::atomic<int> OutstandingForks(0);
+#if !MOBILEAPP
+static PrespawnPolicy Prespawn;
+static WarmupPolicy Warmup;
+/// When a document last found no spare child, under NewChildrenMutex.
+static std::chrono::steady_clock::time_point LastChildMissTime;
+#endif
 static std::map<std::string, std::shared_ptr<DocumentBroker> > DocBrokers;
 static std::mutex DocBrokersMutex;
 static Poco::AutoPtr<Poco::Util::XMLConfiguration> KitXmlConfig;
@@ -439,6 +447,7 @@ static int forkChildren(const int number)
 #endif
         OutstandingForks += number;
         LastForkRequestTime = std::chrono::steady_clock::now();
+        Prespawn.recordSpawnRequest(LastForkRequestTime, number);
         return number;
     }
 
@@ -485,13 +494,16 @@ static int rebalanceChildren(int balance)
         LOG_WRN("ForKit not responsive for " << durationMs << " forking " << OutstandingForks
                                              << " children. Resetting.");
         OutstandingForks = 0;
+        Prespawn.resetSpawnRequests();
     }
 
     const size_t available = NewChildren.size();
     balance -= available;
     balance -= OutstandingForks;
 
-    if (balance > 0 && (rebalance || OutstandingForks == 0))
+    // In adaptive mode the target grows with a burst of opens, so top up
+    // without waiting for the outstanding forks to arrive.
+    if (balance > 0 && (rebalance || OutstandingForks == 0 || Prespawn.isAdaptive()))
     {
         LOG_DBG("prespawnChildren: Have " << available << " spare " <<
                 (available == 1 ? "child" : "children") << ", and " <<
@@ -509,7 +521,20 @@ static bool prespawnChildren()
 {
     // Rebalance if not forking already.
     std::unique_lock<std::mutex> lock(NewChildrenMutex, std::defer_lock);
-    return lock.try_lock() && (rebalanceChildren(COOLWSD::NumPreSpawnedChildren) > 0);
+    return lock.try_lock()
+           && (rebalanceChildren(Prespawn.getTarget(std::chrono::steady_clock::now())) > 0);
+}
+
+void COOLWSD::getPrespawnMetrics(std::ostream& os)
+{
+    Prespawn.dumpMetrics(os, std::chrono::steady_clock::now());
+    Warmup.dumpMetrics(os);
+}
+
+void COOLWSD::recordKitLoad(const std::string& filename, const std::string& warmType,
+                            std::chrono::milliseconds duration)
+{
+    Warmup.recordLoad(filename, warmType, duration);
 }
 
 #endif
@@ -519,6 +544,12 @@ static size_t addNewChild(std::shared_ptr<ChildProcess> child)
     assert(child && "Adding null child");
     const auto pid = child->getPid();
 
+#if !MOBILEAPP
+    // Measured before locking, as reading the smaps isn't instant.
+    const std::size_t memoryKb = Prespawn.isAdaptive() ? Util::getMemoryUsagePSS(pid) : 0;
+    Prespawn.recordSpawn(std::chrono::steady_clock::now(), memoryKb * 1024);
+#endif
+
     std::unique_lock<std::mutex> lock(NewChildrenMutex);
 
     --OutstandingForks;
@@ -529,6 +560,43 @@ static size_t addNewChild(std::shared_ptr<ChildProcess> child)
     // Reset the child-spawn timeout to the default, now that we're set.
     ChildSpawnTimeoutMs = CHILD_TIMEOUT_MS;
 
+#if !MOBILEAPP
+    if (Warmup.isEnabled())
+    {
+        // In a burst, the child goes to a document right away, which would then wait
+        // for the warm-up to finish, so don't. Waiting documents retry about every
+        // CHILD_REBALANCE_INTERVAL_MS / 10, and we are short of spares until we
+        // have the target.
+        const auto now = std::chrono::steady_clock::now();
+        const bool documentsWaiting
+            = now - LastChildMissTime < std::chrono::milliseconds(CHILD_REBALANCE_INTERVAL_MS / 5);
+        if (documentsWaiting || NewChildren.size() + 1 < Prespawn.getTarget(now))
+        {
+            LOG_DBG("Not warming up new child [" << pid << "], as spares are in demand");
+        }
+        else
+        {
+            // Sent before any document can take the child, so nothing else writes to it.
+            std::vector<std::string> spares;
+            for (const auto& spare : NewChildren)
+                spares.push_back(spare->getWarmType());
+
+            const std::string warmType = Warmup.pickType(spares);
+            LOG_DBG("Warming up new child [" << pid << "] for " << warmType << " documents");
+            try
+            {
+                if (child->sendTextFrame("warmup " + warmType))
+                    child->setWarmType(warmType);
+            }
+            catch (const std::exception& exc)
+            {
+                LOG_WRN("Failed to warm up new child [" << pid << "], adding it as it is: "
+                                                         << exc.what());
+            }
+        }
+    }
+#endif
+
     LOG_TRC("Adding a new child " << pid << " to NewChildren");
     NewChildren.emplace_back(std::move(child));
     const size_t count = NewChildren.size();
@@ -547,7 +615,8 @@ std::mutex COOLWSD::lokit_main_mutex;
 #endif
 #endif
 
-std::shared_ptr<ChildProcess> getNewChild_Blocks(unsigned mobileAppDocId)
+std::shared_ptr<ChildProcess> getNewChild_Blocks(unsigned mobileAppDocId, bool wait,
+                                                 const std::string& docType, bool firstAttempt)
 {
     std::unique_lock<std::mutex> lock(NewChildrenMutex);
 
@@ -557,7 +626,12 @@ std::shared_ptr<ChildProcess> getNewChild_Blocks(unsigned mobileAppDocId)
     (void) mobileAppDocId;
 
     LOG_DBG("getNewChild: Rebalancing children.");
-    int numPreSpawn = COOLWSD::NumPreSpawnedChildren;
+    // Brokers retry until they get a child, an open is only the first of those.
+    if (firstAttempt)
+        Prespawn.recordOpen(startTime, !NewChildren.empty());
+    if (NewChildren.empty())
+        LastChildMissTime = startTime;
+    int numPreSpawn = Prespawn.getTarget(startTime);
     ++numPreSpawn; // Replace the one we'll dispatch just now.
     if (rebalanceChildren(numPreSpawn) < 0)
     {
@@ -569,9 +643,12 @@ std::shared_ptr<ChildProcess> getNewChild_Blocks(unsigned mobileAppDocId)
         return nullptr;
     }
 
-    const auto timeout = std::chrono::milliseconds(ChildSpawnTimeoutMs / 2);
+    // Without waiting, just take a child if we have one ready.
+    const auto timeout = std::chrono::milliseconds(wait ? ChildSpawnTimeoutMs / 2 : 0);
     LOG_TRC("Waiting for a new child for a max of " << timeout);
 #else
+    (void) wait;
+    (void) firstAttempt;
     const auto timeout = std::chrono::hours(100);
 
     std::thread([&]
@@ -600,8 +677,20 @@ std::shared_ptr<ChildProcess> getNewChild_Blocks(unsigned mobileAppDocId)
                                }))
     {
         LOG_TRC("NewChildrenCV wait successful");
-        std::shared_ptr<ChildProcess> child = NewChildren.back();
-        NewChildren.pop_back();
+
+        // The newest child warmed up for the document, else the newest one.
+        auto it = std::prev(NewChildren.end());
+        if (!docType.empty())
+        {
+            auto warm = std::find_if(NewChildren.rbegin(), NewChildren.rend(),
+                                     [&docType](const std::shared_ptr<ChildProcess>& spare)
+                                     { return spare->getWarmType() == docType; });
+            if (warm != NewChildren.rend())
+                it = std::prev(warm.base());
+        }
+
+        std::shared_ptr<ChildProcess> child = *it;
+        NewChildren.erase(it);
         const size_t available = NewChildren.size();
 
         // Validate before returning.
@@ -1779,12 +1868,22 @@ void COOLWSD::innerInitialize(Application& self)
         { "logging.userstats", "false" },
         { "browser_logging", "false" },
         { "mount_jail_tree", "true" },
+        { "jail_provisioning", "link" },
         { "net.connection_timeout_secs", "30" },
         { "net.listen", "any" },
         { "net.proto", "all" },
+        { "net.poll_backend", "poll" },
+        { "net.ws_compression.enable", "false" },
+        { "net.ws_compression.window_bits", "15" },
+        { "net.ws_compression.skip_binary",
+          "tile: tilecombine: delta: renderfont: rendersearchresult: windowpaint:" },
         { "net.service_root", "" },
         { "net.proxy_prefix", "false" },
         { "num_prespawn_children", "1" },
+        { "prespawn.adaptive", "false" },
+        { "prespawn.max_children", "10" },
+        { "prespawn.max_memory_mb", "1024" },
+        { "prespawn.warm_templates", "false" },
         { "per_document.always_save_on_exit", "false" },
         { "per_document.autosave_duration_secs", "300" },
         { "per_document.cleanup.cleanup_interval_ms", "10000" },
@@ -1805,11 +1904,17 @@ void COOLWSD::innerInitialize(Application& self)
         { "per_document.limit_stack_mem_kb", "8000" },
         { "per_document.limit_virt_mem_mb", "0" },
         { "per_document.max_concurrency", "4" },
+        { "per_document.tile_compression", "default" },
+        { "per_document.banded_rendering", "false" },
+        { "per_document.tile_delta_ratio", "2.0" },
+        { "per_document.tile_cache_eviction", "viewport" },
         { "per_document.batch_priority", "5" },
         { "per_document.pdf_resolution_dpi", "96" },
+        { "per_document.shared_poll_threads", "0" },
         { "per_document.redlining_as_comments", "false" },
         { "per_view.group_download_as", "false" },
         { "per_view.idle_timeout_secs", "900" },
+        { "per_view.known_tile_cache_size", "64" },
         { "per_view.out_of_focus_timeout_secs", "120" },
         { "security.capabilities", "true" },
         { "security.seccomp", "true" },
@@ -1827,12 +1932,16 @@ void COOLWSD::innerInitialize(Application& self)
         { "ssl.sts.enabled", "false" },
         { "ssl.sts.max_age", "31536000" },
         { "ssl.key_file_path", COOLWSD_CONFIGDIR "/key.pem" },
+        { "ssl.ktls", "false" },
         { "ssl.termination", "true" },
         { "storage.filesystem[@allow]", "false" },
         // "storage.ssl.enable" - deliberately not set; for back-compat
         { "storage.wopi.max_file_size", "0" },
         { "storage.wopi[@allow]", "true" },
         { "storage.wopi.locking.refresh", "900" },
+        { "storage.wopi.connection_pool[@enable]", "true" },
+        { "storage.wopi.connection_pool.max_idle_per_host", "8" },
+        { "storage.wopi.connection_pool.idle_timeout_secs", "30" },
         { "sys_template_path", "systemplate" },
         { "trace_event[@enable]", "false" },
         { "trace.path[@compress]", "true" },
@@ -2094,6 +2203,30 @@ void COOLWSD::innerInitialize(Application& self)
             LOG_WRN("Invalid listen address: " << listen << ". Falling back to default: 'any'" );
     }
 
+    {
+        const std::string backend = getConfigValue<std::string>(conf, "net.poll_backend", "poll");
+        if (!Util::iequal(backend, "poll") && !Util::iequal(backend, "epoll"))
+            LOG_WRN("Invalid poll backend: " << backend << ". Falling back to default: 'poll'");
+        SocketPoll::setPollBackend(SocketPoll::parsePollBackend(Util::toLower(backend)));
+    }
+
+#if !MOBILEAPP
+    {
+        WebSocketDeflate::Config& deflate = WebSocketDeflate::config();
+        deflate._enabled = getConfigValue<bool>(conf, "net.ws_compression.enable", false);
+        deflate._windowBits = getConfigValue<int>(conf, "net.ws_compression.window_bits", 15);
+        if (deflate._windowBits < 9 || deflate._windowBits > 15)
+        {
+            LOG_WRN("Invalid net.ws_compression.window_bits: " << deflate._windowBits
+                                                              << ". Falling back to default: 15");
+            deflate._windowBits = 15;
+        }
+
+        deflate._skipBinary = Util::splitStringToVector(
+            getConfigValue<std::string>(conf, "net.ws_compression.skip_binary", ""), ' ');
+    }
+#endif
+
     // Prefix for the coolwsd pages; should not end with a '/'
     ServiceRoot = getPathFromConfig("net.service_root");
     while (ServiceRoot.length() > 0 && ServiceRoot[ServiceRoot.length() - 1] == '/')
@@ -2236,14 +2369,45 @@ void COOLWSD::innerInitialize(Application& self)
     }
     LOG_INF("NumPreSpawnedChildren set to " << NumPreSpawnedChildren << '.');
 
+    bool adaptivePrespawn = getConfigValue<bool>(conf, "prespawn.adaptive", false);
+#if ENABLE_DEBUG
+    // A single kit is one kit, whatever the demand.
+    adaptivePrespawn = adaptivePrespawn && !SingleKit;
+#endif
+    const unsigned maxPrespawn = getConfigValue<unsigned>(conf, "prespawn.max_children", 10);
+    const uint64_t prespawnMemoryMb = getConfigValue<unsigned>(conf, "prespawn.max_memory_mb", 1024);
+    Prespawn.configure(adaptivePrespawn, NumPreSpawnedChildren, maxPrespawn,
+                       prespawnMemoryMb * 1024 * 1024);
+    if (adaptivePrespawn)
+        LOG_INF("Adaptive prespawn between " << NumPreSpawnedChildren << " and "
+                                             << std::max(NumPreSpawnedChildren, maxPrespawn)
+                                             << " spare children, within " << prespawnMemoryMb
+                                             << " MB.");
+
+    const bool warmTemplates = getConfigValue<bool>(conf, "prespawn.warm_templates", false);
+    Warmup.configure(warmTemplates);
+    if (warmTemplates)
+        LOG_INF("Spare children warm up for the documents most opened.");
+
     FileUtil::registerFileSystemForDiskSpaceChecks(ChildRoot);
 
-    const auto maxConcurrency = getConfigValue<int>(conf, "per_document.max_concurrency", 4);
-    if (maxConcurrency > 0)
-    {
-        setenv("MAX_CONCURRENCY", std::to_string(maxConcurrency).c_str(), 1);
-    }
-    LOG_INF("MAX_CONCURRENCY set to " << maxConcurrency << '.');
+    // Size the kit render pools by the CPUs we may use, capped by the config.
+    const int availableCpus = Util::getAvailableCpuCount();
+    auto maxConcurrency = getConfigValue<int>(conf, "per_document.max_concurrency", 4);
+    if (maxConcurrency <= 0 || maxConcurrency > availableCpus)
+        maxConcurrency = availableCpus;
+    setenv("MAX_CONCURRENCY", std::to_string(maxConcurrency).c_str(), 1);
+    LOG_INF("MAX_CONCURRENCY set to " << maxConcurrency << " with " << availableCpus
+                                      << " available CPUs.");
+
+    const auto tileCompression
+        = getConfigValue<std::string>(conf, "per_document.tile_compression", "default");
+    setenv("TILE_COMPRESSION", tileCompression.c_str(), 1);
+    LOG_INF("TILE_COMPRESSION set to " << tileCompression << '.');
+
+    const bool bandedRendering = getConfigValue<bool>(conf, "per_document.banded_rendering", false);
+    setenv("BANDED_RENDERING", bandedRendering ? "true" : "false", 1);
+    LOG_INF("BANDED_RENDERING set to " << bandedRendering << '.');
 #endif
 
     const auto redlining = getConfigValue<bool>(conf, "per_document.redlining_as_comments", false);
@@ -2453,7 +2617,17 @@ void COOLWSD::initializeSSL()
     if (!ssl::Manager::isServerContextInitialized())
         LOG_ERR("Failed to initialize Server SSL.");
     else
+    {
         LOG_INF("Initialized Server SSL.");
+
+        if (config().getBool("ssl.ktls", false))
+        {
+            if (ssl::Manager::setServerKtls(true))
+                LOG_INF("Kernel TLS offload enabled where the kernel supports it.");
+            else
+                LOG_WRN("Kernel TLS offload requested, but OpenSSL lacks support.");
+        }
+    }
 #else
     LOG_INF("SSL is unavailable in this build.");
 #endif
@@ -2950,6 +3124,7 @@ bool COOLWSD::createForKit()
     LOG_INF("Launching forkit process: " << forKitPath << ' ' << args.cat(' ', 0));
 
     LastForkRequestTime = std::chrono::steady_clock::now();
+    Prespawn.recordSpawnRequest(LastForkRequestTime, 1);
     int child = Util::spawnProcess(forKitPath, args);
     ForKitProcId = child;
 
@@ -2958,7 +3133,7 @@ bool COOLWSD::createForKit()
     // Init the Admin manager
     Admin::instance().setForKitPid(ForKitProcId);
 
-    const int balance = COOLWSD::NumPreSpawnedChildren - OutstandingForks;
+    const int balance = static_cast<int>(Prespawn.getTarget(LastForkRequestTime)) - OutstandingForks;
     if (balance > 0)
         rebalanceChildren(balance);
 
@@ -4418,35 +4593,56 @@ private:
 
                             LOG_DBG('#' << moveSocket->getFD() << " handler is " << clientSession->getName());
 
-                            // Add and load the session.
-                            docBroker->addSession(clientSession);
-
-                            COOLWSD::checkDiskSpaceAndWarnClients(true);
-                            // Users of development versions get just an info
-                            // when reaching max documents or connections
-                            COOLWSD::checkSessionLimitsAndWarnClients();
-
-                            sendLoadResult(clientSession, true, "");
-                        }
-                        catch (const UnauthorizedRequestException& exc)
-                        {
-                            LOG_ERR("Unauthorized Request while starting session on "
-                                    << docBroker->getDocKey() << " for socket #"
-                                    << moveSocket->getFD()
-                                    << ". Terminating connection. Error: " << exc.what());
-                            const std::string msg = "error: cmd=internal kind=unauthorized";
-                            ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
-                            moveSocket->ignoreInput();
-                        }
-                        catch (const StorageConnectionException& exc)
-                        {
-                            LOG_ERR("Storage error while starting session on "
-                                    << docBroker->getDocKey() << " for socket #"
-                                    << moveSocket->getFD()
-                                    << ". Terminating connection. Error: " << exc.what());
-                            const std::string msg = "error: cmd=storage kind=loadfailed";
-                            ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
-                            moveSocket->ignoreInput();
+                            // Add and load the session, polling the others meanwhile.
+                            std::weak_ptr<StreamSocket> weakSocket = streamSocket;
+                            docBroker->addSessionAsync(clientSession,
+                                [docBroker, clientSession, ws, weakSocket](std::exception_ptr error)
+                            {
+                                try
+                                {
+                                    if (error)
+                                        std::rethrow_exception(error);
+
+                                    COOLWSD::checkDiskSpaceAndWarnClients(true);
+                                    // Users of development versions get just an info
+                                    // when reaching max documents or connections
+                                    COOLWSD::checkSessionLimitsAndWarnClients();
+
+                                    sendLoadResult(clientSession, true, "");
+                                    return;
+                                }
+                                catch (const UnauthorizedRequestException& exc)
+                                {
+                                    LOG_ERR("Unauthorized Request while starting session on "
+                                            << docBroker->getDocKey() << " for session ["
+                                            << clientSession->getId()
+                                            << "]. Terminating connection. Error: " << exc.what());
+                                    const std::string msg = "error: cmd=internal kind=unauthorized";
+                                    ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
+                                }
+                                catch (const StorageConnectionException& exc)
+                                {
+                                    LOG_ERR("Storage error while starting session on "
+                                            << docBroker->getDocKey() << " for session ["
+                                            << clientSession->getId()
+                                            << "]. Terminating connection. Error: " << exc.what());
+                                    const std::string msg = "error: cmd=storage kind=loadfailed";
+                                    ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
+                                }
+                                catch (const std::exception& exc)
+                                {
+                                    LOG_ERR("Error while starting session on "
+                                            << docBroker->getDocKey() << " for session ["
+                                            << clientSession->getId()
+                                            << "]. Terminating connection. Error: " << exc.what());
+                                    const std::string msg = "error: cmd=storage kind=loadfailed";
+                                    ws->shutdown(WebSocketHandler::StatusCodes::POLICY_VIOLATION, msg);
+                                }
+
+                                std::shared_ptr<StreamSocket> loadSocket = weakSocket.lock();
+                                if (loadSocket)
+                                    loadSocket->ignoreInput();
+                            });
                         }
                         catch (const std::exception& exc)
                         {
@@ -5116,6 +5312,13 @@ int COOLWSD::innerMain()
     // URI with /contents are public and we don't need to anonymize them.
     Util::mapAnonymized("contents", "contents");
 
+#if !MOBILEAPP
+    int sharedPollThreads = getConfigValue<int>("per_document.shared_poll_threads", 0);
+    if (sharedPollThreads < 0)
+        sharedPollThreads = std::thread::hardware_concurrency();
+    DocumentBroker::startPollWorkers(sharedPollThreads);
+#endif
+
     // Start the server.
     Server->start();
 
@@ -5279,6 +5482,10 @@ int COOLWSD::innerMain()
         DocBrokers.clear();
     }
 
+#if !MOBILEAPP
+    DocumentBroker::stopPollWorkers();
+#endif
+
     if (TraceEventFile != NULL)
     {
         // If we have written any objects to it, it ends with a comma and newline. Back over those.
@@ -5361,6 +5568,7 @@ void COOLWSD::cleanup()
         SavedClipboards.reset();
 
         FileServerRequestHandler::uninitialize();
+        StorageBase::uninitialize();
         JWTAuth::cleanup();
 
 #if ENABLE_SSL
@@ -36,7 +36,11 @@ class TraceFileWriter;
 class DocumentBroker;
 class ClipboardCache;
 
-std::shared_ptr<ChildProcess> getNewChild_Blocks(unsigned mobileAppDocId = 0);
+/// Takes a spare child, preferably one warmed up for @docType, see WarmupPolicy.
+/// The document's open is recorded, see PrespawnPolicy, on its @firstAttempt only.
+std::shared_ptr<ChildProcess> getNewChild_Blocks(unsigned mobileAppDocId = 0, bool wait = true,
+                                                 const std::string& docType = std::string(),
+                                                 bool firstAttempt = true);
 
 // A WSProcess object in the WSD process represents a descendant process, either the direct child
 // process ForKit or a grandchild Kit process, with which the WSD process communicates through a
@@ -433,6 +437,15 @@ public:
     /// Sets the log level of current kits.
     static void setLogLevelsOfKits(const std::string& level);
 
+#if !MOBILEAPP
+    /// Writes the kit spawning and prespawn pool metrics, for the admin console.
+    static void getPrespawnMetrics(std::ostream& os);
+
+    /// A kit warmed up for @warmType, if any, took @duration to load @filename.
+    static void recordKitLoad(const std::string& filename, const std::string& warmType,
+                              std::chrono::milliseconds duration);
+#endif
+
     /// Anonymize the basename of filenames, preserving the path and extension.
     static std::string anonymizeUrl(const std::string& url)
     {
@@ -71,6 +71,8 @@ ClientSession::ClientSession(
     _kitViewId(-1),
     _serverURL(requestDetails),
     _isTextDocument(false),
+    _maxKnownTileCacheSize(std::max(
+        COOLWSD::getConfigValue<int>("per_view.known_tile_cache_size", 64), 0)),
     _lastSentFormFielButtonMessage("")
 {
     const std::size_t curConnections = ++COOLWSD::NumConnections;
@@ -504,6 +506,8 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         sendTextFrame("coolserver " + Util::getVersionJSON(EnableExperimental));
         // Send LOKit version information
         sendTextFrame("lokitversion " + COOLWSD::LOKitVersion);
+        // Offer knowntile: messages; only used once the client accepts.
+        sendTextFrame("knowntilecache " + std::to_string(_maxKnownTileCacheSize));
 
         // If Trace Event generation and logging is enabled (whether it can be turned on), tell it
         // to cool
@@ -534,6 +538,19 @@ bool ClientSession::_handleInput(const char *buffer, int length)
             sendTextFrame("infobar: " + infobar);
 #endif
     }
+    else if (tokens.equals(0, "knowntilecache"))
+    {
+        // The client accepts our offer, and keeps this many keyframes.
+        int size = 0;
+        if (tokens.size() != 2 || !COOLProtocol::stringToInteger(tokens[1], size) || size < 0)
+        {
+            sendTextFrameAndLogError("error: cmd=knowntilecache kind=syntax");
+            return false;
+        }
+
+        _keyframeTracker.reset(std::min<std::size_t>(size, _maxKnownTileCacheSize));
+        return true;
+    }
     else if (tokens.equals(0, "jserror") || tokens.equals(0, "jsexception"))
     {
         LOG_ERR(std::string(buffer, length));
@@ -1359,13 +1376,24 @@ void ClientSession::writeQueuedMessages(std::size_t capacity)
         // Drain the queue, for efficient communication.
         while (capacity > wrote && _senderQueue.dequeue(item) && item)
         {
+            if (item->isBinary() && item->firstTokenMatches("knowntile:"))
+            {
+                // The tiles written since this was queued may have pushed its keyframe out.
+                const std::vector<char> tile
+                    = _keyframeTracker.expandKnownTile(item->firstLine(), item->data());
+                if (!tile.empty())
+                    item = std::make_shared<Message>(tile.data(), tile.size(), Message::Dir::Out);
+            }
+
             const std::vector<char>& data = item->data();
             const auto size = data.size();
             assert(size && "Zero-sized messages must never be queued for sending.");
 
             if (item->isBinary())
             {
-                Session::sendBinaryFrame(data.data(), size);
+                // The message is immutable, so the socket can queue it by reference.
+                Session::sendSharedBinaryFrame(item, data.data(), size);
+                _keyframeTracker.written(item->firstLine());
             }
             else
             {
@@ -1382,6 +1410,9 @@ void ClientSession::writeQueuedMessages(std::size_t capacity)
                                           << " to client: " << ex.what());
     }
 
+    if (!hasQueuedMessages())
+        _keyframeTracker.unpinAll();
+
     LOG_TRC("performed write, wrote " << wrote << " bytes");
 }
 
@@ -1953,7 +1984,7 @@ void ClientSession::enqueueSendMessage(const std::shared_ptr<Message>& data)
     docBroker->assertCorrectThread();
 
     std::unique_ptr<TileDesc> tile;
-    if (data->firstTokenMatches("tile:"))
+    if (data->firstTokenMatches("tile:") || data->firstTokenMatches("knowntile:"))
     {
         // Avoid sending tile if it has the same wireID as the previously sent tile
         tile = Util::make_unique<TileDesc>(TileDesc::parse(data->firstLine()));
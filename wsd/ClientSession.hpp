@@ -104,7 +104,28 @@ public:
 
         std::string header;
         if (tile->needsKeyframe(lastSentId) || tile->isPng())
-            header = desc.serialize("tile:", "\n");
+        {
+            const auto& keyframe = tile->getKeyframe();
+            const std::string hash = keyframe ? keyframe->_hash.toString() : std::string();
+            if (!hash.empty() && _keyframeTracker.isKnown(hash))
+            {
+                // The client has these pixels from another tile: name them and
+                // send just the deltas on top, if any. Should the client drop
+                // them meanwhile, the keyframe is sent when written after all.
+                _keyframeTracker.pin(keyframe);
+                header = desc.serialize("knowntile:", " hash=" + hash + "\n");
+                std::vector<char> output(header.begin(), header.end());
+                tile->appendChangesSince(output, tile->_wids[0]);
+                LOG_TRC(" Sending known tile message: " << header << " lastSendId " << lastSentId);
+                return sendBinaryFrame(output.data(), output.size());
+            }
+
+            // Only bare keyframes are for the client to keep.
+            if (!hash.empty() && tile->isKeyframeOnly() && _keyframeTracker.getSize() > 0)
+                header = desc.serialize("tile:", " hash=" + hash + "\n");
+            else
+                header = desc.serialize("tile:", "\n");
+        }
         else
             header = desc.serialize("delta:", "\n");
 
@@ -197,6 +218,10 @@ public:
     /// Returns the normalized visible area of a given split-pane.
     Util::Rectangle getNormalizedVisiblePaneArea(const SplitPaneName) const;
 
+    int getSelectedPart() const { return _clientSelectedPart; }
+
+    bool isTileInsideVisibleArea(const TileDesc& tile) const;
+
     int getTileWidthInTwips() const { return _tileWidthTwips; }
     int getTileHeightInTwips() const { return _tileHeightTwips; }
 
@@ -279,8 +304,6 @@ private:
     void handleTileInvalidation(const std::string& message,
                                 const std::shared_ptr<DocumentBroker>& docBroker);
 
-    bool isTileInsideVisibleArea(const TileDesc& tile) const;
-
     /// If this session is read-only because of failed lock, try to unlock and make it read-write.
     bool attemptLock(const std::shared_ptr<DocumentBroker>& docBroker);
 
@@ -358,6 +381,12 @@ private:
     /// Store wireID's of the sent tiles inside the actual visible area
     std::map<std::string, TileWireId> _oldWireIds;
 
+    /// How many keyframes we offer the client to keep for knowntile: messages.
+    const std::size_t _maxKnownTileCacheSize;
+
+    /// The keyframes the client keeps, none until it accepts our offer.
+    ClientKeyframeTracker _keyframeTracker;
+
     /// Sockets to send binary selection content to
     std::vector<std::weak_ptr<StreamSocket>> _clipSockets;
 
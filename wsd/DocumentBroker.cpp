@@ -9,12 +9,14 @@
 
 #include "DocumentBroker.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
 #include <ctime>
 #include <ios>
 #include <fstream>
+#include <mutex>
 #include <sstream>
 
 #include <Poco/DigestStream.h>
@@ -35,6 +37,7 @@
 #include "ProxyProtocol.hpp"
 #include "Util.hpp"
 #include "QuarantineUtil.hpp"
+#include "WarmupPolicy.hpp"
 #include <common/Log.hpp>
 #include <common/Message.hpp>
 #include <common/Clipboard.hpp>
@@ -87,7 +90,8 @@ void DocumentBroker::broadcastLastModificationTime(
     broadcastMessage(message);
 }
 
-/// The Document Broker Poll - one of these in a thread per document
+/// The Document Broker Poll - one of these in a thread per document,
+/// or run on a shared thread, see DocumentBroker::startPollWorkers().
 class DocumentBroker::DocumentBrokerPoll final : public TerminatingPoll
 {
     /// The DocumentBroker owning us.
@@ -105,8 +109,67 @@ public:
         // Delegate to the docBroker.
         _docBroker.pollThread();
     }
+
+#if !MOBILEAPP
+    bool pollingStep(int64_t& timeoutMicroS, bool& pollSockets) override
+    {
+        return _docBroker.pollStep(timeoutMicroS, pollSockets);
+    }
+#endif
 };
 
+#if !MOBILEAPP
+namespace
+{
+/// The shared threads running the polls of interactive documents, if any.
+std::mutex PollWorkersMutex;
+std::vector<std::shared_ptr<SocketPollWorker>> PollWorkers;
+
+/// The shared thread running the fewest documents, if any.
+std::shared_ptr<SocketPollWorker> getPollWorker()
+{
+    std::lock_guard<std::mutex> lock(PollWorkersMutex);
+
+    std::shared_ptr<SocketPollWorker> best;
+    for (const auto& worker : PollWorkers)
+    {
+        if (!best || worker->getGuestCount() < best->getGuestCount())
+            best = worker;
+    }
+
+    return best;
+}
+}
+
+void DocumentBroker::startPollWorkers(std::size_t count)
+{
+    std::lock_guard<std::mutex> lock(PollWorkersMutex);
+
+    for (std::size_t i = PollWorkers.size(); i < count; ++i)
+    {
+        auto worker = std::make_shared<SocketPollWorker>("docpoll_" + std::to_string(i));
+        worker->startThread();
+        PollWorkers.push_back(std::move(worker));
+    }
+
+    if (!PollWorkers.empty())
+        LOG_INF("Running the polls of interactive documents on " << PollWorkers.size()
+                                                                 << " shared threads");
+}
+
+void DocumentBroker::stopPollWorkers()
+{
+    std::vector<std::shared_ptr<SocketPollWorker>> workers;
+    {
+        std::lock_guard<std::mutex> lock(PollWorkersMutex);
+        std::swap(workers, PollWorkers);
+    }
+
+    for (const auto& worker : workers)
+        worker->joinThread();
+}
+#endif
+
 std::atomic<unsigned> DocumentBroker::DocBrokerId(1);
 
 DocumentBroker::DocumentBroker(ChildType type,
@@ -130,9 +193,17 @@ DocumentBroker::DocumentBroker(ChildType type,
     _poll(new DocumentBrokerPoll("doc" SHARED_DOC_THREADNAME_SUFFIX + _docId, *this)),
     _stop(false),
     _lockCtx(new LockContext()),
+    _lockRefreshPending(false),
     _tileVersion(0),
     _debugRenderedTileCount(0),
+    _pollStage(PollStage::Start),
+    _childRequested(false),
+    _adminSent(0),
+    _adminRecv(0),
+    _limitLoadSecs(0),
+    _limitStoreFailures(0),
     _wopiDownloadDuration(0),
+    _pendingDownload(false),
     _mobileAppDocId(mobileAppDocId)
 {
     assert(!_docKey.empty());
@@ -145,6 +216,16 @@ DocumentBroker::DocumentBroker(ChildType type,
     LOG_INF("DocumentBroker [" << COOLWSD::anonymizeUrl(_uriPublic.toString()) <<
             "] created with docKey [" << _docKey << ']');
 
+#if !MOBILEAPP
+    // Batch documents lower the priority of their thread, keep them apart.
+    if (_type == ChildType::Interactive)
+    {
+        std::shared_ptr<SocketPollWorker> worker = getPollWorker();
+        if (worker)
+            _poll->setWorker(worker);
+    }
+#endif
+
     if (UnitWSD::isUnitTesting())
     {
         UnitWSD::get().onDocBrokerCreate(_docKey);
@@ -182,20 +263,13 @@ void DocumentBroker::pollThread()
 
     // Request a kit process for this doc.
 #if !MOBILEAPP
-    do
-    {
-        static constexpr std::chrono::milliseconds timeoutMs(COMMAND_TIMEOUT_MS * 5);
-        _childProcess = getNewChild_Blocks();
-        if (_childProcess
-            || std::chrono::duration_cast<std::chrono::milliseconds>(
-                   std::chrono::steady_clock::now() - _threadStart)
-                   > timeoutMs)
-            break;
-
-        // Nominal time between retries, lest we busy-loop. getNewChild could also wait, so don't double that here.
-        std::this_thread::sleep_for(std::chrono::milliseconds(CHILD_REBALANCE_INTERVAL_MS / 10));
+    // Meanwhile, poll our sockets, so that new sessions start
+    // loading without waiting for it. See addSessionAsync().
+    while (_pollStage != PollStage::Poll && !takeNewChild())
+    {
+        // Nominal time between retries, lest we busy-loop.
+        _poll->poll(std::chrono::milliseconds(CHILD_REBALANCE_INTERVAL_MS / 10));
     }
-    while (!_stop && _poll->continuePolling() && !SigUtil::getTerminationFlag() && !SigUtil::getShutdownRequestFlag());
 #else
 #ifdef IOS
     assert(_mobileAppDocId > 0);
@@ -203,11 +277,131 @@ void DocumentBroker::pollThread()
     _childProcess = getNewChild_Blocks(_mobileAppDocId);
 #endif
 
+    if (_pollStage != PollStage::Poll && !startPolling())
+        return;
+
+    // Main polling loop goodness.
+    while (continuePollLoop())
+    {
+        _poll->poll(getPollTimeout());
+        pollIteration();
+    }
+
+    startFlushing();
+    for (std::chrono::microseconds timeoutMicroS = getFlushTimeout(); timeoutMicroS.count() > 0;
+         timeoutMicroS = getFlushTimeout())
+    {
+        _poll->poll(timeoutMicroS);
+
+        processBatchUpdates();
+    }
+
+    finishPolling();
+}
+
+#if !MOBILEAPP
+bool DocumentBroker::pollStep(int64_t& timeoutMicroS, bool& pollSockets)
+{
+    pollSockets = true;
+    if (_pollStage == PollStage::Start)
+    {
+        _threadStart = std::chrono::steady_clock::now();
+        LOG_INF("Starting docBroker polling for docKey [" << _docKey << "] on a shared thread");
+        _pollStage = PollStage::GetChild;
+    }
+
+    switch (_pollStage)
+    {
+        case PollStage::Start:
+        case PollStage::GetChild:
+        {
+            // Request a kit process for this doc, as pollThread(), but
+            // without holding up the other documents on our thread.
+            if (!takeNewChild())
+            {
+                // Retry soon, polling our sockets until then.
+                timeoutMicroS = std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::milliseconds(CHILD_REBALANCE_INTERVAL_MS / 10))
+                                    .count();
+                return true;
+            }
+
+            if (!startPolling())
+                return false;
+        }
+        break;
+
+        case PollStage::Poll:
+            pollIteration();
+            break;
+
+        case PollStage::Flush:
+            processBatchUpdates();
+            break;
+    }
+
+    if (_pollStage == PollStage::Poll)
+    {
+        if (continuePollLoop())
+        {
+            timeoutMicroS = getPollTimeout().count();
+            return true;
+        }
+
+        startFlushing();
+        _pollStage = PollStage::Flush;
+    }
+
+    const std::chrono::microseconds flushTimeoutMicroS = getFlushTimeout();
+    if (flushTimeoutMicroS.count() > 0)
+    {
+        timeoutMicroS = flushTimeoutMicroS.count();
+        return true;
+    }
+
+    finishPolling();
+    return false;
+}
+#endif
+
+#if !MOBILEAPP
+bool DocumentBroker::takeNewChild()
+{
+    static constexpr std::chrono::milliseconds timeoutMs(COMMAND_TIMEOUT_MS * 5);
+    _childProcess = getNewChild_Blocks(0, /*wait=*/false, getExpectedDocumentType(),
+                                       /*firstAttempt=*/!_childRequested);
+    _childRequested = true;
+    return _childProcess
+           || std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - _threadStart)
+                  > timeoutMs
+           || _stop || !_poll->continuePolling() || SigUtil::getTerminationFlag()
+           || SigUtil::getShutdownRequestFlag();
+}
+
+std::string DocumentBroker::getExpectedDocumentType() const
+{
+    // The file name is known once CheckFileInfo is done, else guess by the URI.
+    std::string filename = _filename;
+    if (filename.empty() && !_pendingSessions.empty() && _pendingSessions.front()._haveFileInfo)
+        filename = _pendingSessions.front()._fileInfo.getFilename();
+    if (filename.empty())
+        filename = _uriPublic.getPath();
+
+    return WarmupPolicy::getDocumentType(filename);
+}
+#endif
+
+bool DocumentBroker::startPolling()
+{
     if (!_childProcess)
     {
         // Let the client know we can't serve now.
         LOG_ERR("Failed to get new child.");
 
+        // As well as those still waiting to load.
+        failPendingSessions(std::make_exception_ptr(std::runtime_error("Failed to get new child.")));
+
         // FIXME: need to notify all clients and shut this down ...
         // FIXME: return something good down the websocket ...
 #if 0
@@ -226,7 +420,7 @@ void DocumentBroker::pollThread()
         COOLWSD::doHousekeeping();
 
         LOG_INF("Finished docBroker polling thread for docKey [" << _docKey << "].");
-        return;
+        return false;
     }
 
     // We have a child process.
@@ -236,16 +430,15 @@ void DocumentBroker::pollThread()
     setupPriorities();
 
 #if !MOBILEAPP
-    static const std::size_t IdleDocTimeoutSecs
-        = COOLWSD::getConfigValue<int>("per_document.idle_timeout_secs", 3600);
+    const auto now = std::chrono::steady_clock::now();
 
     // Used to accumulate B/W deltas.
-    uint64_t adminSent = 0;
-    uint64_t adminRecv = 0;
-    auto lastBWUpdateTime = std::chrono::steady_clock::now();
-    auto lastClipboardHashUpdateTime = std::chrono::steady_clock::now();
+    _adminSent = 0;
+    _adminRecv = 0;
+    _lastBWUpdateTime = now;
+    _lastClipboardHashUpdateTime = now;
 
-    const int limit_load_secs =
+    _limitLoadSecs =
 #if ENABLE_DEBUG
         // paused waiting for a debugger to attach
         // ignore load time out
@@ -253,237 +446,283 @@ void DocumentBroker::pollThread()
 #endif
         COOLWSD::getConfigValue<int>("per_document.limit_load_secs", 100);
 
-    auto loadDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(limit_load_secs);
+    _loadDeadline = now + std::chrono::seconds(_limitLoadSecs);
 #endif
 
-    const auto limStoreFailures =
-        COOLWSD::getConfigValue<int>("per_document.limit_store_failures", 5);
+    _limitStoreFailures = COOLWSD::getConfigValue<int>("per_document.limit_store_failures", 5);
 
-    // Main polling loop goodness.
-    while (!_stop && _poll->continuePolling() && !SigUtil::getTerminationFlag())
-    {
-        // Poll more frequently while unloading to cleanup sooner.
-        const bool unloading = isMarkedToDestroy() || _docState.isUnloadRequested();
-        _poll->poll(unloading ? SocketPoll::DefaultPollTimeoutMicroS / 16
-                              : SocketPoll::DefaultPollTimeoutMicroS);
+    _pollStage = PollStage::Poll;
 
-        // Consolidate updates across multiple processed events.
-        processBatchUpdates();
+    // Now that we have a jail, load the sessions that were waiting for one.
+    loadPendingSessions();
 
-        if (_stop)
-        {
-            LOG_DBG("Doc [" << _docKey << "] is flagged to stop after returning from poll.");
-            break;
-        }
+    return true;
+}
 
+bool DocumentBroker::continuePollLoop()
+{
+    return !_stop && _poll->continuePolling() && !SigUtil::getTerminationFlag();
+}
+
+std::chrono::microseconds DocumentBroker::getPollTimeout()
+{
+    // Poll more frequently while unloading to cleanup sooner.
+    const bool unloading = isMarkedToDestroy() || _docState.isUnloadRequested();
+    return unloading ? SocketPoll::DefaultPollTimeoutMicroS / 16
+                     : SocketPoll::DefaultPollTimeoutMicroS;
+}
+
+void DocumentBroker::pollIteration()
+{
 #if !MOBILEAPP
-        const auto now = std::chrono::steady_clock::now();
+    static const std::size_t IdleDocTimeoutSecs
+        = COOLWSD::getConfigValue<int>("per_document.idle_timeout_secs", 3600);
+#endif
 
-        // a tile's data is ~8k, a 4k screen is ~256 256x256 tiles
-        if (_tileCache)
-            _tileCache->setMaxCacheSize(8 * 1024 * 256 * _sessions.size());
+    // Consolidate updates across multiple processed events.
+    processBatchUpdates();
 
-        if (isInteractive())
-        {
-            // Extend the deadline while we are interactiving with the user.
-            loadDeadline = now + std::chrono::seconds(limit_load_secs);
-            continue;
-        }
+    if (_stop)
+    {
+        LOG_DBG("Doc [" << _docKey << "] is flagged to stop after returning from poll.");
+        return;
+    }
 
-        if (!isLoaded() && (limit_load_secs > 0) && (now > loadDeadline))
-        {
-            LOG_ERR("Doc [" << _docKey << "] is taking too long to load. Will kill process ["
-                    << _childProcess->getPid() << "]. per_document.limit_load_secs set to "
-                    << limit_load_secs << " secs.");
-            broadcastMessage("error: cmd=load kind=docloadtimeout");
+#if !MOBILEAPP
+    const auto now = std::chrono::steady_clock::now();
 
-            // Brutal but effective.
-            if (_childProcess)
-                _childProcess->terminate();
+    // a tile's data is ~8k, a 4k screen is ~256 256x256 tiles
+    if (_tileCache)
+        _tileCache->setMaxCacheSize(8 * 1024 * 256 * _sessions.size());
 
-            stop("Doc lifetime expired");
-            continue;
-        }
+    if (isInteractive())
+    {
+        // Extend the deadline while we are interactiving with the user.
+        _loadDeadline = now + std::chrono::seconds(_limitLoadSecs);
+        return;
+    }
 
-        // Check if we had a sunset time and expired.
-        if (_limitLifeSeconds > std::chrono::seconds::zero()
-            && std::chrono::duration_cast<std::chrono::seconds>(now - _threadStart)
-                   > _limitLifeSeconds)
-        {
-            LOG_WRN("Doc [" << _docKey << "] is taking too long to convert. Will kill process ["
-                            << _childProcess->getPid()
-                            << "]. per_document.limit_convert_secs set to "
-                            << _limitLifeSeconds.count() << " secs.");
-            broadcastMessage("error: cmd=load kind=docexpired");
+    if (!isLoaded() && (_limitLoadSecs > 0) && (now > _loadDeadline))
+    {
+        LOG_ERR("Doc [" << _docKey << "] is taking too long to load. Will kill process ["
+                << _childProcess->getPid() << "]. per_document.limit_load_secs set to "
+                << _limitLoadSecs << " secs.");
+        broadcastMessage("error: cmd=load kind=docloadtimeout");
 
-            // Brutal but effective.
-            if (_childProcess)
-                _childProcess->terminate();
+        // Brutal but effective.
+        if (_childProcess)
+            _childProcess->terminate();
 
-            stop("Convert-to timed out");
-            continue;
-        }
+        stop("Doc lifetime expired");
+        return;
+    }
 
-        if (std::chrono::duration_cast<std::chrono::milliseconds>
-                    (now - lastBWUpdateTime).count() >= COMMAND_TIMEOUT_MS)
+    // Check if we had a sunset time and expired.
+    if (_limitLifeSeconds > std::chrono::seconds::zero()
+        && std::chrono::duration_cast<std::chrono::seconds>(now - _threadStart)
+               > _limitLifeSeconds)
+    {
+        LOG_WRN("Doc [" << _docKey << "] is taking too long to convert. Will kill process ["
+                        << _childProcess->getPid()
+                        << "]. per_document.limit_convert_secs set to "
+                        << _limitLifeSeconds.count() << " secs.");
+        broadcastMessage("error: cmd=load kind=docexpired");
+
+        // Brutal but effective.
+        if (_childProcess)
+            _childProcess->terminate();
+
+        stop("Convert-to timed out");
+        return;
+    }
+
+    if (std::chrono::duration_cast<std::chrono::milliseconds>
+                (now - _lastBWUpdateTime).count() >= COMMAND_TIMEOUT_MS)
+    {
+        _lastBWUpdateTime = now;
+        uint64_t sent = 0, recv = 0;
+        getIOStats(sent, recv);
+
+        uint64_t deltaSent = 0, deltaRecv = 0;
+
+        // connection drop transiently reduces this.
+        if (sent > _adminSent)
         {
-            lastBWUpdateTime = now;
-            uint64_t sent = 0, recv = 0;
-            getIOStats(sent, recv);
+            deltaSent = sent - _adminSent;
+            _adminSent = sent;
+        }
+        if (recv > deltaRecv)
+        {
+            deltaRecv = recv - _adminRecv;
+            _adminRecv = recv;
+        }
+        LOG_TRC("Doc [" << _docKey << "] added stats sent: +" << deltaSent << ", recv: +" << deltaRecv << " bytes to totals.");
 
-            uint64_t deltaSent = 0, deltaRecv = 0;
+        // send change since last notification.
+        Admin::instance().addBytes(getDocKey(), deltaSent, deltaRecv);
 
-            // connection drop transiently reduces this.
-            if (sent > adminSent)
-            {
-                deltaSent = sent - adminSent;
-                adminSent = sent;
-            }
-            if (recv > deltaRecv)
-            {
-                deltaRecv = recv - adminRecv;
-                adminRecv = recv;
-            }
-            LOG_TRC("Doc [" << _docKey << "] added stats sent: +" << deltaSent << ", recv: +" << deltaRecv << " bytes to totals.");
+        if (_tileCache)
+        {
+            const TileCache::Stats& stats = _tileCache->getStats();
+            Admin::instance().setDocTileCacheStats(getDocKey(), stats._hits, stats._misses,
+                                                   stats._evictions);
+        }
 
-            // send change since last notification.
-            Admin::instance().addBytes(getDocKey(), deltaSent, deltaRecv);
+        for (const auto& sessionIt : _sessions)
+        {
+            uint64_t raw = 0, compressed = 0;
+            sessionIt.second->getCompressionStats(raw, compressed);
+            if (raw > 0)
+                Admin::instance().setViewCompressionStats(getDocKey(), sessionIt.first, raw,
+                                                          compressed);
         }
+    }
 
-        if (_storage && _lockCtx->needsRefresh(now))
-            refreshLock();
+    if (_storage && !_lockRefreshPending && _lockCtx->needsRefresh(now))
+        refreshLock();
 #endif
 
-        LOG_TRC("Poll: current activity: " << DocumentState::toString(_docState.activity()));
-        switch (_docState.activity())
+    LOG_TRC("Poll: current activity: " << DocumentState::toString(_docState.activity()));
+    switch (_docState.activity())
+    {
+        case DocumentState::Activity::None:
         {
-            case DocumentState::Activity::None:
+            // Check if there are queued activities.
+            if (!_renameFilename.empty() && !_renameSessionId.empty())
             {
-                // Check if there are queued activities.
-                if (!_renameFilename.empty() && !_renameSessionId.empty())
-                {
-                    startRenameFileCommand();
-                    // Nothing more to do until the save is complete.
-                    continue;
-                }
+                startRenameFileCommand();
+                // Nothing more to do until the save is complete.
+                return;
+            }
 
 #if !MOBILEAPP
-                // Remove idle documents after 1 hour.
-                if (isLoaded() && getIdleTimeSecs() >= IdleDocTimeoutSecs)
-                {
-                    autoSaveAndStop("idle");
-                }
-                else
+            // Remove idle documents after 1 hour.
+            if (isLoaded() && getIdleTimeSecs() >= IdleDocTimeoutSecs)
+            {
+                autoSaveAndStop("idle");
+            }
+            else
 #endif
-                if (_sessions.empty() && (isLoaded() || _docState.isMarkedToDestroy()))
-                {
-                    if (!isLoaded())
-                    {
-                        // Nothing to do; no sessions, not loaded, marked to destroy.
-                        stop("dead");
-                    }
-                    else if (_saveManager.isSaving() || isAsyncUploading())
-                    {
-                        LOG_DBG("Don't terminate dead DocumentBroker: async saving in progress for "
-                                "docKey ["
-                                << getDocKey() << "].");
-                        continue;
-                    }
-
-                    autoSaveAndStop("dead");
-                }
-                else if (_docState.isUnloadRequested() || SigUtil::getShutdownRequestFlag() ||
-                         _docState.isCloseRequested())
+            if (_sessions.empty() && _pendingSessions.empty()
+                && (isLoaded() || _docState.isMarkedToDestroy()))
+            {
+                if (!isLoaded())
                 {
-                    if (limStoreFailures > 0 && (_saveManager.saveFailureCount() >=
-                                                     static_cast<std::size_t>(limStoreFailures) ||
-                                                 _storageManager.uploadFailureCount() >=
-                                                     static_cast<std::size_t>(limStoreFailures)))
-                    {
-                        LOG_ERR("Failed to store the document and reached maximum retry count of "
-                                << limStoreFailures
-                                << ". Giving up. The document should be recoverable from the "
-                                   "quarantine. Save failures: "
-                                << _saveManager.saveFailureCount()
-                                << ", Upload failures: " << _storageManager.uploadFailureCount());
-                        stop("storefailed");
-                        continue;
-                    }
-
-                    const std::string reason =
-                        SigUtil::getShutdownRequestFlag()
-                            ? "recycling"
-                            : (!_closeReason.empty() ? _closeReason : "unloading");
-                    autoSaveAndStop(reason);
+                    // Nothing to do; no sessions, not loaded, marked to destroy.
+                    stop("dead");
                 }
-                else if (!_stop && _saveManager.needAutosaveCheck())
+                else if (_saveManager.isSaving() || isAsyncUploading())
                 {
-                    LOG_TRC("Triggering an autosave.");
-                    autoSave(false);
+                    LOG_DBG("Don't terminate dead DocumentBroker: async saving in progress for "
+                            "docKey ["
+                            << getDocKey() << "].");
+                    return;
                 }
-            }
-            break;
 
-            case DocumentState::Activity::Save:
-            case DocumentState::Activity::SaveAs:
+                autoSaveAndStop("dead");
+            }
+            else if (_docState.isUnloadRequested() || SigUtil::getShutdownRequestFlag() ||
+                     _docState.isCloseRequested())
             {
-                if (_docState.isDisconnected())
+                if (_limitStoreFailures > 0 && (_saveManager.saveFailureCount() >=
+                                                 static_cast<std::size_t>(_limitStoreFailures) ||
+                                             _storageManager.uploadFailureCount() >=
+                                                 static_cast<std::size_t>(_limitStoreFailures)))
                 {
-                    // We will never save. No need to wait for timeout.
-                    LOG_DBG("Doc disconnected while saving. Ending save activity.");
-                    _saveManager.setLastSaveResult(false);
-                    endActivity();
-                }
-                else
-                if (_saveManager.hasSavingTimedOut())
-                {
-                    LOG_DBG("Saving timedout. Ending save activity.");
-                    _saveManager.setLastSaveResult(false);
-                    endActivity();
+                    LOG_ERR("Failed to store the document and reached maximum retry count of "
+                            << _limitStoreFailures
+                            << ". Giving up. The document should be recoverable from the "
+                               "quarantine. Save failures: "
+                            << _saveManager.saveFailureCount()
+                            << ", Upload failures: " << _storageManager.uploadFailureCount());
+                    stop("storefailed");
+                    return;
                 }
-            }
-            break;
 
-            // We have some activity ongoing.
-            default:
+                const std::string reason =
+                    SigUtil::getShutdownRequestFlag()
+                        ? "recycling"
+                        : (!_closeReason.empty() ? _closeReason : "unloading");
+                autoSaveAndStop(reason);
+            }
+            else if (!_stop && _saveManager.needAutosaveCheck())
             {
-                constexpr std::chrono::seconds postponeAutosaveDuration(30);
-                LOG_TRC("Postponing autosave check by " << postponeAutosaveDuration);
-                _saveManager.postponeAutosave(postponeAutosaveDuration);
+                LOG_TRC("Triggering an autosave.");
+                autoSave(false);
             }
-            break;
         }
+        break;
 
-#if !MOBILEAPP
-        if (std::chrono::duration_cast<std::chrono::minutes>(now - lastClipboardHashUpdateTime).count() >= 2)
+        case DocumentState::Activity::Save:
+        case DocumentState::Activity::SaveAs:
         {
-            for (auto &it : _sessions)
+            if (_docState.isDisconnected())
             {
-                if (it.second->staleWaitDisconnect(now))
-                {
-                    std::string id = it.second->getId();
-                    LOG_WRN("Unusual, Kit session " + id + " failed its disconnect handshake, killing");
-                    finalRemoveSession(id);
-                    break; // it invalid.
-                }
+                // We will never save. No need to wait for timeout.
+                LOG_DBG("Doc disconnected while saving. Ending save activity.");
+                _saveManager.setLastSaveResult(false);
+                endActivity();
+            }
+            else
+            if (_saveManager.hasSavingTimedOut())
+            {
+                LOG_DBG("Saving timedout. Ending save activity.");
+                _saveManager.setLastSaveResult(false);
+                endActivity();
             }
         }
+        break;
 
-        if (std::chrono::duration_cast<std::chrono::minutes>(now - lastClipboardHashUpdateTime).count() >= 5)
+        // We have some activity ongoing.
+        default:
         {
-            LOG_TRC("Rotating clipboard keys");
-            for (auto &it : _sessions)
-                it.second->rotateClipboardKey(true);
+            constexpr std::chrono::seconds postponeAutosaveDuration(30);
+            LOG_TRC("Postponing autosave check by " << postponeAutosaveDuration);
+            _saveManager.postponeAutosave(postponeAutosaveDuration);
+        }
+        break;
+    }
 
-            lastClipboardHashUpdateTime = now;
+#if !MOBILEAPP
+    if (std::chrono::duration_cast<std::chrono::minutes>(now - _lastClipboardHashUpdateTime).count() >= 2)
+    {
+        for (auto &it : _sessions)
+        {
+            if (it.second->staleWaitDisconnect(now))
+            {
+                std::string id = it.second->getId();
+                LOG_WRN("Unusual, Kit session " + id + " failed its disconnect handshake, killing");
+                finalRemoveSession(id);
+                break; // it invalid.
+            }
         }
-#endif
     }
 
+    if (std::chrono::duration_cast<std::chrono::minutes>(now - _lastClipboardHashUpdateTime).count() >= 5)
+    {
+        LOG_TRC("Rotating clipboard keys");
+        for (auto &it : _sessions)
+            it.second->rotateClipboardKey(true);
+
+        _lastClipboardHashUpdateTime = now;
+    }
+#endif
+}
+
+namespace
+{
+constexpr auto FlushTimeoutMicroS = std::chrono::microseconds(POLL_TIMEOUT_MICRO_S * 2); // ~1000ms
+}
+
+void DocumentBroker::startFlushing()
+{
     LOG_INF("Finished polling doc [" << _docKey << "]. stop: " << _stop << ", continuePolling: " <<
             _poll->continuePolling() << ", ShutdownRequestFlag: " << SigUtil::getShutdownRequestFlag() <<
             ", TerminationFlag: " << SigUtil::getTerminationFlag() << ", closeReason: " << _closeReason << ". Flushing socket.");
 
+    // Those still loading won't be now.
+    failPendingSessions(std::make_exception_ptr(std::runtime_error("Document is unloading.")));
+
     // If we are exiting because the owner discarded conflict changes, don't detect data loss.
     if (!(_docState.isCloseRequested() && _documentChangedInStorage))
     {
@@ -510,30 +749,31 @@ void DocumentBroker::pollThread()
     }
 
     // Flush socket data first.
-    constexpr auto flushTimeoutMicroS = std::chrono::microseconds(POLL_TIMEOUT_MICRO_S * 2); // ~1000ms
     LOG_INF("Flushing socket " << _poll->getSocketCount() << " for doc [" << _docKey << "] for "
-                               << flushTimeoutMicroS << ". stop: " << _stop
+                               << FlushTimeoutMicroS << ". stop: " << _stop
                                << ", continuePolling: " << _poll->continuePolling()
                                << ", ShutdownRequestFlag: " << SigUtil::getShutdownRequestFlag()
                                << ", TerminationFlag: " << SigUtil::getTerminationFlag()
                                << ". Terminating child with reason: [" << _closeReason << "].");
-    const auto flushStartTime = std::chrono::steady_clock::now();
-    while (_poll->getSocketCount())
-    {
-        const auto now = std::chrono::steady_clock::now();
-        const auto elapsedMicroS
-            = std::chrono::duration_cast<std::chrono::microseconds>(now - flushStartTime);
-        if (elapsedMicroS > flushTimeoutMicroS)
-            break;
+    _flushStartTime = std::chrono::steady_clock::now();
+}
 
-        const std::chrono::microseconds timeoutMicroS
-            = std::min(flushTimeoutMicroS - elapsedMicroS,
-                       std::chrono::microseconds(POLL_TIMEOUT_MICRO_S / 5));
-        _poll->poll(timeoutMicroS);
+std::chrono::microseconds DocumentBroker::getFlushTimeout()
+{
+    if (!_poll->getSocketCount())
+        return std::chrono::microseconds::zero();
 
-        processBatchUpdates();
-    }
+    const auto elapsedMicroS = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - _flushStartTime);
+    if (elapsedMicroS > FlushTimeoutMicroS)
+        return std::chrono::microseconds::zero();
 
+    return std::min(FlushTimeoutMicroS - elapsedMicroS,
+                    std::chrono::microseconds(POLL_TIMEOUT_MICRO_S / 5));
+}
+
+void DocumentBroker::finishPolling()
+{
     LOG_INF("Finished flushing socket for doc [" << _docKey << "]. stop: " << _stop << ", continuePolling: " <<
             _poll->continuePolling() << ", ShutdownRequestFlag: " << SigUtil::getShutdownRequestFlag() <<
             ", TerminationFlag: " << SigUtil::getTerminationFlag() << ". Terminating child with reason: [" << _closeReason << "].");
@@ -616,21 +856,44 @@ void DocumentBroker::stop(const std::string& reason)
     _poll->wakeup();
 }
 
-bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, const std::string& jailId)
+bool DocumentBroker::createStorage(const std::shared_ptr<ClientSession>& session,
+                                   const std::string& jailRoot, const std::string& jailPath)
 {
-    assertCorrectThread();
+    _docState.setStatus(DocumentState::Status::Downloading);
 
-    const std::string sessionId = session->getId();
+    // Pass the public URI to storage as it needs to load using the token
+    // and other storage-specific data provided in the URI.
+    const Poco::URI& uriPublic = session->getPublicUri();
+    LOG_DBG("Loading, and creating new storage instance for URI [" << COOLWSD::anonymizeUrl(uriPublic.toString()) << "].");
 
-    LOG_INF("Loading [" << _docKey << "] for session [" << sessionId << "] in jail [" << jailId
-                        << ']');
+    try
+    {
+        _storage = StorageBase::create(uriPublic, jailRoot, jailPath,
+                                       /*takeOwnership=*/isConvertTo());
+    }
+    catch (...)
+    {
+        session->sendMessage("loadstorage: failed");
+        throw;
+    }
 
+    if (_storage == nullptr)
     {
-        bool result;
-        if (UnitWSD::get().filterLoad(sessionId, jailId, result))
-            return result;
+        // We should get an exception, not null.
+        LOG_ERR("Failed to create Storage instance for [" << _docKey << "] in " << jailPath);
+        return false;
     }
 
+    return true;
+}
+
+bool DocumentBroker::loadFileInfo(const std::shared_ptr<ClientSession>& session,
+                                  const std::string& jailId,
+                                  std::unique_ptr<WopiStorage::WOPIFileInfo> wopifileinfo,
+                                  std::string& templateSource)
+{
+    const std::string sessionId = session->getId();
+
     if (_docState.isMarkedToDestroy())
     {
         // Tearing down.
@@ -649,55 +912,42 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
 
     LOG_INF("jailPath: " << jailPath.toString() << ", jailRoot: " << jailRoot);
 
-    bool firstInstance = false;
     if (_storage == nullptr)
     {
-        _docState.setStatus(DocumentState::Status::Downloading);
-
-        // Pass the public URI to storage as it needs to load using the token
-        // and other storage-specific data provided in the URI.
-        const Poco::URI& uriPublic = session->getPublicUri();
-        LOG_DBG("Loading, and creating new storage instance for URI [" << COOLWSD::anonymizeUrl(uriPublic.toString()) << "].");
-
-        try
-        {
-            _storage = StorageBase::create(uriPublic, jailRoot, jailPath.toString(),
-                                           /*takeOwnership=*/isConvertTo());
-        }
-        catch (...)
-        {
-            session->sendMessage("loadstorage: failed");
-            throw;
-        }
-
-        if (_storage == nullptr)
-        {
-            // We should get an exception, not null.
-            LOG_ERR("Failed to create Storage instance for [" << _docKey << "] in " << jailPath.toString());
+        if (!createStorage(session, jailRoot, jailPath.toString()))
             return false;
-        }
-        firstInstance = true;
+    }
+    else if (_storage->getJailPath().empty())
+    {
+        // Created by addSessionAsync() before we had a jail.
+        _storage->setJail(jailRoot, jailPath.toString());
     }
 
     LOG_ASSERT(_storage);
 
+    // Not downloaded yet means we are the first session to get this far.
+    const bool firstInstance = !_storage->isDownloaded();
+
     // Call the storage specific fileinfo functions
     std::string userId, username;
     std::string userExtraInfo;
     std::string watermarkText;
-    std::string templateSource;
 
-#if !MOBILEAPP
-    std::chrono::milliseconds checkFileInfoCallDurationMs = std::chrono::milliseconds::zero();
+#if MOBILEAPP
+    (void) wopifileinfo;
+#else
     WopiStorage* wopiStorage = dynamic_cast<WopiStorage*>(_storage.get());
     if (wopiStorage != nullptr)
     {
-        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
-        std::unique_ptr<WopiStorage::WOPIFileInfo> wopifileinfo =
-            wopiStorage->getWOPIFileInfo(session->getAuthorization(), *_lockCtx);
+        if (!wopifileinfo)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            wopifileinfo = wopiStorage->getWOPIFileInfo(session->getAuthorization(), *_lockCtx);
 
-        checkFileInfoCallDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::steady_clock::now() - start);
+            // Add the time taken to check file info.
+            _wopiDownloadDuration += std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+        }
 
         userId = wopifileinfo->getUserId();
         username = wopifileinfo->getUsername();
@@ -928,165 +1178,171 @@ bool DocumentBroker::download(const std::shared_ptr<ClientSession>& session, con
     }
 
     broadcastLastModificationTime(session);
+    return true;
+}
 
-    // Let's download the document now, if not downloaded.
-    std::chrono::milliseconds getFileCallDurationMs = std::chrono::milliseconds::zero();
-    if (!_storage->isDownloaded())
-    {
-        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
-        std::string localPath = _storage->downloadStorageFileToLocal(session->getAuthorization(),
-                                                                     *_lockCtx, templateSource);
-        if (localPath.empty())
-        {
-            throw std::runtime_error("Failed to retrieve document from storage");
-        }
-
-        getFileCallDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::steady_clock::now() - start);
+bool DocumentBroker::processDownload(const std::shared_ptr<ClientSession>& session,
+                                     std::string localPath, const std::string& templateSource)
+{
+    const StorageBase::FileInfo fileInfo = _storage->getFileInfo();
 
-        _docState.setStatus(DocumentState::Status::Loading); // Done downloading.
+    _docState.setStatus(DocumentState::Status::Loading); // Done downloading.
 
-        // Only lock the document on storage for editing sessions
-        // FIXME: why not lock before downloadStorageFileToLocal? Would also prevent race conditions
-        if (!session->isReadOnly() &&
-            !_storage->updateLockState(session->getAuthorization(), *_lockCtx, true))
-        {
-            LOG_ERR("Failed to lock!");
-            session->setLockFailed(_lockCtx->_lockFailureReason);
-            // TODO: make this "read-only" a special one with a notification (infobar? balloon tip?)
-            //       and a button to unlock
-        }
+    // Only lock the document on storage for editing sessions
+    // FIXME: why not lock before downloadStorageFileToLocal? Would also prevent race conditions
+    if (!session->isReadOnly() &&
+        !_storage->updateLockState(session->getAuthorization(), *_lockCtx, true))
+    {
+        LOG_ERR("Failed to lock!");
+        session->setLockFailed(_lockCtx->_lockFailureReason);
+        // TODO: make this "read-only" a special one with a notification (infobar? balloon tip?)
+        //       and a button to unlock
+    }
 
 #if !MOBILEAPP
-        // Check if we have a prefilter "plugin" for this document format
-        for (const auto& plugin : COOLWSD::PluginConfigurations)
+    // Check if we have a prefilter "plugin" for this document format
+    for (const auto& plugin : COOLWSD::PluginConfigurations)
+    {
+        try
         {
-            try
-            {
-                const std::string extension(plugin->getString("prefilter.extension"));
-                const std::string newExtension(plugin->getString("prefilter.newextension"));
-                std::string commandLine(plugin->getString("prefilter.commandline"));
-
-                if (localPath.length() > extension.length()+1 &&
-                    strcasecmp(localPath.substr(localPath.length() - extension.length() -1).data(), (std::string(".") + extension).data()) == 0)
-                {
-                    // Extension matches, try the conversion. We convert the file to another one in
-                    // the same (jail) directory, with just the new extension tacked on.
+            const std::string extension(plugin->getString("prefilter.extension"));
+            const std::string newExtension(plugin->getString("prefilter.newextension"));
+            std::string commandLine(plugin->getString("prefilter.commandline"));
 
-                    const std::string newRootPath = _storage->getRootFilePath() + '.' + newExtension;
+            if (localPath.length() > extension.length()+1 &&
+                strcasecmp(localPath.substr(localPath.length() - extension.length() -1).data(), (std::string(".") + extension).data()) == 0)
+            {
+                // Extension matches, try the conversion. We convert the file to another one in
+                // the same (jail) directory, with just the new extension tacked on.
 
-                    // The commandline must contain the space-separated substring @INPUT@ that is
-                    // replaced with the input file name, and @OUTPUT@ for the output file name.
-                    int inputs(0), outputs(0);
+                const std::string newRootPath = _storage->getRootFilePath() + '.' + newExtension;
 
-                    std::string input("@INPUT");
-                    std::size_t pos = commandLine.find(input);
-                    if (pos != std::string::npos)
-                    {
-                        commandLine.replace(pos, input.length(), _storage->getRootFilePath());
-                        ++inputs;
-                    }
+                // The commandline must contain the space-separated substring @INPUT@ that is
+                // replaced with the input file name, and @OUTPUT@ for the output file name.
+                int inputs(0), outputs(0);
 
-                    std::string output("@OUTPUT@");
-                    pos = commandLine.find(output);
-                    if (pos != std::string::npos)
-                    {
-                        commandLine.replace(pos, output.length(), newRootPath);
-                        ++outputs;
-                    }
+                std::string input("@INPUT");
+                std::size_t pos = commandLine.find(input);
+                if (pos != std::string::npos)
+                {
+                    commandLine.replace(pos, input.length(), _storage->getRootFilePath());
+                    ++inputs;
+                }
 
-                    StringVector args(StringVector::tokenize(commandLine, ' '));
-                    std::string command(args[0]);
-                    args.erase(args.begin()); // strip the command
+                std::string output("@OUTPUT@");
+                pos = commandLine.find(output);
+                if (pos != std::string::npos)
+                {
+                    commandLine.replace(pos, output.length(), newRootPath);
+                    ++outputs;
+                }
 
-                    if (inputs != 1 || outputs != 1)
-                        throw std::exception();
+                StringVector args(StringVector::tokenize(commandLine, ' '));
+                std::string command(args[0]);
+                args.erase(args.begin()); // strip the command
 
-                    int process = Util::spawnProcess(command, args);
-                    int status = -1;
-                    const int rc = ::waitpid(process, &status, 0);
-                    if (rc != 0)
-                    {
-                        LOG_ERR("Conversion from " << extension << " to " << newExtension << " failed (" << rc << ").");
-                        return false;
-                    }
+                if (inputs != 1 || outputs != 1)
+                    throw std::exception();
 
-                    _storage->setRootFilePath(newRootPath);
-                    localPath += '.' + newExtension;
+                int process = Util::spawnProcess(command, args);
+                int status = -1;
+                const int rc = ::waitpid(process, &status, 0);
+                if (rc != 0)
+                {
+                    LOG_ERR("Conversion from " << extension << " to " << newExtension << " failed (" << rc << ").");
+                    return false;
                 }
 
-                // We successfully converted the file to something LO can use; break out of the for
-                // loop.
-                break;
-            }
-            catch (const std::exception&)
-            {
-                // This plugin is not a proper prefilter one
+                _storage->setRootFilePath(newRootPath);
+                localPath += '.' + newExtension;
             }
+
+            // We successfully converted the file to something LO can use; break out of the for
+            // loop.
+            break;
+        }
+        catch (const std::exception&)
+        {
+            // This plugin is not a proper prefilter one
         }
+    }
 #endif
 
-        const std::string localFilePath = Poco::Path(getJailRoot(), localPath).toString();
-        std::ifstream istr(localFilePath, std::ios::binary);
-        Poco::SHA1Engine sha1;
-        Poco::DigestOutputStream dos(sha1);
-        Poco::StreamCopier::copyStream(istr, dos);
-        dos.close();
-        LOG_INF("SHA1 for DocKey [" << _docKey << "] of [" << COOLWSD::anonymizeUrl(localPath) << "]: " <<
-                Poco::DigestEngine::digestToHex(sha1.digest()));
-
-        std::string localPathEncoded;
-        Poco::URI::encode(localPath, "#?", localPathEncoded);
-        _uriJailed = Poco::URI(Poco::URI("file://"), localPathEncoded).toString();
-        _uriJailedAnonym = Poco::URI(Poco::URI("file://"), COOLWSD::anonymizeUrl(localPathEncoded)).toString();
-
-        _filename = fileInfo.getFilename();
+    const std::string localFilePath = Poco::Path(getJailRoot(), localPath).toString();
+    std::ifstream istr(localFilePath, std::ios::binary);
+    Poco::SHA1Engine sha1;
+    Poco::DigestOutputStream dos(sha1);
+    Poco::StreamCopier::copyStream(istr, dos);
+    dos.close();
+    LOG_INF("SHA1 for DocKey [" << _docKey << "] of [" << COOLWSD::anonymizeUrl(localPath) << "]: " <<
+            Poco::DigestEngine::digestToHex(sha1.digest()));
+
+    std::string localPathEncoded;
+    Poco::URI::encode(localPath, "#?", localPathEncoded);
+    _uriJailed = Poco::URI(Poco::URI("file://"), localPathEncoded).toString();
+    _uriJailedAnonym = Poco::URI(Poco::URI("file://"), COOLWSD::anonymizeUrl(localPathEncoded)).toString();
+
+    _filename = fileInfo.getFilename();
 #if !MOBILEAPP
-        Quarantine::quarantineFile(this, _filename);
+    Quarantine::quarantineFile(this, _filename);
 #endif
-        if (!templateSource.empty())
-        {
-            // Invalid timestamp for templates, to force uploading once we save-after-loading.
-            _saveManager.setLastModifiedTime(std::chrono::system_clock::time_point());
-            _storageManager.setLastUploadedFileModifiedTime(
-                std::chrono::system_clock::time_point());
-        }
-        else
-        {
-            // Use the local temp file's timestamp.
-            const auto timepoint = FileUtil::Stat(localFilePath).modifiedTimepoint();
-            _saveManager.setLastModifiedTime(timepoint);
-            _storageManager.setLastUploadedFileModifiedTime(timepoint); // Used to detect modifications.
-        }
+    if (!templateSource.empty())
+    {
+        // Invalid timestamp for templates, to force uploading once we save-after-loading.
+        _saveManager.setLastModifiedTime(std::chrono::system_clock::time_point());
+        _storageManager.setLastUploadedFileModifiedTime(
+            std::chrono::system_clock::time_point());
+    }
+    else
+    {
+        // Use the local temp file's timestamp.
+        const auto timepoint = FileUtil::Stat(localFilePath).modifiedTimepoint();
+        _saveManager.setLastModifiedTime(timepoint);
+        _storageManager.setLastUploadedFileModifiedTime(timepoint); // Used to detect modifications.
+    }
 
-        bool dontUseCache = false;
+    bool dontUseCache = false;
 #if MOBILEAPP
-        // avoid memory consumption for single-user local bits.
-        // FIXME: arguably should/could do this for single user documents too.
-        dontUseCache = true;
+    // avoid memory consumption for single-user local bits.
+    // FIXME: arguably should/could do this for single user documents too.
+    dontUseCache = true;
 #endif
 
-        _tileCache = Util::make_unique<TileCache>(_storage->getUri().toString(),
-                                                  _saveManager.getLastModifiedTime(), dontUseCache);
-        _tileCache->setThreadOwner(std::this_thread::get_id());
-    }
+    _tileCache = Util::make_unique<TileCache>(_storage->getUri().toString(),
+                                              _saveManager.getLastModifiedTime(), dontUseCache);
+    _tileCache->setThreadOwner(std::this_thread::get_id());
+    _tileCache->setMaxDeltaRatio(
+        COOLWSD::getConfigValue<double>("per_document.tile_delta_ratio", 2.0));
+    _tileCache->setEvictionPolicy(
+        TileCache::parseEvictionPolicy(COOLWSD::getConfigValue<std::string>(
+            "per_document.tile_cache_eviction", "viewport")),
+        [this](const TileDesc& tile) { return isTileInAnyVisibleArea(tile); });
+
+    return true;
+}
 
+void DocumentBroker::endDownload(const std::shared_ptr<ClientSession>& session,
+                                 std::chrono::milliseconds getFileCallDurationMs)
+{
 #if !MOBILEAPP
-    COOLWSD::dumpNewSessionTrace(getJailId(), sessionId, _uriOrig, _storage->getRootFilePath());
+    COOLWSD::dumpNewSessionTrace(getJailId(), session->getId(), _uriOrig,
+                                 _storage->getRootFilePath());
 
     // Since document has been loaded, send the stats if its WOPI
-    if (wopiStorage != nullptr)
+    if (dynamic_cast<WopiStorage*>(_storage.get()) != nullptr)
     {
-        // Add the time taken to load the file from storage and to check file info.
-        _wopiDownloadDuration += getFileCallDurationMs + checkFileInfoCallDurationMs;
+        // Add the time taken to load the file from storage.
+        _wopiDownloadDuration += getFileCallDurationMs;
         const auto downloadSecs = _wopiDownloadDuration.count() / 1000.;
         const std::string msg
             = "stats: wopiloadduration " + std::to_string(downloadSecs); // In seconds.
         LOG_TRC("Sending to Client [" << msg << "].");
         session->sendTextFrame(msg);
     }
+#else
+    (void) session;
+    (void) getFileCallDurationMs;
 #endif
-    return true;
 }
 
 std::string DocumentBroker::handleRenameFileCommand(std::string sessionId,
@@ -1884,8 +2140,27 @@ void DocumentBroker::refreshLock()
     else
     {
         std::shared_ptr<ClientSession> session = it->second;
-        if (!session || !_storage->updateLockState(session->getAuthorization(), *_lockCtx, true))
+        if (!session)
+        {
             LOG_ERR("Failed to refresh lock");
+            return;
+        }
+
+        // Our thread may be shared with other documents, don't wait for the storage.
+        _lockRefreshPending = true;
+        std::weak_ptr<DocumentBroker> weakDocBroker = shared_from_this();
+        _storage->updateLockStateAsync(session->getAuthorization(), *_lockCtx, true, *_poll,
+                                       [weakDocBroker](bool result)
+                                       {
+                                           std::shared_ptr<DocumentBroker> docBroker
+                                               = weakDocBroker.lock();
+                                           if (!docBroker)
+                                               return;
+
+                                           docBroker->_lockRefreshPending = false;
+                                           if (!result)
+                                               LOG_ERR("Failed to refresh lock");
+                                       });
     }
 }
 
@@ -2210,56 +2485,8 @@ std::string DocumentBroker::getJailRoot() const
     return Poco::Path(COOLWSD::ChildRoot, _jailId).toString();
 }
 
-std::size_t DocumentBroker::addSession(const std::shared_ptr<ClientSession>& session)
-{
-    try
-    {
-        return addSessionInternal(session);
-    }
-    catch (const std::exception& exc)
-    {
-        LOG_ERR("Failed to add session to [" << _docKey << "] with URI [" << COOLWSD::anonymizeUrl(session->getPublicUri().toString()) << "]: " << exc.what());
-        if (_sessions.empty())
-        {
-            LOG_INF("Doc [" << _docKey << "] has no more sessions. Marking to destroy.");
-            _docState.markToDestroy();
-        }
-
-        throw;
-    }
-}
-
-std::size_t DocumentBroker::addSessionInternal(const std::shared_ptr<ClientSession>& session)
+std::size_t DocumentBroker::attachSession(const std::shared_ptr<ClientSession>& session)
 {
-    assertCorrectThread();
-
-    try
-    {
-        // First, download the document, since this can fail.
-        if (!download(session, _childProcess->getJailId()))
-        {
-            const auto msg = "Failed to load document with URI [" + session->getPublicUri().toString() + "].";
-            LOG_ERR(msg);
-            throw std::runtime_error(msg);
-        }
-    }
-    catch (const StorageSpaceLowException&)
-    {
-        LOG_ERR("Out of storage while loading document with URI [" << session->getPublicUri().toString() << "].");
-
-        // We use the same message as is sent when some of cool's own locations are full,
-        // even if in this case it might be a totally different location (file system, or
-        // some other type of storage somewhere). This message is not sent to all clients,
-        // though, just to all sessions of this document.
-        alertAllUsers("internal", "diskfull");
-        throw;
-    }
-    catch (const std::exception& exc)
-    {
-        LOG_ERR("loading document exception: " << exc.what());
-        throw;
-    }
-
     const std::string id = session->getId();
 
     // Request a new session from the child kit.
@@ -2292,12 +2519,298 @@ std::size_t DocumentBroker::addSessionInternal(const std::shared_ptr<ClientSessi
     return count;
 }
 
+void DocumentBroker::addSessionAsync(const std::shared_ptr<ClientSession>& session,
+                                     std::function<void(std::exception_ptr)> onLoaded)
+{
+    assertCorrectThread();
+
+    const std::string id = session->getId();
+    LOG_DBG("Adding session [" << id << "] to docKey [" << _docKey << "] to load asynchronously");
+
+    // Hold the messages of the session until it's loaded.
+    const std::shared_ptr<ProtocolHandlerInterface> protocol = session->getProtocol();
+    if (protocol)
+        protocol->enableProcessInput(false);
+    _pendingSessions.emplace_back(session, std::move(onLoaded));
+
+    try
+    {
+#if !MOBILEAPP
+        // Create the storage now, without a jail, to check the file info meanwhile.
+        if (_storage == nullptr && !createStorage(session, std::string(), std::string()))
+            throw std::runtime_error("Failed to create Storage instance for [" + _docKey + ']');
+
+        WopiStorage* wopiStorage = dynamic_cast<WopiStorage*>(_storage.get());
+        if (wopiStorage != nullptr)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            wopiStorage->getWOPIFileInfoAsync(
+                session->getAuthorization(), *_lockCtx, *_poll,
+                [this, id, start](std::unique_ptr<WopiStorage::WOPIFileInfo> wopiFileInfo,
+                                  std::exception_ptr error)
+                {
+                    const auto it = std::find_if(_pendingSessions.begin(), _pendingSessions.end(),
+                                                 [&id](const PendingSession& pending)
+                                                 { return pending._session->getId() == id; });
+                    if (it == _pendingSessions.end())
+                    {
+                        LOG_DBG("Session [" << id << "] is gone, dropping its file info");
+                        return;
+                    }
+
+                    if (error)
+                    {
+                        endPendingSession(id, error);
+                        return;
+                    }
+
+                    it->_wopiFileInfo = std::move(wopiFileInfo);
+                    it->_fileInfo = _storage->getFileInfo();
+                    it->_checkFileInfoDuration
+                        = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - start);
+                    it->_haveFileInfo = true;
+                    loadPendingSessions();
+                });
+            return;
+        }
+#endif
+
+        _pendingSessions.back()._haveFileInfo = true;
+        loadPendingSessions();
+    }
+    catch (...)
+    {
+        endPendingSession(id, std::current_exception());
+    }
+}
+
+void DocumentBroker::loadPendingSessions()
+{
+    // Only one at a time, as the first one downloads the document for the rest.
+    while (!_pendingSessions.empty() && _childProcess && _pollStage == PollStage::Poll
+           && !_pendingDownload)
+    {
+        PendingSession& pending = _pendingSessions.front();
+        if (!pending._haveFileInfo)
+            return;
+
+        const std::shared_ptr<ClientSession> session = pending._session;
+        const std::string id = session->getId();
+        try
+        {
+            const std::string jailId = _childProcess->getJailId();
+            LOG_INF("Loading [" << _docKey << "] for session [" << id << "] in jail [" << jailId
+                                << ']');
+
+            bool result = true;
+            if (UnitWSD::get().filterLoad(id, jailId, result))
+            {
+                if (!result)
+                    throw std::runtime_error("Failed to load document with URI [" +
+                                             session->getPublicUri().toString() + "].");
+
+                attachSession(session);
+                endPendingSession(id, nullptr);
+                continue;
+            }
+
+            std::string templateSource;
+            std::unique_ptr<WopiStorage::WOPIFileInfo> wopiFileInfo
+                = std::move(pending._wopiFileInfo);
+#if !MOBILEAPP
+            WopiStorage* wopiStorage = dynamic_cast<WopiStorage*>(_storage.get());
+            if (wopiStorage != nullptr && wopiFileInfo)
+            {
+                // Others may have checked the file info since, restore ours.
+                _storage->setFileInfo(pending._fileInfo);
+                wopiStorage->setFileUrl(wopiFileInfo->getFileUrl());
+            }
+
+            _wopiDownloadDuration += pending._checkFileInfoDuration;
+#endif
+
+            if (!loadFileInfo(session, jailId, std::move(wopiFileInfo), templateSource))
+                throw std::runtime_error("Failed to load document with URI [" +
+                                         session->getPublicUri().toString() + "].");
+
+            if (!_storage->isDownloaded())
+            {
+                downloadPendingSession(templateSource);
+                return;
+            }
+
+            endDownload(session, std::chrono::milliseconds::zero());
+            attachSession(session);
+            endPendingSession(id, nullptr);
+        }
+        catch (...)
+        {
+            endPendingSession(id, std::current_exception());
+        }
+    }
+}
+
+void DocumentBroker::downloadPendingSession(const std::string& templateSource)
+{
+    const std::shared_ptr<ClientSession> session = _pendingSessions.front()._session;
+    const std::string id = session->getId();
+    const auto start = std::chrono::steady_clock::now();
+
+    _pendingDownload = true;
+    try
+    {
+        _storage->downloadStorageFileToLocalAsync(
+            session->getAuthorization(), *_lockCtx, templateSource, *_poll,
+            [this, session, id, templateSource, start](const std::string& localPath,
+                                                       std::exception_ptr error)
+            {
+                _pendingDownload = false;
+
+                const bool pending
+                    = std::find_if(_pendingSessions.begin(), _pendingSessions.end(),
+                                   [&id](const PendingSession& entry)
+                                   { return entry._session->getId() == id; })
+                      != _pendingSessions.end();
+                if (!pending)
+                {
+                    // The next session downloads again, with its own authorization.
+                    LOG_DBG("Session [" << id << "] is gone, dropping its download");
+                    _storage->setDownloaded(false);
+                    loadPendingSessions();
+                    return;
+                }
+
+                if (!error)
+                {
+                    try
+                    {
+                        if (localPath.empty())
+                            throw std::runtime_error("Failed to retrieve document from storage");
+
+                        if (!processDownload(session, localPath, templateSource))
+                            throw std::runtime_error("Failed to load document with URI [" +
+                                                     session->getPublicUri().toString() + "].");
+
+                        endDownload(session,
+                                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now() - start));
+                        attachSession(session);
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+
+                endPendingSession(id, error);
+                loadPendingSessions();
+            });
+    }
+    catch (...)
+    {
+        _pendingDownload = false;
+        endPendingSession(id, std::current_exception());
+    }
+}
+
+void DocumentBroker::endPendingSession(const std::string& id, std::exception_ptr error)
+{
+    const auto it = std::find_if(_pendingSessions.begin(), _pendingSessions.end(),
+                                 [&id](const PendingSession& pending)
+                                 { return pending._session->getId() == id; });
+    if (it == _pendingSessions.end())
+        return;
+
+    PendingSession pending = std::move(*it);
+    _pendingSessions.erase(it);
+
+    if (error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (const StorageSpaceLowException&)
+        {
+            LOG_ERR("Out of storage while loading document with URI ["
+                    << pending._session->getPublicUri().toString() << "].");
+
+            // We use the same message as is sent when some of cool's own locations are full,
+            // even if in this case it might be a totally different location (file system, or
+            // some other type of storage somewhere). This message is not sent to all clients,
+            // though, just to all sessions of this document.
+            alertAllUsers("internal", "diskfull");
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERR("Failed to add session to [" << _docKey << "] with URI ["
+                    << COOLWSD::anonymizeUrl(pending._session->getPublicUri().toString())
+                    << "]: " << exc.what());
+        }
+        catch (...)
+        {
+            LOG_ERR("Failed to add session to [" << _docKey << "] with unknown exception");
+        }
+
+        if (_sessions.empty() && _pendingSessions.empty())
+        {
+            LOG_INF("Doc [" << _docKey << "] has no more sessions. Marking to destroy.");
+            _docState.markToDestroy();
+        }
+    }
+    else
+    {
+        // Process what the session sent meanwhile.
+        const std::shared_ptr<ProtocolHandlerInterface> protocol = pending._session->getProtocol();
+        if (protocol)
+            protocol->enableProcessInput(true);
+        _poll->wakeup();
+    }
+
+    if (pending._onLoaded)
+        pending._onLoaded(error);
+}
+
+void DocumentBroker::failPendingSessions(std::exception_ptr error)
+{
+    while (!_pendingSessions.empty())
+        endPendingSession(_pendingSessions.front()._session->getId(), error);
+}
+
 std::size_t DocumentBroker::removeSession(const std::string& id)
 {
     assertCorrectThread();
 
     try
     {
+        // Still loading, see addSessionAsync(); its callbacks find it gone.
+        const auto pendingIt = std::find_if(_pendingSessions.begin(), _pendingSessions.end(),
+                                            [&id](const PendingSession& pending)
+                                            { return pending._session->getId() == id; });
+        if (pendingIt != _pendingSessions.end())
+        {
+            LOG_INF("Removing session [" << id << "] on docKey [" << _docKey
+                                         << "] before it loaded.");
+            const std::shared_ptr<ClientSession> session = pendingIt->_session;
+            _pendingSessions.erase(pendingIt);
+
+            if (UnitWSD::isUnitTesting())
+            {
+                UnitWSD::get().onDocBrokerRemoveSession(_docKey, session);
+            }
+
+            if (_sessions.empty() && _pendingSessions.empty())
+            {
+                LOG_INF("Doc [" << _docKey << "] has no more sessions. Marking to destroy.");
+                _docState.markToDestroy();
+            }
+            else
+                loadPendingSessions();
+
+            return _sessions.size();
+        }
+
         const auto it = _sessions.find(id);
         if (it == _sessions.end())
         {
@@ -2587,7 +3100,10 @@ void DocumentBroker::alertAllUsers(const std::string& msg)
 void DocumentBroker::setKitLogLevel(const std::string& level)
 {
     assertCorrectThread();
-    _childProcess->sendTextFrame("setloglevel " + level);
+
+    // We may still be waiting for our child process.
+    if (_childProcess)
+        _childProcess->sendTextFrame("setloglevel " + level);
 }
 
 std::string DocumentBroker::getDownloadURL(const std::string& downloadId)
@@ -2675,6 +3191,18 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
                     COOLWSD::writeTraceEventRecording(newLine + 1, payload.size() - (newLine + 1 - payload.data()));
             }
         }
+#if !MOBILEAPP
+        else if (message->firstTokenMatches("loadtime:"))
+        {
+            LOG_CHECK_RET(message->tokens().size() == 3, false);
+            std::string warm;
+            int duration = 0;
+            LOG_CHECK_RET(COOLProtocol::getTokenString((*message)[1], "warm", warm), false);
+            LOG_CHECK_RET(COOLProtocol::getTokenInteger((*message)[2], "duration", duration), false);
+            COOLWSD::recordKitLoad(getFilename(), warm == "none" ? std::string() : warm,
+                                   std::chrono::milliseconds(duration));
+        }
+#endif
         else
         {
             LOG_ERR("Unexpected message: [" << message->abbr() << "].");
@@ -2692,6 +3220,23 @@ std::size_t DocumentBroker::getMemorySize() const
         _sessions.size() * sizeof(ClientSession);
 }
 
+bool DocumentBroker::isTileInAnyVisibleArea(const TileDesc& tile) const
+{
+    for (const auto& it : _sessions)
+    {
+        const std::shared_ptr<ClientSession>& session = it.second;
+        if (session->getCanonicalViewId() == tile.getNormalizedViewId() &&
+            session->getTileWidthInTwips() == tile.getTileWidth() &&
+            session->getTileHeightInTwips() == tile.getTileHeight() &&
+            (session->isTextDocument() || session->getSelectedPart() == tile.getPart()) &&
+            session->getVisibleArea().hasSurface() &&
+            session->isTileInsideVisibleArea(tile))
+            return true;
+    }
+
+    return false;
+}
+
 // Expected to be legacy, ~all new requests are tilecombinedRequests
 void DocumentBroker::handleTileRequest(const StringVector &tokens, bool forceKeyframe,
                                        const std::shared_ptr<ClientSession>& session)
@@ -2725,7 +3270,7 @@ void DocumentBroker::handleTileRequest(const StringVector &tokens, bool forceKey
         return;
     }
 
-    if (!cachedTile)
+    if (!cachedTile || _tileCache->isDeltaChainTooLong(cachedTile))
         tile.forceKeyframe();
 
     auto now = std::chrono::steady_clock::now();
@@ -2789,7 +3334,7 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined, bool
         Tile cachedTile = _tileCache->lookupTile(tile);
         if(!cachedTile || !cachedTile->isValid())
         {
-            if (!cachedTile)
+            if (!cachedTile || _tileCache->isDeltaChainTooLong(cachedTile))
                 tile.forceKeyframe();
             tilesNeedsRendering.push_back(tile);
             _debugRenderedTileCount++;
@@ -2981,7 +3526,7 @@ void DocumentBroker::sendRequestedTiles(const std::shared_ptr<ClientSession>& se
                     tileCache().getTileBeingRenderedVersion(tile) < tile.getVersion()) // We need a newer version
                 {
                     tile.setVersion(++_tileVersion);
-                    if (!cachedTile) // forceKeyframe
+                    if (!cachedTile || _tileCache->isDeltaChainTooLong(cachedTile)) // forceKeyframe
                     {
                         LOG_TRC("Forcing keyframe for tile was oldwid " << tile.getOldWireId());
                         tile.setOldWireId(0);
@@ -3454,17 +3999,23 @@ bool ConvertToBroker::startConversion(SocketDisposition &disposition, const std:
             docBroker->_clientSession->setSaveAsSocket(streamSocket);
 
             // First add and load the session.
-            docBroker->addSession(docBroker->_clientSession);
+            docBroker->addSessionAsync(docBroker->_clientSession,
+                                       [docBroker](std::exception_ptr error)
+            {
+                // On failure, the error is logged and we are marked to destroy.
+                if (error)
+                    return;
 
-            // Load the document manually and request saving in the target format.
-            std::string encodedFrom;
-            Poco::URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
-            // add batch mode, no interactive dialogs
-            const std::string _load = "load url=" + encodedFrom + " batch=true";
-            std::vector<char> loadRequest(_load.begin(), _load.end());
-            docBroker->_clientSession->handleMessage(loadRequest);
+                // Load the document manually and request saving in the target format.
+                std::string encodedFrom;
+                Poco::URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
+                // add batch mode, no interactive dialogs
+                const std::string _load = "load url=" + encodedFrom + " batch=true";
+                std::vector<char> loadRequest(_load.begin(), _load.end());
+                docBroker->_clientSession->handleMessage(loadRequest);
 
-            // Save is done in the setLoaded
+                // Save is done in the setLoaded
+            });
         });
     return true;
 }
@@ -3547,15 +4098,21 @@ bool RenderSearchResultBroker::executeCommand(SocketDisposition& disposition, st
         docBroker->setResponseSocket(std::static_pointer_cast<StreamSocket>(moveSocket));
 
         // First add and load the session.
-        docBroker->addSession(docBroker->_clientSession);
-
-        // Load the document manually.
-        std::string encodedFrom;
-        Poco::URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
-        // add batch mode, no interactive dialogs
-        const std::string _load = "load url=" + encodedFrom + " batch=true";
-        std::vector<char> loadRequest(_load.begin(), _load.end());
-        docBroker->_clientSession->handleMessage(loadRequest);
+        docBroker->addSessionAsync(docBroker->_clientSession,
+                                   [docBroker](std::exception_ptr error)
+        {
+            // On failure, the error is logged and we are marked to destroy.
+            if (error)
+                return;
+
+            // Load the document manually.
+            std::string encodedFrom;
+            Poco::URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
+            // add batch mode, no interactive dialogs
+            const std::string _load = "load url=" + encodedFrom + " batch=true";
+            std::vector<char> loadRequest(_load.begin(), _load.end());
+            docBroker->_clientSession->handleMessage(loadRequest);
+        });
     });
 
     return true;
@@ -13,6 +13,8 @@
 #include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -73,9 +75,13 @@ public:
     const std::string& getJailId() const { return _jailId; }
     void setSMapsFD(int smapsFD) { _smapsFD = smapsFD;}
     int getSMapsFD(){ return _smapsFD; }
+    /// The kind of document this spare child was asked to warm up for, if any.
+    void setWarmType(const std::string& warmType) { _warmType = warmType; }
+    const std::string& getWarmType() const { return _warmType; }
 
 private:
     const std::string _jailId;
+    std::string _warmType;
     std::weak_ptr<DocumentBroker> _docBroker;
     int _smapsFD;
 };
@@ -342,8 +348,12 @@ public:
 
     std::string getJailRoot() const;
 
-    /// Add a new session. Returns the new number of sessions.
-    std::size_t addSession(const std::shared_ptr<ClientSession>& session);
+    /// Add a new session without blocking our poll thread. The file info
+    /// is checked while we wait for a child process, and the document is
+    /// downloaded once we have its jail. The input of the session is held
+    /// until then. Calls @onLoaded in our thread with the error, if any.
+    void addSessionAsync(const std::shared_ptr<ClientSession>& session,
+                         std::function<void(std::exception_ptr)> onLoaded);
 
     /// Removes a session by ID. Returns the new number of sessions.
     std::size_t removeSession(const std::string& id);
@@ -477,14 +487,48 @@ public:
     void unregisterDownloadId(const std::string& downloadId);
 
 private:
+    /// Is the tile visible, at its zoom level, in any of the views ?
+    /// Used to keep such tiles in the cache.
+    bool isTileInAnyVisibleArea(const TileDesc& tile) const;
+
     /// get the session id of a session that can write the document for save / locking.
     /// Note that if there is no loaded and writable session, the first will be returned.
     std::string getWriteableSessionId() const;
 
+    /// Refreshes the lock on storage asynchronously, not to hold up our thread.
     void refreshLock();
 
-    /// Loads a document from the public URI into the jail.
-    bool download(const std::shared_ptr<ClientSession>& session, const std::string& jailId);
+    /// Creates the storage for the document of @session. Returns false on failure.
+    bool createStorage(const std::shared_ptr<ClientSession>& session, const std::string& jailRoot,
+                       const std::string& jailPath);
+
+    /// The part of loading before GetFile: sets up the session from the file
+    /// info, as given in @wopifileinfo or by calling CheckFileInfo, and gives the
+    /// template to download from in @templateSource.
+    bool loadFileInfo(const std::shared_ptr<ClientSession>& session, const std::string& jailId,
+                      std::unique_ptr<WopiStorage::WOPIFileInfo> wopifileinfo,
+                      std::string& templateSource);
+
+    /// The part of loading after GetFile: locks, filters and loads the
+    /// file at @localPath into the jail.
+    bool processDownload(const std::shared_ptr<ClientSession>& session, std::string localPath,
+                         const std::string& templateSource);
+
+    /// Reports the load to the session, with the time GetFile took.
+    void endDownload(const std::shared_ptr<ClientSession>& session,
+                     std::chrono::milliseconds getFileCallDurationMs);
+
+    /// Loads the sessions of addSessionAsync(), in order, as far as we can.
+    void loadPendingSessions();
+
+    /// Downloads the document for the first pending session.
+    void downloadPendingSession(const std::string& templateSource);
+
+    /// Done with the pending session @id, successfully unless there is an @error.
+    void endPendingSession(const std::string& id, std::exception_ptr error);
+
+    /// Ends all the pending sessions with @error.
+    void failPendingSessions(std::exception_ptr error);
     bool isLoaded() const { return _docState.hadLoaded(); }
     bool isInteractive() const { return _docState.isInteractive(); }
 
@@ -654,8 +698,8 @@ private:
     /// This includes only those that are loaded and not waiting disconnection.
     std::size_t countActiveSessions() const;
 
-    /// Loads a new session and adds to the sessions container.
-    std::size_t addSessionInternal(const std::shared_ptr<ClientSession>& session);
+    /// Adds a loaded session to the sessions container, and to the kit.
+    std::size_t attachSession(const std::shared_ptr<ClientSession>& session);
 
     /// Starts the Kit <-> DocumentBroker shutdown handshake
     void disconnectSessionInternal(const std::string& id);
@@ -667,6 +711,19 @@ private:
     /// associated with this document.
     void pollThread();
 
+#if !MOBILEAPP
+    /// The same as pollThread(), one step at a time, when run on a shared
+    /// thread by a SocketPollWorker. See SocketPoll::pollingStep().
+    bool pollStep(int64_t& timeoutMicroS, bool& pollSockets);
+
+    /// Run the polls of interactive documents on @count shared
+    /// threads, rather than on a thread for each document.
+    static void startPollWorkers(std::size_t count);
+
+    /// Stop the shared threads, once all documents are done.
+    static void stopPollWorkers();
+#endif
+
     /// Sum the I/O stats from all connected sessions
     void getIOStats(uint64_t &sent, uint64_t &recv);
 
@@ -677,6 +734,38 @@ private:
     virtual bool isConvertTo() const { return false; }
 
 private:
+#if !MOBILEAPP
+    /// Takes a child process if one is ready, without waiting. Returns
+    /// false to try again later, true when we have one or gave up.
+    bool takeNewChild();
+
+    /// The kind of document we are loading, as far as we know it yet,
+    /// to take a child warmed up for it.
+    std::string getExpectedDocumentType() const;
+#endif
+
+    /// Get going with our child process, once we have one.
+    /// Returns false, having cleaned up, if we don't.
+    bool startPolling();
+
+    /// Should the poll loop go on ?
+    bool continuePollLoop();
+
+    /// The timeout for the next poll of the poll loop.
+    std::chrono::microseconds getPollTimeout();
+
+    /// The work of the poll loop after each poll.
+    void pollIteration();
+
+    /// Once out of the poll loop, start flushing our sockets.
+    void startFlushing();
+
+    /// The timeout for the next poll while flushing, or zero when done.
+    std::chrono::microseconds getFlushTimeout();
+
+    /// Terminate the child and clean up, after flushing.
+    void finishPolling();
+
     /// Request manager.
     /// Encapsulates common fields for
     /// Save and Upload requests.
@@ -1283,6 +1372,8 @@ private:
     std::atomic<bool> _stop;
     std::string _closeReason;
     std::unique_ptr<LockContext> _lockCtx;
+    /// Whether a lock refresh is in flight, see refreshLock().
+    bool _lockRefreshPending;
     std::string _renameFilename; //< The new filename to rename to.
     std::string _renameSessionId; //< The sessionId used for renaming.
     std::string _lastEditingSessionId; //< The last session edited, for auto-saving.
@@ -1296,9 +1387,59 @@ private:
     std::chrono::steady_clock::time_point _lastNotifiedActivityTime;
     std::chrono::steady_clock::time_point _lastActivityTime;
     std::chrono::steady_clock::time_point _threadStart;
+
+    /// Where pollStep() is at.
+    enum class PollStage
+    {
+        Start,
+        GetChild,
+        Poll,
+        Flush
+    } _pollStage;
+
+    /// Whether we asked for a child already, so the open is recorded once, see PrespawnPolicy.
+    bool _childRequested;
+
+    /// State of the poll loop, across iterations.
+    uint64_t _adminSent; //< Sent bytes reported to Admin.
+    uint64_t _adminRecv; //< Received bytes reported to Admin.
+    std::chrono::steady_clock::time_point _lastBWUpdateTime;
+    std::chrono::steady_clock::time_point _lastClipboardHashUpdateTime;
+    std::chrono::steady_clock::time_point _loadDeadline;
+    std::chrono::steady_clock::time_point _flushStartTime;
+    int _limitLoadSecs;
+    int _limitStoreFailures;
+
     std::chrono::milliseconds _loadDuration;
     std::chrono::milliseconds _wopiDownloadDuration;
 
+    /// A session of addSessionAsync() that is still loading.
+    struct PendingSession
+    {
+        PendingSession(const std::shared_ptr<ClientSession>& session,
+                       std::function<void(std::exception_ptr)> onLoaded)
+            : _session(session)
+            , _onLoaded(std::move(onLoaded))
+            , _fileInfo(std::string(), std::string(), std::string())
+            , _checkFileInfoDuration(0)
+            , _haveFileInfo(false)
+        {
+        }
+
+        std::shared_ptr<ClientSession> _session;
+        std::function<void(std::exception_ptr)> _onLoaded;
+        /// The result of CheckFileInfo, and the basic file info it gave.
+        std::unique_ptr<WopiStorage::WOPIFileInfo> _wopiFileInfo;
+        StorageBase::FileInfo _fileInfo;
+        std::chrono::milliseconds _checkFileInfoDuration;
+        bool _haveFileInfo;
+    };
+
+    /// The sessions waiting to load, in the order they came.
+    std::deque<PendingSession> _pendingSessions;
+    /// Whether GetFile is in flight, for the first pending session.
+    bool _pendingDownload;
+
     /// Unique DocBroker ID for tracing and debugging.
     static std::atomic<unsigned> DocBrokerId;
 
@@ -33,6 +33,7 @@
 #include <Poco/Net/NetException.h>
 #include <Poco/RegularExpression.h>
 #include <Poco/Runnable.h>
+#include <Poco/SHA1Engine.h>
 #include <Poco/StreamCopier.h>
 #include <Poco/URI.h>
 #include <Poco/JSON/Object.h>
@@ -41,8 +42,10 @@
 #include "Auth.hpp"
 #include <Common.hpp>
 #include <Crypto.hpp>
+#include <FileUtil.hpp>
 #include "FileServer.hpp"
 #include "COOLWSD.hpp"
+#include "HtmlTemplate.hpp"
 #include "ServerURL.hpp"
 #include <Log.hpp>
 #include <Protocol.hpp>
@@ -58,7 +61,8 @@ using Poco::Net::HTTPResponse;
 using Poco::Net::NameValueCollection;
 using Poco::Util::Application;
 
-std::map<std::string, std::pair<std::string, std::string>> FileServerRequestHandler::FileHash;
+std::map<std::string, FileServerRequestHandler::CachedFile> FileServerRequestHandler::FileHash;
+std::map<std::string, FileServerRequestHandler::CompiledFile> FileServerRequestHandler::CompiledFiles;
 
 namespace {
 
@@ -519,8 +523,7 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request,
         const std::string relPath = getRequestPathname(request);
         const std::string endPoint = requestSegments[requestSegments.size() - 1];
 
-        static std::string etagString = "\"" COOLWSD_VERSION_HASH +
-            config.getString("ver_suffix", "") + "\"";
+        static const std::string etagSuffix = config.getString("ver_suffix", "");
 
 #if ENABLE_DEBUG
         if (Util::startsWith(relPath, std::string("/wopi/files"))) {
@@ -552,12 +555,7 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request,
             return;
         }
 
-        if (endPoint == "cool.html" ||
-            endPoint == "help-localizations.json" ||
-            endPoint == "localizations.json" ||
-            endPoint == "locore-localizations.json" ||
-            endPoint == "uno-localizations.json" ||
-            endPoint == "uno-localizations-override.json")
+        if (isPreprocessedFile(endPoint))
         {
             preprocessFile(request, requestDetails, message, socket);
             return;
@@ -612,30 +610,9 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request,
             else
                 mimeType = "text/plain";
 
-            auto it = request.find("If-None-Match");
-            if (it != request.end())
-            {
-                // if ETags match avoid re-sending the file.
-                if (!noCache && it->second == etagString)
-                {
-                    // TESTME: harder ... - do we even want ETag support ?
-                    std::ostringstream oss;
-                    Poco::DateTime now;
-                    Poco::DateTime later(now.utcTime(), int64_t(1000)*1000 * 60 * 60 * 24 * 128);
-                    std::string extraHeaders =
-                        "Expires: " + Poco::DateTimeFormatter::format(
-                            later, Poco::DateTimeFormat::HTTP_FORMAT) + "\r\n" +
-                        "Cache-Control: max-age=11059200\r\n";
-                    HttpHelper::sendErrorAndShutdown(304, socket, std::string(), extraHeaders);
-                    return;
-                }
-            }
-
             response.set("Server", HTTP_SERVER_STRING);
             response.set("Date", Util::getHttpTimeNow());
 
-            bool gzip = request.hasToken("Accept-Encoding", "gzip");
-            const std::string *content;
 #if ENABLE_DEBUG
             if (std::getenv("COOL_SERVE_FROM_FS"))
             {
@@ -646,30 +623,64 @@ void FileServerRequestHandler::handleRequest(const HTTPRequest& request,
                 return;
             }
 #endif
-            if (gzip)
-            {
-                response.set("Content-Encoding", "gzip");
-                content = getCompressedFile(relPath);
-            }
-            else
-                content = getUncompressedFile(relPath);
 
-            if (!noCache)
+            const CachedFile& cached = FileHash.find(relPath)->second;
+
+            // Each encoding is a different representation, with its own tag.
+            const std::string encoding = getPreferredEncoding(
+                request.get("Accept-Encoding", std::string()), cached._brotli._data != nullptr,
+                cached._gzip._data != nullptr);
+            const std::string etag = '"' + cached._etag + etagSuffix
+                                     + (encoding.empty() ? "" : '-' + encoding) + '"';
+            const std::string cacheControl
+                = noCache ? "no-cache" : "max-age=11059200"; // 60 * 60 * 24 * 128 (days)
+
+            // The client has it already. Even without caching, a revalidation is cheap.
+            auto it = request.find("If-None-Match");
+            if (it != request.end() && isETagMatch(it->second, etag))
             {
-                // 60 * 60 * 24 * 128 (days) = 11059200
-                response.set("Cache-Control", "max-age=11059200");
-                response.set("ETag", etagString);
+                std::string extraHeaders = "ETag: " + etag + "\r\n"
+                                           "Cache-Control: " + cacheControl + "\r\n"
+                                           "Vary: Accept-Encoding\r\n";
+                if (!noCache)
+                {
+                    Poco::DateTime now;
+                    Poco::DateTime later(now.utcTime(), int64_t(1000)*1000 * 60 * 60 * 24 * 128);
+                    extraHeaders += "Expires: " + Poco::DateTimeFormatter::format(
+                        later, Poco::DateTimeFormat::HTTP_FORMAT) + "\r\n";
+                }
+
+                LOG_TRC('#' << socket->getFD() << ": Not modified: file [" << relPath << ']');
+                HttpHelper::sendErrorAndShutdown(304, socket, std::string(), extraHeaders);
+                return;
             }
+
+            const Content* content = &cached._raw;
+            if (encoding == "br")
+                content = &cached._brotli;
+            else if (encoding == "gzip")
+                content = &cached._gzip;
+
+            if (!encoding.empty())
+                response.set("Content-Encoding", encoding);
+
+            response.set("Cache-Control", cacheControl);
+            response.set("ETag", etag);
+            response.set("Vary", "Accept-Encoding");
             response.setContentType(mimeType);
+            response.setContentLength(content->_size);
             response.add("X-Content-Type-Options", "nosniff");
 
             std::ostringstream oss;
             response.write(oss);
             const std::string header = oss.str();
-            LOG_TRC('#' << socket->getFD() << ": Sending " <<
-                    (!gzip ? "un":"") << "compressed : file [" << relPath << "]: " << header);
-            socket->send(header);
-            socket->send(*content);
+            LOG_TRC('#' << socket->getFD() << ": Sending "
+                        << (encoding.empty() ? "uncompressed" : encoding) << " file [" << relPath
+                        << "]: " << header);
+
+            // The mapped or cached bytes go out as they are, without a copy.
+            socket->send(header, false);
+            socket->send(content->_owner, content->_data, content->_size);
             // shutdown by caller
         }
     }
@@ -718,6 +729,45 @@ void FileServerRequestHandler::sendError(int errorCode, const Poco::Net::HTTPReq
     HttpHelper::sendError(errorCode, socket, body, headers);
 }
 
+namespace
+{
+/// Gzips the @size bytes of @data, for files without a pre-built .gz sibling.
+std::shared_ptr<std::string> gzipContent(const char* data, std::size_t size)
+{
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nullptr;
+
+    auto compressed = std::make_shared<std::string>(deflateBound(&strm, size), '\0');
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    strm.avail_in = size;
+    strm.next_out = reinterpret_cast<Bytef*>(&(*compressed)[0]);
+    strm.avail_out = compressed->size();
+
+    const int rc = deflate(&strm, Z_FINISH);
+    compressed->resize(compressed->size() - strm.avail_out);
+    deflateEnd(&strm);
+    return rc == Z_STREAM_END ? compressed : nullptr;
+}
+
+/// The hex SHA-1 of the @size bytes of @data.
+std::string sha1Hex(const char* data, std::size_t size)
+{
+    Poco::SHA1Engine sha1;
+    sha1.update(data, size);
+    return Poco::DigestEngine::digestToHex(sha1.digest());
+}
+}
+
+bool FileServerRequestHandler::mapContent(const std::string& path, Content& content)
+{
+    content._owner = FileUtil::mapFile(path, content._data, content._size);
+    return content._owner != nullptr;
+}
+
 void FileServerRequestHandler::readDirToHash(const std::string &basePath, const std::string &path, const std::string &prefix)
 {
     LOG_DBG("Caching files in [" << basePath + path << ']');
@@ -740,59 +790,59 @@ void FileServerRequestHandler::readDirToHash(const std::string &basePath, const
             continue;
 
         const std::string relPath = path + '/' + currentFile->d_name;
-        struct stat fileStat;
-        stat ((basePath + relPath).c_str(), &fileStat);
+        const FileUtil::Stat fileStat(basePath + relPath);
 
-        if (S_ISDIR(fileStat.st_mode))
+        if (fileStat.isDirectory())
             readDirToHash(basePath, relPath);
 
-        else if (S_ISREG(fileStat.st_mode))
+        else if (fileStat.isFile())
         {
+            // Pre-compressed siblings are served with the file they belong to.
+            if ((Util::endsWith(relPath, ".br") || Util::endsWith(relPath, ".gz"))
+                && FileUtil::Stat(basePath + relPath.substr(0, relPath.size() - 3)).isFile())
+                continue;
+
+            CachedFile cached;
+            if (!mapContent(basePath + relPath, cached._raw))
+                continue;
+
             fileCount++;
             filesRead.append(currentFile->d_name);
             filesRead += ' ';
 
-            std::ifstream file(basePath + relPath, std::ios::binary);
+            cached._etag = sha1Hex(cached._raw._data, cached._raw._size);
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
-
-            std::unique_ptr<char[]> buf(new char[fileStat.st_size]);
-            std::string compressedFile;
-            compressedFile.reserve(fileStat.st_size);
-            std::string uncompressedFile;
-            uncompressedFile.reserve(fileStat.st_size);
-            do
+            // Use the variants built with the assets, unless they are stale.
+            const auto loadSibling = [&](const std::string& extension, Content& content)
             {
-                file.read(&buf[0], fileStat.st_size);
-                const long unsigned int size = file.gcount();
-                if (size == 0)
-                    break;
-
-                const long unsigned int compSize = compressBound(size);
-                char *cbuf = (char *)calloc(compSize, sizeof(char));
+                const FileUtil::Stat sibling(basePath + relPath + extension);
+                if (!sibling.isFile())
+                    return false;
 
-                strm.next_in = (unsigned char *)&buf[0];
-                strm.avail_in = size;
-                strm.avail_out = compSize;
-                strm.next_out = (unsigned char *)&cbuf[0];
-
-                deflate(&strm, Z_FINISH);
+                if (sibling.modifiedTimeUs() < fileStat.modifiedTimeUs())
+                {
+                    LOG_WRN("Ignoring [" << basePath << relPath << extension
+                                         << "], which is older than the file");
+                    return false;
+                }
 
-                const long unsigned int haveComp = compSize - strm.avail_out;
-                std::string partialcompFile(cbuf, haveComp);
-                std::string partialuncompFile(buf.get(), size);
-                compressedFile += partialcompFile;
-                uncompressedFile += partialuncompFile;
-                free(cbuf);
+                return mapContent(sibling.path(), content);
+            };
 
-            } while(true);
+            loadSibling(".br", cached._brotli);
+            if (!loadSibling(".gz", cached._gzip) && cached._raw._size > 0)
+            {
+                std::shared_ptr<std::string> gzip
+                    = gzipContent(cached._raw._data, cached._raw._size);
+                if (gzip)
+                {
+                    cached._gzip._data = gzip->data();
+                    cached._gzip._size = gzip->size();
+                    cached._gzip._owner = std::move(gzip);
+                }
+            }
 
-            FileHash.emplace(prefix + relPath, std::make_pair(uncompressedFile, compressedFile));
-            deflateEnd(&strm);
+            FileHash.emplace(prefix + relPath, std::move(cached));
         }
     }
     closedir(workingdir);
@@ -809,16 +859,37 @@ void FileServerRequestHandler::initialize()
     } catch (...) {
         LOG_ERR("Failed to read from directory " << COOLWSD::FileServerRoot);
     }
+
+    // Parse the files we fill in for each request.
+    for (const auto& pair : FileHash)
+    {
+        if (isPreprocessedFile(pair.first.substr(pair.first.rfind('/') + 1)))
+        {
+            CompiledFiles[pair.first]._template
+                = std::make_shared<HtmlTemplate>(getUncompressedFile(pair.first));
+            LOG_TRC("Parsed " << CompiledFiles[pair.first]._template->getSlotCount()
+                              << " placeholders in [" << pair.first << ']');
+        }
+    }
 }
 
-const std::string *FileServerRequestHandler::getCompressedFile(const std::string &path)
+bool FileServerRequestHandler::isPreprocessedFile(const std::string& endPoint)
 {
-    return &FileHash[path].second;
+    return endPoint == "cool.html" ||
+           endPoint == "help-localizations.json" ||
+           endPoint == "localizations.json" ||
+           endPoint == "locore-localizations.json" ||
+           endPoint == "uno-localizations.json" ||
+           endPoint == "uno-localizations-override.json";
 }
 
-const std::string *FileServerRequestHandler::getUncompressedFile(const std::string &path)
+std::string FileServerRequestHandler::getUncompressedFile(const std::string &path)
 {
-    return &FileHash[path].first;
+    const auto it = FileHash.find(path);
+    if (it == FileHash.end() || it->second._raw._data == nullptr)
+        return std::string();
+
+    return std::string(it->second._raw._data, it->second._raw._size);
 }
 
 std::string FileServerRequestHandler::getRequestPathname(const HTTPRequest& request)
@@ -878,7 +949,17 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
     // Is this a file we read at startup - if not; it's not for serving.
     const std::string relPath = getRequestPathname(request);
     LOG_DBG("Preprocessing file: " << relPath);
-    std::string preprocess = *getUncompressedFile(relPath);
+
+    // The values shared by all users, and those of this request.
+    HtmlTemplate::Values sharedValues;
+    std::string sharedKey;
+    const auto setShared = [&](const std::string& placeholder, const std::string& value)
+    {
+        sharedValues.set(placeholder, value);
+        sharedKey += placeholder + '=' + value + '\n';
+    };
+
+    HtmlTemplate::Values values;
 
     // We need to pass certain parameters from the cool html GET URI
     // to the embedded document URI. Here we extract those params
@@ -929,29 +1010,29 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
     std::string socketProxy = "false";
     if (requestDetails.isProxy())
         socketProxy = "true";
-    Poco::replaceInPlace(preprocess, std::string("%SOCKET_PROXY%"), socketProxy);
+    values.set("%SOCKET_PROXY%", socketProxy);
 
     std::string responseRoot = cnxDetails.getResponseRoot();
     std::string userInterfaceMode;
 
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN%"), escapedAccessToken);
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN_TTL%"), std::to_string(tokenTtl));
-    Poco::replaceInPlace(preprocess, std::string("%ACCESS_HEADER%"), escapedAccessHeader);
-    Poco::replaceInPlace(preprocess, std::string("%HOST%"), cnxDetails.getWebSocketUrl());
-    Poco::replaceInPlace(preprocess, std::string("%VERSION%"), std::string(COOLWSD_VERSION_HASH));
-    Poco::replaceInPlace(preprocess, std::string("%COOLWSD_VERSION%"), std::string(COOLWSD_VERSION));
-    Poco::replaceInPlace(preprocess, std::string("%SERVICE_ROOT%"), responseRoot);
-    Poco::replaceInPlace(preprocess, std::string("%UI_DEFAULTS%"), uiDefaultsToJSON(uiDefaults, userInterfaceMode));
-    Poco::replaceInPlace(preprocess, std::string("%POSTMESSAGE_ORIGIN%"), escapedPostmessageOrigin);
+    values.set("%ACCESS_TOKEN%", escapedAccessToken);
+    values.set("%ACCESS_TOKEN_TTL%", std::to_string(tokenTtl));
+    values.set("%ACCESS_HEADER%", escapedAccessHeader);
+    values.set("%HOST%", cnxDetails.getWebSocketUrl());
+    setShared("%VERSION%", std::string(COOLWSD_VERSION_HASH));
+    setShared("%COOLWSD_VERSION%", std::string(COOLWSD_VERSION));
+    values.set("%SERVICE_ROOT%", responseRoot);
+    values.set("%UI_DEFAULTS%", uiDefaultsToJSON(uiDefaults, userInterfaceMode));
+    values.set("%POSTMESSAGE_ORIGIN%", escapedPostmessageOrigin);
 
     const auto& config = Application::instance().config();
 
     std::string protocolDebug = stringifyBoolFromConfig(config, "logging.protocol", false);
-    Poco::replaceInPlace(preprocess, std::string("%PROTOCOL_DEBUG%"), protocolDebug);
+    setShared("%PROTOCOL_DEBUG%", protocolDebug);
 
     static const std::string hexifyEmbeddedUrls =
         COOLWSD::getConfigValue<bool>("hexify_embedded_urls", false) ? "true" : "false";
-    Poco::replaceInPlace(preprocess, std::string("%HEXIFY_URL%"), hexifyEmbeddedUrls);
+    setShared("%HEXIFY_URL%", hexifyEmbeddedUrls);
 
 
     bool useIntegrationTheme = config.getBool("user_interface.use_integration_theme", true);
@@ -973,9 +1054,9 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
     }
 #endif
 
-    Poco::replaceInPlace(preprocess, std::string("<!--%BRANDING_CSS%-->"), brandCSS);
-    Poco::replaceInPlace(preprocess, std::string("<!--%BRANDING_JS%-->"), brandJS);
-    Poco::replaceInPlace(preprocess, std::string("<!--%CSS_VARIABLES%-->"), cssVarsToStyle(cssVars));
+    values.set("<!--%BRANDING_CSS%-->", brandCSS);
+    values.set("<!--%BRANDING_JS%-->", brandJS);
+    values.set("<!--%CSS_VARIABLES%-->", cssVarsToStyle(cssVars));
 
     // Customization related to document signing.
     std::string documentSigningDiv;
@@ -986,17 +1067,17 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
         documentSigningDiv = "<div id=\"document-signing-bar\"></div>";
         Poco::URI::encode(documentSigningURL, "'", escapedDocumentSigningURL);
     }
-    Poco::replaceInPlace(preprocess, std::string("<!--%DOCUMENT_SIGNING_DIV%-->"), documentSigningDiv);
-    Poco::replaceInPlace(preprocess, std::string("%DOCUMENT_SIGNING_URL%"), escapedDocumentSigningURL);
+    setShared("<!--%DOCUMENT_SIGNING_DIV%-->", documentSigningDiv);
+    setShared("%DOCUMENT_SIGNING_URL%", escapedDocumentSigningURL);
 
     const auto coolLogging = stringifyBoolFromConfig(config, "browser_logging", false);
-    Poco::replaceInPlace(preprocess, std::string("%BROWSER_LOGGING%"), coolLogging);
+    setShared("%BROWSER_LOGGING%", coolLogging);
     const auto groupDownloadAs = stringifyBoolFromConfig(config, "per_view.group_download_as", false);
-    Poco::replaceInPlace(preprocess, std::string("%GROUP_DOWNLOAD_AS%"), groupDownloadAs);
+    setShared("%GROUP_DOWNLOAD_AS%", groupDownloadAs);
     const unsigned int outOfFocusTimeoutSecs = config.getUInt("per_view.out_of_focus_timeout_secs", 60);
-    Poco::replaceInPlace(preprocess, std::string("%OUT_OF_FOCUS_TIMEOUT_SECS%"), std::to_string(outOfFocusTimeoutSecs));
+    setShared("%OUT_OF_FOCUS_TIMEOUT_SECS%", std::to_string(outOfFocusTimeoutSecs));
     const unsigned int idleTimeoutSecs = config.getUInt("per_view.idle_timeout_secs", 900);
-    Poco::replaceInPlace(preprocess, std::string("%IDLE_TIMEOUT_SECS%"), std::to_string(idleTimeoutSecs));
+    setShared("%IDLE_TIMEOUT_SECS%", std::to_string(idleTimeoutSecs));
 
 #if ENABLE_WELCOME_MESSAGE
     std::string enableWelcomeMessage = "true";
@@ -1004,7 +1085,7 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
     std::string enableWelcomeMessage = stringifyBoolFromConfig(config, "welcome.enable", false);
 #endif
 
-    Poco::replaceInPlace(preprocess, std::string("%ENABLE_WELCOME_MSG%"), enableWelcomeMessage);
+    setShared("%ENABLE_WELCOME_MSG%", enableWelcomeMessage);
 
     // the config value of 'notebookbar/tabbed' or 'classic/compact' overrides the UIMode
     // from the WOPI
@@ -1023,21 +1104,21 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
     if (userInterfaceMode != "classic" && userInterfaceMode != "notebookbar")
         userInterfaceMode = "notebookbar";
 
-    Poco::replaceInPlace(preprocess, std::string("%USER_INTERFACE_MODE%"), userInterfaceMode);
+    values.set("%USER_INTERFACE_MODE%", userInterfaceMode);
 
     std::string uiRtlSettings;
     if (isRtlLanguage(requestDetails.getParam("lang")))
         uiRtlSettings = " dir=\"rtl\" ";
-    Poco::replaceInPlace(preprocess, std::string("%UI_RTL_SETTINGS%"), uiRtlSettings);
+    values.set("%UI_RTL_SETTINGS%", uiRtlSettings);
 
     const std::string useIntegrationThemeString = useIntegrationTheme && hasIntegrationTheme ? "true" : "false";
-    Poco::replaceInPlace(preprocess, std::string("%USE_INTEGRATION_THEME%"), useIntegrationThemeString);
+    values.set("%USE_INTEGRATION_THEME%", useIntegrationThemeString);
 
     std::string enableMacrosExecution = stringifyBoolFromConfig(config, "security.enable_macros_execution", false);
-    Poco::replaceInPlace(preprocess, std::string("%ENABLE_MACROS_EXECUTION%"), enableMacrosExecution);
+    setShared("%ENABLE_MACROS_EXECUTION%", enableMacrosExecution);
 
-    Poco::replaceInPlace(preprocess, std::string("%FEEDBACK_URL%"), std::string(FEEDBACK_URL));
-    Poco::replaceInPlace(preprocess, std::string("%WELCOME_URL%"), std::string(WELCOME_URL));
+    setShared("%FEEDBACK_URL%", std::string(FEEDBACK_URL));
+    setShared("%WELCOME_URL%", std::string(WELCOME_URL));
 
     const std::string mimeType = "text/html";
 
@@ -1088,7 +1169,7 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
                 << "frame-ancestors " << frameAncestors;
         std::string escapedFrameAncestors;
         Poco::URI::encode(frameAncestors, "'", escapedFrameAncestors);
-        Poco::replaceInPlace(preprocess, std::string("%FRAME_ANCESTORS%"), escapedFrameAncestors);
+        values.set("%FRAME_ANCESTORS%", escapedFrameAncestors);
     }
     else
     {
@@ -1098,15 +1179,36 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
 
     cspOss << "\r\n";
 
+    // The shared values change rarely, if ever, so we keep the file bound to them,
+    // with its literals compressed, and fill in and compress only the rest.
+    CompiledFile& compiled = CompiledFiles[relPath];
+    if (!compiled._template)
+        compiled._template = std::make_shared<HtmlTemplate>(getUncompressedFile(relPath));
+    if (!compiled._bound || compiled._sharedKey != sharedKey)
+    {
+        LOG_DBG("Binding [" << relPath << "] to its shared values");
+        compiled._bound = std::make_shared<HtmlTemplate>(compiled._template->bind(sharedValues));
+        compiled._sharedKey = sharedKey;
+    }
+
+    std::string body;
+    if (getPreferredEncoding(request.get("Accept-Encoding", std::string()), false, true) == "gzip")
+        body = compiled._bound->renderGzip(values);
+    const bool compressed = !body.empty();
+    if (!compressed)
+        body = compiled._bound->render(values);
+
     std::ostringstream oss;
     oss << "HTTP/1.1 200 OK\r\n"
         "Date: " << Util::getHttpTimeNow() << "\r\n"
         "Last-Modified: " << Util::getHttpTimeNow() << "\r\n"
         "User-Agent: " << WOPI_AGENT_STRING << "\r\n"
         "Cache-Control:max-age=11059200\r\n"
-        "ETag: \"" COOLWSD_VERSION_HASH "\"\r\n"
-        "Content-Length: " << preprocess.size() << "\r\n"
+        "ETag: \"" COOLWSD_VERSION_HASH << (compressed ? "-gzip" : "") << "\"\r\n"
+        "Content-Length: " << body.size() << "\r\n"
         "Content-Type: " << mimeType << "\r\n"
+        << (compressed ? "Content-Encoding: gzip\r\n" : "") <<
+        "Vary: Accept-Encoding\r\n"
         "X-Content-Type-Options: nosniff\r\n"
         "X-XSS-Protection: 1; mode=block\r\n"
         "Referrer-Policy: no-referrer\r\n";
@@ -1171,11 +1273,12 @@ void FileServerRequestHandler::preprocessFile(const HTTPRequest& request,
         }
     }
 
-    oss << "\r\n"
-        << preprocess;
+    oss << "\r\n";
 
-    socket->send(oss.str());
-    LOG_TRC("Sent file: " << relPath << ": " << preprocess);
+    socket->send(oss.str(), false);
+    socket->send(body);
+    LOG_TRC("Sent " << (compressed ? "gzipped" : "uncompressed") << " file: " << relPath << " ("
+                    << body.size() << " bytes)");
 }
 
 
@@ -1187,7 +1290,7 @@ void FileServerRequestHandler::preprocessWelcomeFile(const HTTPRequest& request,
     Poco::Net::HTTPResponse response;
     const std::string relPath = getRequestPathname(request);
     LOG_DBG("Preprocessing file: " << relPath);
-    std::string templateWelcome = *getUncompressedFile(relPath);
+    std::string templateWelcome = getUncompressedFile(relPath);
 
     // Ask UAs to block if they detect any XSS attempt
     response.add("X-XSS-Protection", "1; mode=block");
@@ -1227,10 +1330,10 @@ void FileServerRequestHandler::preprocessAdminFile(const HTTPRequest& request,
 
     const std::string relPath = getRequestPathname(request);
     LOG_DBG("Preprocessing file: " << relPath);
-    std::string adminFile = *getUncompressedFile(relPath);
+    std::string adminFile = getUncompressedFile(relPath);
     const std::string templatePath =
         Poco::Path(relPath).setFileName("admintemplate.html").toString();
-    std::string templateFile = *getUncompressedFile(templatePath);
+    std::string templateFile = getUncompressedFile(templatePath);
     Poco::replaceInPlace(templateFile, std::string("<!--%MAIN_CONTENT%-->"), adminFile); // Now template has the main content..
 
     std::string brandJS(Poco::format(scriptJS, responseRoot, std::string(BRANDING)));
@@ -13,6 +13,7 @@
 #include <Poco/MemoryStream.h>
 #include <Poco/Util/LayeredConfiguration.h>
 
+class HtmlTemplate;
 class RequestDetails;
 /// Handles file requests over HTTP(S).
 class FileServerRequestHandler
@@ -58,16 +59,67 @@ public:
     static void initialize();
 
     /// Clean cached files.
-    static void uninitialize() { FileHash.clear(); }
+    static void uninitialize()
+    {
+        CompiledFiles.clear();
+        FileHash.clear();
+    }
 
     static void readDirToHash(const std::string &basePath, const std::string &path, const std::string &prefix = std::string());
 
-    static const std::string *getCompressedFile(const std::string &path);
+    static std::string getUncompressedFile(const std::string &path);
 
-    static const std::string *getUncompressedFile(const std::string &path);
+    /// Whether the If-None-Match header value @ifNoneMatch matches @etag,
+    /// by the weak comparison of RFC 7232.
+    static bool isETagMatch(const std::string& ifNoneMatch, const std::string& etag);
+
+    /// The encoding, "br", "gzip" or empty for none, to serve a file in for
+    /// the Accept-Encoding header value @acceptEncoding, given what we have.
+    static std::string getPreferredEncoding(const std::string& acceptEncoding, bool haveBrotli,
+                                            bool haveGzip);
 
 private:
-    static std::map<std::string, std::pair<std::string, std::string>> FileHash;
+    /// Bytes of a file we serve, kept alive by a mapping of the file, or a string.
+    struct Content
+    {
+        Content()
+            : _data(nullptr)
+            , _size(0)
+        {
+        }
+
+        std::shared_ptr<const void> _owner;
+        const char* _data;
+        std::size_t _size;
+    };
+
+    /// A file we serve, with any compressed variants we have of it.
+    struct CachedFile
+    {
+        Content _raw;
+        Content _gzip;
+        Content _brotli;
+        /// The strong ETag of the raw content, without quotes.
+        std::string _etag;
+    };
+
+    /// A file we fill in for each request, parsed once, and bound to the
+    /// values that are the same for all users, as given by _sharedKey.
+    struct CompiledFile
+    {
+        std::shared_ptr<const HtmlTemplate> _template;
+        std::string _sharedKey;
+        std::shared_ptr<const HtmlTemplate> _bound;
+    };
+
+    /// Whether the file named @endPoint is filled in for each request.
+    static bool isPreprocessedFile(const std::string& endPoint);
+
+    /// Maps the file at @path into @content.
+    static bool mapContent(const std::string& path, Content& content);
+
+    static std::map<std::string, CachedFile> FileHash;
+    static std::map<std::string, CompiledFile> CompiledFiles;
     static void sendError(int errorCode, const Poco::Net::HTTPRequest& request,
                           const std::shared_ptr<StreamSocket>& socket, const std::string& shortMessage,
                           const std::string& longMessage, const std::string& extraHeader = "");
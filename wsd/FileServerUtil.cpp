@@ -11,6 +11,9 @@
 #include "StringVector.hpp"
 #include "Util.hpp"
 
+#include <cstdlib>
+#include <vector>
+
 #include <Poco/JSON/Object.h>
 
 std::string FileServerRequestHandler::uiDefaultsToJSON(const std::string& uiDefaults, std::string& uiMode)
@@ -191,4 +194,67 @@ std::string FileServerRequestHandler::stringifyBoolFromConfig(
     return value;
 }
 
+bool FileServerRequestHandler::isETagMatch(const std::string& ifNoneMatch, const std::string& etag)
+{
+    // Proxies that compress may weaken our tags, which If-None-Match ignores.
+    const auto strip = [](std::string tag)
+    {
+        Util::trim(tag);
+        return Util::startsWith(tag, "W/") ? tag.substr(2) : tag;
+    };
+
+    const std::string wanted = strip(etag);
+    for (const std::string& tag : Util::splitStringToVector(ifNoneMatch, ','))
+    {
+        const std::string candidate = strip(tag);
+        if (candidate == "*" || candidate == wanted)
+            return true;
+    }
+
+    return false;
+}
+
+std::string FileServerRequestHandler::getPreferredEncoding(const std::string& acceptEncoding,
+                                                           bool haveBrotli, bool haveGzip)
+{
+    // The quality values of each coding, -1 when not listed.
+    double brotli = -1;
+    double gzip = -1;
+    double any = -1;
+    for (const std::string& entry : Util::splitStringToVector(acceptEncoding, ','))
+    {
+        std::vector<std::string> params = Util::splitStringToVector(entry, ';');
+        if (params.empty())
+            continue;
+
+        double quality = 1;
+        for (std::size_t i = 1; i < params.size(); ++i)
+        {
+            Util::trim(params[i]);
+            if (Util::startsWith(params[i], "q="))
+                quality = std::strtod(params[i].c_str() + 2, nullptr);
+        }
+
+        const std::string coding = Util::toLower(Util::trim(params[0]));
+        if (coding == "br")
+            brotli = quality;
+        else if (coding == "gzip" || coding == "x-gzip")
+            gzip = quality;
+        else if (coding == "*")
+            any = quality;
+    }
+
+    if (brotli < 0)
+        brotli = any;
+    if (gzip < 0)
+        gzip = any;
+
+    // Brotli is the smaller, so it wins a tie.
+    if (haveBrotli && brotli > 0 && (!haveGzip || brotli >= gzip))
+        return "br";
+    if (haveGzip && gzip > 0)
+        return "gzip";
+    return std::string();
+}
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,298 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+/// A file with %NAME% and <!--%NAME%--> placeholders, such as cool.html, parsed
+/// once into literal segments and placeholder slots. Each request then renders
+/// it in one pass, rather than scanning the whole file for every placeholder.
+/// Values are never scanned, so placeholders in them are left as they are.
+class HtmlTemplate
+{
+public:
+    /// The values to render a template with. Placeholders without one are kept.
+    class Values
+    {
+    public:
+        /// Sets the value of @placeholder, "%NAME%" or "<!--%NAME%-->". The value
+        /// of "%NAME%" also goes inside a "<!--%NAME%-->" without a value of its own.
+        void set(const std::string& placeholder, std::string value)
+        {
+            _values[placeholder] = std::move(value);
+        }
+
+    private:
+        friend class HtmlTemplate;
+        std::unordered_map<std::string, std::string> _values;
+    };
+
+    explicit HtmlTemplate(const std::string& text)
+    {
+        std::size_t start = 0;
+        std::size_t pos = text.find('%');
+        while (pos != std::string::npos)
+        {
+            std::size_t end = pos + 1;
+            while (end < text.size()
+                   && (std::isupper(static_cast<unsigned char>(text[end]))
+                       || std::isdigit(static_cast<unsigned char>(text[end])) || text[end] == '_'))
+                ++end;
+
+            if (end == pos + 1 || end == text.size() || text[end] != '%')
+            {
+                // Not a placeholder, but a '%' where we stopped may start one.
+                pos = text.find('%', end);
+                continue;
+            }
+
+            // The name, including the percent signs.
+            ++end;
+            std::size_t slotStart = pos;
+            std::size_t slotEnd = end;
+            if (pos >= 4 && text.compare(pos - 4, 4, "<!--") == 0
+                && text.compare(end, 3, "-->") == 0)
+            {
+                slotStart -= 4;
+                slotEnd += 3;
+            }
+
+            Segment segment;
+            segment._literal = text.substr(start, slotStart - start);
+            segment._name = text.substr(slotStart, slotEnd - slotStart);
+            segment._bareName = text.substr(pos, end - pos);
+            _segments.push_back(std::move(segment));
+
+            start = slotEnd;
+            pos = text.find('%', start);
+        }
+
+        Segment tail;
+        tail._literal = text.substr(start);
+        _segments.push_back(std::move(tail));
+    }
+
+    /// The number of placeholders found, counting repeats.
+    std::size_t getSlotCount() const { return _segments.size() - 1; }
+
+    /// Renders the template with @values.
+    std::string render(const Values& values) const
+    {
+        std::size_t size = 0;
+        for (const Segment& segment : _segments)
+            size += segment._literal.size() + getSlotSize(segment, values);
+
+        std::string output;
+        output.reserve(size);
+        for (const Segment& segment : _segments)
+        {
+            output += segment._literal;
+            appendSlot(output, segment, values);
+        }
+
+        return output;
+    }
+
+    /// Returns a copy of this template with the placeholders that have a
+    /// value in @values replaced, leaving only the others as slots.
+    /// The literals of the copy are deflated ahead, for renderGzip().
+    HtmlTemplate bind(const Values& values) const
+    {
+        HtmlTemplate bound;
+        std::string literal;
+        for (const Segment& segment : _segments)
+        {
+            literal += segment._literal;
+            if (segment._name.empty() || getSlotValue(segment, values, nullptr) == nullptr)
+            {
+                Segment copy = segment;
+                copy._literal = std::move(literal);
+                literal.clear();
+                bound._segments.push_back(std::move(copy));
+            }
+            else
+                appendSlot(literal, segment, values);
+        }
+
+        bound.deflateLiterals();
+        return bound;
+    }
+
+    /// Renders the template with @values as a gzip stream. Only the values are
+    /// compressed here, the literals were deflated by bind(). Returns an empty
+    /// string when the template wasn't bound, or on failure.
+    std::string renderGzip(const Values& values) const
+    {
+        if (!_deflated)
+            return std::string();
+
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY)
+            != Z_OK)
+            return std::string();
+
+        // The gzip header: deflate, no name or time, Unix.
+        std::string output("\x1f\x8b\x08\0\0\0\0\0\0\x03", 10);
+        uLong crc = crc32(0, Z_NULL, 0);
+        uLong total = 0;
+
+        bool good = true;
+        std::string value;
+        for (const Segment& segment : _segments)
+        {
+            output += segment._deflatedLiteral;
+            crc = crc32_combine(crc, segment._literalCrc, segment._literal.size());
+            total += segment._literal.size();
+
+            value.clear();
+            appendSlot(value, segment, values);
+            if (!value.empty())
+            {
+                // Each piece starts on its own, and ends on a byte boundary.
+                good = good && deflateReset(&strm) == Z_OK
+                       && deflatePiece(strm, value.data(), value.size(), output);
+                crc = crc32(crc, reinterpret_cast<const Bytef*>(value.data()), value.size());
+                total += value.size();
+            }
+        }
+
+        deflateEnd(&strm);
+        if (!good)
+            return std::string();
+
+        // An empty, final, fixed-Huffman block ends the stream.
+        output.append("\x03\0", 2);
+        for (int i = 0; i < 4; ++i)
+            output += static_cast<char>((crc >> (8 * i)) & 0xff);
+        for (int i = 0; i < 4; ++i)
+            output += static_cast<char>((total >> (8 * i)) & 0xff);
+
+        return output;
+    }
+
+private:
+    struct Segment
+    {
+        /// The text before the slot.
+        std::string _literal;
+        /// The placeholder, as in the text; empty for the text after the last one.
+        std::string _name;
+        /// The placeholder without any comment around it.
+        std::string _bareName;
+        std::string _deflatedLiteral;
+        uLong _literalCrc = 0;
+    };
+
+    HtmlTemplate() = default;
+
+    /// The value for the slot of @segment, if any, and whether it goes in a comment.
+    static const std::string* getSlotValue(const Segment& segment, const Values& values,
+                                           bool* inComment)
+    {
+        if (segment._name.empty())
+            return nullptr;
+
+        auto it = values._values.find(segment._name);
+        if (it == values._values.end() && segment._name != segment._bareName)
+        {
+            it = values._values.find(segment._bareName);
+            if (it != values._values.end())
+            {
+                if (inComment)
+                    *inComment = true;
+                return &it->second;
+            }
+        }
+
+        if (inComment)
+            *inComment = false;
+        return it != values._values.end() ? &it->second : nullptr;
+    }
+
+    static std::size_t getSlotSize(const Segment& segment, const Values& values)
+    {
+        bool inComment = false;
+        const std::string* value = getSlotValue(segment, values, &inComment);
+        if (!value)
+            return segment._name.size();
+
+        return value->size() + (inComment ? 7 : 0);
+    }
+
+    static void appendSlot(std::string& output, const Segment& segment, const Values& values)
+    {
+        bool inComment = false;
+        const std::string* value = getSlotValue(segment, values, &inComment);
+        if (!value)
+            output += segment._name;
+        else if (inComment)
+            output += "<!--" + *value + "-->";
+        else
+            output += *value;
+    }
+
+    /// Deflates @len bytes of @data with @strm, ending on a byte boundary.
+    static bool deflatePiece(z_stream& strm, const char* data, std::size_t len,
+                             std::string& output)
+    {
+        strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        strm.avail_in = len;
+        do
+        {
+            char buffer[16 * 1024];
+            strm.next_out = reinterpret_cast<Bytef*>(buffer);
+            strm.avail_out = sizeof(buffer);
+            const int rc = deflate(&strm, Z_SYNC_FLUSH);
+            if (rc != Z_OK && rc != Z_BUF_ERROR)
+                return false;
+
+            output.append(buffer, sizeof(buffer) - strm.avail_out);
+        } while (strm.avail_out == 0);
+
+        return strm.avail_in == 0;
+    }
+
+    void deflateLiterals()
+    {
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY)
+            != Z_OK)
+            return;
+
+        _deflated = true;
+        for (Segment& segment : _segments)
+        {
+            const std::string& literal = segment._literal;
+            segment._literalCrc
+                = crc32(0, reinterpret_cast<const Bytef*>(literal.data()), literal.size());
+            if (!literal.empty()
+                && (deflateReset(&strm) != Z_OK
+                    || !deflatePiece(strm, literal.data(), literal.size(),
+                                     segment._deflatedLiteral)))
+                _deflated = false;
+        }
+
+        deflateEnd(&strm);
+    }
+
+    std::vector<Segment> _segments;
+    /// Whether the literals were deflated by bind().
+    bool _deflated = false;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,200 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+
+/// Decides how many spare kits to keep spawned, see num_prespawn_children
+/// and the prespawn section in coolwsd.xml.
+/// By default that is a fixed number. In adaptive mode it covers the
+/// documents expected to open while new kits spawn, predicted from the
+/// recent rate of opens and the time spawning took, within a memory budget.
+/// Also keeps the spawn times and how often a kit was ready, for the metrics.
+class PrespawnPolicy
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// How quickly the open rate forgets the past: opens this long ago
+    /// count for about a third of the recent ones.
+    static constexpr std::chrono::seconds RateTimeConstant = std::chrono::seconds(10);
+
+    /// The upper bounds of the spawn time histogram buckets, in ms.
+    static constexpr int64_t LatencyBucketsMs[] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+    static constexpr std::size_t LatencyBucketCount = sizeof(LatencyBucketsMs) / sizeof(int64_t);
+
+    PrespawnPolicy()
+        : _adaptive(false)
+        , _minimum(1)
+        , _maxChildren(1)
+        , _memoryBudget(0)
+        , _openRate(0)
+        , _spawnLatencyMs(0)
+        , _kitMemory(0)
+        , _hitCount(0)
+        , _missCount(0)
+        , _latencyBuckets{}
+        , _latencyCount(0)
+        , _latencySumMs(0)
+    {
+    }
+
+    /// Keeps @minimum spare kits, and in @adaptive mode up to @maxChildren,
+    /// using no more than @memoryBudget bytes (0 for no limit).
+    void configure(bool adaptive, unsigned minimum, unsigned maxChildren, uint64_t memoryBudget)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _adaptive = adaptive;
+        _minimum = std::max(1U, minimum);
+        _maxChildren = std::max(_minimum, maxChildren);
+        _memoryBudget = memoryBudget;
+    }
+
+    bool isAdaptive() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _adaptive;
+    }
+
+    /// A document wants a kit at @now, @hit when a spare one was ready for it.
+    void recordOpen(Clock::time_point now, bool hit)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _openRate = decayedRate(now) + 1.0 / RateTimeConstant.count();
+        _lastOpen = now;
+        if (hit)
+            ++_hitCount;
+        else
+            ++_missCount;
+    }
+
+    /// Forkit was asked at @now to spawn @count kits.
+    void recordSpawnRequest(Clock::time_point now, int count)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (int i = 0; i < count; ++i)
+            _spawnRequests.push_back(now);
+    }
+
+    /// The spawn requests we had were forgotten, as forkit didn't answer them.
+    void resetSpawnRequests()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _spawnRequests.clear();
+    }
+
+    /// A new kit arrived at @now, using @memory bytes (0 when unknown).
+    void recordSpawn(Clock::time_point now, uint64_t memory)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (memory > 0)
+            _kitMemory = _kitMemory ? (3 * _kitMemory + memory) / 4 : memory;
+
+        // Kits arrive in the order requested, near enough.
+        if (_spawnRequests.empty())
+            return;
+
+        const int64_t latencyMs
+            = std::chrono::duration_cast<std::chrono::milliseconds>(now - _spawnRequests.front())
+                  .count();
+        _spawnRequests.pop_front();
+
+        _spawnLatencyMs = _latencyCount ? (3 * _spawnLatencyMs + latencyMs) / 4 : latencyMs;
+        ++_latencyCount;
+        _latencySumMs += latencyMs;
+        for (std::size_t i = 0; i < LatencyBucketCount; ++i)
+        {
+            if (latencyMs <= LatencyBucketsMs[i])
+            {
+                ++_latencyBuckets[i];
+                break;
+            }
+        }
+    }
+
+    /// The number of spare kits to keep at @now.
+    unsigned getTarget(Clock::time_point now) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_adaptive)
+            return _minimum;
+
+        // Opens are about Poisson, so cover the expected ones and two deviations more.
+        const double expected = decayedRate(now) * _spawnLatencyMs / 1000.0;
+        const double demand = std::ceil(expected + 2 * std::sqrt(expected));
+
+        unsigned limit = _maxChildren;
+        if (_memoryBudget > 0 && _kitMemory > 0)
+            limit = std::min<uint64_t>(limit, _memoryBudget / _kitMemory);
+
+        return std::max(_minimum, std::min(limit, static_cast<unsigned>(demand)));
+    }
+
+    /// Writes the metrics, see the KITS section of metrics.txt.
+    void dumpMetrics(std::ostream& os, Clock::time_point now) const
+    {
+        const unsigned target = getTarget(now);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t count = 0;
+        for (std::size_t i = 0; i < LatencyBucketCount; ++i)
+        {
+            count += _latencyBuckets[i];
+            os << "kit_spawn_duration_milliseconds_bucket{le=\"" << LatencyBucketsMs[i] << "\"} "
+               << count << '\n';
+        }
+
+        os << "kit_spawn_duration_milliseconds_bucket{le=\"+Inf\"} " << _latencyCount << '\n';
+        os << "kit_spawn_duration_milliseconds_sum " << _latencySumMs << '\n';
+        os << "kit_spawn_duration_milliseconds_count " << _latencyCount << '\n';
+        os << "kit_prespawn_hit_count " << _hitCount << '\n';
+        os << "kit_prespawn_miss_count " << _missCount << '\n';
+        os << "kit_prespawn_target_count " << target << '\n';
+        os << "kit_prespawn_open_rate_per_minute "
+           << static_cast<uint64_t>(std::lround(decayedRate(now) * 60)) << '\n';
+    }
+
+private:
+    /// The open rate, per second, as it stands at @now.
+    double decayedRate(Clock::time_point now) const
+    {
+        if (_openRate <= 0 || now <= _lastOpen)
+            return _openRate;
+
+        const double elapsed = std::chrono::duration<double>(now - _lastOpen).count();
+        return _openRate * std::exp(-elapsed / RateTimeConstant.count());
+    }
+
+    mutable std::mutex _mutex;
+    bool _adaptive;
+    unsigned _minimum;
+    unsigned _maxChildren;
+    uint64_t _memoryBudget;
+    /// Opens per second as of _lastOpen, an exponentially decaying average.
+    double _openRate;
+    Clock::time_point _lastOpen;
+    /// The recent time to spawn a kit, averaged.
+    int64_t _spawnLatencyMs;
+    /// The recent memory of a spare kit, averaged.
+    uint64_t _kitMemory;
+    /// When each of the kits still expected was requested.
+    std::deque<Clock::time_point> _spawnRequests;
+    uint64_t _hitCount;
+    uint64_t _missCount;
+    uint64_t _latencyBuckets[LatencyBucketCount];
+    uint64_t _latencyCount;
+    int64_t _latencySumMs;
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
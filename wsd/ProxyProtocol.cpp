@@ -22,6 +22,7 @@
 #include "Exceptions.hpp"
 #include "COOLWSD.hpp"
 #include <Socket.hpp>
+#include <net/HttpHelper.hpp>
 
 #include <atomic>
 #include <cassert>
@@ -45,24 +46,33 @@ void DocumentBroker::handleProxyRequest(
         clientSession = createNewClientSession(
                 std::make_shared<ProxyProtocolHandler>(),
                 id, uriPublic, isReadOnly, requestDetails);
-        addSession(clientSession);
-        COOLWSD::checkDiskSpaceAndWarnClients(true);
-        COOLWSD::checkSessionLimitsAndWarnClients();
-
-        const std::string &sessionId = clientSession->getOrCreateProxyAccess();
-        LOG_TRC("proxy: Returning sessionId " << sessionId);
-
-        std::ostringstream oss;
-        oss << "HTTP/1.1 200 OK\r\n"
-            "Last-Modified: " << Util::getHttpTimeNow() << "\r\n"
-            "User-Agent: " WOPI_AGENT_STRING "\r\n"
-            "Content-Length: " << sessionId.size() << "\r\n"
-            "Content-Type: application/json; charset=utf-8\r\n"
-            "X-Content-Type-Options: nosniff\r\n"
-            "\r\n" << sessionId;
-
-        socket->send(oss.str());
-        socket->shutdown();
+        addSessionAsync(clientSession, [clientSession, socket](std::exception_ptr error)
+        {
+            if (error)
+            {
+                // The error is logged already, badness occurred:
+                HttpHelper::sendErrorAndShutdown(400, socket);
+                return;
+            }
+
+            COOLWSD::checkDiskSpaceAndWarnClients(true);
+            COOLWSD::checkSessionLimitsAndWarnClients();
+
+            const std::string &sessionId = clientSession->getOrCreateProxyAccess();
+            LOG_TRC("proxy: Returning sessionId " << sessionId);
+
+            std::ostringstream oss;
+            oss << "HTTP/1.1 200 OK\r\n"
+                "Last-Modified: " << Util::getHttpTimeNow() << "\r\n"
+                "User-Agent: " WOPI_AGENT_STRING "\r\n"
+                "Content-Length: " << sessionId.size() << "\r\n"
+                "Content-Type: application/json; charset=utf-8\r\n"
+                "X-Content-Type-Options: nosniff\r\n"
+                "\r\n" << sessionId;
+
+            socket->send(oss.str());
+            socket->shutdown();
+        });
         return;
     }
     else
@@ -28,17 +28,14 @@
 #include <Poco/Net/AcceptCertificateHandler.h>
 #include <Poco/Net/Context.h>
 #include <Poco/Net/DNS.h>
-#include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
-#include <Poco/Net/HTTPSClientSession.h>
 #include <Poco/Net/KeyConsoleHandler.h>
 #include <Poco/Net/NameValueCollection.h>
 #include <Poco/Net/SSLManager.h>
 
 #endif
 
-#include <Poco/StreamCopier.h>
 #include <Poco/URI.h>
 
 #include "Auth.hpp"
@@ -64,6 +61,7 @@
 bool StorageBase::FilesystemEnabled;
 bool StorageBase::SSLAsScheme = true;
 bool StorageBase::SSLEnabled = false;
+std::shared_ptr<http::SessionPool> StorageBase::HttpSessionPool;
 
 #if !MOBILEAPP
 
@@ -162,11 +160,37 @@ void StorageBase::initialize()
     else
         LOG_INF("Initialized Client SSL.");
 #endif
+
+    if (COOLWSD::getConfigValue<bool>("storage.wopi.connection_pool[@enable]", true))
+    {
+        const std::size_t maxIdlePerHost
+            = COOLWSD::getConfigValue<unsigned>("storage.wopi.connection_pool.max_idle_per_host", 8);
+        const std::chrono::seconds idleTimeout(
+            COOLWSD::getConfigValue<unsigned>("storage.wopi.connection_pool.idle_timeout_secs", 30));
+        HttpSessionPool = std::make_shared<http::SessionPool>(maxIdlePerHost, idleTimeout);
+        LOG_INF("Keeping up to " << maxIdlePerHost << " idle connections to each storage host for "
+                                 << idleTimeout);
+
+#if ENABLE_SSL
+        // Resuming the TLS session makes new connections cheaper too.
+        if (ssl::Manager::isClientContextInitialized())
+            ssl::Manager::setClientSessionResumption(true);
+#endif
+    }
 #else
     FilesystemEnabled = true;
 #endif
 }
 
+void StorageBase::uninitialize()
+{
+    if (HttpSessionPool)
+    {
+        HttpSessionPool->clear();
+        HttpSessionPool.reset();
+    }
+}
+
 #if !MOBILEAPP
 
 bool isLocalhost(const std::string& targetHost)
@@ -425,37 +449,6 @@ LocalStorage::uploadLocalFileToStorage(const Authorization& /*auth*/, LockContex
 
 #if !MOBILEAPP
 
-Poco::Net::HTTPClientSession* StorageBase::getHTTPClientSession(const Poco::URI& uri)
-{
-    bool useSSL = false;
-    if (SSLAsScheme)
-    {
-        // the WOPI URI itself should control whether we use SSL or not
-        // for whether we verify vs. certificates, cf. above
-        useSSL = uri.getScheme() != "http";
-    }
-    else
-    {
-        // We decoupled the Wopi communication from client communication because
-        // the Wopi communication must have an independent policy.
-        // So, we will use here only Storage settings.
-        useSSL = SSLEnabled || COOLWSD::isSSLTermination();
-    }
-    // We decoupled the Wopi communication from client communication because
-    // the Wopi communication must have an independent policy.
-    // So, we will use here only Storage settings.
-    Poco::Net::HTTPClientSession* session = useSSL
-        ? new Poco::Net::HTTPSClientSession(uri.getHost(), uri.getPort(),
-                                            Poco::Net::SSLManager::instance().defaultClientContext())
-        : new Poco::Net::HTTPClientSession(uri.getHost(), uri.getPort());
-
-    // Set the timeout to the configured value.
-    static int timeoutSec = COOLWSD::getConfigValue<int>("net.connection_timeout_secs", 30);
-    session->setTimeout(Poco::Timespan(timeoutSec, 0));
-
-    return session;
-}
-
 std::shared_ptr<http::Session> StorageBase::getHttpSession(const Poco::URI& uri)
 {
     bool useSSL = false;
@@ -476,8 +469,10 @@ std::shared_ptr<http::Session> StorageBase::getHttpSession(const Poco::URI& uri)
     const auto protocol
         = useSSL ? http::Session::Protocol::HttpSsl : http::Session::Protocol::HttpUnencrypted;
 
-    // Create the session.
-    auto httpSession = http::Session::create(uri.getHost(), protocol, uri.getPort());
+    // Create the session, reusing an open connection to the host, if we have one.
+    auto httpSession = HttpSessionPool
+                           ? HttpSessionPool->create(uri.getHost(), protocol, uri.getPort())
+                           : http::Session::create(uri.getHost(), protocol, uri.getPort());
 
     static int timeoutSec = COOLWSD::getConfigValue<int>("net.connection_timeout_secs", 30);
     httpSession->setTimeout(std::chrono::seconds(timeoutSec));
@@ -523,6 +518,50 @@ std::map<std::string, std::string> GetQueryParams(const Poco::URI& uri)
     return result;
 }
 
+/// Returns true when @httpResponse redirects us to its Location.
+bool isRedirect(const http::Response& httpResponse)
+{
+    const int statusCode = httpResponse.statusLine().statusCode();
+    return statusCode == Poco::Net::HTTPResponse::HTTP_FOUND
+           || statusCode == Poco::Net::HTTPResponse::HTTP_MOVED_PERMANENTLY
+           || statusCode == Poco::Net::HTTPResponse::HTTP_TEMPORARY_REDIRECT
+           || statusCode == Poco::Net::HTTPResponse::HTTP_PERMANENT_REDIRECT;
+}
+
+/// Returns the message of the exception in @error, for logging.
+std::string getErrorMessage(const std::exception_ptr& error)
+{
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (const std::exception& exc)
+    {
+        return exc.what();
+    }
+    catch (...)
+    {
+        return "Unknown exception";
+    }
+}
+
+/// Returns true when @error is a StorageSpaceLowException.
+bool isStorageSpaceLow(const std::exception_ptr& error)
+{
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (const StorageSpaceLowException&)
+    {
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
 } // anonymous namespace
 
 #endif // !MOBILEAPP
@@ -637,10 +676,7 @@ WopiStorage::getWOPIFileInfoForUri(Poco::URI uriObject, const Authorization& aut
         callDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::steady_clock::now() - startTime);
 
-        if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FOUND ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_MOVED_PERMANENTLY ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_TEMPORARY_REDIRECT ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_PERMANENT_REDIRECT)
+        if (isRedirect(*httpResponse))
         {
             if (redirectLimit)
             {
@@ -659,34 +695,7 @@ WopiStorage::getWOPIFileInfoForUri(Poco::URI uriObject, const Authorization& aut
 
         // Note: we don't log the response if obfuscation is enabled, except for failures.
         wopiResponse = httpResponse->getBody();
-        const bool failed
-            = (httpResponse->statusLine().statusCode() != Poco::Net::HTTPResponse::HTTP_OK);
-
-        Log::StreamLogger logRes = failed ? Log::error() : Log::trace();
-        if (logRes.enabled())
-        {
-            logRes << "WOPI::CheckFileInfo " << (failed ? "failed" : "returned") << " for URI ["
-                   << uriAnonym << "]: " << httpResponse->statusLine().statusCode() << ' '
-                   << httpResponse->statusLine().reasonPhrase() << ". Headers: ";
-            for (const auto& pair : httpResponse->header())
-            {
-                logRes << '\t' << pair.first << ": " << pair.second << " / ";
-            }
-
-            if (failed)
-                logRes << "\tBody: [" << wopiResponse << "]";
-
-            LOG_END(logRes);
-        }
-
-        if (failed)
-        {
-            if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FORBIDDEN)
-                throw UnauthorizedRequestException(
-                    "Access denied, 403. WOPI::CheckFileInfo failed on: " + uriAnonym);
-
-            throw StorageConnectionException("WOPI::CheckFileInfo failed: " + wopiResponse);
-        }
+        checkWOPIFileInfoResponse(*httpResponse, uriAnonym);
     }
     catch (const Poco::Exception& pexc)
     {
@@ -699,6 +708,48 @@ WopiStorage::getWOPIFileInfoForUri(Poco::URI uriObject, const Authorization& aut
         LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym << "]. Error: " << exc.what());
     }
 
+    return parseWOPIFileInfo(std::move(wopiResponse), callDurationMs, uriObject, lockCtx,
+                             uriAnonym);
+}
+
+void WopiStorage::checkWOPIFileInfoResponse(const http::Response& httpResponse,
+                                            const std::string& uriAnonym) const
+{
+    const bool failed
+        = (httpResponse.statusLine().statusCode() != Poco::Net::HTTPResponse::HTTP_OK);
+
+    Log::StreamLogger logRes = failed ? Log::error() : Log::trace();
+    if (logRes.enabled())
+    {
+        logRes << "WOPI::CheckFileInfo " << (failed ? "failed" : "returned") << " for URI ["
+               << uriAnonym << "]: " << httpResponse.statusLine().statusCode() << ' '
+               << httpResponse.statusLine().reasonPhrase() << ". Headers: ";
+        for (const auto& pair : httpResponse.header())
+        {
+            logRes << '\t' << pair.first << ": " << pair.second << " / ";
+        }
+
+        if (failed)
+            logRes << "\tBody: [" << httpResponse.getBody() << "]";
+
+        LOG_END(logRes);
+    }
+
+    if (failed)
+    {
+        if (httpResponse.statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FORBIDDEN)
+            throw UnauthorizedRequestException(
+                "Access denied, 403. WOPI::CheckFileInfo failed on: " + uriAnonym);
+
+        throw StorageConnectionException("WOPI::CheckFileInfo failed: " + httpResponse.getBody());
+    }
+}
+
+std::unique_ptr<WopiStorage::WOPIFileInfo>
+WopiStorage::parseWOPIFileInfo(std::string wopiResponse, std::chrono::milliseconds callDurationMs,
+                               Poco::URI& uriObject, LockContext& lockCtx,
+                               const std::string& uriAnonym)
+{
     Poco::JSON::Object::Ptr object;
     if (JsonUtil::parseJSON(wopiResponse, object))
     {
@@ -751,6 +802,102 @@ std::unique_ptr<WopiStorage::WOPIFileInfo> WopiStorage::getWOPIFileInfo(const Au
     return getWOPIFileInfoForUri(uriObject, auth, lockCtx, RedirectionLimit);
 }
 
+void WopiStorage::getWOPIFileInfoAsync(const Authorization& auth, LockContext& lockCtx,
+                                       SocketPoll& socketPoll,
+                                       const AsyncFileInfoCallback& asyncFileInfoCallback)
+{
+    Poco::URI uriObject(getUri());
+    getWOPIFileInfoForUriAsync(uriObject, auth, lockCtx, RedirectionLimit, socketPoll,
+                               asyncFileInfoCallback);
+}
+
+void WopiStorage::getWOPIFileInfoForUriAsync(Poco::URI uriObject, const Authorization& auth,
+                                             LockContext& lockCtx, unsigned redirectLimit,
+                                             SocketPoll& socketPoll,
+                                             const AsyncFileInfoCallback& asyncFileInfoCallback)
+{
+    // update the access_token to the one matching to the session
+    auth.authorizeURI(uriObject);
+    const std::string uriAnonym = COOLWSD::anonymizeUrl(uriObject.toString());
+
+    LOG_DBG("Getting info asynchronously for wopi uri [" << uriAnonym << "].");
+
+    try
+    {
+        std::shared_ptr<http::Session> httpSession = getHttpSession(uriObject);
+        http::Request httpRequest = initHttpRequest(uriObject, auth);
+
+        const auto startTime = std::chrono::steady_clock::now();
+
+        http::Session::FinishedCallback finishedCallback =
+            [this, uriObject, auth, &lockCtx, redirectLimit, &socketPoll, asyncFileInfoCallback,
+             uriAnonym, startTime](const std::shared_ptr<http::Session>& session)
+        {
+            assert(session && "Expected a valid http::Session");
+            const std::shared_ptr<const http::Response> httpResponse = session->response();
+
+            const auto callDurationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startTime);
+
+            std::unique_ptr<WOPIFileInfo> wopiFileInfo;
+            std::exception_ptr error;
+            try
+            {
+                if (isRedirect(*httpResponse))
+                {
+                    if (redirectLimit)
+                    {
+                        const std::string& location = httpResponse->get("Location");
+                        LOG_TRC("WOPI::CheckFileInfo redirect to URI ["
+                                << COOLWSD::anonymizeUrl(location) << "]");
+
+                        Poco::URI redirectUriObject(location);
+                        setUri(redirectUriObject);
+                        getWOPIFileInfoForUriAsync(redirectUriObject, auth, lockCtx,
+                                                   redirectLimit - 1, socketPoll,
+                                                   asyncFileInfoCallback);
+                        return;
+                    }
+
+                    LOG_WRN("WOPI::CheckFileInfo redirected too many times - URI [" << uriAnonym
+                                                                                   << "]");
+                }
+
+                checkWOPIFileInfoResponse(*httpResponse, uriAnonym);
+
+                Poco::URI uri(uriObject);
+                wopiFileInfo = parseWOPIFileInfo(httpResponse->getBody(), callDurationMs, uri,
+                                                 lockCtx, uriAnonym);
+            }
+            catch (const std::exception& exc)
+            {
+                LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym
+                                                                       << "]. Error: " << exc.what());
+                error = std::current_exception();
+            }
+
+            // Fire the callback to our client (DocBroker, typically).
+            asyncFileInfoCallback(std::move(wopiFileInfo), error);
+        };
+
+        httpSession->setFinishedHandler(finishedCallback);
+
+        LOG_DBG("Async CheckFileInfo request: " << httpRequest.header().toString());
+
+        // Make the request.
+        if (httpSession->asyncRequest(httpRequest, socketPoll))
+            return;
+
+        throw StorageConnectionException("WOPI::CheckFileInfo failed to connect to " + uriAnonym);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERR("Cannot get file info from WOPI storage uri [" << uriAnonym
+                                                               << "]. Error: " << exc.what());
+        asyncFileInfoCallback(nullptr, std::current_exception());
+    }
+}
+
 void WopiStorage::WOPIFileInfo::init()
 {
     _userCanWrite = false;
@@ -915,6 +1062,54 @@ WopiStorage::WOPIFileInfo::WOPIFileInfo(const FileInfo &fileInfo,
         _disableExport = true;
 }
 
+http::Request WopiStorage::initLockRequest(const Poco::URI& uriObject, const Authorization& auth,
+                                           const LockContext& lockCtx, bool lock) const
+{
+    http::Request httpRequest = initHttpRequest(uriObject, auth);
+    httpRequest.setVerb(http::Request::VERB_POST);
+
+    http::Header& httpHeader = httpRequest.header();
+    httpHeader.set("X-WOPI-Override", lock ? "LOCK" : "UNLOCK");
+    httpHeader.set("X-WOPI-Lock", lockCtx._lockToken);
+    if (!getExtendedData().empty())
+    {
+        httpHeader.set("X-COOL-WOPI-ExtendedData", getExtendedData());
+        httpHeader.set("X-LOOL-WOPI-ExtendedData", getExtendedData());
+    }
+
+    // IIS requires content-length for POST requests: see https://forums.iis.net/t/1119456.aspx
+    httpHeader.setContentLength(0);
+
+    return httpRequest;
+}
+
+bool WopiStorage::handleLockResponse(const http::Response& httpResponse, LockContext& lockCtx,
+                                     bool lock) const
+{
+    const std::string wopiLog(lock ? "WOPI::Lock" : "WOPI::Unlock");
+    const std::string responseString = httpResponse.getBody();
+    const unsigned status = httpResponse.statusLine().statusCode();
+
+    LOG_INF(wopiLog << " response: " << responseString << " status " << status);
+
+    if (status == Poco::Net::HTTPResponse::HTTP_OK)
+    {
+        lockCtx._isLocked = lock;
+        lockCtx._lastLockTime = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    std::string sMoreInfo = httpResponse.get("X-WOPI-LockFailureReason", "");
+    if (!sMoreInfo.empty())
+    {
+        lockCtx._lockFailureReason = sMoreInfo;
+        sMoreInfo = ", failure reason: \"" + sMoreInfo + "\"";
+    }
+    LOG_ERR("Un-successful " << wopiLog << " with status " << status <<
+            sMoreInfo << " and response: " << responseString);
+    return false;
+}
+
 bool WopiStorage::updateLockState(const Authorization& auth, LockContext& lockCtx, bool lock)
 {
     lockCtx._lockFailureReason.clear();
@@ -933,52 +1128,65 @@ bool WopiStorage::updateLockState(const Authorization& auth, LockContext& lockCt
 
     try
     {
-        std::unique_ptr<Poco::Net::HTTPClientSession> psession(getHTTPClientSession(uriObject));
+        std::shared_ptr<http::Session> httpSession = getHttpSession(uriObject);
 
-        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST,
-                                       uriObject.getPathAndQuery(),
-                                       Poco::Net::HTTPMessage::HTTP_1_1);
-        initHttpRequest(request, uriObject, auth);
+        http::Request httpRequest = initLockRequest(uriObject, auth, lockCtx, lock);
 
-        request.set("X-WOPI-Override", lock ? "LOCK" : "UNLOCK");
-        request.set("X-WOPI-Lock", lockCtx._lockToken);
-        if (!getExtendedData().empty())
-        {
-            request.set("X-COOL-WOPI-ExtendedData", getExtendedData());
-            request.set("X-LOOL-WOPI-ExtendedData", getExtendedData());
-        }
+        const std::shared_ptr<const http::Response> httpResponse
+            = httpSession->syncRequest(httpRequest);
 
-        // IIS requires content-length for POST requests: see https://forums.iis.net/t/1119456.aspx
-        request.setContentLength(0);
+        return handleLockResponse(*httpResponse, lockCtx, lock);
+    }
+    catch (const Poco::Exception& pexc)
+    {
+        LOG_ERR("Cannot " << wopiLog << " uri [" << uriAnonym << "]. Error: " <<
+                pexc.displayText() << (pexc.nested() ? " (" + pexc.nested()->displayText() + ')' : ""));
+    }
+    catch (const BadRequestException& exc)
+    {
+        LOG_ERR("Cannot " << wopiLog << " uri [" << uriAnonym << "]. Error: " << exc.what());
+    }
+    return false;
+}
 
-        psession->sendRequest(request);
-        Poco::Net::HTTPResponse response;
-        std::istream& rs = psession->receiveResponse(response);
+void WopiStorage::updateLockStateAsync(const Authorization& auth, LockContext& lockCtx, bool lock,
+                                       SocketPoll& socketPoll,
+                                       const AsyncLockCallback& asyncLockCallback)
+{
+    lockCtx._lockFailureReason.clear();
+    if (!lockCtx._supportsLocks)
+    {
+        asyncLockCallback(true);
+        return;
+    }
 
-        std::ostringstream oss;
-        Poco::StreamCopier::copyStream(rs, oss);
-        std::string responseString = oss.str();
+    Poco::URI uriObject(getUri());
+    auth.authorizeURI(uriObject);
 
-        LOG_INF(wopiLog << " response: " << responseString <<
-                " status " << response.getStatus());
+    Poco::URI uriObjectAnonym(getUri());
+    uriObjectAnonym.setPath(COOLWSD::anonymizeUrl(uriObjectAnonym.getPath()));
+    const std::string uriAnonym = uriObjectAnonym.toString();
 
-        if (response.getStatus() == Poco::Net::HTTPResponse::HTTP_OK)
-        {
-            lockCtx._isLocked = lock;
-            lockCtx._lastLockTime = std::chrono::steady_clock::now();
-            return true;
-        }
-        else
-        {
-            std::string sMoreInfo = response.get("X-WOPI-LockFailureReason", "");
-            if (!sMoreInfo.empty())
+    const std::string wopiLog(lock ? "WOPI::Lock" : "WOPI::Unlock");
+    LOG_DBG(wopiLog << " requesting asynchronously: " << uriAnonym);
+
+    try
+    {
+        std::shared_ptr<http::Session> httpSession = getHttpSession(uriObject);
+
+        http::Request httpRequest = initLockRequest(uriObject, auth, lockCtx, lock);
+
+        httpSession->setFinishedHandler(
+            [this, &lockCtx, lock, asyncLockCallback](const std::shared_ptr<http::Session>& session)
             {
-                lockCtx._lockFailureReason = sMoreInfo;
-                sMoreInfo = ", failure reason: \"" + sMoreInfo + "\"";
-            }
-            LOG_ERR("Un-successful " << wopiLog << " with status " << response.getStatus() <<
-                    sMoreInfo << " and response: " << responseString);
-        }
+                assert(session && "Expected a valid http::Session");
+                asyncLockCallback(handleLockResponse(*session->response(), lockCtx, lock));
+            });
+
+        if (httpSession->asyncRequest(httpRequest, socketPoll))
+            return;
+
+        LOG_ERR("Cannot " << wopiLog << " uri [" << uriAnonym << "]. Failed to connect.");
     }
     catch (const Poco::Exception& pexc)
     {
@@ -989,7 +1197,8 @@ bool WopiStorage::updateLockState(const Authorization& auth, LockContext& lockCt
     {
         LOG_ERR("Cannot " << wopiLog << " uri [" << uriAnonym << "]. Error: " << exc.what());
     }
-    return false;
+
+    asyncLockCallback(false);
 }
 
 /// uri format: http://server/<...>/wopi*/files/<id>/content
@@ -1067,6 +1276,101 @@ std::string WopiStorage::downloadStorageFileToLocal(const Authorization& auth,
     return std::string();
 }
 
+void WopiStorage::downloadStorageFileToLocalAsync(const Authorization& auth,
+                                                  LockContext& /*lockCtx*/,
+                                                  const std::string& templateUri,
+                                                  SocketPoll& socketPoll,
+                                                  const AsyncDownloadCallback& asyncDownloadCallback)
+{
+    if (!templateUri.empty())
+    {
+        // Download the template file and load it normally.
+        // The document will get saved once loading in Core is complete.
+        const std::string templateUriAnonym = COOLWSD::anonymizeUrl(templateUri);
+        LOG_INF("WOPI::GetFile template source: " << templateUriAnonym);
+        downloadDocumentAsync(
+            Poco::URI(templateUri), templateUriAnonym, auth, RedirectionLimit, socketPoll,
+            [templateUriAnonym, asyncDownloadCallback](const std::string& localPath,
+                                                       std::exception_ptr error)
+            {
+                if (error)
+                    LOG_ERR("Could not download template from [" + templateUriAnonym
+                                + "]. Error: "
+                            << getErrorMessage(error));
+
+                asyncDownloadCallback(localPath, error);
+            });
+        return;
+    }
+
+    // The default URL, for when we don't have FileUrl, or it failed.
+    // WOPI URI to download files ends in '/contents'.
+    // Add it here to get the payload instead of file info.
+    const auto downloadFromDefaultUri = [this, auth, &socketPoll, asyncDownloadCallback]()
+    {
+        Poco::URI uriObject(getUri());
+        uriObject.setPath(uriObject.getPath() + "/contents");
+        auth.authorizeURI(uriObject);
+
+        Poco::URI uriObjectAnonym(getUri());
+        uriObjectAnonym.setPath(COOLWSD::anonymizeUrl(uriObjectAnonym.getPath()) + "/contents");
+        const std::string uriAnonym = uriObjectAnonym.toString();
+
+        LOG_INF("WOPI::GetFile using default URI: " << uriAnonym);
+        downloadDocumentAsync(
+            uriObject, uriAnonym, auth, RedirectionLimit, socketPoll,
+            [uriAnonym, asyncDownloadCallback](const std::string& localPath,
+                                               std::exception_ptr error)
+            {
+                if (error)
+                    LOG_ERR("Cannot download document from WOPI storage uri [" + uriAnonym
+                                + "]. Error: "
+                            << getErrorMessage(error));
+
+                asyncDownloadCallback(localPath, error);
+            });
+    };
+
+    if (_fileUrl.empty())
+    {
+        downloadFromDefaultUri();
+        return;
+    }
+
+    // First try the FileUrl.
+    const std::string fileUrlAnonym = COOLWSD::anonymizeUrl(_fileUrl);
+    Poco::URI fileUriObject;
+    try
+    {
+        fileUriObject = Poco::URI(_fileUrl);
+    }
+    catch (const std::exception& ex)
+    {
+        LOG_ERR("Invalid WOPI FileUrl [" + fileUrlAnonym + "]. Will use default URL. Error: "
+                << ex.what());
+        downloadFromDefaultUri();
+        return;
+    }
+
+    LOG_INF("WOPI::GetFile using FileUrl: " << fileUrlAnonym);
+    downloadDocumentAsync(
+        fileUriObject, fileUrlAnonym, auth, RedirectionLimit, socketPoll,
+        [fileUrlAnonym, asyncDownloadCallback, downloadFromDefaultUri](
+            const std::string& localPath, std::exception_ptr error)
+        {
+            if (error && !isStorageSpaceLow(error))
+            {
+                LOG_ERR("Could not download document from WOPI FileUrl ["
+                            + fileUrlAnonym + "]. Will use default URL. Error: "
+                        << getErrorMessage(error));
+                downloadFromDefaultUri();
+                return;
+            }
+
+            asyncDownloadCallback(localPath, error);
+        });
+}
+
 std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std::string& uriAnonym,
                                           const Authorization& auth, unsigned redirectLimit)
 {
@@ -1075,6 +1379,93 @@ std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std:
 
     http::Request httpRequest = initHttpRequest(uriObject, auth);
 
+    prepareDownloadPath();
+
+    LOG_TRC("Downloading from [" << uriAnonym << "] to [" << getRootFilePath()
+                                 << "]: " << httpRequest.header().toString());
+    const std::shared_ptr<const http::Response> httpResponse
+        = httpSession->syncDownload(httpRequest, getRootFilePath());
+
+    if (redirectLimit && isRedirect(*httpResponse))
+    {
+        const std::string& location = httpResponse->get("Location");
+        LOG_TRC("WOPI::GetFile redirect to URI [" << COOLWSD::anonymizeUrl(location) << "]");
+
+        Poco::URI redirectUriObject(location);
+        return downloadDocument(redirectUriObject, uriAnonym, auth, redirectLimit - 1);
+    }
+
+    return handleDownloadResponse(*httpResponse, uriAnonym, startTime);
+}
+
+void WopiStorage::downloadDocumentAsync(const Poco::URI& uriObject, const std::string& uriAnonym,
+                                        const Authorization& auth, unsigned redirectLimit,
+                                        SocketPoll& socketPoll,
+                                        const AsyncDownloadCallback& asyncDownloadCallback)
+{
+    const auto startTime = std::chrono::steady_clock::now();
+    try
+    {
+        std::shared_ptr<http::Session> httpSession = getHttpSession(uriObject);
+
+        http::Request httpRequest = initHttpRequest(uriObject, auth);
+
+        prepareDownloadPath();
+
+        http::Session::FinishedCallback finishedCallback =
+            [this, uriAnonym, auth, redirectLimit, &socketPoll, asyncDownloadCallback,
+             startTime](const std::shared_ptr<http::Session>& session)
+        {
+            assert(session && "Expected a valid http::Session");
+            const std::shared_ptr<const http::Response> httpResponse = session->response();
+
+            std::string localPath;
+            std::exception_ptr error;
+            try
+            {
+                if (redirectLimit && isRedirect(*httpResponse))
+                {
+                    const std::string& location = httpResponse->get("Location");
+                    LOG_TRC("WOPI::GetFile redirect to URI [" << COOLWSD::anonymizeUrl(location)
+                                                              << "]");
+
+                    Poco::URI redirectUriObject(location);
+                    downloadDocumentAsync(redirectUriObject, uriAnonym, auth, redirectLimit - 1,
+                                          socketPoll, asyncDownloadCallback);
+                    return;
+                }
+
+                localPath = handleDownloadResponse(*httpResponse, uriAnonym, startTime);
+            }
+            catch (const std::exception&)
+            {
+                error = std::current_exception();
+            }
+
+            // Fire the callback to our client (DocBroker, typically).
+            asyncDownloadCallback(localPath, error);
+        };
+
+        httpSession->setFinishedHandler(finishedCallback);
+
+        LOG_TRC("Async downloading from [" << uriAnonym << "] to [" << getRootFilePath()
+                                           << "]: " << httpRequest.header().toString());
+
+        // Make the request.
+        if (httpSession->asyncDownload(httpRequest, getRootFilePath(), socketPoll))
+            return;
+
+        throw StorageConnectionException("WOPI::GetFile [" + uriAnonym
+                                         + "] failed: cannot connect");
+    }
+    catch (const std::exception&)
+    {
+        asyncDownloadCallback(std::string(), std::current_exception());
+    }
+}
+
+void WopiStorage::prepareDownloadPath()
+{
     setRootFilePath(Poco::Path(getLocalRootPath(), getFileInfo().getFilename()).toString());
     setRootFilePathAnonym(COOLWSD::anonymizeUrl(getRootFilePath()));
 
@@ -1082,23 +1473,23 @@ std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std:
     {
         throw StorageSpaceLowException("Low disk space for " + getRootFilePathAnonym());
     }
+}
 
-    LOG_TRC("Downloading from [" << uriAnonym << "] to [" << getRootFilePath()
-                                 << "]: " << httpRequest.header().toString());
-    const std::shared_ptr<const http::Response> httpResponse
-        = httpSession->syncDownload(httpRequest, getRootFilePath());
-
+std::string WopiStorage::handleDownloadResponse(const http::Response& httpResponse,
+                                                const std::string& uriAnonym,
+                                                std::chrono::steady_clock::time_point startTime)
+{
     const std::chrono::milliseconds diff = std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::steady_clock::now() - startTime);
 
-    if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_OK)
+    if (httpResponse.statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_OK)
     {
         // Log the response header.
         Log::StreamLogger logger = Log::trace();
         if (logger.enabled())
         {
             logger << "WOPI::GetFile response header for URI [" << uriAnonym << "]:\n";
-            for (const auto& pair : httpResponse->header())
+            for (const auto& pair : httpResponse.header())
             {
                 logger << '\t' << pair.first << ": " << pair.second << " / ";
             }
@@ -1106,30 +1497,16 @@ std::string WopiStorage::downloadDocument(const Poco::URI& uriObject, const std:
             LOG_END(logger);
         }
     }
-    else if (httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_FOUND ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_MOVED_PERMANENTLY ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_TEMPORARY_REDIRECT ||
-            httpResponse->statusLine().statusCode() == Poco::Net::HTTPResponse::HTTP_PERMANENT_REDIRECT)
+    else if (isRedirect(httpResponse))
     {
-        if (redirectLimit)
-        {
-            const std::string& location = httpResponse->get("Location");
-            LOG_TRC("WOPI::GetFile redirect to URI [" << COOLWSD::anonymizeUrl(location) << "]");
-
-            Poco::URI redirectUriObject(location);
-            return downloadDocument(redirectUriObject, uriAnonym, auth, redirectLimit - 1);
-        }
-        else
-        {
-            throw StorageConnectionException("WOPI::GetFile [" + uriAnonym
+        throw StorageConnectionException("WOPI::GetFile [" + uriAnonym
                                          + "] failed: redirected too many times");
-        }
     }
     else
     {
-        const std::string responseString = httpResponse->getBody();
+        const std::string responseString = httpResponse.getBody();
         LOG_ERR("WOPI::GetFile [" << uriAnonym << "] failed with Status Code: "
-                                  << httpResponse->statusLine().statusCode());
+                                  << httpResponse.statusLine().statusCode());
         throw StorageConnectionException("WOPI::GetFile [" + uriAnonym
                                          + "] failed: " + responseString);
     }
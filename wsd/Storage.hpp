@@ -12,6 +12,7 @@
 #include <set>
 #include <string>
 #include <chrono>
+#include <exception>
 
 #include <Poco/URI.h>
 #include <Poco/Util/Application.h>
@@ -28,15 +29,6 @@
 /// Limits number of HTTP redirections to prevent from redirection loops
 static constexpr auto RedirectionLimit = 21;
 
-namespace Poco
-{
-namespace Net
-{
-class HTTPClientSession;
-}
-
-} // namespace Poco
-
 /// Represents whether the underlying file is locked
 /// and with what token.
 struct LockContext
@@ -212,6 +204,14 @@ public:
 
     const std::string& getJailPath() const { return _jailPath; };
 
+    /// Sets the jail to download into, when we were created before
+    /// the document had one, to get the file info in the meantime.
+    void setJail(const std::string& localStorePath, const std::string& jailPath)
+    {
+        _localStorePath = localStorePath;
+        _jailPath = jailPath;
+    }
+
     /// Returns the root path to the jailed file.
     const std::string& getRootFilePath() const { return _jailedFilePath; };
 
@@ -272,11 +272,49 @@ public:
     /// Update the locking state (check-in/out) of the associated file
     virtual bool updateLockState(const Authorization& auth, LockContext& lockCtx, bool lock) = 0;
 
+    /// The asynchronous lock completion callback function.
+    /// Gets the result, as from updateLockState().
+    using AsyncLockCallback = std::function<void(bool result)>;
+
+    /// Updates the locking state as updateLockState(), asynchronously if possible.
+    virtual void updateLockStateAsync(const Authorization& auth, LockContext& lockCtx, bool lock,
+                                      SocketPoll&, const AsyncLockCallback& asyncLockCallback)
+    {
+        // By default update synchronously.
+        asyncLockCallback(updateLockState(auth, lockCtx, lock));
+    }
+
     /// Returns a local file path for the given URI.
     /// If necessary copies the file locally first.
     virtual std::string downloadStorageFileToLocal(const Authorization& auth, LockContext& lockCtx,
                                                    const std::string& templateUri) = 0;
 
+    /// The asynchronous download completion callback function.
+    /// Gets the local path, as from downloadStorageFileToLocal(), or the error it threw.
+    using AsyncDownloadCallback
+        = std::function<void(const std::string& localPath, std::exception_ptr error)>;
+
+    /// Downloads the file as downloadStorageFileToLocal(), asynchronously if possible.
+    /// @param asyncDownloadCallback Used to communicate the result back to the caller.
+    virtual void downloadStorageFileToLocalAsync(const Authorization& auth, LockContext& lockCtx,
+                                                 const std::string& templateUri, SocketPoll&,
+                                                 const AsyncDownloadCallback& asyncDownloadCallback)
+    {
+        // By default do a synchronous download.
+        std::string localPath;
+        try
+        {
+            localPath = downloadStorageFileToLocal(auth, lockCtx, templateUri);
+        }
+        catch (...)
+        {
+            asyncDownloadCallback(std::string(), std::current_exception());
+            return;
+        }
+
+        asyncDownloadCallback(localPath, nullptr);
+    }
+
     /// Writes the contents of the file back to the source.
     /// @param savedFile When the operation was saveAs, this is the path to the file that was saved.
     virtual UploadResult uploadLocalFileToStorage(const Authorization& auth, LockContext& lockCtx,
@@ -319,15 +357,20 @@ public:
     /// Must be called at startup to configure.
     static void initialize();
 
+    /// Closes the connections kept open to storage servers.
+    static void uninitialize();
+
     /// Storage object creation factory.
     /// @takeOwnership is for local files that are temporary,
     /// such as convert-to requests.
     static std::unique_ptr<StorageBase> create(const Poco::URI& uri, const std::string& jailRoot,
                                                const std::string& jailPath, bool takeOwnership);
 
-    static Poco::Net::HTTPClientSession* getHTTPClientSession(const Poco::URI& uri);
     static std::shared_ptr<http::Session> getHttpSession(const Poco::URI& uri);
 
+    /// The connections to storage servers shared by all documents, if enabled.
+    static std::shared_ptr<const http::SessionPool> getHttpSessionPool() { return HttpSessionPool; }
+
 protected:
 
     /// Sanitize a URI by removing authorization tokens.
@@ -362,8 +405,8 @@ protected:
 
 private:
     Poco::URI _uri;
-    const std::string _localStorePath;
-    const std::string _jailPath;
+    std::string _localStorePath;
+    std::string _jailPath;
     std::string _jailedFilePath;
     std::string _jailedFilePathAnonym;
     FileInfo _fileInfo;
@@ -385,6 +428,8 @@ private:
     static bool SSLAsScheme;
     /// If true, force SSL communication with storage server
     static bool SSLEnabled;
+    /// The open connections to storage servers, see getHttpSession().
+    static std::shared_ptr<http::SessionPool> HttpSessionPool;
 };
 
 /// Trivial implementation of local storage that does not need do anything.
@@ -584,13 +629,35 @@ public:
                                                         LockContext& lockCtx,
                                                         unsigned redirectLimit);
 
+    /// Sets the URL to use for GetFile, as given by CheckFileInfo. When sessions
+    /// check the file info in parallel, the one that downloads restores its own.
+    void setFileUrl(const std::string& fileUrl) { _fileUrl = fileUrl; }
+
+    /// The asynchronous CheckFileInfo completion callback function.
+    /// Gets the file info, as from getWOPIFileInfo(), or the error it threw.
+    using AsyncFileInfoCallback = std::function<void(std::unique_ptr<WOPIFileInfo> wopiFileInfo,
+                                                     std::exception_ptr error)>;
+
+    /// Makes the CheckFileInfo call as getWOPIFileInfo(), asynchronously on @socketPoll.
+    void getWOPIFileInfoAsync(const Authorization& auth, LockContext& lockCtx,
+                              SocketPoll& socketPoll,
+                              const AsyncFileInfoCallback& asyncFileInfoCallback);
+
     /// Update the locking state (check-in/out) of the associated file
     bool updateLockState(const Authorization& auth, LockContext& lockCtx, bool lock) override;
 
+    void updateLockStateAsync(const Authorization& auth, LockContext& lockCtx, bool lock,
+                              SocketPoll& socketPoll,
+                              const AsyncLockCallback& asyncLockCallback) override;
+
     /// uri format: http://server/<...>/wopi*/files/<id>/content
     std::string downloadStorageFileToLocal(const Authorization& auth, LockContext& lockCtx,
                                            const std::string& templateUri) override;
 
+    void downloadStorageFileToLocalAsync(const Authorization& auth, LockContext& lockCtx,
+                                         const std::string& templateUri, SocketPoll& socketPoll,
+                                         const AsyncDownloadCallback& asyncDownloadCallback) override;
+
     UploadResult uploadLocalFileToStorage(const Authorization& auth, LockContext& lockCtx,
                                           const std::string& saveAsPath,
                                           const std::string& saveAsFilename,
@@ -638,11 +705,49 @@ private:
     /// Create an http::Request with the common headers.
     http::Request initHttpRequest(const Poco::URI& uri, const Authorization& auth) const;
 
+    /// Create the http::Request of the Lock or Unlock call.
+    http::Request initLockRequest(const Poco::URI& uriObject, const Authorization& auth,
+                                  const LockContext& lockCtx, bool lock) const;
+
+    /// Handles the response of the Lock or Unlock call. Returns true on success.
+    bool handleLockResponse(const http::Response& httpResponse, LockContext& lockCtx,
+                            bool lock) const;
+
+    /// Implementation of getWOPIFileInfoAsync for specific URI.
+    void getWOPIFileInfoForUriAsync(Poco::URI uriObject, const Authorization& auth,
+                                    LockContext& lockCtx, unsigned redirectLimit,
+                                    SocketPoll& socketPoll,
+                                    const AsyncFileInfoCallback& asyncFileInfoCallback);
+
+    /// Logs the CheckFileInfo @httpResponse, and throws if it failed.
+    void checkWOPIFileInfoResponse(const http::Response& httpResponse,
+                                   const std::string& uriAnonym) const;
+
+    /// Parses the CheckFileInfo response and stores the basic file information.
+    std::unique_ptr<WOPIFileInfo> parseWOPIFileInfo(std::string wopiResponse,
+                                                    std::chrono::milliseconds callDurationMs,
+                                                    Poco::URI& uriObject, LockContext& lockCtx,
+                                                    const std::string& uriAnonym);
+
     /// Download the document from the given URI.
     /// Does not add authorization tokens or any other logic.
     std::string downloadDocument(const Poco::URI& uriObject, const std::string& uriAnonym,
                                  const Authorization& auth, unsigned redirectLimit);
 
+    /// Download the document from the given URI asynchronously, as downloadDocument().
+    void downloadDocumentAsync(const Poco::URI& uriObject, const std::string& uriAnonym,
+                               const Authorization& auth, unsigned redirectLimit,
+                               SocketPoll& socketPoll,
+                               const AsyncDownloadCallback& asyncDownloadCallback);
+
+    /// Sets up the path to download the document to, checking for disk space.
+    void prepareDownloadPath();
+
+    /// Handles the GetFile response that isn't a redirect, and returns the jailed path.
+    std::string handleDownloadResponse(const http::Response& httpResponse,
+                                       const std::string& uriAnonym,
+                                       std::chrono::steady_clock::time_point startTime);
+
 private:
     /// A URl provided by the WOPI host to use for GetFile.
     std::string _fileUrl;
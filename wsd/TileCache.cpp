@@ -9,11 +9,14 @@
 
 #include "TileCache.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <memory>
 #include <sstream>
@@ -24,6 +27,7 @@
 #include "ClientSession.hpp"
 #include <Common.hpp>
 #include <Protocol.hpp>
+#include <SpookyV2.h>
 #include <StringVector.hpp>
 #include <Unit.hpp>
 #include <Util.hpp>
@@ -31,12 +35,107 @@
 
 using namespace COOLProtocol;
 
+std::string TileKeyframeStore::Hash::toString() const
+{
+    if (isEmpty())
+        return std::string();
+
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0') << std::setw(16) << _high << std::setw(16) << _low;
+    return oss.str();
+}
+
+const std::shared_ptr<TileKeyframeStore>& TileKeyframeStore::instance()
+{
+    static const std::shared_ptr<TileKeyframeStore> store = std::make_shared<TileKeyframeStore>();
+    return store;
+}
+
+std::shared_ptr<const TileKeyframeStore::Keyframe> TileKeyframeStore::intern(const char* data,
+                                                                           size_t size)
+{
+    // Copy first: SpookyHash needs 8 byte alignment, and we keep the copy if it's new.
+    std::unique_ptr<Keyframe> candidate(new Keyframe{ Hash{ 0, 0 }, std::vector<char>(data, data + size) });
+    SpookyHash::Hash128(candidate->_data.data(), size, &candidate->_hash._high,
+                        &candidate->_hash._low);
+    const Hash hash = candidate->_hash;
+
+    // Declared before the lock: if ours ends up the last reference, its
+    // deleter must run after we unlock.
+    std::shared_ptr<const Keyframe> existing;
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    const auto it = _keyframes.find(hash);
+    if (it != _keyframes.end())
+    {
+        existing = it->second.lock();
+        if (existing && existing->_data == candidate->_data)
+        {
+            ++_hits;
+            return existing;
+        }
+
+        if (existing)
+        {
+            // A collision, extremely unlikely; just don't share this one,
+            // nor name it to clients, who may have the other one.
+            LOG_WRN("Tile keyframe hash collision on " << hash.toString());
+            candidate->_hash = Hash{ 0, 0 };
+            return std::shared_ptr<const Keyframe>(std::move(candidate));
+        }
+    }
+
+    // The deleter holds the store, so it outlives all keyframes.
+    std::shared_ptr<TileKeyframeStore> self = shared_from_this();
+    std::shared_ptr<const Keyframe> keyframe(candidate.release(),
+                                             [self](const Keyframe* expired)
+                                             {
+                                                 self->forget(expired);
+                                                 delete expired;
+                                             });
+    _keyframes[hash] = keyframe;
+    return keyframe;
+}
+
+void TileKeyframeStore::forget(const Keyframe* keyframe)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // It might have been replaced by a new one with the same payload already.
+    const auto it = _keyframes.find(keyframe->_hash);
+    if (it != _keyframes.end() && it->second.expired())
+        _keyframes.erase(it);
+}
+
+size_t TileKeyframeStore::count() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _keyframes.size();
+}
+
+uint64_t TileKeyframeStore::getHits() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _hits;
+}
+
+void TileKeyframeStore::dumpState(std::ostream& os) const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    os << "  shared keyframes: " << _keyframes.size() << ", hits: " << _hits << '\n';
+}
+
 TileCache::TileCache(std::string docURL, const std::chrono::system_clock::time_point& modifiedTime,
                      bool dontCache)
     : _docURL(std::move(docURL))
     , _dontCache(dontCache)
     , _cacheSize(0)
     , _maxCacheSize(512 * 1024)
+    , _maxDeltaRatio(2.0)
+    , _evictionPolicy(EvictionPolicy::WireId)
+    , _useCount(0)
+    , _arena(std::make_shared<TileArena>())
+    , _keyframes(TileKeyframeStore::instance())
 {
 #ifndef BUILDING_TESTS
     LOG_INF("TileCache ctor for uri [" << COOLWSD::anonymizeUrl(_docURL) <<
@@ -57,6 +156,7 @@ TileCache::~TileCache()
 void TileCache::clear()
 {
     _cache.clear();
+    _tileIndex.clear();
     _cacheSize = 0;
     for (auto i : _streamCache)
         i.clear();
@@ -169,6 +269,13 @@ Tile TileCache::lookupTile(const TileDesc& tile)
         return Tile();
 
     Tile ret = findTile(tile);
+    if (ret && ret->isValid())
+    {
+        ret->_lastUsed = ++_useCount;
+        ++_stats._hits;
+    }
+    else
+        ++_stats._misses;
 
     UnitWSD::get().lookupTile(tile.getPart(), tile.getWidth(), tile.getHeight(),
                               tile.getTilePosX(), tile.getTilePosY(),
@@ -292,26 +399,42 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height, i
 
     assertCorrectThread();
 
-    for (auto it = _cache.begin(); it != _cache.end();)
+    // Tiles whose top-left corner is within these bounds may intersect.
+    const int64_t right = int64_t(x) + width;
+    const int64_t bottom = int64_t(y) + height;
+
+    size_t count = 0;
+    for (auto& layer : _tileIndex)
     {
-        if (intersectsTile(it->first, part, x, y, width, height, normalizedViewId))
-        {
-            // FIXME: only want to keep as invalid keyframes in the view area(s)
-            it->second->invalidate();
-            ++it;
-        }
-#if 0
-        {
-            LOG_TRC("Removing tile: " << it->first.serialize());
-            _cacheSize -= itemCacheSize(it->second);
-            it = _cache.erase(it);
-        }
-#endif
-        else
+        if ((part != -1 && layer.first._part != part) ||
+            layer.first._normalizedViewId != normalizedViewId)
+            continue;
+
+        auto& rows = layer.second;
+        const int top = std::max<int64_t>(int64_t(y) - layer.first._tileHeight, INT_MIN);
+        for (auto row = rows.lower_bound(top); row != rows.end() && row->first <= bottom; ++row)
         {
-            ++it;
+            auto& columns = row->second;
+            const int left = std::max<int64_t>(int64_t(x) - layer.first._tileWidth, INT_MIN);
+            for (auto column = columns.lower_bound(left);
+                 column != columns.end() && column->first <= right; ++column)
+            {
+                if (!intersectsTile(column->second, part, x, y, width, height, normalizedViewId))
+                    continue;
+
+                const auto it = _cache.find(column->second);
+                assert(it != _cache.end() && "Tile index out of sync with cache");
+                // FIXME: only want to keep as invalid keyframes in the view area(s)
+                if (it != _cache.end())
+                {
+                    it->second->invalidate();
+                    ++count;
+                }
+            }
         }
     }
+
+    LOG_TRC("Invalidated " << count << " of " << _cache.size() << " cached tiles");
 }
 
 void TileCache::invalidateTiles(const std::string& tiles, int normalizedViewId)
@@ -529,8 +652,9 @@ Tile TileCache::saveDataToCache(const TileDesc &desc, const char *data, const si
         else
         {
             LOG_TRC("new tile for " << desc.serialize() << " of size " << size);
-            tile = std::make_shared<TileData>(desc.getWireId(), data, size);
+            tile = std::make_shared<TileData>(desc.getWireId(), data, size, _arena, _keyframes);
             _cache[desc] = tile;
+            indexTile(desc);
             _cacheSize += itemCacheSize(tile);
         }
     }
@@ -540,12 +664,39 @@ Tile TileCache::saveDataToCache(const TileDesc &desc, const char *data, const si
         _cacheSize += tile->appendBlob(desc.getWireId(), data, size);
     }
 
+    if (tile)
+        tile->_lastUsed = ++_useCount;
+
     return tile;
 }
 
+void TileCache::indexTile(const TileDesc& desc)
+{
+    _tileIndex[TileLayer(desc)][desc.getTilePosY()].emplace(desc.getTilePosX(), desc);
+}
+
+void TileCache::unindexTile(const TileDesc& desc)
+{
+    const auto layer = _tileIndex.find(TileLayer(desc));
+    if (layer == _tileIndex.end())
+        return;
+
+    const auto row = layer->second.find(desc.getTilePosY());
+    if (row == layer->second.end())
+        return;
+
+    row->second.erase(desc.getTilePosX());
+    if (row->second.empty())
+    {
+        layer->second.erase(row);
+        if (layer->second.empty())
+            _tileIndex.erase(layer);
+    }
+}
+
 size_t TileCache::itemCacheSize(const Tile &tile)
 {
-    return sizeof(Tile) + sizeof(TileDesc) + tile->size();
+    return sizeof(Tile) + sizeof(TileDesc) + tile->getMemorySize();
 }
 
 void TileCache::assertCacheSize()
@@ -557,6 +708,12 @@ void TileCache::assertCacheSize()
         recalcSize += itemCacheSize(it.second);
     }
     assert(recalcSize == _cacheSize);
+
+    size_t indexed = 0;
+    for (const auto& layer : _tileIndex)
+        for (const auto& row : layer.second)
+            indexed += row.second.size();
+    assert(indexed == _cache.size());
 #endif
 }
 
@@ -570,6 +727,21 @@ void TileCache::ensureCacheSize()
     LOG_TRC("Cleaning tile cache of size " << _cacheSize << " vs. " << _maxCacheSize <<
             " with " << _cache.size() << " entries");
 
+    const size_t oldCount = _cache.size();
+    if (_evictionPolicy == EvictionPolicy::WireId)
+        evictByWireId();
+    else
+        evictLeastRecentlyUsed();
+    _stats._evictions += oldCount - _cache.size();
+
+    LOG_TRC("Cache is now of size " << _cacheSize << " and " <<
+            _cache.size() << " entries after cleaning");
+
+    assertCacheSize();
+}
+
+void TileCache::evictByWireId()
+{
     struct WidSize {
         TileWireId _wid;
         size_t     _size;
@@ -622,6 +794,7 @@ void TileCache::ensureCacheSize()
             {
                 LOG_TRC("cleaned out tile: " << it->first.serialize());
                 _cacheSize -= itemCacheSize(it->second);
+                unindexTile(it->first);
                 it = _cache.erase(it);
             }
         }
@@ -630,16 +803,70 @@ void TileCache::ensureCacheSize()
             ++it;
         }
     }
+}
 
-    LOG_TRC("Cache is now of size " << _cacheSize << " and " <<
-            _cache.size() << " entries after cleaning");
+void TileCache::evictLeastRecentlyUsed()
+{
+    // Erasing from _cache doesn't invalidate iterators to other entries.
+    std::vector<decltype(_cache)::iterator> candidates;
+    candidates.reserve(_cache.size());
+    for (auto it = _cache.begin(); it != _cache.end(); ++it)
+    {
+        // avoid getting a delta instead of a keyframe at the bottom.
+        if (_tilesBeingRendered.find(it->first) != _tilesBeingRendered.end())
+            continue;
 
-    assertCacheSize();
+        if (_evictionPolicy == EvictionPolicy::Viewport && _isPinned && _isPinned(it->first))
+            continue;
+
+        candidates.push_back(it);
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const decltype(_cache)::iterator& a, const decltype(_cache)::iterator& b)
+              { return a->second->_lastUsed < b->second->_lastUsed; });
+
+    // Free up a quarter, as evictByWireId does.
+    size_t freed = 0;
+    for (const auto& it : candidates)
+    {
+        if (freed > _maxCacheSize / 4)
+            break;
+
+        LOG_TRC("cleaned out tile: " << it->first.serialize() << " last used " << it->second->_lastUsed);
+        const size_t size = itemCacheSize(it->second);
+        freed += size;
+        _cacheSize -= size;
+        unindexTile(it->first);
+        _cache.erase(it);
+    }
+
+    if (freed == 0)
+        LOG_DBG("No tile could be evicted from the cache of " << _cache.size() << " tiles");
+}
+
+TileCache::EvictionPolicy TileCache::parseEvictionPolicy(const std::string& name)
+{
+    if (name == "lru")
+        return EvictionPolicy::LRU;
+    if (name == "viewport")
+        return EvictionPolicy::Viewport;
+    if (name != "wireid")
+        LOG_WRN("Unknown tile cache eviction policy [" << name << "], using wireid");
+    return EvictionPolicy::WireId;
+}
+
+void TileCache::setEvictionPolicy(EvictionPolicy policy,
+                                  std::function<bool(const TileDesc&)> isPinned)
+{
+    _evictionPolicy = policy;
+    _isPinned = std::move(isPinned);
 }
 
 void TileCache::setMaxCacheSize(size_t cacheSize)
 {
     _maxCacheSize = cacheSize;
+    _arena->setMaxFreeSize(cacheSize / 8);
     ensureCacheSize();
 }
 
@@ -672,6 +899,8 @@ void TileCache::dumpState(std::ostream& os)
 {
     os << "\n  TileCache:";
     os << "\n    num: " << _cache.size() << " size: " << _cacheSize << " bytes\n";
+    os << "    hits: " << _stats._hits << " misses: " << _stats._misses
+       << " evictions: " << _stats._evictions << '\n';
     for (const auto& it : _cache)
     {
         os << "    " << std::setw(4) << it.first.getWireId()
@@ -700,9 +929,63 @@ void TileCache::dumpState(std::ostream& os)
         }
     }
 
+    _arena->dumpState(os);
+    _keyframes->dumpState(os);
+
     os << "    tiles being rendered " << _tilesBeingRendered.size() << '\n';
     for (const auto& it : _tilesBeingRendered)
         it.second->dumpState(os);
 }
 
+bool ClientKeyframeTracker::isKnown(const std::string& hash) const
+{
+    return std::find(_known.begin(), _known.end(), hash) != _known.end();
+}
+
+std::vector<char> ClientKeyframeTracker::expandKnownTile(const std::string& firstLine,
+                                                         const std::vector<char>& data) const
+{
+    std::string hash;
+    if (!COOLProtocol::getTokenStringFromMessage(firstLine, "hash", hash) || isKnown(hash))
+        return std::vector<char>();
+
+    const auto it = _pinned.find(hash);
+    if (it == _pinned.end())
+    {
+        LOG_ERR("No keyframe held for knowntile: message with hash " << hash);
+        return std::vector<char>();
+    }
+
+    // The hash comes last. Only bare keyframes are for the client to keep.
+    const size_t deltas = firstLine.size() + 1;
+    std::string header = "tile:" + firstLine.substr(std::strlen("knowntile:"));
+    if (data.size() > deltas || _size == 0)
+        header.erase(header.rfind(" hash="));
+    header += '\n';
+
+    LOG_DBG("Client dropped keyframe " << hash << " since queueing, sending it again");
+    const std::vector<char>& keyframe = it->second->_data;
+    std::vector<char> output;
+    output.reserve(header.size() + keyframe.size() + data.size() - std::min(deltas, data.size()));
+    output.insert(output.end(), header.begin(), header.end());
+    output.insert(output.end(), keyframe.begin(), keyframe.end());
+    if (data.size() > deltas)
+        output.insert(output.end(), data.begin() + deltas, data.end());
+
+    return output;
+}
+
+void ClientKeyframeTracker::written(const std::string& firstLine)
+{
+    // The client keeps the keyframes sent with a hash from now on.
+    std::string hash;
+    if (_size > 0 && COOLProtocol::matchPrefix("tile:", firstLine)
+        && COOLProtocol::getTokenStringFromMessage(firstLine, "hash", hash) && !isKnown(hash))
+    {
+        if (_known.size() >= _size)
+            _known.pop_back();
+        _known.push_front(hash);
+    }
+}
+
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -7,12 +7,17 @@
 
 #pragma once
 
+#include <deque>
+#include <functional>
 #include <iosfwd>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include <Rectangle.hpp>
 
@@ -57,17 +62,193 @@ struct TileDescCacheHasher final
     }
 };
 
+/// Slab allocator for the tile blobs of one TileCache.
+/// Slabs come in power-of-two size classes and freed ones are kept
+/// for reuse, up to a bound, so tile churn (keyframes replacing
+/// delta chains, eviction) doesn't hit the general heap every time.
+class TileArena
+{
+public:
+    static constexpr size_t MinSlabSize = 512;
+    static constexpr size_t MaxSlabSize = 64 * 1024;
+
+    TileArena()
+        : _freeSize(0)
+        , _maxFreeSize(1024 * 1024)
+        , _allocatedSize(0)
+    {
+    }
+
+    ~TileArena()
+    {
+        for (auto& slabs : _free)
+            for (char* slab : slabs)
+                delete[] slab;
+    }
+
+    TileArena(const TileArena&) = delete;
+    TileArena& operator=(const TileArena&) = delete;
+
+    /// Returns a slab of at least @size bytes, and its real size in @capacity.
+    char* allocate(size_t size, size_t& capacity)
+    {
+        const int bucket = getBucket(size);
+        capacity = bucket < 0 ? size : MinSlabSize << bucket;
+        _allocatedSize += capacity;
+        if (bucket >= 0 && !_free[bucket].empty())
+        {
+            char* slab = _free[bucket].back();
+            _free[bucket].pop_back();
+            _freeSize -= capacity;
+            return slab;
+        }
+
+        return new char[capacity];
+    }
+
+    void release(char* slab, size_t capacity)
+    {
+        _allocatedSize -= capacity;
+        const int bucket = getBucket(capacity);
+        if (bucket >= 0 && _freeSize + capacity <= _maxFreeSize)
+        {
+            _free[bucket].push_back(slab);
+            _freeSize += capacity;
+        }
+        else
+            delete[] slab;
+    }
+
+    /// Set how much freed memory we keep around for reuse.
+    void setMaxFreeSize(size_t maxFreeSize)
+    {
+        _maxFreeSize = maxFreeSize;
+        for (int bucket = Buckets - 1; bucket >= 0 && _freeSize > _maxFreeSize; --bucket)
+        {
+            while (!_free[bucket].empty() && _freeSize > _maxFreeSize)
+            {
+                delete[] _free[bucket].back();
+                _free[bucket].pop_back();
+                _freeSize -= MinSlabSize << bucket;
+            }
+        }
+    }
+
+    size_t getFreeSize() const { return _freeSize; }
+    size_t getAllocatedSize() const { return _allocatedSize; }
+
+    void dumpState(std::ostream& os) const
+    {
+        os << "  tile arena: " << _allocatedSize << " bytes in use, " << _freeSize
+           << " bytes free (max " << _maxFreeSize << ")\n";
+    }
+
+private:
+    static constexpr int Buckets = 8; // MinSlabSize << 7 == MaxSlabSize
+
+    /// The size class for @size, or -1 if it's too large to pool.
+    static int getBucket(size_t size)
+    {
+        if (size > MaxSlabSize)
+            return -1;
+
+        int bucket = 0;
+        while ((MinSlabSize << bucket) < size)
+            ++bucket;
+        return bucket;
+    }
+
+    std::vector<char*> _free[Buckets];
+    size_t _freeSize;
+    size_t _maxFreeSize;
+    size_t _allocatedSize;
+};
+
+/// Keyframes shared by the TileCaches of all documents, so identical
+/// ones - blank page areas, spreadsheet grid, slide backgrounds - are
+/// held once per process. An entry lives as long as a tile uses it.
+class TileKeyframeStore final : public std::enable_shared_from_this<TileKeyframeStore>
+{
+public:
+    /// 128-bit SpookyHash of a keyframe's payload.
+    struct Hash final
+    {
+        uint64_t _high;
+        uint64_t _low;
+
+        bool operator==(const Hash& other) const
+        {
+            return _high == other._high && _low == other._low;
+        }
+
+        /// Unshared keyframes have no hash, so they can't be referred to.
+        bool isEmpty() const { return _high == 0 && _low == 0; }
+
+        /// Hex form, as sent to clients; empty if isEmpty().
+        std::string toString() const;
+    };
+
+    struct HashHasher final
+    {
+        size_t operator()(const Hash& hash) const { return hash._low; }
+    };
+
+    struct Keyframe final
+    {
+        Hash _hash;
+        std::vector<char> _data;
+    };
+
+    /// The store of this process.
+    static const std::shared_ptr<TileKeyframeStore>& instance();
+
+    /// Returns the keyframe with this payload, adding it if we don't have one.
+    std::shared_ptr<const Keyframe> intern(const char* data, size_t size);
+
+    /// Number of distinct keyframes held.
+    size_t count() const;
+
+    /// Number of intern() calls that found an existing keyframe.
+    uint64_t getHits() const;
+
+    void dumpState(std::ostream& os) const;
+
+private:
+    /// Deleter for the keyframes we hand out, drops their entry.
+    void forget(const Keyframe* keyframe);
+
+    mutable std::mutex _mutex;
+    std::unordered_map<Hash, std::weak_ptr<const Keyframe>, HashHasher> _keyframes;
+    uint64_t _hits = 0;
+};
+
 struct TileData
 {
-    TileData(TileWireId start, const char *data, const size_t size)
+    TileData(TileWireId start, const char *data, const size_t size,
+             std::shared_ptr<TileArena> arena = std::shared_ptr<TileArena>(),
+             std::shared_ptr<TileKeyframeStore> keyframes = std::shared_ptr<TileKeyframeStore>())
+        : _valid(false)
+        , _lastUsed(0)
+        , _arena(std::move(arena))
+        , _keyframes(std::move(keyframes))
+        , _size(0)
+        , _capacity(0)
     {
         appendBlob(start, data, size);
     }
 
-    // Add a frame or delta and - return the size change
+    ~TileData()
+    {
+        clearSlabs();
+    }
+
+    TileData(const TileData&) = delete;
+    TileData& operator=(const TileData&) = delete;
+
+    // Add a frame or delta and - return the change in memory used
     ssize_t appendBlob(TileWireId id, const char *data, const size_t dataSize)
     {
-        size_t oldCacheSize = size();
+        const size_t oldCapacity = _capacity;
 
         assert (dataSize >= 1); // kit provides us a 'Z' or a 'D' or a png
         if (isKeyframe(data, dataSize))
@@ -75,7 +256,8 @@ struct TileData
             LOG_TRC("received key-frame - clearing tile");
             _wids.clear();
             _offsets.clear();
-            _deltas.clear();
+            clearSlabs();
+            _keyframe.reset();
         }
         else
         {
@@ -83,23 +265,56 @@ struct TileData
             assert(_wids.size() > 0 && "no underlying keyframe!");
         }
 
-        size_t oldSize = size();
-
-        // FIXME: too many/large deltas means we should reset -
-        // but not here - when requesting the tiles.
         _wids.push_back(id);
-        _offsets.push_back(_deltas.size());
-        _deltas.resize(oldSize + dataSize - 1);
-        std::memcpy(_deltas.data() + oldSize, data + 1, dataSize - 1);
+        _offsets.push_back(_size);
+        const char* src = data + 1;
+        size_t remaining = dataSize - 1;
+
+        // Keyframes are shared with identical ones of other tiles, if we can.
+        if (_keyframes && data[0] == 'Z' && remaining > 0)
+        {
+            _keyframe = _keyframes->intern(src, remaining);
+            _size = remaining;
+            remaining = 0;
+        }
+
+        // Deltas go into the spare room of the last slab, then into new
+        // slabs; existing data is never moved. A keyframe gets a slab of
+        // its own size, subsequent slabs are sized for a few deltas.
+        while (remaining > 0)
+        {
+            if (_slabs.empty() || _slabs.back()._used == _slabs.back()._capacity)
+            {
+                const size_t want = _size == 0 ? remaining
+                                               : std::max(remaining, _size / 4);
+                Slab slab;
+                slab._data = allocate(want, slab._capacity);
+                slab._used = 0;
+                _slabs.push_back(slab);
+                _capacity += slab._capacity;
+            }
+
+            Slab& slab = _slabs.back();
+            const size_t len = std::min(remaining, slab._capacity - slab._used);
+            std::memcpy(slab._data + slab._used, src, len);
+            slab._used += len;
+            _size += len;
+            src += len;
+            remaining -= len;
+        }
 
         // FIXME: possible race - should store a seq. from the invalidation(s) ?
         _valid = true;
 
-        return size() - oldCacheSize;
+        return _capacity - oldCapacity;
     }
 
-    bool isPng() const { return (_deltas.size() > 1 &&
-                                 _deltas[0] == (char)0x89); }
+    bool isPng() const
+    {
+        if (_size <= 1)
+            return false;
+        return (_keyframe ? _keyframe->_data[0] : _slabs[0]._data[0]) == (char)0x89;
+    }
 
     static bool isKeyframe(const char *data, size_t dataSize)
     {
@@ -110,19 +325,51 @@ struct TileData
     bool isValid() const { return _valid; }
     void invalidate() { _valid = false; }
 
+    /// Is the delta chain on top of the keyframe more than @ratio
+    /// times the size of the keyframe itself ? If so, the next
+    /// rendering should be a keyframe, to compact the chain.
+    bool isDeltaChainTooLong(double ratio) const
+    {
+        if (_wids.size() < 2)
+            return false;
+
+        const size_t keyframeSize = _offsets[1];
+        return _size - keyframeSize > keyframeSize * ratio;
+    }
+
     bool _valid; // not true - waiting for a new tile if in view.
+    uint64_t _lastUsed; // TileCache's use count when last saved or looked up.
     std::vector<TileWireId> _wids;
     std::vector<size_t> _offsets; // offset of the start of data
-    BlobData _deltas; // first item is a key-frame, followed by deltas at _offsets
 
-    size_t size()
+    /// Bytes of keyframe and deltas.
+    size_t size() const
+    {
+        return _size;
+    }
+
+    /// Bytes of memory held for them, a shared keyframe is counted in full.
+    size_t getMemorySize() const
     {
-        return _deltas.size();
+        return _capacity + (_keyframe ? _keyframe->_data.size() : 0);
     }
 
-    const BlobData &data()
+    /// The shared keyframe, if our keyframe is one.
+    const std::shared_ptr<const TileKeyframeStore::Keyframe>& getKeyframe() const
     {
-        return _deltas;
+        return _keyframe;
+    }
+
+    /// Do we have just the keyframe, without deltas on top ?
+    bool isKeyframeOnly() const { return _wids.size() == 1; }
+
+    /// A contiguous copy of the key-frame followed by the deltas at _offsets.
+    BlobData data() const
+    {
+        BlobData output;
+        output.reserve(_size);
+        copyFrom(0, output);
+        return output;
     }
 
     /// if we send changes since this seq - do we need to first send the keyframe ?
@@ -150,13 +397,9 @@ struct TileData
             if (i != _offsets.size() - 1)
                 LOG_TRC("appending from " << i << " to " << (_offsets.size() - 1) <<
                         " from wid: " << _wids[i] << " to wid: " << since <<
-                        " from offset: " << offset << " to " << _deltas.size());
-
-            size_t extra = _deltas.size() - offset;
-            size_t dest = output.size();
-            output.resize(output.size() + extra);
+                        " from offset: " << offset << " to " << _size);
 
-            std::memcpy(output.data() + dest, _deltas.data() + offset, extra);
+            copyFrom(offset, output);
             return true;
         }
     }
@@ -173,6 +416,79 @@ struct TileData
             }
         }
     }
+
+private:
+    struct Slab
+    {
+        char* _data;
+        size_t _capacity;
+        size_t _used;
+    };
+
+    char* allocate(size_t size, size_t& capacity)
+    {
+        if (_arena)
+            return _arena->allocate(size, capacity);
+
+        capacity = size;
+        return new char[size];
+    }
+
+    void clearSlabs()
+    {
+        for (const Slab& slab : _slabs)
+        {
+            if (_arena)
+                _arena->release(slab._data, slab._capacity);
+            else
+                delete[] slab._data;
+        }
+
+        _slabs.clear();
+        _size = 0;
+        _capacity = 0;
+    }
+
+    /// Appends our data from @offset onwards to @output.
+    void copyFrom(size_t offset, std::vector<char>& output) const
+    {
+        size_t dest = output.size();
+        output.resize(dest + _size - offset);
+        if (_keyframe)
+        {
+            const size_t keyframeSize = _keyframe->_data.size();
+            if (offset < keyframeSize)
+            {
+                std::memcpy(output.data() + dest, _keyframe->_data.data() + offset,
+                            keyframeSize - offset);
+                dest += keyframeSize - offset;
+                offset = 0;
+            }
+            else
+                offset -= keyframeSize;
+        }
+
+        for (const Slab& slab : _slabs)
+        {
+            if (offset >= slab._used)
+            {
+                offset -= slab._used;
+                continue;
+            }
+
+            std::memcpy(output.data() + dest, slab._data + offset, slab._used - offset);
+            dest += slab._used - offset;
+            offset = 0;
+        }
+    }
+
+    std::shared_ptr<TileArena> _arena;
+    std::shared_ptr<TileKeyframeStore> _keyframes;
+    /// Our keyframe, when shared via _keyframes; the deltas are in _slabs.
+    std::shared_ptr<const TileKeyframeStore::Keyframe> _keyframe;
+    std::vector<Slab> _slabs;
+    size_t _size;
+    size_t _capacity;
 };
 using Tile = std::shared_ptr<TileData>;
 
@@ -250,9 +566,44 @@ public:
     /// Set the high watermark for tilecache size
     void setMaxCacheSize(size_t cacheSize);
 
+    /// How ensureCacheSize() picks the tiles to drop.
+    enum class EvictionPolicy
+    {
+        WireId,  ///< The oldest rendered tiles first.
+        LRU,     ///< The least recently saved or looked up tiles first.
+        Viewport ///< As LRU, but never the tiles @isPinned, eg. those in view.
+    };
+
+    static EvictionPolicy parseEvictionPolicy(const std::string& name);
+
+    /// Set the eviction policy, for Viewport @isPinned tells which tiles to keep.
+    void setEvictionPolicy(EvictionPolicy policy,
+                           std::function<bool(const TileDesc&)> isPinned = nullptr);
+
+    /// Lookup and eviction counters.
+    struct Stats
+    {
+        Stats() : _hits(0), _misses(0), _evictions(0) {}
+
+        uint64_t _hits;
+        uint64_t _misses;
+        uint64_t _evictions;
+    };
+
+    const Stats& getStats() const { return _stats; }
+
     /// Get the current memory use.
     size_t getMemorySize() const { return _cacheSize; }
 
+    /// Set how many times its keyframe's size a tile's deltas may grow to.
+    void setMaxDeltaRatio(double ratio) { _maxDeltaRatio = ratio; }
+
+    /// Should the next rendering of @tile be a keyframe, to compact its delta chain ?
+    bool isDeltaChainTooLong(const Tile& tile) const
+    {
+        return tile && tile->isDeltaChainTooLong(_maxDeltaRatio);
+    }
+
     // Debugging bits ...
     void dumpState(std::ostream& os);
     void setThreadOwner(const std::thread::id &id) { _owner = id; }
@@ -261,6 +612,8 @@ public:
 
 private:
     void ensureCacheSize();
+    void evictByWireId();
+    void evictLeastRecentlyUsed();
     static size_t itemCacheSize(const Tile &tile);
 
     void invalidateTiles(int part, int x, int y, int width, int height, int normalizedViewId);
@@ -275,6 +628,10 @@ private:
     static bool intersectsTile(const TileDesc &tileDesc, int part, int x, int y, int width, int height, int normalizedViewId);
 
     Tile saveDataToCache(const TileDesc& desc, const char* data, size_t size);
+
+    /// Add or remove a _cache entry to / from _tileIndex.
+    void indexTile(const TileDesc& desc);
+    void unindexTile(const TileDesc& desc);
     void saveDataToStreamCache(StreamType type, const std::string& fileName, const char* data,
                                size_t size);
 
@@ -290,10 +647,76 @@ private:
     /// Maximum (high watermark) size of the tilecache in bytes
     size_t _maxCacheSize;
 
+    EvictionPolicy _evictionPolicy;
+    std::function<bool(const TileDesc&)> _isPinned;
+
+    /// Incremented on each use of a tile, to order them for LRU.
+    uint64_t _useCount;
+
+    Stats _stats;
+
+    /// Maximum size of a tile's delta chain, relative to its keyframe.
+    double _maxDeltaRatio;
+
+    /// Allocates the tile blobs, must outlive _cache.
+    std::shared_ptr<TileArena> _arena;
+
+    /// Where our keyframes are shared with those of other documents.
+    std::shared_ptr<TileKeyframeStore> _keyframes;
+
     // FIXME: should we have a tile-desc to WID map instead and a simpler lookup ?
     std::unordered_map<TileDesc, Tile,
                        TileDescCacheHasher,
                        TileDescCacheCompareEq> _cache;
+    /// The tiles of one part at one zoom level, for one view, which share a grid.
+    struct TileLayer final
+    {
+        explicit TileLayer(const TileDesc& desc)
+            : _part(desc.getPart())
+            , _width(desc.getWidth())
+            , _height(desc.getHeight())
+            , _tileWidth(desc.getTileWidth())
+            , _tileHeight(desc.getTileHeight())
+            , _normalizedViewId(desc.getNormalizedViewId())
+        {
+        }
+
+        bool operator==(const TileLayer& other) const
+        {
+            return _part == other._part && _width == other._width && _height == other._height
+                   && _tileWidth == other._tileWidth && _tileHeight == other._tileHeight
+                   && _normalizedViewId == other._normalizedViewId;
+        }
+
+        int _part;
+        int _width;
+        int _height;
+        int _tileWidth;
+        int _tileHeight;
+        int _normalizedViewId;
+    };
+
+    struct TileLayerHasher final
+    {
+        size_t operator()(const TileLayer& l) const
+        {
+            size_t hash = l._part;
+
+            hash = (hash << 5) + hash + l._width;
+            hash = (hash << 5) + hash + l._height;
+            hash = (hash << 5) + hash + l._tileWidth;
+            hash = (hash << 5) + hash + l._tileHeight;
+            hash = (hash << 5) + hash + l._normalizedViewId;
+
+            return hash;
+        }
+    };
+
+    /// Spatial index of _cache, so invalidation only visits the tiles it
+    /// may hit: per layer, the cached tiles by tilePosY, then tilePosX.
+    std::unordered_map<TileLayer, std::map<int, std::map<int, TileDesc>>,
+                       TileLayerHasher> _tileIndex;
+
     // FIXME: TileBeingRendered contains TileDesc too ...
     std::unordered_map<TileDesc, std::shared_ptr<TileBeingRendered>,
                        TileDescCacheHasher,
@@ -349,13 +772,65 @@ public:
     }
 };
 
+/// Mirrors the keyframes a client keeps from the tile: messages sent with
+/// a hash, so we can send knowntile: messages instead. The client's cache
+/// only changes as messages reach it, so this follows the written messages.
+class ClientKeyframeTracker final
+{
+public:
+    ClientKeyframeTracker()
+        : _size(0)
+    {
+    }
+
+    /// How many keyframes the client keeps, 0 when it takes no knowntile:.
+    size_t getSize() const { return _size; }
+
+    /// The client (re)starts its cache, to keep this many keyframes.
+    void reset(size_t size)
+    {
+        _size = size;
+        _known.clear();
+    }
+
+    /// Does the client have the keyframe with this @hash, as of the last written message ?
+    bool isKnown(const std::string& hash) const;
+
+    /// Holds on to the keyframe of a queued knowntile: message, in case the
+    /// client drops it, by the tiles written before, by the time it's written.
+    void pin(const std::shared_ptr<const TileKeyframeStore::Keyframe>& keyframe)
+    {
+        _pinned.emplace(keyframe->_hash.toString(), keyframe);
+    }
+
+    /// Releases the keyframes held, once no knowntile: messages are queued.
+    void unpinAll() { _pinned.clear(); }
+
+    /// Returns the tile: message to write instead of this knowntile: message,
+    /// if the client no longer has its keyframe, empty otherwise.
+    std::vector<char> expandKnownTile(const std::string& firstLine,
+                                      const std::vector<char>& data) const;
+
+    /// A message is written to the client.
+    void written(const std::string& firstLine);
+
+private:
+    size_t _size;
+
+    /// Hashes of the keyframes the client keeps, most recently written first.
+    std::deque<std::string> _known;
+
+    /// Keyframes of the queued knowntile: messages, by hash.
+    std::unordered_map<std::string, std::shared_ptr<const TileKeyframeStore::Keyframe>> _pinned;
+};
+
 inline std::ostream& operator<< (std::ostream& os, const Tile& tile)
 {
     if (!tile)
         os << "nullptr";
     else
         os << "keyframe id " << tile->_wids[0] <<
-            " size: " << tile->_deltas.size() <<
+            " size: " << tile->size() <<
             " deltas: " << (tile->_wids.size() - 1);
     return os;
 }
@@ -0,0 +1,194 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// Decides which kind of document each spare kit warms up for, see
+/// prespawn.warm_templates in coolwsd.xml. A kit warms up by loading and
+/// closing an empty document of its kind, so the LibreOffice component,
+/// its fonts and its lists are ready when the real document of that kind
+/// comes. The kinds follow the recent mix of documents opened.
+/// Also keeps, for each kind, how often the kit was warmed for it and how
+/// long the loads took, for the metrics.
+class WarmupPolicy
+{
+public:
+    /// The kinds of documents, as sent to the kit with 'warmup'.
+    static constexpr const char* Types[] = { "text", "spreadsheet", "presentation", "drawing" };
+    static constexpr std::size_t TypeCount = sizeof(Types) / sizeof(Types[0]);
+
+    /// How much of the mix each open keeps: 0.95 forgets over about 20 opens.
+    static constexpr double MixDecay = 0.95;
+
+    WarmupPolicy()
+        : _enabled(false)
+        , _mix{}
+        , _stats{}
+    {
+    }
+
+    void configure(bool enabled)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _enabled = enabled;
+    }
+
+    bool isEnabled() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _enabled;
+    }
+
+    /// The kind of the document @filename, by its extension; empty when unknown.
+    static std::string getDocumentType(const std::string& filename)
+    {
+        const std::size_t dot = filename.rfind('.');
+        if (dot == std::string::npos || filename.find('/', dot) != std::string::npos)
+            return std::string();
+
+        std::string ext = filename.substr(dot + 1);
+        std::transform(ext.begin(), ext.end(), ext.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+
+        static const std::vector<std::string> extensions[TypeCount] = {
+            { "odt", "ott", "fodt", "odm", "doc", "dot", "docx", "docm", "dotx", "dotm", "rtf",
+              "txt", "wpd", "wps", "pages" },
+            { "ods", "ots", "fods", "xls", "xlt", "xlsx", "xlsm", "xlsb", "xltx", "xltm", "csv",
+              "numbers" },
+            { "odp", "otp", "fodp", "ppt", "pps", "pot", "pptx", "pptm", "ppsx", "potx", "potm",
+              "key" },
+            { "odg", "otg", "fodg", "vsd", "vsdx", "pdf" },
+        };
+
+        for (std::size_t i = 0; i < TypeCount; ++i)
+        {
+            if (std::find(extensions[i].begin(), extensions[i].end(), ext) != extensions[i].end())
+                return Types[i];
+        }
+
+        return std::string();
+    }
+
+    /// The kind to warm a new spare kit for, given the kinds of the
+    /// @spares we have: the one furthest below its share of the mix.
+    std::string pickType(const std::vector<std::string>& spares) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        double total = 0;
+        for (const double share : _mix)
+            total += share;
+
+        // Without any opens yet, text is the most common.
+        if (total <= 0)
+            return Types[0];
+
+        std::size_t best = 0;
+        double bestDeficit = 0;
+        for (std::size_t i = 0; i < TypeCount; ++i)
+        {
+            const double expected = _mix[i] / total * (spares.size() + 1);
+            const double deficit
+                = expected - std::count(spares.begin(), spares.end(), std::string(Types[i]));
+            if (i == 0 || deficit > bestDeficit)
+            {
+                best = i;
+                bestDeficit = deficit;
+            }
+        }
+
+        return Types[best];
+    }
+
+    /// A document named @filename took @duration to load, in a kit warmed
+    /// for @warmType (empty when it wasn't warmed).
+    void recordLoad(const std::string& filename, const std::string& warmType,
+                    std::chrono::milliseconds duration)
+    {
+        const int index = getTypeIndex(getDocumentType(filename));
+        if (index < 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (double& share : _mix)
+            share *= MixDecay;
+        _mix[index] += 1;
+
+        TypeStats& stats = _stats[index];
+        const bool warm = warmType == Types[index];
+        if (warmType.empty())
+            ++stats._coldCount;
+        else if (warm)
+            ++stats._hitCount;
+        else
+            ++stats._missCount;
+
+        if (warm)
+            stats._warmLoadMs += duration.count();
+        else
+            stats._coldLoadMs += duration.count();
+    }
+
+    /// Writes the metrics, see the KITS section of metrics.txt.
+    void dumpMetrics(std::ostream& os) const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (std::size_t i = 0; i < TypeCount; ++i)
+        {
+            const TypeStats& stats = _stats[i];
+            const int64_t warmAverage = stats._hitCount ? stats._warmLoadMs / stats._hitCount : 0;
+            const uint64_t coldLoads = stats._missCount + stats._coldCount;
+            const int64_t coldAverage = coldLoads ? stats._coldLoadMs / coldLoads : 0;
+            const std::string prefix = std::string("kit_warm_") + Types[i];
+            os << prefix << "_hit_count " << stats._hitCount << '\n';
+            os << prefix << "_miss_count " << stats._missCount << '\n';
+            os << prefix << "_cold_count " << stats._coldCount << '\n';
+            os << prefix << "_load_average_milliseconds " << warmAverage << '\n';
+            os << prefix << "_cold_load_average_milliseconds " << coldAverage << '\n';
+            os << prefix << "_load_saving_milliseconds "
+               << (stats._hitCount && coldLoads ? coldAverage - warmAverage : 0) << '\n';
+        }
+    }
+
+private:
+    static int getTypeIndex(const std::string& type)
+    {
+        for (std::size_t i = 0; i < TypeCount; ++i)
+        {
+            if (type == Types[i])
+                return static_cast<int>(i);
+        }
+
+        return -1;
+    }
+
+    struct TypeStats
+    {
+        /// Loads in a kit warmed for this kind, for another, and not warmed at all.
+        uint64_t _hitCount;
+        uint64_t _missCount;
+        uint64_t _coldCount;
+        int64_t _warmLoadMs;
+        int64_t _coldLoadMs;
+    };
+
+    mutable std::mutex _mutex;
+    bool _enabled;
+    /// The recent opens of each kind, an exponentially decaying count.
+    double _mix[TypeCount];
+    TypeStats _stats[TypeCount];
+};
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */